@@ -0,0 +1,110 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_BACKEND_H
+#define BIRBCAM_C_BACKEND_H
+
+#define ERR_BACKEND "Unknown backend: %s (choices: auto, tegra, software)"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "nvds_config.h"
+
+// default resolution the detector sees (and the one bounding boxes are
+// reported in), see config.h
+#define BC_INFER_WIDTH 384
+#define BC_INFER_HEIGHT 216
+
+// the argus camera only exists on a Jetson (nvds_config.h maps the CSI camera
+// to videotestsrc elsewhere), so it doubles as the tegra probe
+#define BC_ELEM_CAMERA_ARGUS "nvarguscamerasrc"
+
+// software (no GPU) elements
+#define BC_ELEM_SW_CAMERA "videotestsrc"
+#define BC_ELEM_SW_URI NVDS_ELEM_SRC_URI
+#define BC_ELEM_SW_CONVERTER "videoconvert"
+#define BC_ELEM_SW_SCALER "videoscale"
+#define BC_ELEM_SW_ENCODER "x265enc"
+#define BC_ELEM_SW_INFERENCE "identity"  // cpu detector probes its src pad
+#define BC_ELEM_SW_FUNNEL "funnel"  // interleaves sources, there's no batching
+#define BC_ELEM_SW_TRACKER "identity"  // iou tracker probes its src pad
+#define BC_ELEM_SW_CLASSIFIER "identity"  // cpu classifier probes its src pad
+// no framerate here so file inputs negotiate whatever rate they were shot at.
+// Sizes here and in BC_SW_INFER_CAPS_STRING are replaced with the configured.
+#define BC_SW_CAPS_STRING \
+  "video/x-raw, width=(int)1920, height=(int)1080, format=(string)I420"
+#define BC_SW_INFER_CAPS_STRING                          \
+  "video/x-raw, width=(int)" G_STRINGIFY(BC_INFER_WIDTH) \
+  ", height=(int)" G_STRINGIFY(BC_INFER_HEIGHT) ", format=(string)I420"
+
+typedef enum {
+  BC_BACKEND_TEGRA,     // NVMM buffers, argus camera, nvv4l2 encoder, nvinfer
+  BC_BACKEND_SOFTWARE,  // system memory, x265enc and the cpu detector
+} BcBackendType;
+
+// the element table for one backend. Every element that differs between the
+// Jetson and a plain x86 box is looked up here rather than hard-wired, so the
+// pipeline code builds the same tee/encode/inference topology on both.
+typedef struct {
+  const gchar* name;
+  BcBackendType type;
+
+  // pipeline beginning (converter and scaler may be NULL)
+  const gchar* camera;
+  const gchar* uri_source;  // used instead of camera when an input is given
+  const gchar* uri_converter;  // decoded uri pads may need a different one
+  const gchar* converter;
+  const gchar* scaler;
+  const gchar* caps;
+
+  // encoder branch
+  const gchar* encoder;
+  guint bitrate_divisor;  // "bitrate" is bits/s on nvv4l2, kbit/s on x265enc
+  const gchar* keyframe_property;  // max frames between keyframes
+  const gchar* parser;
+  const gchar* muxer;
+
+  // inference branch. On tegra every source goes into the streammux and one
+  // (batched) infer after it; on software each source is scaled and run
+  // through its own infer (the cpu detector) before they're interleaved.
+  const gchar* infer_scaler;  // per source, NULL if the streammux scales
+  const gchar* infer_caps;    // per source, NULL if the streammux scales
+  const gchar* streammux;     // joins the sources
+  const gchar* infer;
+  const gchar* tracker;  // after infer, when tracking
+  const gchar* classifier;  // after the tracker, when classifying
+  // tiled inference (see tiles.h), a cropper and caps per tile on tegra. The
+  // cpu detector crops for itself, so NULL on software.
+  const gchar* tile_cropper;
+  const gchar* tile_caps;
+
+  // motion gate branch (see motion.h), scales to system memory I420
+  const gchar* motion_scaler;
+  // snapshot branch (see snapshot.h), converts to system memory I420
+  const gchar* snapshot_converter;
+} BcBackend;
+
+// look up a backend by name. "auto" (or NULL) picks tegra when the argus
+// camera and nvinfer plugins are installed and software otherwise. Returns
+// NULL on an unknown name.
+const BcBackend* find_backend(const gchar* name);
+
+#endif  // BIRBCAM_C_BACKEND_H
@@ -0,0 +1,163 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The .brb ("birb") binary metadata format.
+//
+// A .brb file is one BrbHeader followed by any number of BrbRecords, all
+// fixed size and little endian, so a reader can mmap the file and index the
+// records directly:
+//
+//   records = (const BrbRecord*)(map + header->header_size);
+//   count = (size - header->header_size) / header->record_size;
+//
+// A file cut short by a crash is still valid; a partial last record is simply
+// ignored. Readers must use header_size and record_size from the header rather
+// than sizeof() so newer writers can append fields without breaking them.
+//
+// Alongside every metadata file (.jl or .brb) there is a .bri seek index: one
+// BriHeader followed by a BriEntry per keyframe of the matching .mkv, in pts
+// order, so finding the keyframe at or before a time is a binary search over
+// the mmapped entries. Each entry has
+//
+//   mkv_offset:  where the muxer started writing that keyframe in the .mkv,
+//                at or just before the start of the Cluster holding it. A
+//                player can start demuxing there (scan forward for a Cluster
+//                ID, 1F 43 B6 75) without reading the rest of the file.
+//   meta_offset: every record with pts >= the entry's pts is at or after
+//                this offset in the metadata file.
+//
+// Entries are only written after the metadata they point into, so an index
+// cut short by a crash never points past the end of its metadata file.
+
+#ifndef BIRBCAM_C_BRB_H
+#define BIRBCAM_C_BRB_H
+
+#include <glib.h>
+
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+#error ".brb files are little endian and are written in host order"
+#endif
+
+#define BRB_MAGIC "BRB"  // plus the terminating NUL, 4 bytes
+#define BRB_VERSION 1
+
+#define BRI_MAGIC "BRI"
+#define BRI_VERSION 1
+
+#define BRB_UNTRACKED G_MAXUINT32  // object_id of an untracked object
+#define BRB_CONFIDENCE_SCALE 65535.0f
+// species is the classifier's class + 1 (see classifier.h), so files from
+// before there was a classifier, with zeros there, read as unclassified
+#define BRB_UNCLASSIFIED 0
+#define BRB_SPECIES_SCALE 255.0f  // species_confidence = probability * this
+
+// record flags. Without tracking every box of every frame is a record with
+// no flags. With it, a track is written as one BRB_TRACK_START record, a
+// BRB_TRACK_KEY record whenever its box changes much (or a while has
+// passed) and one BRB_TRACK_END record with the last pts and box it was seen
+// with. An end is only known once a track has been gone a while, so end
+// records are written up to BRB_TRACK_TIMEOUT seconds out of pts order. In
+// segmented recordings a track open at the end of a file is ended in it (no
+// later than the pts before the next file's start_pts) and started again in
+// the next one.
+#define BRB_TRACK_START 0x01
+#define BRB_TRACK_KEY 0x02
+#define BRB_TRACK_END 0x04
+#define BRB_TRACK_TIMEOUT 3  // seconds
+// a run of frames that were recorded but never inferred (see throttle.h), so
+// no boxes for them doesn't mean no birds. pts is the first of them and
+// brb_skip_last() the last, object_id how many there were and class_id why
+// (BRB_SKIP_*); the box fields hold the run's length instead of a box, and
+// frame_num is -1. Every frame from the first to the last was skipped, but a
+// run only counts those skipped for its own reason. Written up to a second
+// or so late.
+#define BRB_FRAME_SKIPPED 0x08
+#define BRB_SKIP_THROTTLE 0  // inference was over its latency budget
+#define BRB_SKIP_MOTION 1    // nothing was moving (see motion.h)
+#define BRB_SKIP_RESTART 2   // inference was down, restarting (restart.h)
+
+typedef struct {
+  gchar magic[4];        // BRB_MAGIC
+  guint16 version;       // BRB_VERSION
+  guint16 header_size;   // offset of the first record
+  guint16 record_size;   // stride between records
+  guint16 frame_width;   // resolution the boxes are in
+  guint16 frame_height;  //
+  guint16 reserved;
+  // where the file starts, set when it's opened rather than by any record:
+  // pts 0 for the first file, the segment boundary for a rotated one (see
+  // writer.h), so the first record is usually later.
+  gint64 start_time;   // wall clock at start_pts, us since the epoch
+  guint64 start_pts;   // ns
+} BrbHeader;
+
+typedef struct {
+  guint64 pts;        // buffer pts, ns (start_time + pts - start_pts = wall)
+  gint32 frame_num;   //
+  guint32 object_id;  // tracker id, BRB_UNTRACKED if there is no tracker
+  guint16 source_id;  // camera
+  guint8 class_id;    //
+  guint8 flags;       // BRB_*, 0 for a per frame record
+  guint16 confidence;  // confidence * BRB_CONFIDENCE_SCALE
+  guint16 left;        // bounding box, pixels at frame_width x frame_height
+  guint16 top;         //
+  guint16 width;       //
+  guint16 height;      //
+  guint8 species;             // BRB_UNCLASSIFIED or the classifier's class + 1
+  guint8 species_confidence;  // probability * BRB_SPECIES_SCALE
+} BrbRecord;
+
+// a .bri header is a BrbHeader with BRI_MAGIC, BRI_VERSION and entry_size in
+// place of record_size
+typedef BrbHeader BriHeader;
+
+typedef struct {
+  guint64 pts;          // keyframe pts, ns
+  gint64 time;          // wall clock, us since the epoch
+  guint64 mkv_offset;   // bytes into the .mkv
+  guint64 meta_offset;  // bytes into the .jl or .brb
+} BriEntry;
+
+// the last pts of a BRB_FRAME_SKIPPED run, its length being spread over the
+// four box fields
+static inline guint64 brb_skip_last(const BrbRecord* record) {
+  return record->pts + ((guint64)record->left | (guint64)record->top << 16 |
+                        (guint64)record->width << 32 |
+                        (guint64)record->height << 48);
+}
+
+static inline void brb_set_skip_last(BrbRecord* record, guint64 last) {
+  guint64 length = last - record->pts;
+  record->left = (guint16)length;
+  record->top = (guint16)(length >> 16);
+  record->width = (guint16)(length >> 32);
+  record->height = (guint16)(length >> 48);
+}
+
+// how many frames a BRB_FRAME_SKIPPED run is
+static inline guint32 brb_skip_count(const BrbRecord* record) {
+  return record->object_id;
+}
+
+G_STATIC_ASSERT(sizeof(BrbHeader) == 32);
+G_STATIC_ASSERT(sizeof(BrbRecord) == 32);
+G_STATIC_ASSERT(sizeof(BriEntry) == 32);
+
+#endif  // BIRBCAM_C_BRB_H
@@ -0,0 +1,273 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// The .brc ("birb columns") archival metadata format, written by
+// birbcam-compact from closed .jl or .brb files and read by birbcam-query.
+//
+// A .brc file is a BrbHeader with BRC_MAGIC, BRC_VERSION and the size of a
+// BrcChunk in place of record_size, followed by chunks of up to
+// BRC_CHUNK_RECORDS records. Each chunk is a BrcChunk, then its columns one
+// after the other, column_size[c] bytes each, padded to a multiple of 8 bytes
+// so the next BrcChunk is aligned. A column holds one field of every record
+// in the chunk, as the difference from the record before it (zigzag encoded,
+// so small negative ones stay small) in LEB128 varints, and a run of zero
+// differences (a box that didn't move, a frame's boxes sharing a pts, a class
+// that never changes) is a 0 followed by a varint of how many more zeros
+// follow. Every chunk starts from zero, so chunks decode on their own.
+//
+// BrcChunk's min/max fields are a zone map: a reader can tell from those
+// alone that nothing in the chunk matches a time range, a box size, a species
+// or a kind of record and skip straight over its size bytes to the next.
+//
+// Wall times are start_time + (pts - start_pts) / 1000 as in a .brb, plus
+// BRC_COLUMN_TIME, which is whatever a .jl file's "ts" differed from that by
+// (almost always nothing). Like a .brb, a newer writer may add columns to the
+// end of column_size, growing the BrcChunk (so readers use the header's
+// chunk size, not sizeof()), and a file cut short ends at the last whole
+// chunk.
+
+#ifndef BIRBCAM_C_BRC_H
+#define BIRBCAM_C_BRC_H
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "brb.h"
+
+#define BRC_MAGIC "BRC"
+#define BRC_VERSION 1
+#define BRC_EXTENSION ".brc"
+#define BRC_CHUNK_RECORDS 4096  // a few minutes of busy feeder
+#define BRC_MAX_VARINT 10       // bytes in the longest 64 bit varint
+
+typedef enum {
+  BRC_COLUMN_PTS,
+  BRC_COLUMN_TIME,  // wall time less the one implied by pts, us
+  BRC_COLUMN_FRAME,
+  BRC_COLUMN_OBJECT,
+  BRC_COLUMN_SOURCE,
+  BRC_COLUMN_CLASS,
+  BRC_COLUMN_FLAGS,
+  BRC_COLUMN_CONFIDENCE,
+  BRC_COLUMN_LEFT,
+  BRC_COLUMN_TOP,
+  BRC_COLUMN_WIDTH,
+  BRC_COLUMN_HEIGHT,
+  BRC_COLUMN_SPECIES,
+  BRC_COLUMN_SPECIES_CONFIDENCE,
+  BRC_COLUMNS,
+} BrcColumn;
+
+typedef struct {
+  guint32 count;     // records
+  guint32 size;      // bytes of columns after this, padding included
+  gint64 min_time;   // wall clock, us since the epoch, of the earliest record
+  gint64 max_time;   // and the latest (track ends are out of order)
+  guint32 min_area;  // width * height
+  guint32 max_area;  //
+  guint8 flags;      // every BRB_* flag any record has
+  guint8 min_species;
+  guint8 max_species;
+  guint8 reserved;
+  guint32 reserved2;
+  guint32 column_size[BRC_COLUMNS];  // bytes, BrcColumn order
+} BrcChunk;
+
+G_STATIC_ASSERT(sizeof(BrcChunk) == 96);
+
+// the time a record's pts implies, as in a .brb
+static inline gint64 brc_pts_time(const BrbHeader* header, guint64 pts) {
+  return header->start_time + (gint64)(pts - header->start_pts) / 1000;
+}
+
+// a record's field for column, time being its wall time
+static inline gint64 brc_get(const BrbHeader* header,
+                             const BrbRecord* record,
+                             gint64 time,
+                             BrcColumn column) {
+  switch (column) {
+    case BRC_COLUMN_PTS:
+      return (gint64)record->pts;
+    case BRC_COLUMN_TIME:
+      return time - brc_pts_time(header, record->pts);
+    case BRC_COLUMN_FRAME:
+      return record->frame_num;
+    case BRC_COLUMN_OBJECT:
+      return record->object_id;
+    case BRC_COLUMN_SOURCE:
+      return record->source_id;
+    case BRC_COLUMN_CLASS:
+      return record->class_id;
+    case BRC_COLUMN_FLAGS:
+      return record->flags;
+    case BRC_COLUMN_CONFIDENCE:
+      return record->confidence;
+    case BRC_COLUMN_LEFT:
+      return record->left;
+    case BRC_COLUMN_TOP:
+      return record->top;
+    case BRC_COLUMN_WIDTH:
+      return record->width;
+    case BRC_COLUMN_HEIGHT:
+      return record->height;
+    case BRC_COLUMN_SPECIES:
+      return record->species;
+    case BRC_COLUMN_SPECIES_CONFIDENCE:
+      return record->species_confidence;
+    default:
+      return 0;
+  }
+}
+
+// the reverse of brc_get. BRC_COLUMN_TIME must come after BRC_COLUMN_PTS.
+static inline void brc_set(const BrbHeader* header,
+                           BrbRecord* record,
+                           gint64* time,
+                           BrcColumn column,
+                           gint64 value) {
+  switch (column) {
+    case BRC_COLUMN_PTS:
+      record->pts = (guint64)value;
+      break;
+    case BRC_COLUMN_TIME:
+      *time = brc_pts_time(header, record->pts) + value;
+      break;
+    case BRC_COLUMN_FRAME:
+      record->frame_num = (gint32)value;
+      break;
+    case BRC_COLUMN_OBJECT:
+      record->object_id = (guint32)value;
+      break;
+    case BRC_COLUMN_SOURCE:
+      record->source_id = (guint16)value;
+      break;
+    case BRC_COLUMN_CLASS:
+      record->class_id = (guint8)value;
+      break;
+    case BRC_COLUMN_FLAGS:
+      record->flags = (guint8)value;
+      break;
+    case BRC_COLUMN_CONFIDENCE:
+      record->confidence = (guint16)value;
+      break;
+    case BRC_COLUMN_LEFT:
+      record->left = (guint16)value;
+      break;
+    case BRC_COLUMN_TOP:
+      record->top = (guint16)value;
+      break;
+    case BRC_COLUMN_WIDTH:
+      record->width = (guint16)value;
+      break;
+    case BRC_COLUMN_HEIGHT:
+      record->height = (guint16)value;
+      break;
+    case BRC_COLUMN_SPECIES:
+      record->species = (guint8)value;
+      break;
+    case BRC_COLUMN_SPECIES_CONFIDENCE:
+      record->species_confidence = (guint8)value;
+      break;
+    default:
+      break;
+  }
+}
+
+static inline guint64 brc_zigzag(gint64 value) {
+  return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+static inline gint64 brc_unzigzag(guint64 value) {
+  return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
+
+// append value to out (at least BRC_MAX_VARINT bytes), returns the bytes used
+static inline guint brc_put_varint(guint8* out, guint64 value) {
+  guint length = 0;
+  while (value >= 0x80) {
+    out[length++] = (guint8)value | 0x80;
+    value >>= 7;
+  }
+  out[length++] = (guint8)value;
+  return length;
+}
+
+// read a varint from p, before end. Returns NULL if it runs past end.
+static inline const guint8* brc_get_varint(const guint8* p,
+                                           const guint8* end,
+                                           guint64* value) {
+  *value = 0;
+  for (guint shift = 0; p < end && shift < 64; shift += 7) {
+    guint8 byte = *p++;
+    *value |= (guint64)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return p;
+  }
+  return NULL;
+}
+
+// Decode the chunk at data (the BrcChunk, of the header's record_size, then
+// its columns), with size bytes available, into records and their wall times
+// (each room for chunk->count). Returns FALSE if the chunk is cut short or
+// corrupt.
+static inline gboolean brc_decode(const BrbHeader* header,
+                                  const guint8* data,
+                                  gsize size,
+                                  BrbRecord* records,
+                                  gint64* times) {
+  const BrcChunk* chunk = (const BrcChunk*)data;
+  if (size < header->record_size ||
+      size - header->record_size < chunk->size ||
+      chunk->count > BRC_CHUNK_RECORDS) {
+    return FALSE;
+  }
+  memset(records, 0, chunk->count * sizeof(BrbRecord));
+  const guint8* p = data + header->record_size;
+  const guint8* chunk_end = p + chunk->size;
+  for (guint c = 0; c < BRC_COLUMNS; c++) {
+    const guint8* end = p + chunk->column_size[c];
+    if (end > chunk_end || end < p)
+      return FALSE;
+    gint64 value = 0;
+    guint64 zeros = 0;  // of a run still to go
+    for (guint i = 0; i < chunk->count; i++) {
+      if (zeros > 0) {
+        zeros--;
+      } else {
+        guint64 encoded;
+        if ((p = brc_get_varint(p, end, &encoded)) == NULL)
+          return FALSE;
+        if (encoded == 0) {
+          if ((p = brc_get_varint(p, end, &zeros)) == NULL)
+            return FALSE;
+        } else {
+          value += brc_unzigzag(encoded);
+        }
+      }
+      brc_set(header, &records[i], &times[i], (BrcColumn)c, value);
+    }
+    p = end;
+  }
+  return TRUE;
+}
+
+#endif  // BIRBCAM_C_BRC_H
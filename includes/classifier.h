@@ -0,0 +1,67 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_CLASSIFIER_H
+#define BIRBCAM_C_CLASSIFIER_H
+
+#define ERR_CLASSIFIER_PAD "Could not get cpu classifier src pad."
+#define ERR_CLASSIFIER_CAPS \
+  "cpu classifier could not read frame size from caps."
+#define MSG_CLASSIFIER_STATS                                              \
+  "classifier: %" G_GUINT64_FORMAT " crops classified, %" G_GUINT64_FORMAT \
+  " answered from the track cache\n"
+
+#include <gst/gst.h>
+#include <gstnvdsmeta.h>
+
+#include "config.h"
+
+// Species classification. Birds found by the detector are classified by a
+// second stage after the tracker: a secondary nvinfer (the [classifier]
+// config-file) on tegra, and the cpu classifier on software. Either way the
+// result ends up as NvDsClassifierMeta with unique_component_id
+// BC_CLASSIFIER_ID on the bird's object meta, where on_batch reads it into the
+// record's species (see brb.h).
+//
+// Classifying every box of every frame would cost far more than detecting
+// them, so results are cached per track: a tracked bird is classified again
+// only every [classifier] interval frames, and (cpu classifier) not at all
+// once it's been classified [classifier] samples times. In between, the
+// cached answer is attached. Untracked birds (no --tracks) have nothing to
+// cache on and are classified every frame.
+//
+// The cpu classifier is a stand-in, like the cpu detector: it isn't a
+// species classifier. It crops each bird to BC_CLASSIFIER_INPUT square,
+// then names it after the nearest of a few reference colours, which is
+// enough to exercise the batching, caching and metadata paths. Its classes
+// are BC_CLASSIFIER_LABELS, in order.
+#define BC_CLASSIFIER_ID 2  // unique_component_id, the sgie's unique-id
+#define BC_CLASSIFIER_BATCH 16  // crops classified at once, at most
+#define BC_CLASSIFIER_INPUT 16  // pixels, crops are scaled to this square
+#define BC_CLASSIFIER_MAX_AGE 3  // seconds a track is cached unseen
+#define BC_CLASSIFIER_LABELS \
+  { "red", "yellow", "blue", "brown", "grey", "black", "white" }
+
+// attach the cpu classifier to the src pad of elem, which must carry I420 in
+// system memory with NvDsBatchMeta (after the detector, and the tracker if
+// there is one). config's [classifier] interval and samples are read once.
+gboolean attach_cpu_classifier(GstElement* elem, const BcConfig* config);
+
+#endif  // BIRBCAM_C_CLASSIFIER_H
@@ -0,0 +1,113 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_CONFIG_H
+#define BIRBCAM_C_CONFIG_H
+
+#define ERR_CONFIG_LOAD "Could not load config file %s: %s\n"
+#define MSG_CONFIG_RELOAD "config: reloaded %s\n"
+#define MSG_CONFIG_RESTART "config: [%s] %s only changes on a restart\n"
+
+#include <glib.h>
+
+// The runtime configuration file, a GKeyFile (see birbcam.conf for every key
+// and its default). Anything not in the file keeps its default. On SIGHUP
+// the file is read again and the "live" keys are applied to the running
+// pipeline; the rest only change on a restart.
+
+#define BC_CONFIG_CAMERA "camera"
+#define BC_CONFIG_ENCODER "encoder"
+#define BC_CONFIG_INFERENCE "inference"
+#define BC_CONFIG_MOTION "motion"
+#define BC_CONFIG_CLASSIFIER "classifier"
+#define BC_CONFIG_TILES "tiles"
+
+#define BC_CONFIG_WIDTH 1920
+#define BC_CONFIG_HEIGHT 1080
+#define BC_CONFIG_FRAMERATE 30
+#define BC_CONFIG_BITRATE 4000000  // bits/s
+#define BC_CONFIG_INFER_FILE "../birbcam.cfg"
+#define BC_CONFIG_INFER_WIDTH 384
+#define BC_CONFIG_INFER_HEIGHT 216
+#define BC_CONFIG_CLASS_ID 1  // the detection id of a birb
+#define BC_CONFIG_CLASSIFIER_FILE "../birbcam_species.cfg"
+#define BC_CONFIG_CLASSIFY_INTERVAL 30  // frames, per track
+#define BC_CONFIG_CLASSIFY_SAMPLES 3    // per track
+#define BC_CONFIG_MAX_TILES 4     // columns or rows
+#define BC_CONFIG_MAX_REGIONS 16  // BC_CONFIG_MAX_TILES squared
+#define BC_CONFIG_TILE_OVERLAP 20  // percent of a tile
+#define BC_CONFIG_TILE_NMS 0.5     // see tiles.h
+
+// a rectangle of the camera frame, in pixels
+typedef struct {
+  gint left;
+  gint top;
+  gint width;
+  gint height;
+} BcRegion;
+
+typedef struct {
+  // [camera]
+  gint width;
+  gint height;
+  gint framerate;  // frames per second, tegra only (files keep their own)
+
+  // [encoder]
+  gint bitrate;  // bits/s, live
+
+  // [inference]
+  gchar* infer_file;   // nvinfer config-file-path
+  gint infer_width;    // what the detector sees, and what boxes are in
+  gint infer_height;   //
+  gint interval;       // frames nvinfer skips between batches, live (tegra)
+  gint class_id;       // the class written as a bird, live (atomic)
+  gint min_confidence; // BRB_CONFIDENCE_SCALE units, live (atomic)
+
+  // [motion]
+  gint motion_threshold;  // see BC_MOTION_THRESHOLD, live
+
+  // [classifier], with --classify (see classifier.h)
+  gchar* classifier_file;   // secondary nvinfer config-file-path (tegra)
+  gint classify_interval;   // frames between classifying a track again
+  gint classify_samples;    // times a track is classified (software)
+
+  // [tiles], off unless there's more than one tile or a region (see tiles.h)
+  gint tile_columns;
+  gint tile_rows;
+  gint tile_overlap;  // percent of a tile each neighbour shares
+  gint tile_nms;      // BRB_CONFIDENCE_SCALE units, boxes this alike are one
+  BcRegion regions[BC_CONFIG_MAX_REGIONS];  // instead of the grid, if any
+  gint n_regions;
+} BcConfig;
+
+// fill in the defaults
+void config_init(BcConfig* config);
+// read filename over the defaults. On failure config is left as it was and
+// err is set.
+gboolean config_load(BcConfig* config, const gchar* filename, GError** err);
+// copy the live values of from into config, and say which of the others
+// differ (and are ignored). class_fixed makes class_id one of the others,
+// for when an element was set up with it (the tegra species classifier).
+void config_update(BcConfig* config,
+                   const BcConfig* from,
+                   gboolean class_fixed);
+void config_clear(BcConfig* config);
+
+#endif  // BIRBCAM_C_CONFIG_H
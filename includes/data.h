@@ -21,28 +21,90 @@
 #ifndef BIRBCAM_C_DATA_H
 #define BIRBCAM_C_DATA_H
 
+#include "config.h"
+#include "feed.h"
+#include "gate.h"
+#include "metrics.h"
+#include "motion.h"
 #include "pipeline.h"  // where PipelineData struct is defined
+#include "reconnect.h"
+#include "reprocess.h"
+#include "restart.h"
+#include "seekindex.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include "tracks.h"
+#include "uplink.h"
+#include "videosync.h"
+#include "writer.h"    // metadata writer and MetaType
 
-#define BIRB_ID 1  // the detection id of a birb TODO: use a real number
-
-typedef enum {
-  JSON_LINES,
-  PROTOBUF,
-} MetaType;
+// the default detection id of a birb, see [inference] class-id in config.h
+#define BIRB_ID BC_CONFIG_CLASS_ID
 
 typedef struct {  // struct to hold parsed arguments
+  gchar* config_filename;  // NULL for the defaults
+  BcConfig config;         // loaded from config_filename, updated on SIGHUP
   gchar* base_filename;
-  gchar* mkv_filename;
-  gchar* meta_filename;
   MetaType meta_type;
+  gchar* backend_name;  // NULL or "auto" to pick one (see backend.h)
+  gchar** inputs;       // NULL for the live camera, else one per source
+  BcWriterOptions writer_options;
+  gchar* metrics_address;  // port or unix socket path, NULL for no metrics
+  gchar* feed_socket;      // unix socket path, NULL for no socket feed
+  gchar* feed_shm;         // shared memory name, NULL for no shared ring
+  gchar* uplink_url;       // where to ship records, NULL for nowhere
+  gchar* uplink_spool;     // NULL for the base filename plus _spool
+  gint uplink_spool_mb;    // megabytes the spool may take up
+  gboolean gated;          // only record around detections, see gate.h
+  gint preroll;            // seconds
+  gint postroll;           // seconds
+  gint segment_time;       // seconds, 0 for no time limit
+  gint segment_size;       // megabytes, 0 for no size limit
+  gint video_sync;         // seconds between video syncs, 0 for none
+  gboolean motion;         // only infer on motion, see motion.h
+  gdouble keepalive;       // frames/s inferred anyway, 0 for none
+  gint infer_budget;       // ms, inference latency bound, 0 for none
+  gboolean tracks;         // track birds and write tracks, see tracks.h
+  gboolean classify;       // classify birds' species, see classifier.h
+  gboolean snapshots;      // write JPEGs of birds, see snapshot.h
+  gboolean reprocess;      // inputs are recordings to rescore, reprocess.h
+  gint reprocess_every;    // with reprocess, infer one frame in this many
+  gint snapshot_interval;  // seconds, per bird
 } BcArgs;
 
+// everything one source records to. With more than one source each gets
+// the base filename plus _camN, numbered like the inputs.
+typedef struct {
+  gchar* base_filename;
+  gchar* mkv_filename;   // the first segment's, when segmenting
+  gchar* meta_filename;  // the first segment's, when segmenting
+  const gchar* meta_extension;
+  BcWriter* writer;
+  BcGate* gate;  // NULL unless --gated was given
+  BcSeekIndex* index;
+  BcMotion* motion;  // NULL unless --motion was given
+  BcTracks* tracks;  // NULL unless --tracks was given
+  BcSnapshots* snapshots;  // NULL unless --snapshots was given
+  BcVideoSync* video_sync;  // NULL unless --video-sync was given
+  BcThrottle* throttle;     // NULL when reprocessing without --motion
+  BcReprocess* reprocess;   // NULL unless --reprocess was given
+  BcReconnect* reconnect;   // NULL unless the camera can come and go
+  gint64 start_time;        // wall time at pts 0, 0 for when we start
+  guint64 detections;       // birds on_batch kept, written only by it
+} BcOutput;
+
 // main data struct to pass around through callback hell. Hail Satan!
 typedef struct {
   PipelineData* pipeline_data;
   GMainLoop* main_loop;
   BcArgs* args;
-  FILE* meta_file;
+  BcOutput outputs[BC_MAX_SOURCES];  // by source_id
+  guint n_outputs;
+  BcMetrics* metrics;  // NULL unless --metrics was given
+  BcFeed* feed;        // NULL unless --feed, --feed-shm or --uplink was given
+  BcUplink* uplink;    // NULL unless --uplink was given
+  BcRestart* restart;  // NULL when reprocessing, see restart.h
+  gboolean failed;     // exit with an error, see main()
 } BcData;
 
 #endif  // BIRBCAM_C_DATA_H
@@ -0,0 +1,53 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_DETECTOR_H
+#define BIRBCAM_C_DETECTOR_H
+
+#define ERR_DETECTOR_PAD "Could not get cpu detector src pad."
+#define ERR_DETECTOR_CAPS "cpu detector could not read frame size from caps."
+
+#include <gst/gst.h>
+#include <gstnvdsmeta.h>
+
+#include "config.h"
+#include "data.h"
+
+// the cpu detector is a stand-in for nvinfer so the software backend can run
+// the whole pipeline (and on_batch) without a GPU. It is not a bird detector:
+// it reports the bounding box of whatever moved since the last frame as a
+// single object of the configured class-id, which is plenty to exercise the
+// metadata path.
+#define BC_DETECTOR_ID 1          // unique_component_id, same as the pgie
+#define BC_DETECTOR_BLOCK 8       // block size (pixels), fixed by block_sad
+#define BC_DETECTOR_THRESHOLD 12  // mean abs luma difference of a moving block
+#define BC_DETECTOR_MIN_BLOCKS 4  // fewer moving blocks than this is noise
+
+// attach the cpu detector to the src pad of elem (which must carry I420 or
+// other planar-luma-first raw video in system memory). Each buffer leaving
+// elem gets an NvDsBatchMeta just like the one nvstreammux + nvinfer attach,
+// with a single frame from source_id. When config tiles the frame there's a
+// frame per view instead, numbered and scaled as on tegra (see tiles.h),
+// though no sharper: the views are cut from the frame at the inference size.
+gboolean attach_cpu_detector(GstElement* elem,
+                             guint source_id,
+                             const BcConfig* config);
+
+#endif  // BIRBCAM_C_DETECTOR_H
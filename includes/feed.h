@@ -0,0 +1,140 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_FEED_H
+#define BIRBCAM_C_FEED_H
+
+#define ERR_FEED_SHM "Could not create shared memory feed %s: %s"
+#define ERR_FEED_LISTEN "Could not listen for feed subscribers on %s: %s"
+#define MSG_FEED_LISTEN "publishing records on %s\n"
+#define MSG_FEED_STATS                                                \
+  "feed: %" G_GUINT64_FORMAT " records published, %" G_GUINT64_FORMAT \
+  " lost by slow subscribers\n"
+
+// a record as a subscriber sees it: the source, the wall time it was
+// published, then as in JSON_TRACK_RECORD plus the species (0 if there's
+// no classifier, see JSON_SPECIES)
+#define JSON_FEED_RECORD                                              \
+  "{\"s\": %u, \"f\": %d, \"pts\": %" G_GUINT64_FORMAT               \
+  ", \"ts\": %" G_GINT64_FORMAT ", \"id\": %u, \"k\": %u, \"t\": %d, " \
+  "\"h\": %d, \"l\": %d, \"w\": %d, \"sp\": %u}\n"
+// sent instead of the records a subscriber was too slow to read
+#define JSON_FEED_LOST "{\"lost\": %u}\n"
+
+#include <glib.h>
+
+#include "brb.h"
+
+// A live feed of every record, for local services that can't wait for the
+// metadata file. Records are published as writer_push() accepts them (and
+// skipped frames once writer_publish() next runs, see writer.h) into a
+// ring of BRF_CAPACITY slots, each guarded by its own sequence number (a
+// seqlock), so the producer never waits for anyone: a subscriber that falls
+// more than the ring behind loses the oldest records, finds out how many,
+// and carries on from the oldest one still there.
+//
+// The ring can live in POSIX shared memory (--feed-shm=NAME), where any
+// number of processes map it read only and each keeps its own cursor; see
+// brf_read() below and tools/feed.c. It's also served as JSON lines on a
+// Unix socket (--feed=PATH), for anything that would rather just connect.
+// Neither replaces a ring or socket another birbcam is still publishing on,
+// or anything at PATH that isn't a socket; only ones left behind by a crash.
+// Socket subscribers are drained every BC_FEED_POLL_MS from the main loop
+// with non-blocking sends, and are just as unable to hold anything up.
+
+#define BRF_MAGIC "BRF"
+#define BRF_VERSION 1
+#define BRF_CAPACITY 4096  // slots, must be a power of two
+#define BC_FEED_POLL_MS 10     // socket subscribers are sent records this often
+#define BC_FEED_BATCH 256      // records formatted for a subscriber at a time
+
+typedef struct {
+  gchar magic[4];        // BRF_MAGIC
+  guint16 version;       // BRF_VERSION
+  guint16 header_size;   // offset of the first slot
+  guint16 slot_size;     // stride between slots
+  guint16 reserved;
+  guint32 capacity;      // slots, a power of two
+  gint head;             // records published so far (wrapping), atomic
+  gint32 pid;            // the producer's, to tell a ring left by a crash
+} BrfHeader;
+
+typedef struct {
+  gint seq;        // 2n + 1 while record n is written, 2n + 2 once it's done
+  guint32 reserved;
+  gint64 ts;       // wall time it was published, us since the epoch
+  BrbRecord record;
+} BrfSlot;
+
+// the slots follow the header
+#define BRF_SLOTS(header) \
+  ((const BrfSlot*)((const gchar*)(header) + (header)->header_size))
+
+typedef struct _BcFeed BcFeed;
+
+// a ring in the shared memory object shm_name (may be NULL, for the socket
+// only), served on the Unix socket at socket_path (may be NULL, for shared
+// memory only). The socket is served from the default main context.
+BcFeed* feed_new(const gchar* shm_name, const gchar* socket_path);
+// publish a record. Only one thread at a time, which is the streaming thread
+// while there is a pipeline. Never blocks.
+void feed_publish(BcFeed* feed, const BrbRecord* record);
+// the ring, for readers in this process (see brf_read)
+const BrfHeader* feed_ring(BcFeed* feed);
+// disconnect everyone and unlink the shared memory and the socket
+void feed_free(BcFeed* feed);
+
+// Read the record after *cursor from a ring (start with *cursor = head, for
+// new records only). Returns TRUE and advances *cursor if there was one,
+// FALSE if there is nothing new. If the ring has moved on past *cursor, the
+// records missed are added to *lost and *cursor skips ahead to the oldest.
+static inline gboolean brf_read(const BrfHeader* header,
+                                const BrfSlot* slots,
+                                guint32* cursor,
+                                BrfSlot* slot,
+                                guint32* lost) {
+  for (;;) {
+    guint32 head = (guint32)g_atomic_int_get(&header->head);
+    if (*cursor == head)
+      return FALSE;
+    if (head - *cursor > header->capacity) {
+      // lapped. Skip to the oldest slot, plus some room, as the producer is
+      // about to overwrite it
+      guint32 next = head - header->capacity + header->capacity / 8;
+      *lost += next - *cursor;
+      *cursor = next;
+      continue;
+    }
+    const BrfSlot* from = &slots[*cursor & (header->capacity - 1)];
+    gint seq = g_atomic_int_get(&from->seq);
+    if (seq & 1)
+      return FALSE;  // being overwritten, head will show how far behind we are
+    if (seq != (gint)(2 * *cursor + 2))
+      continue;  // overwritten since head was read, so lapped now
+    *slot = *from;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (g_atomic_int_get(&from->seq) != seq)
+      continue;  // overwritten while it was copied
+    (*cursor)++;
+    return TRUE;
+  }
+}
+
+#endif  // BIRBCAM_C_FEED_H
@@ -0,0 +1,54 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_GATE_H
+#define BIRBCAM_C_GATE_H
+
+#define ERR_GATE_PAD "Could not get parser src pad for the recording gate."
+#define MSG_GATE_START "recording: bird at %" GST_TIME_FORMAT "\n"
+#define MSG_GATE_STOP "recording: stopped at %" GST_TIME_FORMAT "\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+// Detection gated recording. Encoded access units coming out of the parser
+// are held in memory instead of going to the muxer, keeping at least preroll
+// worth, trimmed a whole GOP at a time so the oldest held unit is always a
+// keyframe. When on_batch reports a bird the held units are flushed to the
+// muxer in order and everything passes through until postroll after the last
+// detection, then it goes back to holding. The muxer just sees a timestamp
+// gap, so each visit is a seekable run of video in the same file.
+
+#define BC_GATE_PREROLL 10                // seconds, default
+#define BC_GATE_POSTROLL 10               // seconds, default
+#define BC_GATE_MAX_BYTES (64 << 20)      // never hold more than this
+#define BC_KEYFRAME_INTERVAL 30           // frames, encoders are set to this
+
+typedef struct _BcGate BcGate;
+
+// gate the buffers leaving the parser
+BcGate* gate_new(GstElement* parser, guint preroll, guint postroll);
+// a bird was seen in the frame with this pts. Called from the inference
+// branch's streaming thread.
+void gate_trigger(BcGate* gate, GstClockTime pts);
+// call after the pipeline is gone, the probe uses the gate
+void gate_free(BcGate* gate);
+
+#endif  // BIRBCAM_C_GATE_H
@@ -0,0 +1,128 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Reading back .jl metadata (see writer.h), for the tools. A .jl line has
+// less in it than a BrbRecord, so what it doesn't say (the class, source and
+// detector confidence) is 0 and an untracked bird's object_id BRB_UNTRACKED,
+// as in a .brb.
+
+#ifndef BIRBCAM_C_JL_H
+#define BIRBCAM_C_JL_H
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "brb.h"
+
+// read a non negative or negative decimal integer, stopping at anything else
+static inline const gchar* jl_parse_int(const gchar* p,
+                                        const gchar* end,
+                                        gint64* out) {
+  gboolean negative = p < end && *p == '-';
+  if (negative)
+    p++;
+  gint64 value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    value = value * 10 + (*p - '0');
+  *out = negative ? -value : value;
+  return p;
+}
+
+// one line of JSON_RECORD or JSON_TRACK_RECORD, maybe ending in JSON_SPECIES,
+// or of JSON_SKIP_RECORD (see writer.h). Keys may come in any order and files
+// from before pts and ts were added parse with both as 0. FALSE if it isn't a
+// record at all.
+static inline gboolean jl_parse_line(const gchar* p,
+                                     const gchar* end,
+                                     BrbRecord* record,
+                                     gint64* time) {
+  gboolean has_frame = FALSE;
+  guint64 last = 0;
+  memset(record, 0, sizeof(*record));
+  record->object_id = BRB_UNTRACKED;
+  *time = 0;
+  while ((p = memchr(p, '"', end - p)) != NULL) {
+    const gchar* key = ++p;
+    p = memchr(p, '"', end - p);
+    if (p == NULL)
+      break;
+    gsize key_length = p - key;
+    // skip the closing quote, the colon and any spaces
+    for (p++; p < end && (*p == ':' || *p == ' '); p++)
+      continue;
+    if (key_length == 2 && !memcmp(key, "sc", 2)) {
+      gchar* after;
+      gdouble value = g_ascii_strtod(p, &after);
+      record->species_confidence =
+          (guint8)(CLAMP(value, 0.0, 1.0) * BRB_SPECIES_SCALE + 0.5f);
+      p = after;
+      continue;
+    }
+    gint64 value;
+    p = jl_parse_int(p, end, &value);
+
+    if (key_length == 1) {
+      switch (key[0]) {
+        case 'f':
+          record->frame_num = (gint32)value;
+          has_frame = TRUE;
+          break;
+        case 't':
+          record->top = (guint16)value;
+          break;
+        case 'h':
+          record->height = (guint16)value;
+          break;
+        case 'l':
+          record->left = (guint16)value;
+          break;
+        case 'w':
+          record->width = (guint16)value;
+          break;
+        case 'k':
+          record->flags = (guint8)value;
+          break;
+        case 'r':
+          record->class_id = (guint8)value;
+          break;
+        case 'n':
+          record->object_id = (guint32)value;
+          break;
+      }
+    } else if (key_length == 2 && !memcmp(key, "ts", 2)) {
+      *time = value;
+    } else if (key_length == 2 && !memcmp(key, "id", 2)) {
+      record->object_id = (guint32)value;
+    } else if (key_length == 2 && !memcmp(key, "sp", 2)) {
+      record->species = (guint8)value;
+    } else if (key_length == 2 && !memcmp(key, "to", 2)) {
+      last = (guint64)value;
+    } else if (key_length == 3 && !memcmp(key, "pts", 3)) {
+      record->pts = (guint64)value;
+    }
+  }
+  // a run of skipped frames keeps its last pts where the box would be
+  if ((record->flags & BRB_FRAME_SKIPPED) && last > record->pts)
+    brb_set_skip_last(record, last);
+  return has_frame;
+}
+
+#endif  // BIRBCAM_C_JL_H
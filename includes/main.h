@@ -42,5 +42,6 @@
 #include "data.h"
 #include "pipeline.h"
 #include "probe.h"
+#include "segment.h"
 
 #endif  // BIRBCAM_C_MAIN_H
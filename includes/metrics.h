@@ -0,0 +1,66 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_METRICS_H
+#define BIRBCAM_C_METRICS_H
+
+#define ERR_METRICS_LISTEN "Could not listen for metrics on %s: %s"
+#define ERR_METRICS_ADDRESS \
+  "--metrics takes a localhost port or a unix socket path, not %s"
+#define MSG_METRICS_LISTEN "serving metrics on %s\n"
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "pipeline.h"
+#include "reconnect.h"
+#include "writer.h"
+
+// Pad probe instrumentation of the pipeline, served in the Prometheus text
+// format over plain HTTP on a local port or Unix socket. Every instrumented
+// point counts buffers and keeps a moving average of its frame rate; points
+// with both pads probed also get a histogram of the time a buffer spends
+// inside the element, and queues report how full they are at scrape time.
+
+// instrumented elements, at most: five per source plus the shared nvinfer
+#define BC_METRICS_POINTS (BC_MAX_SOURCES * 5 + 1)
+#define BC_METRICS_INFLIGHT 256  // buffers inside one element we can time
+#define BC_METRICS_BUCKETS 11    // see BC_METRICS_BUCKET_BOUNDS in metrics.c
+
+typedef struct _BcMetrics BcMetrics;
+
+// attach probes to every source's tee, enc_queue, infer_queue and filesink
+// and to inference. writers, reconnects and detections (one per source, by
+// source_id, the last counting the birds on_batch kept) may be NULL,
+// otherwise their counters are exported too.
+BcMetrics* metrics_new(PipelineData* p_data,
+                       BcWriter** writers,
+                       BcReconnect** reconnects,
+                       const guint64** detections);
+// start serving on address: a port number (bound to localhost only) or the
+// path of a Unix socket. Runs on the default main context.
+gboolean metrics_serve(BcMetrics* metrics, const gchar* address);
+// the current metrics in the Prometheus text exposition format
+GString* metrics_format(BcMetrics* metrics);
+// stop serving. Probes stay on the pipeline, so free this after the pipeline
+void metrics_free(BcMetrics* metrics);
+
+#endif  // BIRBCAM_C_METRICS_H
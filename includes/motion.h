@@ -0,0 +1,75 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_MOTION_H
+#define BIRBCAM_C_MOTION_H
+
+#define ERR_MOTION_PAD "Could not get pads for the motion gate."
+#define ERR_MOTION_CAPS "motion gate could not read frame size from caps."
+#define MSG_MOTION_STATS                                          \
+  "motion: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames " \
+  "sent to inference\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "throttle.h"
+
+// Motion gated inference. Each source's tee gets a small extra branch that
+// scales frames down to BC_MOTION_CAPS_STRING and differences each one with
+// the last in 8x8 blocks. A probe on the infer_queue src pad only lets
+// frames through to inference while there is motion (and for hold after),
+// plus one every keepalive so a bird sitting perfectly still is still seen.
+// The motion branch only does a few hundred block compares per frame, so it
+// normally runs ahead of the infer_queue and nothing is gated late. Gated
+// frames are recorded as skipped (BRB_SKIP_MOTION) by the throttle.
+
+#define BC_MOTION_WIDTH 160
+#define BC_MOTION_HEIGHT 90
+// I420 in system memory, so the luma plane is first and rows are 4 aligned
+#define BC_MOTION_CAPS_STRING                             \
+  "video/x-raw, width=(int)" G_STRINGIFY(BC_MOTION_WIDTH) \
+  ", height=(int)" G_STRINGIFY(BC_MOTION_HEIGHT) ", format=(string)I420"
+#define BC_MOTION_BLOCK 8          // block size (pixels), fixed by block_sad
+#define BC_MOTION_THRESHOLD 10     // mean abs luma difference, default
+#define BC_MOTION_MIN_BLOCKS 2     // fewer moving blocks than this is noise
+#define BC_MOTION_HOLD 2           // seconds to keep inferring after motion
+#define BC_MOTION_KEEPALIVE 1.0    // frames/s inferred without motion, default
+
+typedef struct _BcMotion BcMotion;
+
+// watch what reaches sink (the end of the motion branch) and gate what
+// leaves infer_queue, recording what's gated to throttle. keepalive is in
+// frames per second, 0 for none.
+BcMotion* motion_new(GstElement* sink,
+                     GstElement* infer_queue,
+                     BcThrottle* throttle,
+                     gdouble keepalive);
+// mean absolute luma difference (0-255) that makes a block count as
+// moving. Safe to call from any thread.
+void motion_set_threshold(BcMotion* motion, guint threshold);
+// call after the pipeline is gone, the probes use the gate
+void motion_free(BcMotion* motion);
+
+// sum of absolute differences of the 8x8 blocks at a and b, which are rows
+// of stride bytes. SSE2 or NEON where available.
+guint block_sad(const guint8* a, const guint8* b, gint stride);
+
+#endif  // BIRBCAM_C_MOTION_H
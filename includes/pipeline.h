@@ -27,27 +27,39 @@
 #define ERR_PIPELINE_DATA "Could not create PipelineData struct."
 #define ERR_BUS_GET "Could not get bus."
 #define ERR_CAMERA_CREATION "Could not create camera."
+#define ERR_BACKEND_MISSING "No backend selected."
+#define ERR_SOURCES "Between 1 and %d inputs are supported."
 
 #include <unistd.h>
 
 #include <glib.h>
 #include <gst/gst.h>
 
+#include "backend.h"
+#include "config.h"
 #include "nvds_config.h"
+#include "tiles.h"
 
 // sources
 #define BC_CAMERA_CSI NVDS_ELEM_SRC_CAMERA_CSI
 #define BC_ELEM_CAMERA_V4L2 NVDS_ELEM_SRC_CAMERA_V4L2
 // utilities
 #define BC_ELEM_CAPS_FILTER NVDS_ELEM_CAPS_FILTER
+// size and framerate are replaced with the configured ones (see config.h)
 #define BC_CAPS_STRING                                            \
   "video/x-raw(memory:NVMM), width=(int)1920, height=(int)1080, " \
   "format=(string)NV12, framerate=(fraction)30/1"
+// a tile cropped for inference (see tiles.h), sized to the inference size
+#define BC_TILE_CAPS_STRING "video/x-raw(memory:NVMM), format=(string)NV12"
 #define BC_ELEM_QUEUE NVDS_ELEM_QUEUE
 #define BC_ELEM_TEE NVDS_ELEM_TEE
 // inference elements
 #define BC_ELEM_STREAM_MUX NVDS_ELEM_STREAM_MUX
 #define BC_ELEM_INFERENCE NVDS_ELEM_PGIE
+#define BC_ELEM_TRACKER NVDS_ELEM_TRACKER
+#define BC_ELEM_CLASSIFIER NVDS_ELEM_SGIE
+#define BC_TRACKER_LIB \
+  "/opt/nvidia/deepstream/deepstream-4.0/lib/libnvds_mot_klt.so"
 // encoders
 #define BC_ELEM_ENC_H265 NVDS_ELEM_ENC_H265
 #define BC_ELEM_ENC_H264 NVDS_ELEM_ENC_H264
@@ -61,18 +73,47 @@
 // sink elements
 #define BC_ELEM_FAKESINK NVDS_ELEM_SINK_FAKESINK
 #define BC_ELEM_FILESINK NVDS_ELEM_SINK_FILE
+#define BC_ELEM_SPLITMUX "splitmuxsink"
 
-// a struct to pass the pipeline elements to callbacks
+// rotate the recording into segments when either limit is reached (0 is no
+// limit). Cuts are always on a keyframe, so segments run a little over.
 typedef struct {
-  // pipeline will unreference all its children on gst_object_unref()
-  GstPipeline* pipeline;
-  GstBus* bus;
+  guint64 max_time;   // nanoseconds
+  guint64 max_bytes;
+} BcSegmentOptions;
+
+#define BC_MAX_SOURCES 8
+// input prefixes, anything else is a filename or uri (rtsp:// included)
+#define BC_INPUT_CSI "csi:"    // csi:N, the argus sensor-id
+#define BC_INPUT_V4L2 "v4l2:"  // v4l2:/dev/videoN
+// nvstreammux pushes an incomplete batch after this long (us), so a camera
+// that stalls doesn't stall inference for the others
+#define BC_STREAMMUX_TIMEOUT 40000
 
-  // pipeline beginning and split to T
+// queue depths, ms of video. infer_queue is leaky (downstream).
+#define BC_ENC_QUEUE_TIME 1000
+#define BC_INFER_QUEUE_TIME 2000
+// buffers, the tile queues only decouple the views from each other
+#define BC_TILE_QUEUE_SIZE 2
+
+// optional branches, or'd together for create_pipeline_data
+#define BC_BRANCH_MOTION 0x01     // a motion branch per source, see motion.h
+#define BC_BRANCH_TRACKER 0x02    // a tracker after inference
+#define BC_BRANCH_SNAPSHOTS 0x04  // a snapshot branch per source, snapshot.h
+#define BC_BRANCH_CLASSIFIER 0x08  // species after the tracker, classifier.h
+#define BC_BRANCH_OFFLINE 0x10  // no encoder branch and no clock, reprocess.h
+// the snapshot branch hands full size frames in system memory to the probe
+#define BC_SNAPSHOT_CAPS_STRING "video/x-raw, format=(string)I420"
+
+// one camera (or stand-in) and everything that's only for it
+typedef struct {
+  guint id;        // source_id in the batch metadata, index into sources
+  gboolean live;   // a camera or network stream, not a file
+
+  // pipeline beginning and split to T (converter and scaler are optional)
   GstElement* camera;
-#ifndef IS_TEGRA
   GstElement* converter;
-#endif
+  GstElement* scaler;
   GstElement* capsfilter;
   GstElement* tee;
 
@@ -80,18 +121,86 @@ typedef struct {
   GstElement* enc_queue;
   GstElement* encoder;
   GstElement* parser;
-  GstElement* muxer;
-  GstElement* filesink;
+  GstElement* muxer;     // inside splitmux, when segmenting
+  GstElement* filesink;  // inside splitmux, when segmenting
+  GstElement* splitmux;  // NULL unless segmenting
 
-  // metadata branch of T split
+  // this source's part of the inference branch. There's no batching on the
+  // software backend, so each source is scaled and detected on its own there.
   GstElement* infer_queue;
-  GstElement* streammux;
-  GstElement* infer;
+  GstElement* infer_scaler;      // software only
+  GstElement* infer_capsfilter;  // software only, sets the inference size
+  GstElement* detector;          // software only, the cpu detector
+  // tegra only, when tiling: infer_queue splits into a queue per view, and
+  // every view but the whole frame is cropped out and scaled (see tiles.h)
+  GstElement* tile_tee;
+  GstElement* tile_queues[BC_TILES_MAX_VIEWS];
+  GstElement* tile_croppers[BC_TILES_MAX_VIEWS];     // NULL for view 0
+  GstElement* tile_capsfilters[BC_TILES_MAX_VIEWS];  // NULL for view 0
+
+  // motion gate branch of T split, NULL unless motion gating (see motion.h)
+  GstElement* motion_queue;
+  GstElement* motion_scaler;
+  GstElement* motion_capsfilter;
+  GstElement* motion_sink;
+
+  // snapshot branch of T split, NULL unless taking snapshots (see snapshot.h)
+  GstElement* snap_queue;
+  GstElement* snap_converter;
+  GstElement* snap_capsfilter;
+  GstElement* snap_sink;
+} BcSource;
+
+// a struct to pass the pipeline elements to callbacks
+typedef struct {
+  // pipeline will unreference all its children on gst_object_unref()
+  GstPipeline* pipeline;
+  GstBus* bus;
+  // element table the pipeline is built from (see backend.h)
+  const BcBackend* backend;
+  const BcConfig* config;
+
+  BcSource sources[BC_MAX_SOURCES];
+  guint n_sources;
+  gboolean offline;  // reprocessing recordings, nothing is encoded
+  // what each source is inferred as, the whole frame and any tiles (tiles.h)
+  BcRegion views[BC_TILES_MAX_VIEWS];
+  guint n_views;
+
+  // metadata branch, shared by every source
+  GstElement* streammux;  // batches (tegra) or interleaves (software)
+  GstElement* infer;      // tegra only, one batched nvinfer for all sources
+  GstElement* tracker;    // NULL unless tracking
+  GstElement* classifier;  // NULL unless classifying
   GstElement* fakesink;
 } PipelineData;
 
-// create the pipeline and a struct to pass it and its members around
-gboolean create_pipeline_data(PipelineData* p_data, const gchar* filename);
+// create the pipeline and a struct to pass it and its members around, with
+// n_sources sources. inputs[i] is a filename, uri, BC_INPUT_CSI or
+// BC_INPUT_V4L2 device, or NULL for the default camera, and filenames[i] is
+// where that source is recorded. If segments is not NULL recordings are
+// split with splitmuxsink and filenames are only the first segments'; connect
+// to each splitmux "format-location-full" signal to name the rest. branches
+// are the BC_BRANCH_* optional branches to add.
+gboolean create_pipeline_data(PipelineData* p_data,
+                              const BcBackend* backend,
+                              const BcConfig* config,
+                              guint n_sources,
+                              const gchar* const* inputs,
+                              const gchar* const* filenames,
+                              const BcSegmentOptions* segments,
+                              guint branches);
+// the first element after a source's camera (or its decoder, for a uri
+// source), where the camera's raw video comes in
+GstElement* source_camera_peer(BcSource* source);
+// take a source's camera out of the running pipeline, leaving the rest of it
+// running without (see reconnect.h)
+void remove_camera(PipelineData* p_data, BcSource* source);
+// and put a new one for input in its place, linked like the old one and
+// brought up to the pipeline's state. FALSE (and no camera) if it can't be.
+gboolean replace_camera(PipelineData* p_data,
+                        BcSource* source,
+                        const gchar* input);
 // returns false on cleanup success
 gboolean cleanup_pipeline_data(PipelineData* p_data);
 gboolean shutdown_pipeline(PipelineData* p_data);
@@ -25,12 +25,10 @@
 #include <gstnvdsmeta.h>
 #include <stdio.h>
 
+#include "brb.h"
 #include "data.h"
+#include "writer.h"
 
-#define JSON_RECORD "{\"f\": %d, \"t\": %d, \"h\": %d, \"l\": %d, \"w\": %d}\n"
-#define JSON_RECORD_ERR "{\"f\": %d, \"error\": \"%s\"}\n"
-
-#define ERR_METADATA_WRITE "CRITICAL: Can't write anything to metadata file!!!!"
 GstPadProbeReturn on_batch(GstPad* pad, GstPadProbeInfo* info, BcData* data);
 
 #endif  // BIRBCAM_C_PROBE_H
@@ -0,0 +1,83 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_RECONNECT_H
+#define BIRBCAM_C_RECONNECT_H
+
+#define MSG_RECONNECT_LOST "source %u: lost %s (%s), reconnecting\n"
+#define MSG_RECONNECT_DONE "source %u: back after %.1f s (%u attempts)\n"
+#define MSG_RECONNECT_STATS                                                  \
+  "source %u: lost %" G_GUINT64_FORMAT " times, down %.1f s in all, %"        \
+  G_GUINT64_FORMAT " reconnect attempts\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "pipeline.h"
+
+// Hot-plug for network (rtsp:// and the like) and USB (v4l2:) cameras. A
+// camera that goes away doesn't stop birbcam: its camera element alone is
+// taken out of the pipeline and a new one is put in after a backoff that
+// doubles from BC_RECONNECT_MIN_MS to BC_RECONNECT_MAX_MS, until frames come
+// through again. Everything after the camera (converter, tee, encoder and
+// the recording, inference) stays up throughout, as do the other cameras,
+// and the recording simply has a gap. A camera that isn't there at startup
+// is treated the same, so cameras can come and go as they like; the sources
+// themselves (and their files) are still the ones given at startup.
+//
+// A camera is lost when something inside it posts an error (see
+// on_bus_message), when it sends EOS (an RTSP server going away, which would
+// otherwise finish the recording), or when no frame has come from it for
+// BC_RECONNECT_STALL_MS (a network that silently stops). The time from
+// losing a camera to its first frame back is exported with --metrics.
+
+#define BC_RECONNECT_MIN_MS 500     // first retry after this long
+#define BC_RECONNECT_MAX_MS 30000   // and the backoff doubles up to this
+#define BC_RECONNECT_STALL_MS 5000  // no frames this long is as good as gone
+#define BC_RECONNECT_CHECK_MS 250   // how often the watchdog looks
+
+typedef struct {
+  gboolean up;           // frames are coming through
+  guint64 losses;        // times the camera went away
+  guint64 attempts;      // new cameras tried
+  gdouble last_seconds;  // from the last loss to the first frame back
+  gdouble down_seconds;  // in all, not counting a loss still going on
+} BcReconnectStats;
+
+typedef struct _BcReconnect BcReconnect;
+
+// whether input is a camera that can come and go (see above). The built in
+// (csi) camera can't, nor can a file.
+gboolean reconnect_wanted(const gchar* input);
+// keep source's camera, input, connected. Runs on the default main context.
+BcReconnect* reconnect_new(PipelineData* p_data,
+                           BcSource* source,
+                           const gchar* input);
+// if the error message came from source's camera, deal with it and return
+// TRUE, else FALSE. Call from the bus watch.
+gboolean reconnect_on_error(BcReconnect* reconnect,
+                            GstMessage* message,
+                            const GError* err);
+// for the metrics, from the main thread
+void reconnect_get_stats(BcReconnect* reconnect, BcReconnectStats* stats);
+// print how it went. Call after the pipeline is gone.
+void reconnect_free(BcReconnect* reconnect);
+
+#endif  // BIRBCAM_C_RECONNECT_H
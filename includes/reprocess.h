@@ -0,0 +1,65 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_REPROCESS_H
+#define BIRBCAM_C_REPROCESS_H
+
+#define ERR_REPROCESS_PAD "Could not get the decoded video pad to reprocess."
+#define MSG_REPROCESS_START "reprocess: %s -> %s\n"
+#define MSG_REPROCESS_STATS                                                 \
+  "reprocess: source %u, %" G_GUINT64_FORMAT " frames decoded, %"           \
+  G_GUINT64_FORMAT " inferred, %.1f s of video in %.1f s (%.1fx)%s\n"
+#define MSG_REPROCESS_KEYFRAMES ", keyframes only"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "pipeline.h"
+
+// Offline reprocessing (--reprocess). The inputs are earlier recordings and
+// the pipeline runs without an encoder branch or a clock, so frames are
+// decoded and inferred as fast as the hardware allows rather than in real
+// time, and metadata is written for each recording with the usual writers,
+// next to it as NAME BC_REPROCESS_SUFFIX (birbs_00012.mkv is rescored into
+// birbs_00012_rescored.jl). Record times come from the recording's own .bri
+// header, so they are the times the birds were there, not the time of the
+// rescoring. There's no video written, so no keyframes for that .bri.
+//
+// With every > 1 only every Nth decoded frame goes on to be converted,
+// scaled and inferred. Inter frames still need decoding for the frames after
+// them, except that a decoder that can skip them (nvv4l2decoder) is told to
+// decode keyframes only when every is at least a keyframe interval, and N is
+// then counted in keyframes.
+
+#define BC_REPROCESS_SUFFIX "_rescored"
+
+typedef struct _BcReprocess BcReprocess;
+
+// input minus its extension, plus BC_REPROCESS_SUFFIX. Free with g_free.
+gchar* reprocess_base_filename(const gchar* input);
+// the wall time, us since the epoch, at pts 0 of the recording input, from
+// the .bri written alongside it. 0 if there isn't a readable one.
+gint64 reprocess_start_time(const gchar* input);
+// decimate the frames source decodes to one in every, and time the run
+BcReprocess* reprocess_new(BcSource* source, guint every);
+// print how it went. Call after the pipeline is gone.
+void reprocess_free(BcReprocess* reprocess);
+
+#endif  // BIRBCAM_C_REPROCESS_H
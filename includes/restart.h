@@ -0,0 +1,80 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_RESTART_H
+#define BIRBCAM_C_RESTART_H
+
+#define ERR_RESTART_PAD "Could not get the tee pad feeding inference."
+#define ERR_RESTART_LIMIT \
+  "inference: failed %u times in %d s, giving up\n"
+#define MSG_RESTART_FAILED \
+  "inference: %s failed (%s), restarting inference in %.1f s\n"
+#define MSG_RESTART_DONE                                                 \
+  "inference: restarted, down %.1f s, %u frames recorded but not inferred\n"
+#define MSG_RESTART_STATS "inference: restarted %u times\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "pipeline.h"
+#include "throttle.h"
+
+// Fault isolation for the inference branch: everything from each source's
+// infer_queue to the fakesink on_batch is attached to. An error from any of
+// those no longer stops birbcam. The moment it's posted (from a bus sync
+// handler, on the failing thread) the branch is cut off at every source's
+// tee pad, where frames bound for inference are dropped instead, so the
+// error can't travel back up through the tee and stop the camera, and the
+// encoder branch goes on recording. After BC_RESTART_DELAY_MS (doubling with
+// each recent restart) the branch's elements are taken down to NULL and
+// brought back up in place, the tee pads send them the stream's caps and
+// segment again, and frames flow back in.
+//
+// The elements, their links and every probe on them (on_batch, the
+// throttle, motion gating, metrics) stay as they are; a state change to NULL
+// is as much of a reset as a new element would be, nvinfer included (it
+// reloads its engine, from the cached engine file). Only BC_RESTART_MAX
+// restarts are tried in BC_RESTART_WINDOW seconds; a branch that keeps
+// failing is an error like any other, so something outside (systemd) can
+// restart the whole thing.
+
+#define BC_RESTART_DELAY_MS 1000  // before the first restart
+#define BC_RESTART_MAX 3          // restarts within the window, at most
+#define BC_RESTART_WINDOW 600     // seconds
+
+typedef struct _BcRestart BcRestart;
+
+// watch p_data's inference branch. Installs p_data's bus sync handler.
+BcRestart* restart_new(PipelineData* p_data);
+// record the frames source_id drops while inference is down to throttle, as
+// BRB_SKIP_RESTART. Call before the pipeline starts.
+void restart_set_throttle(BcRestart* restart,
+                          guint source_id,
+                          BcThrottle* throttle);
+// if the error message came from the inference branch, restart it and return
+// TRUE. FALSE if it's from elsewhere, or the branch has failed too often.
+// Call from the bus watch.
+gboolean restart_on_error(BcRestart* restart,
+                          GstMessage* message,
+                          const GError* err);
+// call after the pipeline is gone
+void restart_free(BcRestart* restart);
+
+#endif  // BIRBCAM_C_RESTART_H
@@ -0,0 +1,45 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BIRBCAM_C_SEEKINDEX_H
+#define BIRBCAM_C_SEEKINDEX_H
+
+#define ERR_SEEK_INDEX_PAD "Could not get filesink sink pad for the seek index."
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "writer.h"
+
+// Feeds the .bri seek index (see brb.h). matroskamux marks the buffers it
+// writes for a keyframe (the Cluster it starts and the block) as non-delta and
+// stamps them with the frame's pts, so a probe on the filesink can see where
+// in the file each keyframe lands, counting bytes from the last byte segment
+// (a new file, when segmenting). The writer thread does the actual indexing.
+
+typedef struct _BcSeekIndex BcSeekIndex;
+
+// watch what reaches filesink and report keyframes to writer
+BcSeekIndex* seek_index_new(GstElement* filesink, BcWriter* writer);
+// call after the pipeline is gone, the probe uses the index
+void seek_index_free(BcSeekIndex* index);
+
+#endif  // BIRBCAM_C_SEEKINDEX_H
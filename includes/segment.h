@@ -0,0 +1,50 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BIRBCAM_C_SEGMENT_H
+#define BIRBCAM_C_SEGMENT_H
+
+#define MSG_SEGMENT "recording: segment %s\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "data.h"
+
+// Segmented recording. splitmuxsink cuts the video at keyframes once a
+// segment is long (or big) enough and asks on_format_location for the next
+// name, which also rotates the metadata writer at the pts the new segment
+// starts at. Both are named base_NNNNN plus their extension, so segment 12
+// of "birbs" is birbs_00012.mkv and birbs_00012.jl (or .brb), and of the
+// second camera birbs_cam1_00012.mkv and so on.
+
+#define BC_SEGMENT_FORMAT "%s_%05u%s"
+
+// base_NNNNN.extension, free with g_free
+gchar* segment_filename(const gchar* base, guint index, const gchar* extension);
+// the splitmuxsink "format-location-full" handler, for the source recording
+// to output
+gchar* on_format_location(GstElement* splitmux,
+                          guint fragment_id,
+                          GstSample* first_sample,
+                          BcOutput* output);
+
+#endif  // BIRBCAM_C_SEGMENT_H
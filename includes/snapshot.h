@@ -0,0 +1,76 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_SNAPSHOT_H
+#define BIRBCAM_C_SNAPSHOT_H
+
+#define ERR_SNAPSHOT_PAD "Could not get snapshot sink pad."
+#define ERR_SNAPSHOT_DIR "Could not create snapshot directory %s"
+#define ERR_SNAPSHOT_POOL "Could not start snapshot workers: %s"
+#define ERR_SNAPSHOT_WRITE "snapshot: %s: %s\n"
+#define MSG_SNAPSHOT_STATS                                          \
+  "snapshots: %" G_GUINT64_FORMAT " written, %" G_GUINT64_FORMAT \
+  " dropped\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "brb.h"
+
+// Detection snapshots. A probe at the end of each source's snapshot branch
+// keeps refs to the last full size frames (system memory I420), enough to
+// cover the inference latency budget at the camera's framerate. When
+// on_batch writes a bird, snapshot_request() finds the frame it was seen in,
+// and a small pool of worker threads crops the box out of it, encodes it as
+// a JPEG and writes it to the snapshot directory as PTS_ID.jpg (the record's
+// pts, and its track id or index in the frame if untracked), so a record
+// and its image can be matched up without decoding any video. Snapshots are
+// rate limited per track (or per source, if untracked) and dropped, rather
+// than queued, when the workers are behind.
+
+#define BC_SNAPSHOT_FRAMES 8       // frames held beyond the latency budget
+#define BC_SNAPSHOT_MAX_FRAMES 64  // frames held, at most
+#define BC_SNAPSHOT_SLACK 50       // ms, a frame this close in pts will do
+#define BC_SNAPSHOT_WORKERS 2      // encoding threads
+#define BC_SNAPSHOT_QUEUE 8        // jobs waiting at most, per source
+#define BC_SNAPSHOT_INTERVAL 10    // seconds between snapshots, default
+#define BC_SNAPSHOT_MARGIN 0.2f    // extra box size on each side, for context
+#define BC_SNAPSHOT_SUFFIX "_snapshots"  // directory, after the base filename
+
+typedef struct _BcSnapshots BcSnapshots;
+
+// hold the frames reaching sink and write snapshots to directory. Boxes are
+// in infer_width x infer_height and are scaled to the frame. Frames are held
+// for latency_ms (the inference budget) at framerate, and then some.
+BcSnapshots* snapshots_new(GstElement* sink,
+                           const gchar* directory,
+                           guint infer_width,
+                           guint infer_height,
+                           guint interval,
+                           guint latency_ms,
+                           guint framerate);
+// snapshot the bird in record, maybe. index is its index in the frame. Only
+// called from the inference branch's streaming thread. Never blocks on
+// encoding or I/O.
+void snapshot_request(BcSnapshots* snaps, const BrbRecord* record, guint index);
+// wait for the workers to finish. Call after the pipeline is gone.
+void snapshots_free(BcSnapshots* snaps);
+
+#endif  // BIRBCAM_C_SNAPSHOT_H
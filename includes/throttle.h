@@ -0,0 +1,96 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_THROTTLE_H
+#define BIRBCAM_C_THROTTLE_H
+
+#define ERR_THROTTLE_PAD "Could not get infer_queue sink pad for the throttle."
+#define MSG_THROTTLE_STATS                                               \
+  "inference: %" G_GUINT64_FORMAT " frames skipped (%" G_GUINT64_FORMAT \
+  " decimated, %" G_GUINT64_FORMAT " over budget), latency %.0f ms, "   \
+  "inferring 1 in %u\n"
+#define MSG_THROTTLE_UNRECORDED                                        \
+  "inference: %" G_GUINT64_FORMAT " skipped frames not recorded, the " \
+  "writer fell behind\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "writer.h"
+
+// Latency bounded inference. The tee hands every frame to the encoder and
+// inference branches alike, and a slow detector must never hold up the
+// recording, so frames are skipped on their way into inference (never on the
+// way to the encoder). A probe on the infer_queue sink pad times each frame
+// until on_batch sees it (throttle_done) and keeps a moving average of that
+// latency. Over budget, only every Nth frame is let in, N growing by one
+// every BC_THROTTLE_ADJUST_MS while it stays over and shrinking once it's
+// back under half the budget. A frame that finds more than the budget
+// already waiting in the queue is skipped too, whatever N is.
+//
+// Skipped frames aren't silent, whether the throttle, the motion gate (see
+// motion.h) or a restart of inference (see restart.h) skipped them.
+// Consecutive ones become a run, a single BRB_FRAME_SKIPPED record (see
+// brb.h), which the writer thread collects itself (see writer_set_pull) so
+// they're written even while inference is stalled and on_batch isn't
+// running. There's a fixed number of runs per reason waiting to be written;
+// a skip that would start another when they're all taken is only counted,
+// and the count printed on exit. A run still growing is written once it's
+// BC_THROTTLE_RUN_MS old, and the next skip starts another.
+//
+// With a budget the throttle keeps infer_queue under it, and the queue is
+// made to hold twice that, so it only leaks (dropping frames with no record
+// of them) when inference has stopped altogether; it stays leaky so that a
+// stalled branch can't back up through the tee into the recording. With
+// --infer-budget 0 nothing keeps it short, and what it drops isn't recorded.
+// Frames without a pts are throttled too, but aren't timed or recorded.
+
+#define BC_THROTTLE_BUDGET 500        // ms, default latency budget
+#define BC_THROTTLE_ADJUST_MS 1000    // between changes to the decimation
+#define BC_THROTTLE_MAX_DECIMATION 30  // infer at least 1 frame in this many
+#define BC_THROTTLE_SMOOTHING 0.1     // weight of a new latency sample
+#define BC_THROTTLE_INFLIGHT 64       // frames timed at once, at most
+#define BC_THROTTLE_RUNS 32           // skipped runs per reason, unwritten
+#define BC_THROTTLE_RUN_MS 1000       // a growing run is written after this
+#define BC_THROTTLE_REASONS 3         // BRB_SKIP_*
+
+typedef struct _BcThrottle BcThrottle;
+
+// bound the latency of frames entering infer_queue to budget_ms, and record
+// the frames that are skipped to writer as source_id's. With a budget of 0
+// nothing is throttled and only the motion gate's and restart's skips are
+// recorded.
+BcThrottle* throttle_new(GstElement* infer_queue,
+                         BcWriter* writer,
+                         guint source_id,
+                         guint budget_ms);
+// the frame with pts has been through inference. Only called from the
+// inference branch's streaming thread, like writer_push.
+void throttle_done(BcThrottle* throttle, guint64 pts);
+// the frame with pts was skipped for reason (BRB_SKIP_*). Safe to call from
+// any thread.
+void throttle_skip(BcThrottle* throttle, guint64 pts, guint8 reason);
+// a frame got past reason's check, so its run of skips is over
+void throttle_pass(BcThrottle* throttle, guint8 reason);
+// write the last skipped runs. Call after the pipeline is gone and before
+// writer_free.
+void throttle_free(BcThrottle* throttle);
+
+#endif  // BIRBCAM_C_THROTTLE_H
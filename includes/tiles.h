@@ -0,0 +1,63 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_TILES_H
+#define BIRBCAM_C_TILES_H
+
+#define ERR_TILES_PAD "Could not get tile merger src pad."
+
+#include <gst/gst.h>
+#include <gstnvdsmeta.h>
+
+#include "config.h"
+
+// Tiled inference, for birds too small to find once the whole frame is
+// scaled down to the inference size. Besides the whole frame, each source is
+// cut into overlapping tiles (or the [tiles] regions, if any), and every one
+// of these views is a frame of its own in the inference batch, scaled to the
+// inference size like any other. Nothing is inferred at full resolution, but
+// a 4 pixel bird in the whole frame is 8 to 16 pixels in a tile.
+//
+// The views of source s are batch frames s * n_views + view, the whole frame
+// first. The merger, right after the detector, moves every box into its
+// source's whole frame (so still in inference size coordinates) and merges
+// the ones found twice where views overlap. A source whose whole frame
+// missed a partial batch is left out of it, tiles and all. From the tracker
+// on, a batch looks just like it would without tiles.
+#define BC_TILES_MAX_VIEWS (1 + BC_CONFIG_MAX_REGIONS)
+
+// fill views with the whole frame and then the tiles or regions of config,
+// camera pixels with even edges (for NV12 crops). Returns how many, 1 when
+// tiling is off.
+guint tiles_layout(const BcConfig* config, BcRegion* views);
+
+// rect is a box in view, scaled to the inference size like the view was.
+// Move it into the whole frame, at the inference size.
+void tiles_to_frame(const BcConfig* config,
+                    const BcRegion* view,
+                    NvOSD_RectParams* rect);
+
+// attach the merger to the src pad of elem, which carries the detector's
+// batches for n_sources sources
+gboolean attach_tile_merger(GstElement* elem,
+                            const BcConfig* config,
+                            guint n_sources);
+
+#endif  // BIRBCAM_C_TILES_H
@@ -0,0 +1,43 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_TRACKER_H
+#define BIRBCAM_C_TRACKER_H
+
+#define ERR_TRACKER_PAD "Could not get iou tracker src pad."
+
+#include <gst/gst.h>
+#include <gstnvdsmeta.h>
+
+#include "pipeline.h"  // BC_MAX_SOURCES
+
+// the iou tracker stands in for nvtracker on the software backend. Every
+// object in a frame is matched to the track (from the same source) whose
+// last box it overlaps most, if that's at least BC_TRACKER_IOU, and gets its
+// object_id; anything left over starts a new track. Birds at a feeder don't
+// move far between frames, so overlap alone does well enough.
+#define BC_TRACKER_IOU 0.3f   // least overlap to continue a track
+#define BC_TRACKER_MAX_AGE 1  // seconds a track is kept without a match
+
+// attach the iou tracker to the src pad of elem, which must carry buffers
+// with NvDsBatchMeta (after the detector)
+gboolean attach_iou_tracker(GstElement* elem);
+
+#endif  // BIRBCAM_C_TRACKER_H
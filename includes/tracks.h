@@ -0,0 +1,58 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_TRACKS_H
+#define BIRBCAM_C_TRACKS_H
+
+#include <glib.h>
+
+#include "brb.h"
+#include "writer.h"
+
+// Track output. Instead of a record per bird per frame, each tracked bird
+// becomes a start record, a keyframe record whenever its box has moved
+// (overlaps the last written one by less than BC_TRACK_KEY_IOU), its species
+// has changed (see classifier.h) or every BC_TRACK_KEY_INTERVAL, and an end
+// record once it hasn't been seen for BRB_TRACK_TIMEOUT (see brb.h). A bird
+// sitting on the feeder for five minutes is a few dozen records rather than
+// 9000. Untracked objects are still written every frame.
+//
+// Tracks don't span metadata files. When the writer rotates (see writer.h),
+// every track started before the boundary is ended there, so each file has
+// the end record for every start record in it, and a bird that stays starts
+// a new track in the next file.
+
+#define BC_TRACK_KEY_IOU 0.7f      // write a keyframe below this overlap
+#define BC_TRACK_KEY_INTERVAL 10   // seconds, between keyframes at most
+
+typedef struct _BcTracks BcTracks;
+
+// write tracks to writer
+BcTracks* tracks_new(BcWriter* writer);
+// a tracked object was seen. Only called from the inference branch's
+// streaming thread, like writer_push.
+void tracks_update(BcTracks* tracks, const BrbRecord* record);
+// end the tracks that haven't been seen for BRB_TRACK_TIMEOUT before pts
+void tracks_expire(BcTracks* tracks, guint64 pts);
+// end every track still open. Call after the pipeline is gone and before
+// writer_free.
+void tracks_free(BcTracks* tracks);
+
+#endif  // BIRBCAM_C_TRACKS_H
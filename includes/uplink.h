@@ -0,0 +1,111 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_UPLINK_H
+#define BIRBCAM_C_UPLINK_H
+
+#define ERR_UPLINK_URL \
+  "Unsupported uplink URL: %s (http://HOST[:PORT]/PATH or file://PATH)"
+#define ERR_UPLINK_SPOOL "Could not create uplink spool directory %s"
+#define ERR_UPLINK_THREAD "Could not start uplink thread."
+#define ERR_UPLINK_STATUS "%s answered: %.*s"
+#define MSG_UPLINK_DOWN "uplink: %s, retrying in %u s\n"
+#define MSG_UPLINK_UP "uplink: delivering again\n"
+#define MSG_UPLINK_STATS                                                  \
+  "uplink: %" G_GUINT64_FORMAT " records in %" G_GUINT64_FORMAT          \
+  " batches (%" G_GUINT64_FORMAT " KiB) delivered, %" G_GUINT64_FORMAT \
+  " batches spooled, %" G_GUINT64_FORMAT " dropped, %" G_GUINT64_FORMAT \
+  " records lost\n"
+
+// an HTTP/1.1 POST of one batch, the connection is closed after each
+#define HTTP_POST                                                   \
+  "POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: birbcam\r\n"         \
+  "Content-Type: application/x-ndjson\r\nContent-Encoding: gzip\r\n" \
+  "Content-Length: %" G_GSIZE_FORMAT "\r\nConnection: close\r\n\r\n"
+
+#include <glib.h>
+
+#include "feed.h"
+
+// Ships records to a collector over an unreliable uplink. The uplink reads
+// the feed (see feed.h) with its own cursor, so the pipeline never waits for
+// it. Records are gathered into batches of JSON lines (JSON_FEED_RECORD) for
+// up to BC_UPLINK_BATCH_MS or BC_UPLINK_BATCH_RECORDS, and each batch is
+// gzipped and handed to a delivery thread. A failed delivery is retried with
+// exponential backoff while new batches queue up in memory, up to
+// BC_UPLINK_MEMORY bytes; past that the oldest are spooled to disk, up to
+// BC_UPLINK_SPOOL_MB, and past that the oldest are dropped and counted.
+// Spooled batches are delivered first once the collector is back, including
+// the ones left by a previous run, so a shutdown during an outage loses
+// nothing either.
+//
+// Where batches go is up to the backend picked by the URL's scheme:
+//   http://HOST[:PORT]/PATH  POSTs each batch (Content-Encoding: gzip), any
+//                            2xx is delivered. Fluent Bit, Vector or a Kafka
+//                            REST bridge can take it from there.
+//   file://PATH              appends each batch to a file, a stand-in
+//                            collector for testing (zcat reads it back)
+
+#define BC_UPLINK_BATCH_MS 1000     // a batch is sent at least this often
+#define BC_UPLINK_BATCH_RECORDS 1000  // or when it has this many records
+#define BC_UPLINK_POLL_MS 50        // between reads of the feed
+#define BC_UPLINK_MEMORY (4 << 20)  // bytes of batches queued in memory
+#define BC_UPLINK_SPOOL_MB 256      // default, bytes of batches on disk
+#define BC_UPLINK_TIMEOUT 10        // seconds, per delivery
+#define BC_UPLINK_BACKOFF 1         // seconds, first retry
+#define BC_UPLINK_BACKOFF_MAX 60    // seconds, the longest between retries
+#define BC_UPLINK_SPOOL_SUFFIX "_spool"  // directory, after the base filename
+#define BC_UPLINK_SPOOL_EXT ".jl.gz"
+
+typedef struct _BcUplink BcUplink;
+
+// a way of delivering batches, see BC_UPLINK_BACKENDS in uplink.c
+typedef struct {
+  const gchar* scheme;  // of the URLs it handles
+  // check url and keep what deliver needs in *state. FALSE if it's unusable.
+  gboolean (*open)(const gchar* url, gpointer* state, GError** err);
+  // deliver one gzipped batch, blocking for at most BC_UPLINK_TIMEOUT.
+  // FALSE (with err set) to try again later.
+  gboolean (*deliver)(gpointer state, GBytes* batch, GError** err);
+  void (*close)(gpointer state);
+} BcUplinkBackend;
+
+typedef struct {
+  guint64 records;    // delivered
+  guint64 batches;    // delivered
+  guint64 bytes;      // delivered, compressed
+  guint64 spooled;    // batches written to disk
+  guint64 dropped;    // batches lost because the spool was full
+  guint64 lost;       // records the uplink fell too far behind the feed for
+} BcUplinkStats;
+
+// start shipping the records published to feed to url. Batches that can't be
+// delivered go to spool_dir, at most spool_mb megabytes. NULL on failure.
+BcUplink* uplink_new(BcFeed* feed,
+                     const gchar* url,
+                     const gchar* spool_dir,
+                     guint spool_mb);
+// counters are updated without locks, so this is a (close) snapshot
+void uplink_get_stats(BcUplink* uplink, BcUplinkStats* stats);
+// batch what's left, spool whatever wasn't delivered and stop. Waits for at
+// most the delivery in progress. Free before the feed, after its publishers.
+void uplink_free(BcUplink* uplink);
+
+#endif  // BIRBCAM_C_UPLINK_H
@@ -0,0 +1,54 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_VIDEOSYNC_H
+#define BIRBCAM_C_VIDEOSYNC_H
+
+#define ERR_VIDEO_SYNC_PAD "Could not get filesink sink pad for video sync."
+#define ERR_VIDEO_SYNC_THREAD "Could not start video sync thread."
+#define ERR_VIDEO_SYNC "video sync: %s: %s\n"
+#define MSG_VIDEO_SYNC_STATS                                           \
+  "video sync: %" G_GUINT64_FORMAT " syncs, slowest %" G_GINT64_FORMAT \
+  " ms\n"
+
+#include <glib.h>
+#include <gst/gst.h>
+
+// Crash-safe recording. matroskamux only writes its Cues (the index) and the
+// final sizes when the file is closed, and the kernel may sit on written
+// video for half a minute, so a power cut loses the tail of the recording and
+// leaves the rest unseekable. With --video-sync, filesink writes straight
+// through to the kernel and a thread fdatasync()s the file being recorded
+// every interval (seconds of video), so at most that much is lost. A probe on
+// filesink only notes the time and the current file; the sync itself never
+// runs on a streaming thread. What's left after a crash is made seekable
+// again, in place, by birbcam-recover (tools/recover.c).
+
+#define BC_VIDEO_SYNC_INTERVAL 10  // seconds, default for --video-sync
+
+typedef struct _BcVideoSync BcVideoSync;
+
+// sync whatever file filesink is writing every interval seconds. Call before
+// the pipeline starts, it sets filesink's buffer mode.
+BcVideoSync* video_sync_new(GstElement* filesink, guint interval);
+// sync one last time and stop. Call after the pipeline is gone.
+void video_sync_free(BcVideoSync* sync);
+
+#endif  // BIRBCAM_C_VIDEOSYNC_H
@@ -0,0 +1,168 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BIRBCAM_C_WRITER_H
+#define BIRBCAM_C_WRITER_H
+
+#define ERR_WRITER_OPEN "Could not open metadata file %s: %s"
+#define ERR_WRITER_THREAD "Could not start metadata writer thread."
+#define ERR_METADATA_WRITE "CRITICAL: Can't write anything to metadata file!!!!"
+#define MSG_WRITER_STATS                                                   \
+  "metadata: %" G_GUINT64_FORMAT " records in %" G_GUINT64_FORMAT          \
+  " writes, %" G_GUINT64_FORMAT " dropped, %" G_GUINT64_FORMAT " late\n"
+#define MSG_ECHO_SUPPRESSED "(%u records not echoed)\n"
+#define MSG_WRITER_ROTATE "metadata: now writing %s\n"
+
+// frame, pts (ns), wall time (us since the epoch), then the box
+#define JSON_RECORD                                                        \
+  "{\"f\": %d, \"pts\": %" G_GUINT64_FORMAT ", \"ts\": %" G_GINT64_FORMAT \
+  ", \"t\": %d, \"h\": %d, \"l\": %d, \"w\": %d}\n"
+// the same, plus the track id and BRB_TRACK_* flags, for track records
+#define JSON_TRACK_RECORD                                                  \
+  "{\"f\": %d, \"pts\": %" G_GUINT64_FORMAT ", \"ts\": %" G_GINT64_FORMAT \
+  ", \"id\": %u, \"k\": %u, \"t\": %d, \"h\": %d, \"l\": %d, \"w\": %d}\n"
+// the end of either of those for a classified bird, species and confidence
+#define JSON_SPECIES ", \"sp\": %u, \"sc\": %.2f}\n"
+// a run of frames inference skipped, BRB_FRAME_SKIPPED: the first, then the
+// BRB_SKIP_* reason, how many and the pts of the last
+#define JSON_SKIP_RECORD                                                   \
+  "{\"f\": %d, \"pts\": %" G_GUINT64_FORMAT ", \"ts\": %" G_GINT64_FORMAT \
+  ", \"k\": %u, \"r\": %u, \"n\": %u, \"to\": %" G_GUINT64_FORMAT "}\n"
+
+#include <glib.h>
+
+#include "brb.h"
+#include "feed.h"
+
+// The metadata writer moves formatting and file I/O off the streaming thread.
+// on_batch() copies each record into a preallocated single producer, single
+// consumer ring (no locks, no allocation) and a writer thread drains it every
+// flush_ms, formatting the whole batch into one buffer and handing it to the
+// kernel with a single write() (group commit). If the ring is full the record
+// is dropped and counted rather than blocking the pipeline, unless the writer
+// is lossless (reprocessing, where there's no camera to keep up with).
+//
+// When the video is segmented, writer_rotate() switches to a new file at the
+// pts the new video segment starts at. Records are routed by their pts, not
+// by when they arrive: the previous file stays open until the next rotation,
+// and a record from before the boundary that only turns up after it (a track
+// ended there, see tracks.h) is appended to it rather than to the new one.
+// The one exception is a record from after the boundary that was already
+// written before the encoder reported it, which stays in the previous file.
+//
+// Every metadata file gets a .bri seek index (see brb.h). Keyframes reported
+// by writer_mark_keyframe() are indexed the same way, against the offset the
+// next record at or after their pts is written at.
+
+#define BC_WRITER_CAPACITY 4096    // records, must be a power of two
+#define BC_WRITER_FLUSH_MS 100     // default group commit interval
+#define BC_WRITER_WAIT_MS 1        // between looks at a full ring, lossless
+#define BC_WRITER_LATE_MS 1000     // queued longer than this counts as late
+#define BC_WRITER_PULL 64          // records pulled per group commit, at most
+#define BC_WRITER_UNPUBLISHED 256  // pulled, not yet published, power of two
+
+typedef enum {
+  JSON_LINES,
+  BRB,  // fixed size binary records, see brb.h
+} MetaType;
+
+#define BC_EXT_JSON_LINES ".jl"
+#define BC_EXT_BRB ".brb"
+#define BC_EXT_INDEX ".bri"  // replaces the metadata extension
+
+typedef enum {
+  BC_SYNC_NONE,   // leave it to the kernel (a crash can lose ~30 s)
+  BC_SYNC_BATCH,  // fdatasync() after every group commit
+} BcSync;
+
+typedef struct {
+  MetaType type;
+  BcSync sync;
+  guint flush_ms;   // group commit interval
+  guint echo_rate;  // console echo, max records per second, 0 is off
+  guint frame_width;   // resolution the boxes are in, for the .brb header
+  guint frame_height;  //
+  BcFeed* feed;  // every record pushed or pulled is published here too, or NULL
+  gint64 start_time;  // wall time at pts 0, us since the epoch, 0 for now
+  gboolean lossless;  // writer_push waits for room instead of dropping
+} BcWriterOptions;
+
+typedef struct {
+  guint64 queued;   // records accepted by writer_push
+  guint64 written;  // records handed to the kernel
+  guint64 writes;   // write() calls (batches)
+  guint64 pulled;   // records from the pull function, written with the rest
+  guint64 unpublished;  // pulled records the feed missed
+  guint64 dropped;  // records lost because the ring was full
+  guint64 late;     // records that waited more than BC_WRITER_LATE_MS
+  guint64 files;    // files opened, more than one when rotating
+  gboolean failed;  // a write failed (and the main loop was quit)
+} BcWriterStats;
+
+typedef struct _BcWriter BcWriter;
+
+// records from another thread than the streaming one (the throttle's
+// skipped frames, see throttle.h): fill in at most max and return how many.
+// They're written by the writer thread, but the feed has a single producer,
+// so they're handed back to the streaming thread to publish (see
+// writer_publish).
+typedef guint (*BcWriterPull)(gpointer user_data,
+                              BrbRecord* records,
+                              guint max);
+
+// open filename, write the format's header and start the writer thread.
+// main_loop is quit if the file can't be written to. Returns NULL on failure.
+BcWriter* writer_new(const gchar* filename,
+                     const BcWriterOptions* options,
+                     GMainLoop* main_loop);
+// queue a record, and publish it to the feed if there is one. Safe to call
+// from exactly one thread (the streaming thread). Never blocks, unless the
+// writer is lossless and the ring is full, when it waits (polling every
+// BC_WRITER_WAIT_MS) for the writer thread to make room. Returns FALSE if
+// the record had to be dropped.
+gboolean writer_push(BcWriter* writer, const BrbRecord* record);
+// publish the records pulled since the last call to the feed, if there is
+// one. writer_push does this first too; call it from the same thread, every
+// frame, so they're published when there are no birds to push (while
+// inference is stalled they wait for it to resume). Never blocks.
+void writer_publish(BcWriter* writer);
+// have the writer thread call pull before every group commit, or stop when
+// it's NULL (which waits for a call in progress). Safe to call from any
+// thread.
+void writer_set_pull(BcWriter* writer, BcWriterPull pull, gpointer user_data);
+// close the current file at pts and continue in filename. Records with an
+// earlier pts still go to the current file. Safe to call from any thread.
+void writer_rotate(BcWriter* writer, const gchar* filename, guint64 pts);
+// if writer_rotate() has been called since *rotations (start it at 0), update
+// it and set pts to the latest boundary. A few atomic reads unless it has, so
+// it's fine to call every frame.
+gboolean writer_rotated(BcWriter* writer, gint* rotations, guint64* pts);
+// index the keyframe with this pts, which starts mkv_offset bytes into the
+// current video file. Safe to call from any thread.
+void writer_mark_keyframe(BcWriter* writer, guint64 pts, guint64 mkv_offset);
+// the file extension for a metadata format, with the dot
+const gchar* writer_extension(MetaType type);
+// counters are updated without locks, so this is a (close) snapshot
+void writer_get_stats(BcWriter* writer, BcWriterStats* stats);
+// drain everything still queued, stop the thread and close the file. FALSE if
+// anything failed to be written, now or earlier.
+gboolean writer_free(BcWriter* writer);
+
+#endif  // BIRBCAM_C_WRITER_H
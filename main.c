@@ -23,14 +23,101 @@
 // signal handler callback to shut down the main loop
 gboolean on_SIGINT(BcData* data) {
   g_print(MSG_SIGINT);
+  // a rescoring that didn't reach the end isn't done
+  if (data->args->reprocess)
+    data->failed = TRUE;
   shutdown_pipeline(data->pipeline_data);
   g_main_loop_quit(data->main_loop);  // ask main loop to quit
   return FALSE;                       // unregister signal handler
 }
 
+// apply the live parts of the config to the running pipeline
+static void apply_config(BcData* data) {
+  const BcConfig* config = &data->args->config;
+  PipelineData* p_data = data->pipeline_data;
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    if (p_data->sources[i].encoder != NULL) {
+      g_object_set(G_OBJECT(p_data->sources[i].encoder), "bitrate",
+                   config->bitrate / p_data->backend->bitrate_divisor, NULL);
+    }
+    if (data->outputs[i].motion != NULL)
+      motion_set_threshold(data->outputs[i].motion, config->motion_threshold);
+  }
+  if (p_data->infer != NULL)
+    g_object_set(G_OBJECT(p_data->infer), "interval", config->interval, NULL);
+}
+
+// signal handler callback to reload the config file without stopping
+gboolean on_SIGHUP(BcData* data) {
+  const gchar* filename = data->args->config_filename;
+  if (filename == NULL)
+    return TRUE;  // nothing to reload, but keep the handler
+
+  BcConfig config;
+  config_init(&config);
+  GError* err = NULL;
+  if (!config_load(&config, filename, &err)) {
+    // keep running with what we have
+    g_printerr(ERR_CONFIG_LOAD, filename, err->message);
+    g_error_free(err);
+  } else {
+    // the tegra classifier's infer-on-class-ids was set from class-id, and
+    // records of any other class would never be classified
+    PipelineData* p_data = data->pipeline_data;
+    config_update(&data->args->config, &config,
+                  p_data->classifier != NULL &&
+                      p_data->backend->type == BC_BACKEND_TEGRA);
+    apply_config(data);
+    g_print(MSG_CONFIG_RELOAD, filename);
+  }
+  config_clear(&config);
+  return TRUE;
+}
+
+// --reprocess reads recordings and writes only metadata
+static gboolean check_reprocess(BcArgs* args) {
+  if (args->inputs == NULL) {
+    gst_printerr("--reprocess needs the recordings to rescore, with -i\n");
+    return FALSE;
+  }
+  for (gchar** input = args->inputs; *input != NULL; input++) {
+    if (g_str_has_prefix(*input, BC_INPUT_CSI) ||
+        g_str_has_prefix(*input, BC_INPUT_V4L2) ||
+        (gst_uri_is_valid(*input) && !g_str_has_prefix(*input, "file:"))) {
+      gst_printerr("--reprocess only reads files, not %s\n", *input);
+      return FALSE;
+    }
+  }
+  if (args->gated || args->segment_time || args->segment_size ||
+      args->video_sync) {
+    gst_printerr("--reprocess writes no video, so can't be --gated, "
+                 "segmented or --video-sync'd\n");
+    return FALSE;
+  }
+  // every frame is wanted, however long it takes
+  args->infer_budget = 0;
+  return TRUE;
+}
+
+// --classify on tegra runs the species model the [classifier] config-file
+// names, which isn't shipped, so say so before nvinfer fails to start
+static gboolean check_classifier(BcArgs* args, const BcBackend* backend) {
+  if (!args->classify || backend->type != BC_BACKEND_TEGRA ||
+      g_file_test(args->config.classifier_file, G_FILE_TEST_IS_REGULAR)) {
+    return TRUE;
+  }
+  gst_printerr("--classify needs a species model on tegra, and its nvinfer "
+               "config %s does not exist. Set [classifier] config-file, see "
+               "\"Species\" in the README.\n",
+               args->config.classifier_file);
+  return FALSE;
+}
+
 gboolean parse_args(int argc, char** argv, BcArgs* args) {
   g_autoptr(GOptionContext) ctx = g_option_context_new("- Birbcam");
-  g_autoptr(GError) err;
+  g_autoptr(GError) err = NULL;
+  gchar* format = NULL;
+  gchar* sync = NULL;
 
   // alternative to calling gst_init() is to get the GOption option group and
   // add it to your own context
@@ -39,9 +126,100 @@ gboolean parse_args(int argc, char** argv, BcArgs* args) {
   GOptionEntry entries[] = {
       {"output", 'o', 0, G_OPTION_ARG_FILENAME, &args->base_filename,
        "output base filename (minus extension)", "FILE"},
+      {"config", 'c', 0, G_OPTION_ARG_FILENAME, &args->config_filename,
+       "read settings from FILE (see birbcam.conf), reloaded on SIGHUP",
+       "FILE"},
+      {"backend", 'b', 0, G_OPTION_ARG_STRING, &args->backend_name,
+       "element backend: auto, tegra or software (default: auto)", "NAME"},
+      {"input", 'i', 0, G_OPTION_ARG_FILENAME_ARRAY, &args->inputs,
+       "read video from a file, uri, csi:SENSOR or v4l2:DEVICE instead of the "
+       "camera. Repeat for more sources (up to 8)",
+       "INPUT"},
+      {"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+       "metadata format: json (.jl) or brb (.brb) (default: json)", "FORMAT"},
+      {"sync", 0, 0, G_OPTION_ARG_STRING, &sync,
+       "metadata durability: none or batch (fdatasync every write) "
+       "(default: none)",
+       "POLICY"},
+      {"flush-interval", 0, 0, G_OPTION_ARG_INT,
+       &args->writer_options.flush_ms,
+       "write queued metadata every MS milliseconds (default: 100)", "MS"},
+      {"echo", 'e', 0, G_OPTION_ARG_INT, &args->writer_options.echo_rate,
+       "echo up to N records a second to the console (default: 0, off)", "N"},
+      {"metrics", 'm', 0, G_OPTION_ARG_STRING, &args->metrics_address,
+       "serve Prometheus metrics on a localhost PORT or a unix socket PATH",
+       "ADDR"},
+      {"feed", 0, 0, G_OPTION_ARG_STRING, &args->feed_socket,
+       "publish every record as JSON lines on a unix socket PATH", "PATH"},
+      {"feed-shm", 0, 0, G_OPTION_ARG_STRING, &args->feed_shm,
+       "publish every record in a shared memory ring NAME (see feed.h)",
+       "NAME"},
+      {"uplink", 'u', 0, G_OPTION_ARG_STRING, &args->uplink_url,
+       "ship batches of records to URL (http://HOST[:PORT]/PATH or "
+       "file://PATH)",
+       "URL"},
+      {"uplink-spool", 0, 0, G_OPTION_ARG_FILENAME, &args->uplink_spool,
+       "with --uplink, keep undelivered batches in DIR (default: the output "
+       "filename plus _spool)",
+       "DIR"},
+      {"uplink-spool-size", 0, 0, G_OPTION_ARG_INT, &args->uplink_spool_mb,
+       "with --uplink, spool at most MB megabytes (default: 256)", "MB"},
+      {"video-sync", 0, 0, G_OPTION_ARG_INT, &args->video_sync,
+       "crash-safe recording: get the video onto the disk every SECONDS "
+       "(default: 0, leave it to the kernel)",
+       "SECONDS"},
+      {"gated", 'g', 0, G_OPTION_ARG_NONE, &args->gated,
+       "only record video around detections", NULL},
+      {"preroll", 0, 0, G_OPTION_ARG_INT, &args->preroll,
+       "with --gated, record this long before a detection (default: 10)",
+       "SECONDS"},
+      {"postroll", 0, 0, G_OPTION_ARG_INT, &args->postroll,
+       "with --gated, record this long after the last detection (default: 10)",
+       "SECONDS"},
+      {"segment-time", 0, 0, G_OPTION_ARG_INT, &args->segment_time,
+       "start a new video and metadata file every SECONDS", "SECONDS"},
+      {"segment-size", 0, 0, G_OPTION_ARG_INT, &args->segment_size,
+       "start a new video and metadata file every MB megabytes of video",
+       "MB"},
+      {"motion", 0, 0, G_OPTION_ARG_NONE, &args->motion,
+       "only run inference on frames with motion", NULL},
+      {"keepalive", 0, 0, G_OPTION_ARG_DOUBLE, &args->keepalive,
+       "with --motion, infer this many frames a second anyway (default: 1, "
+       "0 for none)",
+       "FPS"},
+      {"infer-budget", 0, 0, G_OPTION_ARG_INT, &args->infer_budget,
+       "skip frames so inference lags the camera by at most MS (default: "
+       "500, 0 for no limit)",
+       "MS"},
+      {"tracks", 't', 0, G_OPTION_ARG_NONE, &args->tracks,
+       "track birds and write a record per track (start, keyframes and end) "
+       "instead of per frame",
+       NULL},
+      {"classify", 0, 0, G_OPTION_ARG_NONE, &args->classify,
+       "classify each bird's species (once every [classifier] interval "
+       "frames per track with --tracks)",
+       NULL},
+      {"reprocess", 0, 0, G_OPTION_ARG_NONE, &args->reprocess,
+       "rescore the recordings given with --input as fast as they decode, "
+       "writing metadata next to each as NAME_rescored",
+       NULL},
+      {"every", 0, 0, G_OPTION_ARG_INT, &args->reprocess_every,
+       "with --reprocess, infer one frame in N (default: 1, all of them)",
+       "N"},
+      {"snapshots", 0, 0, G_OPTION_ARG_NONE, &args->snapshots,
+       "write a JPEG of each bird to the snapshot directory", NULL},
+      {"snapshot-interval", 0, 0, G_OPTION_ARG_INT, &args->snapshot_interval,
+       "with --snapshots, at most one snapshot of a bird every SECONDS "
+       "(default: 10)",
+       "SECONDS"},
       {NULL},
   };
 
+  // 0 is a valid keepalive, so the default goes in before parsing
+  args->keepalive = BC_MOTION_KEEPALIVE;
+  args->infer_budget = BC_THROTTLE_BUDGET;
+  args->snapshot_interval = BC_SNAPSHOT_INTERVAL;
+
   g_option_context_add_main_entries(ctx, entries, NULL);
   g_option_context_add_group(ctx, gst_init_get_option_group());
 
@@ -51,51 +229,299 @@ gboolean parse_args(int argc, char** argv, BcArgs* args) {
     return FALSE;
   }
 
+  // settings not in the file (or with no file) are the defaults
+  config_init(&args->config);
+  if (args->config_filename != NULL &&
+      !config_load(&args->config, args->config_filename, &err)) {
+    gst_printerr(ERR_CONFIG_LOAD, args->config_filename, err->message);
+    g_clear_error(&err);
+    return FALSE;
+  }
+  args->writer_options.frame_width = args->config.infer_width;
+  args->writer_options.frame_height = args->config.infer_height;
+
   // make sure the filename isn't blank
-  if (!strcmp(args->base_filename, "")) {
+  if (args->base_filename == NULL || !strcmp(args->base_filename, "")) {
     gst_printerr(
         "-o (output base filename) required, use --help for full usage)");
     return FALSE;
   }
 
-  // calculate mkv and metadata filename based on passed options
-  strcat(args->mkv_filename, args->base_filename);
-  strcat(args->mkv_filename, ".mkv");
-  GST_INFO("MKV FILENAME: %s", args->mkv_filename);
-  strcat(args->meta_filename, args->base_filename);
-  args->meta_type = JSON_LINES;  // TODO: add choices
-  if (args->meta_type == JSON_LINES) {
-    strcat(args->meta_filename, ".jl");
-  } else if (args->meta_type == PROTOBUF) {
-    strcat(args->meta_filename, ".brb");
+  if (format == NULL || !strcmp(format, "json")) {
+    args->meta_type = JSON_LINES;
+  } else if (!strcmp(format, "brb")) {
+    args->meta_type = BRB;
+  } else {
+    gst_printerr("unknown metadata format: %s (choices: json, brb)\n", format);
+    g_free(format);
+    return FALSE;
+  }
+  g_free(format);
+  args->writer_options.type = args->meta_type;
+  if (sync == NULL || !strcmp(sync, "none")) {
+    args->writer_options.sync = BC_SYNC_NONE;
+  } else if (!strcmp(sync, "batch")) {
+    args->writer_options.sync = BC_SYNC_BATCH;
+  } else {
+    gst_printerr("unknown sync policy: %s (choices: none, batch)\n", sync);
+    g_free(sync);
+    return FALSE;
+  }
+  g_free(sync);
+  if (args->writer_options.flush_ms == 0)
+    args->writer_options.flush_ms = BC_WRITER_FLUSH_MS;
+  if (args->preroll <= 0)
+    args->preroll = BC_GATE_PREROLL;
+  if (args->postroll <= 0)
+    args->postroll = BC_GATE_POSTROLL;
+  if (args->uplink_spool_mb <= 0)
+    args->uplink_spool_mb = BC_UPLINK_SPOOL_MB;
+  if (args->video_sync < 0) {
+    gst_printerr("video sync interval can't be negative\n");
+    return FALSE;
+  }
+  if (args->snapshot_interval < 0) {
+    gst_printerr("snapshot interval can't be negative\n");
+    return FALSE;
+  }
+  if (args->infer_budget < 0) {
+    gst_printerr("inference budget can't be negative\n");
+    return FALSE;
+  }
+  if (args->keepalive < 0) {
+    gst_printerr("keepalive can't be negative\n");
+    return FALSE;
+  }
+  if (args->segment_time < 0 || args->segment_size < 0) {
+    gst_printerr("segment limits can't be negative\n");
+    return FALSE;
+  }
+
+  if (args->inputs != NULL &&
+      g_strv_length(args->inputs) > BC_MAX_SOURCES) {
+    gst_printerr("at most %d inputs are supported\n", BC_MAX_SOURCES);
+    return FALSE;
+  }
+  if (args->reprocess_every < 0) {
+    gst_printerr("--every can't be negative\n");
+    return FALSE;
   }
-  GST_INFO("METADATA_FILENAME: %s", args->meta_filename);
+  if (args->reprocess && !check_reprocess(args))
+    return FALSE;
 
   return TRUE;
 }
 
-int main(int argc, char** argv) {
-  static char meta_buf[BUFSIZ];  // metadata buffer
+// calculate a source's mkv and metadata filenames based on passed options.
+// When segmenting these are the first segment's (see segment.h).
+static void init_output(BcOutput* output, const BcArgs* args, guint id,
+                        guint n_sources) {
+  output->meta_extension = writer_extension(args->meta_type);
+  if (args->reprocess) {
+    // no video, and the metadata goes with the recording it's from
+    output->base_filename = reprocess_base_filename(args->inputs[id]);
+    output->meta_filename =
+        g_strconcat(output->base_filename, output->meta_extension, NULL);
+    output->start_time = reprocess_start_time(args->inputs[id]);
+    g_print(MSG_REPROCESS_START, args->inputs[id], output->meta_filename);
+    return;
+  }
+
+  output->base_filename =
+      n_sources > 1 ? g_strdup_printf("%s_cam%u", args->base_filename, id)
+                    : g_strdup(args->base_filename);
+  if (args->segment_time || args->segment_size) {
+    output->mkv_filename = segment_filename(output->base_filename, 0, ".mkv");
+    output->meta_filename = segment_filename(output->base_filename, 0,
+                                             output->meta_extension);
+  } else {
+    output->mkv_filename = g_strconcat(output->base_filename, ".mkv", NULL);
+    output->meta_filename =
+        g_strconcat(output->base_filename, output->meta_extension, NULL);
+  }
+  GST_INFO("MKV FILENAME: %s", output->mkv_filename);
+  GST_INFO("METADATA_FILENAME: %s", output->meta_filename);
+}
 
+// open a source's metadata file (and index), and hook its outputs up to the
+// pipeline, before anything can reach on_batch
+static gboolean start_output(BcOutput* output, PipelineData* p_data,
+                             BcSource* source, const BcArgs* args,
+                             GMainLoop* main_loop) {
+  BcWriterOptions options = args->writer_options;
+  options.start_time = output->start_time;
+  options.lossless = args->reprocess;
+  output->writer = writer_new(output->meta_filename, &options, main_loop);
+  if (output->writer == NULL)
+    return FALSE;
+
+  // rescoring a recording: there's no video to index, just frames to skip
+  if (args->reprocess) {
+    output->reprocess = reprocess_new(source, (guint)args->reprocess_every);
+    if (output->reprocess == NULL)
+      return FALSE;
+  } else {
+    // index where the keyframes land in the video, alongside the metadata
+    output->index = seek_index_new(source->filesink, output->writer);
+    if (output->index == NULL)
+      return FALSE;
+  }
+
+  // bring a network or usb camera back when it goes away
+  const gchar* input = args->inputs ? args->inputs[source->id] : NULL;
+  if (!args->reprocess && reconnect_wanted(input)) {
+    output->reconnect = reconnect_new(p_data, source, input);
+    if (output->reconnect == NULL)
+      return FALSE;
+  }
+
+  // name the video segments, and rotate the metadata along with them
+  if (source->splitmux != NULL) {
+    g_signal_connect(source->splitmux, "format-location-full",
+                     G_CALLBACK(on_format_location), output);
+  }
+
+  // get the video onto the disk every so often, if asked to
+  if (args->video_sync > 0) {
+    output->video_sync = video_sync_new(source->filesink, args->video_sync);
+    if (output->video_sync == NULL)
+      return FALSE;
+  }
+
+  // write a bird's track rather than every box, if asked to
+  if (args->tracks)
+    output->tracks = tracks_new(output->writer);
+
+  // keep inference within its latency budget, skipping frames if it must,
+  // and record the frames skipped by it, the motion gate or a restart
+  if (args->infer_budget > 0 || args->motion || !args->reprocess) {
+    output->throttle = throttle_new(source->infer_queue, output->writer,
+                                    source->id, args->infer_budget);
+    if (output->throttle == NULL)
+      return FALSE;
+  }
+
+  // only let frames with motion (and keepalives) through to inference
+  if (args->motion) {
+    output->motion = motion_new(source->motion_sink, source->infer_queue,
+                                output->throttle, args->keepalive);
+    if (output->motion == NULL)
+      return FALSE;
+    motion_set_threshold(output->motion, args->config.motion_threshold);
+  }
+
+  // crop birds out of the full size frames, if asked to
+  if (args->snapshots) {
+    g_autofree gchar* directory =
+        g_strconcat(output->base_filename, BC_SNAPSHOT_SUFFIX, NULL);
+    // a bird is seen as late as the latency budget lets it be
+    guint latency_ms =
+        args->infer_budget > 0 ? args->infer_budget : BC_THROTTLE_BUDGET;
+    output->snapshots = snapshots_new(
+        source->snap_sink, directory, args->config.infer_width,
+        args->config.infer_height, args->snapshot_interval, latency_ms,
+        args->config.framerate);
+    if (output->snapshots == NULL)
+      return FALSE;
+  }
+
+  // hold the encoded video back until there's a bird, if asked to
+  if (args->gated) {
+    output->gate = gate_new(source->parser, args->preroll, args->postroll);
+    if (output->gate == NULL)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// the pipeline has to be gone first, the probes use all of this
+static void cleanup_outputs(BcData* data) {
+  for (guint i = 0; i < data->n_outputs; i++) {
+    BcOutput* output = &data->outputs[i];
+    if (output->index != NULL)
+      seek_index_free(output->index);
+    if (output->reprocess != NULL)
+      reprocess_free(output->reprocess);
+    if (output->reconnect != NULL)
+      reconnect_free(output->reconnect);
+    if (output->gate != NULL)
+      gate_free(output->gate);
+    if (output->video_sync != NULL)
+      video_sync_free(output->video_sync);
+    if (output->motion != NULL)
+      motion_free(output->motion);
+    if (output->snapshots != NULL)
+      snapshots_free(output->snapshots);
+    // so do the last skipped frames
+    if (output->throttle != NULL)
+      throttle_free(output->throttle);
+    // tracks still open end here, so this goes before the writer
+    if (output->tracks != NULL)
+      tracks_free(output->tracks);
+    // write out whatever is still queued and close the metadata file
+    if (output->writer != NULL && !writer_free(output->writer))
+      data->failed = TRUE;
+    g_free(output->base_filename);
+    g_free(output->mkv_filename);
+    g_free(output->meta_filename);
+  }
+  if (data->restart != NULL)
+    restart_free(data->restart);
+  if (data->metrics != NULL)
+    metrics_free(data->metrics);
+  // reads the feed, after everything that publishes to it
+  if (data->uplink != NULL)
+    uplink_free(data->uplink);
+  // the writers publish to it, so it goes last
+  if (data->feed != NULL)
+    feed_free(data->feed);
+}
+
+int main(int argc, char** argv) {
   BcData data = {NULL};  // main data struct to pass around
   PipelineData p_data = {NULL};
   data.pipeline_data = &p_data;
-  BcArgs args = {
-      // default arguments
-      (gchar*)calloc(1024, sizeof(gchar)),  // mkv_filename
-      (gchar*)calloc(1024, sizeof(gchar)),  // meta_filename
-      (gchar*)calloc(1020, sizeof(gchar)),  // base_filename
-      JSON_LINES,                           // metadata type
-  };
+  BcArgs args = {NULL};  // defaults are filled in by parse_args
   data.args = &args;  // attach args to data
 
   // parse arguments and init GStreamer
   if (!parse_args(argc, argv, data.args))
     return -1;
 
+  // pick the element backend (tegra or software)
+  const BcBackend* backend = find_backend(args.backend_name);
+  if (backend == NULL || !check_classifier(&args, backend))
+    return -1;
+
+  // split the recording, if asked to
+  BcSegmentOptions segments = {
+      args.segment_time * GST_SECOND,
+      (guint64)args.segment_size << 20,
+  };
+  gboolean segmented = args.segment_time || args.segment_size;
+
+  // one output per source, the default camera if there are no inputs
+  data.n_outputs = args.inputs ? g_strv_length(args.inputs) : 1;
+  const gchar* filenames[BC_MAX_SOURCES];
+  for (guint i = 0; i < data.n_outputs; i++) {
+    init_output(&data.outputs[i], &args, i, data.n_outputs);
+    filenames[i] = data.outputs[i].mkv_filename;
+  }
+
+  // the optional branches
+  guint branches = (args.motion ? BC_BRANCH_MOTION : 0) |
+                   (args.tracks ? BC_BRANCH_TRACKER : 0) |
+                   (args.classify ? BC_BRANCH_CLASSIFIER : 0) |
+                   (args.snapshots ? BC_BRANCH_SNAPSHOTS : 0) |
+                   (args.reprocess ? BC_BRANCH_OFFLINE : 0);
+
   // create the pipeline and all it's elements (including bus)
-  if (!create_pipeline_data(data.pipeline_data, args.mkv_filename)) {
+  if (!create_pipeline_data(data.pipeline_data, backend, &args.config,
+                            data.n_outputs, (const gchar* const*)args.inputs,
+                            filenames, segmented ? &segments : NULL,
+                            branches)) {
     GST_ERROR(ERR_PIPELINE_DATA);
+    cleanup_outputs(&data);
     return -1;
   }
 
@@ -109,7 +535,78 @@ int main(int argc, char** argv) {
   gst_bus_add_watch(data.pipeline_data->bus, (GstBusFunc)on_bus_message,
                     &data);  // on_bus_message defined in bus.h
   g_unix_signal_add(SIGINT, (GSourceFunc)on_SIGINT,
-                    data.main_loop);  // handy, this function
+                    &data);  // handy, this function
+  g_unix_signal_add(SIGHUP, (GSourceFunc)on_SIGHUP, &data);
+
+  // an inference error restarts inference rather than stopping the
+  // recording. Reprocessing, there's nothing to keep recording.
+  if (!args.reprocess) {
+    data.restart = restart_new(data.pipeline_data);
+    if (data.restart == NULL) {
+      cleanup_pipeline_data(data.pipeline_data);
+      cleanup_outputs(&data);
+      return -1;
+    }
+  }
+
+  // the live feed the writers publish to, if asked for or the uplink needs it
+  if (args.feed_socket != NULL || args.feed_shm != NULL ||
+      args.uplink_url != NULL) {
+    data.feed = feed_new(args.feed_shm, args.feed_socket);
+    if (data.feed == NULL) {
+      cleanup_pipeline_data(data.pipeline_data);
+      cleanup_outputs(&data);
+      return -1;
+    }
+    args.writer_options.feed = data.feed;
+  }
+
+  // and ship it off the box
+  if (args.uplink_url != NULL) {
+    g_autofree gchar* spool =
+        args.uplink_spool != NULL
+            ? g_strdup(args.uplink_spool)
+            : g_strconcat(args.base_filename, BC_UPLINK_SPOOL_SUFFIX, NULL);
+    data.uplink = uplink_new(data.feed, args.uplink_url, spool,
+                             (guint)args.uplink_spool_mb);
+    if (data.uplink == NULL) {
+      cleanup_pipeline_data(data.pipeline_data);
+      cleanup_outputs(&data);
+      return -1;
+    }
+  }
+
+  // metadata files, indexes, segments, gates and motion gates, per source
+  for (guint i = 0; i < data.n_outputs; i++) {
+    if (!start_output(&data.outputs[i], &p_data, &p_data.sources[i], &args,
+                      data.main_loop)) {
+      cleanup_pipeline_data(data.pipeline_data);
+      cleanup_outputs(&data);
+      return -1;
+    }
+    // so a restart's dropped frames are recorded with the others
+    if (data.restart != NULL)
+      restart_set_throttle(data.restart, i, data.outputs[i].throttle);
+  }
+
+  // instrument the pipeline, if asked to
+  if (args.metrics_address != NULL) {
+    BcWriter* writers[BC_MAX_SOURCES];
+    BcReconnect* reconnects[BC_MAX_SOURCES];
+    const guint64* detections[BC_MAX_SOURCES];
+    for (guint i = 0; i < data.n_outputs; i++) {
+      writers[i] = data.outputs[i].writer;
+      reconnects[i] = data.outputs[i].reconnect;
+      detections[i] = &data.outputs[i].detections;
+    }
+    data.metrics =
+        metrics_new(data.pipeline_data, writers, reconnects, detections);
+    if (!metrics_serve(data.metrics, args.metrics_address)) {
+      cleanup_pipeline_data(data.pipeline_data);
+      cleanup_outputs(&data);
+      return -1;
+    }
+  }
 
   // connect metadata probe to fake sink pad in
   GstPad* sink_pad =
@@ -122,25 +619,19 @@ int main(int argc, char** argv) {
   gst_element_set_state(GST_ELEMENT(data.pipeline_data->pipeline),
                         GST_STATE_PLAYING);
 
-  // open output metadata file for writing
-  data.meta_file = fopen(args.meta_filename, "w");
-  // set the file to line buffered mode, TODO: change for protobuf
-  if (setvbuf(data.meta_file, meta_buf, _IOLBF,
-              BUFSIZ)) {  // returns 0 on success
-    g_printerr("Could not set metadata file mode to line buffered.");
-    return -1;
-  }
-
   // run, main_loop run! (blocks here until main loop is shut down)
   g_main_loop_run(data.main_loop);
 
-  // flush and close the metadata file
-  fflush(data.meta_file);
-  fclose(data.meta_file);
-
-  // shut down and clean up pipeline and all elements
+  // shut down and clean up pipeline and all elements, so nothing is left to
+  // call on_batch
   cleanup_pipeline_data(data.pipeline_data);
+
+  // the metrics, gate and index probes were on the pipeline, so they go
+  // after it
+  cleanup_outputs(&data);
   g_main_loop_unref(data.main_loop);
+  config_clear(&args.config);
 
-  return 0;
+  // a pipeline error, a metadata write error or an unfinished reprocessing
+  return data.failed ? 1 : 0;
 }
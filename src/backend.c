@@ -0,0 +1,101 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "backend.h"
+#include "pipeline.h"  // BC_ELEM_* for the tegra table
+
+static const BcBackend BC_BACKENDS[] = {
+    {
+        "tegra",
+        BC_BACKEND_TEGRA,
+        BC_ELEM_CAMERA_ARGUS, // camera
+        BC_ELEM_SW_URI,       // uri_source
+        NVDS_ELEM_VIDEO_CONV, // uri_converter
+        NULL,                 // converter
+        NULL,                 // scaler
+        BC_CAPS_STRING,       // caps
+        BC_ELEM_ENCODER,      // encoder
+        1,                    // bitrate_divisor (bits/s)
+        "iframeinterval",     // keyframe_property
+        BC_ELEM_PARSER,       // parser
+        BC_ELEM_MUXER,        // muxer
+        NULL,                 // infer_scaler
+        NULL,                 // infer_caps
+        BC_ELEM_STREAM_MUX,   // streammux
+        BC_ELEM_INFERENCE,    // infer
+        BC_ELEM_TRACKER,      // tracker
+        BC_ELEM_CLASSIFIER,   // classifier
+        NVDS_ELEM_VIDEO_CONV, // tile_cropper
+        BC_TILE_CAPS_STRING,  // tile_caps
+        NVDS_ELEM_VIDEO_CONV, // motion_scaler
+        NVDS_ELEM_VIDEO_CONV, // snapshot_converter
+    },
+    {
+        "software",
+        BC_BACKEND_SOFTWARE,
+        BC_ELEM_SW_CAMERA,        // camera
+        BC_ELEM_SW_URI,           // uri_source
+        BC_ELEM_SW_CONVERTER,     // uri_converter
+        BC_ELEM_SW_CONVERTER,     // converter
+        BC_ELEM_SW_SCALER,        // scaler
+        BC_SW_CAPS_STRING,        // caps
+        BC_ELEM_SW_ENCODER,       // encoder
+        1000,                     // bitrate_divisor (kbit/s)
+        "key-int-max",            // keyframe_property
+        BC_ELEM_PARSER,           // parser
+        BC_ELEM_MUXER,            // muxer
+        BC_ELEM_SW_SCALER,        // infer_scaler
+        BC_SW_INFER_CAPS_STRING,  // infer_caps
+        BC_ELEM_SW_FUNNEL,        // streammux
+        BC_ELEM_SW_INFERENCE,     // infer
+        BC_ELEM_SW_TRACKER,       // tracker
+        BC_ELEM_SW_CLASSIFIER,    // classifier
+        NULL,                     // tile_cropper
+        NULL,                     // tile_caps
+        BC_ELEM_SW_SCALER,        // motion_scaler
+        BC_ELEM_SW_CONVERTER,     // snapshot_converter
+    },
+};
+
+static gboolean have_factory(const gchar* name) {
+  GstElementFactory* factory = gst_element_factory_find(name);
+  if (factory == NULL)
+    return FALSE;
+  gst_object_unref(factory);
+  return TRUE;
+}
+
+const BcBackend* find_backend(const gchar* name) {
+  if (name == NULL || !strcmp(name, "auto")) {
+    // the Jetson needs both the argus camera and nvinfer, anything else
+    // (including x86 boxes with DeepStream but no CSI camera) gets software
+    if (have_factory(BC_ELEM_CAMERA_ARGUS) && have_factory(BC_ELEM_INFERENCE))
+      return &BC_BACKENDS[BC_BACKEND_TEGRA];
+    return &BC_BACKENDS[BC_BACKEND_SOFTWARE];
+  }
+
+  for (gsize i = 0; i < G_N_ELEMENTS(BC_BACKENDS); i++) {
+    if (!strcmp(name, BC_BACKENDS[i].name))
+      return &BC_BACKENDS[i];
+  }
+
+  GST_ERROR(ERR_BACKEND, name);
+  return NULL;
+}
@@ -25,7 +25,9 @@
 gboolean on_bus_message(GstBus* bus, GstMessage* message, BcData* data) {
   switch (GST_MESSAGE_TYPE(message)) {
     case GST_MESSAGE_EOS:
-      GST_WARNING("End of stream reached. This shouldn't happen.");
+      // the end of the recordings, when reprocessing (see reprocess.h)
+      if (!data->args->reprocess)
+        GST_WARNING("End of stream reached. This shouldn't happen.");
       g_main_loop_quit(data->main_loop);
       break;
     case GST_MESSAGE_ERROR: {
@@ -33,8 +35,24 @@ gboolean on_bus_message(GstBus* bus, GstMessage* message, BcData* data) {
       gchar* debug_info;
       gst_message_parse_error(message, &err, &debug_info);
       GST_ERROR("Error received from %s: %s", message->src->name, err->message);
+      // a camera that can come and go is reconnected (see reconnect.h), and
+      // one already taken out may still have errors queued. The inference
+      // branch is restarted (see restart.h) unless it keeps failing.
+      // Anything else is fatal.
+      gboolean handled = !gst_object_has_as_ancestor(
+          GST_MESSAGE_SRC(message), GST_OBJECT(data->pipeline_data->pipeline));
+      for (guint i = 0; i < data->n_outputs && !handled; i++) {
+        BcReconnect* reconnect = data->outputs[i].reconnect;
+        if (reconnect != NULL)
+          handled = reconnect_on_error(reconnect, message, err);
+      }
+      if (!handled && data->restart != NULL)
+        handled = restart_on_error(data->restart, message, err);
       g_clear_error(&err);
-      g_free(err);
+      g_free(debug_info);
+      if (handled)
+        break;
+      data->failed = TRUE;
       g_main_loop_quit(data->main_loop);
       break;
     }
@@ -0,0 +1,319 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "classifier.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <gst/video/video.h>
+
+#include "pipeline.h"  // BC_MAX_SOURCES
+
+#define BC_NS_PER_SECOND G_GUINT64_CONSTANT(1000000000)
+#define BC_CLASSIFIER_CHROMA (BC_CLASSIFIER_INPUT / 2)
+#define BC_CLASSIFIER_SOFTNESS 24.0f  // distance that's 1/e less likely
+
+static const gchar* const LABELS[] = BC_CLASSIFIER_LABELS;
+#define N_LABELS G_N_ELEMENTS(LABELS)
+
+// the mean Y, U and V of each label, BT.601 studio range
+static const gfloat REFERENCES[N_LABELS][3] = {
+    {82, 90, 240},   // red
+    {210, 16, 146},  // yellow
+    {41, 240, 110},  // blue
+    {88, 91, 167},   // brown
+    {128, 128, 128}, // grey
+    {16, 128, 128},  // black
+    {235, 128, 128}, // white
+};
+
+// a bird scaled down to the classifier's input, I420
+typedef struct {
+  guint8 y[BC_CLASSIFIER_INPUT * BC_CLASSIFIER_INPUT];
+  guint8 u[BC_CLASSIFIER_CHROMA * BC_CLASSIFIER_CHROMA];
+  guint8 v[BC_CLASSIFIER_CHROMA * BC_CLASSIFIER_CHROMA];
+} Crop;
+
+typedef struct {
+  guint64 object_id;        // the key
+  gfloat scores[N_LABELS];  // summed probabilities, over classified
+  guint classified;
+  gint last_frame;    // frame_num it was last classified in
+  GstClockTime seen;  // pts it was last seen at
+} CachedTrack;
+
+// an object waiting on the batch it's in
+typedef struct {
+  NvDsObjectMeta* object;
+  CachedTrack* track;  // NULL if untracked
+} Pending;
+
+typedef struct {
+  const BcConfig* config;  // interval and samples
+  GstVideoInfo info;
+  gboolean configured;
+  GHashTable* tracks[BC_MAX_SOURCES];  // object_id -> CachedTrack, by source
+  GstClockTime swept;  // pts of the last sweep for tracks gone unseen
+
+  Crop crops[BC_CLASSIFIER_BATCH];
+  Pending pending[BC_CLASSIFIER_BATCH];
+  guint n_pending;
+
+  guint64 classified;  // crops
+  guint64 cached;      // objects answered from the cache
+} CpuClassifier;
+
+static GstPadProbeReturn on_classifier_buffer(GstPad* pad,
+                                              GstPadProbeInfo* info,
+                                              CpuClassifier* cls);
+static void free_classifier(CpuClassifier* cls);
+
+gboolean attach_cpu_classifier(GstElement* elem, const BcConfig* config) {
+  GstPad* src_pad = gst_element_get_static_pad(elem, "src");
+  if (src_pad == NULL) {
+    GST_ERROR(ERR_CLASSIFIER_PAD);
+    return FALSE;
+  }
+  // the probe owns the classifier state and frees it when removed
+  CpuClassifier* cls = g_new0(CpuClassifier, 1);
+  cls->config = config;
+  for (guint i = 0; i < BC_MAX_SOURCES; i++) {
+    cls->tracks[i] =
+        g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+  }
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_classifier_buffer, cls,
+                    (GDestroyNotify)free_classifier);
+  gst_object_unref(src_pad);
+  return TRUE;
+}
+
+static void free_classifier(CpuClassifier* cls) {
+  g_print(MSG_CLASSIFIER_STATS, cls->classified, cls->cached);
+  for (guint i = 0; i < BC_MAX_SOURCES; i++)
+    g_hash_table_unref(cls->tracks[i]);
+  g_free(cls);
+}
+
+// nearest neighbour scale the rect of plane into out (side x side)
+static void crop_plane(const guint8* plane,
+                       gint stride,
+                       gint plane_width,
+                       gint plane_height,
+                       const NvOSD_RectParams* rect,
+                       gint subsampling,
+                       guint8* out,
+                       gint side) {
+  gint left = CLAMP((gint)rect->left / subsampling, 0, plane_width - 1);
+  gint top = CLAMP((gint)rect->top / subsampling, 0, plane_height - 1);
+  gint width = CLAMP((gint)rect->width / subsampling, 1, plane_width - left);
+  gint height = CLAMP((gint)rect->height / subsampling, 1, plane_height - top);
+  for (gint y = 0; y < side; y++) {
+    const guint8* row = plane + (top + y * height / side) * stride + left;
+    for (gint x = 0; x < side; x++)
+      out[y * side + x] = row[x * width / side];
+  }
+}
+
+static void crop(const GstVideoFrame* frame,
+                 const NvOSD_RectParams* rect,
+                 Crop* out) {
+  gint width = GST_VIDEO_FRAME_WIDTH(frame);
+  gint height = GST_VIDEO_FRAME_HEIGHT(frame);
+  crop_plane(GST_VIDEO_FRAME_PLANE_DATA(frame, 0),
+             GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0), width, height, rect, 1,
+             out->y, BC_CLASSIFIER_INPUT);
+  crop_plane(GST_VIDEO_FRAME_PLANE_DATA(frame, 1),
+             GST_VIDEO_FRAME_PLANE_STRIDE(frame, 1), width / 2, height / 2,
+             rect, 2, out->u, BC_CLASSIFIER_CHROMA);
+  crop_plane(GST_VIDEO_FRAME_PLANE_DATA(frame, 2),
+             GST_VIDEO_FRAME_PLANE_STRIDE(frame, 2), width / 2, height / 2,
+             rect, 2, out->v, BC_CLASSIFIER_CHROMA);
+}
+
+static gfloat mean(const guint8* values, gsize n) {
+  guint sum = 0;
+  for (gsize i = 0; i < n; i++)
+    sum += values[i];
+  return (gfloat)sum / n;
+}
+
+// the "model": a probability per label for each of n crops
+static void classify_batch(const Crop* crops,
+                           guint n,
+                           gfloat probabilities[][N_LABELS]) {
+  for (guint i = 0; i < n; i++) {
+    gfloat yuv[3] = {
+        mean(crops[i].y, sizeof(crops[i].y)),
+        mean(crops[i].u, sizeof(crops[i].u)),
+        mean(crops[i].v, sizeof(crops[i].v)),
+    };
+    gfloat total = 0.0f;
+    for (guint label = 0; label < N_LABELS; label++) {
+      gfloat dy = (yuv[0] - REFERENCES[label][0]) / 2;  // light matters less
+      gfloat du = yuv[1] - REFERENCES[label][1];
+      gfloat dv = yuv[2] - REFERENCES[label][2];
+      gfloat distance = sqrtf(dy * dy + du * du + dv * dv);
+      probabilities[i][label] = expf(-distance / BC_CLASSIFIER_SOFTNESS);
+      total += probabilities[i][label];
+    }
+    for (guint label = 0; label < N_LABELS; label++)
+      probabilities[i][label] /= total;
+  }
+}
+
+// say what object is the way a secondary nvinfer would
+static void attach_result(NvDsBatchMeta* batch,
+                          NvDsObjectMeta* object,
+                          const gfloat scores[N_LABELS],
+                          guint classified) {
+  guint best = 0;
+  for (guint label = 1; label < N_LABELS; label++) {
+    if (scores[label] > scores[best])
+      best = label;
+  }
+
+  NvDsClassifierMeta* meta = nvds_acquire_classifier_meta_from_pool(batch);
+  meta->unique_component_id = BC_CLASSIFIER_ID;
+  NvDsLabelInfo* label = nvds_acquire_label_info_meta_from_pool(batch);
+  label->num_classes = N_LABELS;
+  label->result_class_id = best;
+  label->result_prob = scores[best] / classified;
+  label->label_id = 0;
+  g_strlcpy(label->result_label, LABELS[best], MAX_LABEL_SIZE);
+  nvds_add_label_info_meta_to_classifier(meta, label);
+  nvds_add_classifier_meta_to_object(object, meta);
+}
+
+static void run_batch(CpuClassifier* cls, NvDsBatchMeta* batch) {
+  gfloat probabilities[BC_CLASSIFIER_BATCH][N_LABELS];
+  classify_batch(cls->crops, cls->n_pending, probabilities);
+  cls->classified += cls->n_pending;
+
+  for (guint i = 0; i < cls->n_pending; i++) {
+    Pending* pending = &cls->pending[i];
+    CachedTrack* track = pending->track;
+    if (track == NULL) {
+      attach_result(batch, pending->object, probabilities[i], 1);
+      continue;
+    }
+    for (guint label = 0; label < N_LABELS; label++)
+      track->scores[label] += probabilities[i][label];
+    track->classified++;
+    attach_result(batch, pending->object, track->scores, track->classified);
+  }
+  cls->n_pending = 0;
+}
+
+// the track object belongs to, new if it's the first time it's been seen.
+// NULL if it's untracked.
+static CachedTrack* lookup_track(CpuClassifier* cls,
+                                 const NvDsFrameMeta* frame,
+                                 const NvDsObjectMeta* object) {
+  if (object->object_id == UNTRACKED_OBJECT_ID ||
+      frame->source_id >= BC_MAX_SOURCES) {
+    return NULL;
+  }
+  GHashTable* tracks = cls->tracks[frame->source_id];
+  CachedTrack* track = g_hash_table_lookup(tracks, &object->object_id);
+  if (track == NULL) {
+    track = g_new0(CachedTrack, 1);
+    track->object_id = object->object_id;
+    track->last_frame = G_MININT / 2;  // due at once
+    g_hash_table_insert(tracks, &track->object_id, track);
+  }
+  track->seen = frame->buf_pts;
+  return track;
+}
+
+static gboolean is_stale(gpointer key, CachedTrack* track, GstClockTime* pts) {
+  return *pts >= track->seen + BC_CLASSIFIER_MAX_AGE * BC_NS_PER_SECOND;
+}
+
+// forget the tracks that haven't been seen for a while, once a second
+static void sweep(CpuClassifier* cls, GstClockTime pts) {
+  if (pts < cls->swept + BC_NS_PER_SECOND)
+    return;
+  cls->swept = pts;
+  for (guint i = 0; i < BC_MAX_SOURCES; i++)
+    g_hash_table_foreach_remove(cls->tracks[i], (GHRFunc)is_stale, &pts);
+}
+
+static GstPadProbeReturn on_classifier_buffer(GstPad* pad,
+                                              GstPadProbeInfo* info,
+                                              CpuClassifier* cls) {
+  if (!cls->configured) {
+    GstCaps* caps = gst_pad_get_current_caps(pad);
+    cls->configured =
+        caps != NULL && gst_video_info_from_caps(&cls->info, caps);
+    if (caps != NULL)
+      gst_caps_unref(caps);
+    if (!cls->configured) {
+      GST_ERROR(ERR_CLASSIFIER_CAPS);
+      return GST_PAD_PROBE_OK;
+    }
+  }
+
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  NvDsBatchMeta* batch = gst_buffer_get_nvds_batch_meta(buffer);
+  if (batch == NULL)
+    return GST_PAD_PROBE_OK;
+  // a batch is a single frame on software, the one in this buffer
+  GstVideoFrame video;
+  if (!gst_video_frame_map(&video, &cls->info, buffer, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+
+  gint interval = cls->config->classify_interval;
+  guint samples = (guint)cls->config->classify_samples;
+  for (NvDsMetaList* frames = batch->frame_meta_list; frames != NULL;
+       frames = frames->next) {
+    NvDsFrameMeta* frame = (NvDsFrameMeta*)frames->data;
+    for (NvDsMetaList* objects = frame->obj_meta_list; objects != NULL;
+         objects = objects->next) {
+      NvDsObjectMeta* object = (NvDsObjectMeta*)objects->data;
+      CachedTrack* track = lookup_track(cls, frame, object);
+      if (track != NULL &&
+          (track->classified >= samples ||
+           frame->frame_num - track->last_frame < interval)) {
+        // settled, or classified recently enough
+        if (track->classified > 0) {
+          attach_result(batch, object, track->scores, track->classified);
+          cls->cached++;
+        }
+        continue;
+      }
+
+      if (track != NULL)
+        track->last_frame = frame->frame_num;
+      crop(&video, &object->rect_params, &cls->crops[cls->n_pending]);
+      cls->pending[cls->n_pending].object = object;
+      cls->pending[cls->n_pending].track = track;
+      if (++cls->n_pending == BC_CLASSIFIER_BATCH)
+        run_batch(cls, batch);
+    }
+    sweep(cls, frame->buf_pts);
+  }
+  if (cls->n_pending > 0)
+    run_batch(cls, batch);
+
+  gst_video_frame_unmap(&video);
+  return GST_PAD_PROBE_OK;
+}
@@ -0,0 +1,260 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "brb.h"     // BRB_CONFIDENCE_SCALE
+#include "motion.h"  // BC_MOTION_THRESHOLD
+
+void config_init(BcConfig* config) {
+  config->width = BC_CONFIG_WIDTH;
+  config->height = BC_CONFIG_HEIGHT;
+  config->framerate = BC_CONFIG_FRAMERATE;
+  config->bitrate = BC_CONFIG_BITRATE;
+  config->infer_file = g_strdup(BC_CONFIG_INFER_FILE);
+  config->infer_width = BC_CONFIG_INFER_WIDTH;
+  config->infer_height = BC_CONFIG_INFER_HEIGHT;
+  config->interval = 0;
+  config->class_id = BC_CONFIG_CLASS_ID;
+  config->min_confidence = 0;
+  config->motion_threshold = BC_MOTION_THRESHOLD;
+  config->classifier_file = g_strdup(BC_CONFIG_CLASSIFIER_FILE);
+  config->classify_interval = BC_CONFIG_CLASSIFY_INTERVAL;
+  config->classify_samples = BC_CONFIG_CLASSIFY_SAMPLES;
+  config->tile_columns = 1;
+  config->tile_rows = 1;
+  config->tile_overlap = BC_CONFIG_TILE_OVERLAP;
+  config->tile_nms = (gint)(BC_CONFIG_TILE_NMS * BRB_CONFIDENCE_SCALE + 0.5);
+  config->n_regions = 0;
+}
+
+// read group.key into out, if it's there and between min and max
+static gboolean read_int(GKeyFile* file,
+                         const gchar* group,
+                         const gchar* key,
+                         gint min,
+                         gint max,
+                         gint* out,
+                         GError** err) {
+  if (!g_key_file_has_key(file, group, key, NULL))
+    return TRUE;
+  GError* error = NULL;
+  gint value = g_key_file_get_integer(file, group, key, &error);
+  if (error != NULL) {
+    g_propagate_error(err, error);
+    return FALSE;
+  }
+  if (value < min || value > max) {
+    g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                "[%s] %s must be between %d and %d", group, key, min, max);
+    return FALSE;
+  }
+  *out = value;
+  return TRUE;
+}
+
+static gboolean read_confidence(GKeyFile* file,
+                                const gchar* group,
+                                const gchar* key,
+                                gint* out,
+                                GError** err) {
+  if (!g_key_file_has_key(file, group, key, NULL))
+    return TRUE;
+  GError* error = NULL;
+  gdouble value = g_key_file_get_double(file, group, key, &error);
+  if (error != NULL) {
+    g_propagate_error(err, error);
+    return FALSE;
+  }
+  if (value < 0.0 || value > 1.0) {
+    g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                "[%s] %s must be between 0 and 1", group, key);
+    return FALSE;
+  }
+  *out = (gint)(value * BRB_CONFIDENCE_SCALE + 0.5);
+  return TRUE;
+}
+
+// read group.key, a list of left,top,width,height regions (separated by ;)
+// that must fit in the camera frame of loaded
+static gboolean read_regions(GKeyFile* file,
+                             const gchar* group,
+                             const gchar* key,
+                             BcConfig* loaded,
+                             GError** err) {
+  if (!g_key_file_has_key(file, group, key, NULL))
+    return TRUE;
+  gsize length = 0;
+  gchar** list = g_key_file_get_string_list(file, group, key, &length, err);
+  if (list == NULL)
+    return FALSE;
+  gboolean ok = TRUE;
+  if (length > BC_CONFIG_MAX_REGIONS) {
+    g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                "[%s] %s has more than %d regions", group, key,
+                BC_CONFIG_MAX_REGIONS);
+    ok = FALSE;
+  }
+  for (gsize i = 0; ok && i < length; i++) {
+    BcRegion* region = &loaded->regions[i];
+    if (sscanf(list[i], "%d,%d,%d,%d", &region->left, &region->top,
+               &region->width, &region->height) != 4 ||
+        region->left < 0 || region->top < 0 || region->width < 16 ||
+        region->height < 16 ||
+        region->left + region->width > loaded->width ||
+        region->top + region->height > loaded->height) {
+      g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                  "[%s] %s: %s is not left,top,width,height inside the "
+                  "%dx%d frame",
+                  group, key, list[i], loaded->width, loaded->height);
+      ok = FALSE;
+    }
+  }
+  if (ok)
+    loaded->n_regions = length;
+  g_strfreev(list);
+  return ok;
+}
+
+gboolean config_load(BcConfig* config, const gchar* filename, GError** err) {
+  g_autoptr(GKeyFile) file = g_key_file_new();
+  if (!g_key_file_load_from_file(file, filename, G_KEY_FILE_NONE, err))
+    return FALSE;
+
+  // read into a copy, so a bad file changes nothing
+  BcConfig loaded = *config;
+  gchar* infer_file = NULL;
+  gchar* classifier_file = NULL;
+  gboolean ok =
+      read_int(file, BC_CONFIG_CAMERA, "width", 16, 8192, &loaded.width,
+               err) &&
+      read_int(file, BC_CONFIG_CAMERA, "height", 16, 8192, &loaded.height,
+               err) &&
+      read_int(file, BC_CONFIG_CAMERA, "framerate", 1, 240,
+               &loaded.framerate, err) &&
+      read_int(file, BC_CONFIG_ENCODER, "bitrate", 10000, G_MAXINT,
+               &loaded.bitrate, err) &&
+      read_int(file, BC_CONFIG_INFERENCE, "width", 16, 8192,
+               &loaded.infer_width, err) &&
+      read_int(file, BC_CONFIG_INFERENCE, "height", 16, 8192,
+               &loaded.infer_height, err) &&
+      read_int(file, BC_CONFIG_INFERENCE, "interval", 0, 1000,
+               &loaded.interval, err) &&
+      read_int(file, BC_CONFIG_INFERENCE, "class-id", 0, G_MAXUINT8,
+               &loaded.class_id, err) &&
+      read_confidence(file, BC_CONFIG_INFERENCE, "min-confidence",
+                      &loaded.min_confidence, err) &&
+      read_int(file, BC_CONFIG_MOTION, "threshold", 1, 255,
+               &loaded.motion_threshold, err) &&
+      read_int(file, BC_CONFIG_CLASSIFIER, "interval", 1, 100000,
+               &loaded.classify_interval, err) &&
+      read_int(file, BC_CONFIG_CLASSIFIER, "samples", 1, 1000,
+               &loaded.classify_samples, err) &&
+      read_int(file, BC_CONFIG_TILES, "columns", 1, BC_CONFIG_MAX_TILES,
+               &loaded.tile_columns, err) &&
+      read_int(file, BC_CONFIG_TILES, "rows", 1, BC_CONFIG_MAX_TILES,
+               &loaded.tile_rows, err) &&
+      read_int(file, BC_CONFIG_TILES, "overlap", 0, 100,
+               &loaded.tile_overlap, err) &&
+      read_confidence(file, BC_CONFIG_TILES, "nms", &loaded.tile_nms, err) &&
+      read_regions(file, BC_CONFIG_TILES, "regions", &loaded, err);
+  if (ok && g_key_file_has_key(file, BC_CONFIG_INFERENCE, "config-file", NULL)) {
+    infer_file = g_key_file_get_string(file, BC_CONFIG_INFERENCE,
+                                       "config-file", err);
+    ok = infer_file != NULL;
+  }
+  if (ok &&
+      g_key_file_has_key(file, BC_CONFIG_CLASSIFIER, "config-file", NULL)) {
+    classifier_file = g_key_file_get_string(file, BC_CONFIG_CLASSIFIER,
+                                            "config-file", err);
+    ok = classifier_file != NULL;
+  }
+  if (!ok) {
+    g_free(infer_file);
+    return FALSE;
+  }
+
+  if (infer_file != NULL) {
+    g_free(config->infer_file);
+    loaded.infer_file = infer_file;
+  }
+  if (classifier_file != NULL) {
+    g_free(config->classifier_file);
+    loaded.classifier_file = classifier_file;
+  }
+  *config = loaded;
+  return TRUE;
+}
+
+static void check_restart(gboolean changed,
+                          const gchar* group,
+                          const gchar* key) {
+  if (changed)
+    g_print(MSG_CONFIG_RESTART, group, key);
+}
+
+void config_update(BcConfig* config,
+                   const BcConfig* from,
+                   gboolean class_fixed) {
+  check_restart(config->width != from->width, BC_CONFIG_CAMERA, "width");
+  check_restart(config->height != from->height, BC_CONFIG_CAMERA, "height");
+  check_restart(config->framerate != from->framerate, BC_CONFIG_CAMERA,
+                "framerate");
+  check_restart(strcmp(config->infer_file, from->infer_file) != 0,
+                BC_CONFIG_INFERENCE, "config-file");
+  check_restart(strcmp(config->classifier_file, from->classifier_file) != 0,
+                BC_CONFIG_CLASSIFIER, "config-file");
+  check_restart(config->classify_interval != from->classify_interval,
+                BC_CONFIG_CLASSIFIER, "interval");
+  check_restart(config->classify_samples != from->classify_samples,
+                BC_CONFIG_CLASSIFIER, "samples");
+  check_restart(config->infer_width != from->infer_width, BC_CONFIG_INFERENCE,
+                "width");
+  check_restart(config->infer_height != from->infer_height,
+                BC_CONFIG_INFERENCE, "height");
+  check_restart(config->tile_columns != from->tile_columns, BC_CONFIG_TILES,
+                "columns");
+  check_restart(config->tile_rows != from->tile_rows, BC_CONFIG_TILES, "rows");
+  check_restart(config->tile_overlap != from->tile_overlap, BC_CONFIG_TILES,
+                "overlap");
+  check_restart(config->tile_nms != from->tile_nms, BC_CONFIG_TILES, "nms");
+  check_restart(config->n_regions != from->n_regions ||
+                    memcmp(config->regions, from->regions,
+                           from->n_regions * sizeof(BcRegion)) != 0,
+                BC_CONFIG_TILES, "regions");
+  check_restart(class_fixed && config->class_id != from->class_id,
+                BC_CONFIG_INFERENCE, "class-id");
+
+  config->bitrate = from->bitrate;
+  config->interval = from->interval;
+  config->motion_threshold = from->motion_threshold;
+  // these two are read by on_batch on the streaming thread
+  if (!class_fixed)
+    g_atomic_int_set(&config->class_id, from->class_id);
+  g_atomic_int_set(&config->min_confidence, from->min_confidence);
+}
+
+void config_clear(BcConfig* config) {
+  g_clear_pointer(&config->infer_file, g_free);
+  g_clear_pointer(&config->classifier_file, g_free);
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "detector.h"
+#include "motion.h"  // block_sad
+#include "tiles.h"
+
+typedef struct {
+  gint width;
+  gint height;
+  gint stride;        // luma row stride, I420 rows are 4 byte aligned
+  guint8* previous;   // last luma plane, NULL until the first frame
+  gint frame_num;
+  guint source_id;
+  const BcConfig* config;
+  BcRegion views[BC_TILES_MAX_VIEWS];  // camera pixels, see tiles.h
+  guint n_views;
+} CpuDetector;
+
+// what detect_motion found in a view
+typedef struct {
+  gboolean found;
+  gfloat confidence;
+  NvOSD_RectParams rect;
+} Detection;
+
+static GstPadProbeReturn on_detector_buffer(GstPad* pad,
+                                            GstPadProbeInfo* info,
+                                            CpuDetector* det);
+static void free_detector(CpuDetector* det);
+
+gboolean attach_cpu_detector(GstElement* elem,
+                             guint source_id,
+                             const BcConfig* config) {
+  GstPad* src_pad = gst_element_get_static_pad(elem, "src");
+  if (src_pad == NULL) {
+    GST_ERROR(ERR_DETECTOR_PAD);
+    return FALSE;
+  }
+  // the probe owns the detector state and frees it when removed
+  CpuDetector* det = g_new0(CpuDetector, 1);
+  det->source_id = source_id;
+  det->config = config;
+  det->n_views = tiles_layout(config, det->views);
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_detector_buffer, det,
+                    (GDestroyNotify)free_detector);
+  gst_object_unref(src_pad);
+  return TRUE;
+}
+
+static void free_detector(CpuDetector* det) {
+  g_free(det->previous);
+  g_free(det);
+}
+
+// read the frame size from the negotiated caps the first time we see a buffer
+static gboolean configure_detector(GstPad* pad, CpuDetector* det) {
+  GstCaps* caps = gst_pad_get_current_caps(pad);
+  if (caps == NULL)
+    return FALSE;
+  GstStructure* s = gst_caps_get_structure(caps, 0);
+  gboolean ok = gst_structure_get_int(s, "width", &det->width) &&
+                gst_structure_get_int(s, "height", &det->height);
+  gst_caps_unref(caps);
+  if (!ok)
+    return FALSE;
+  det->stride = GST_ROUND_UP_4(det->width);
+  det->previous = g_malloc0(det->stride * det->height);
+  return TRUE;
+}
+
+// the blocks of the frame that are in view, as [x0, x1) x [y0, y1)
+static void view_blocks(const CpuDetector* det,
+                        const BcRegion* view,
+                        gint* x0,
+                        gint* y0,
+                        gint* x1,
+                        gint* y1) {
+  const BcConfig* config = det->config;
+  *x0 = GST_ROUND_UP_8(view->left * det->width / config->width);
+  *y0 = GST_ROUND_UP_8(view->top * det->height / config->height);
+  *x1 = (view->left + view->width) * det->width / config->width;
+  *y1 = (view->top + view->height) * det->height / config->height;
+}
+
+// frame differencing over BC_DETECTOR_BLOCK sized blocks of view. Returns
+// TRUE and fills rect with the bounding box of all moving blocks if there
+// are enough, in the view scaled to the frame size (as nvstreammux would).
+static gboolean detect_motion(CpuDetector* det,
+                              const guint8* luma,
+                              const BcRegion* view,
+                              NvOSD_RectParams* rect,
+                              gfloat* confidence) {
+  const gint block_area = BC_DETECTOR_BLOCK * BC_DETECTOR_BLOCK;
+  gint left = G_MAXINT, top = G_MAXINT, right = 0, bottom = 0;
+  guint moving = 0;
+  gint x0, y0, x1, y1;
+  view_blocks(det, view, &x0, &y0, &x1, &y1);
+
+  for (gint by = y0; by + BC_DETECTOR_BLOCK <= y1; by += BC_DETECTOR_BLOCK) {
+    for (gint bx = x0; bx + BC_DETECTOR_BLOCK <= x1;
+         bx += BC_DETECTOR_BLOCK) {
+      gsize offset = by * det->stride + bx;
+      guint sad = block_sad(luma + offset, det->previous + offset, det->stride);
+      if (sad > BC_DETECTOR_THRESHOLD * block_area) {
+        moving++;
+        left = MIN(left, bx);
+        top = MIN(top, by);
+        right = MAX(right, bx + BC_DETECTOR_BLOCK);
+        bottom = MAX(bottom, by + BC_DETECTOR_BLOCK);
+      }
+    }
+  }
+
+  if (moving < BC_DETECTOR_MIN_BLOCKS)
+    return FALSE;
+
+  // how much of the box actually moved
+  *confidence =
+      (gfloat)(moving * block_area) / ((right - left) * (bottom - top));
+  gfloat x_scale = (gfloat)det->config->width / view->width;
+  gfloat y_scale = (gfloat)det->config->height / view->height;
+  gfloat view_left = (gfloat)view->left * det->width / det->config->width;
+  gfloat view_top = (gfloat)view->top * det->height / det->config->height;
+  rect->left = (left - view_left) * x_scale;
+  rect->top = (top - view_top) * y_scale;
+  rect->width = (right - left) * x_scale;
+  rect->height = (bottom - top) * y_scale;
+  return TRUE;
+}
+
+// attach a frame per view the same way nvstreammux does, so everything
+// downstream (on_batch in particular) can't tell the difference
+static void attach_batch_meta(GstBuffer* buffer,
+                              CpuDetector* det,
+                              const Detection* detections) {
+  NvDsBatchMeta* batch = nvds_create_batch_meta(det->n_views);
+  NvDsMeta* meta =
+      gst_buffer_add_nvds_meta(buffer, batch, NULL, nvds_batch_meta_copy_func,
+                               nvds_batch_meta_release_func);
+  meta->meta_type = NVDS_BATCH_GST_META;
+  batch->base_meta.batch_meta = batch;
+
+  for (guint i = 0; i < det->n_views; i++) {
+    NvDsFrameMeta* frame = nvds_acquire_frame_meta_from_pool(batch);
+    frame->batch_id = i;
+    frame->frame_num = det->frame_num;
+    frame->buf_pts = GST_BUFFER_PTS(buffer);
+    frame->source_id = det->source_id * det->n_views + i;
+    frame->pad_index = frame->source_id;
+    frame->source_frame_width = det->width;
+    frame->source_frame_height = det->height;
+    frame->bInferDone = TRUE;
+    nvds_add_frame_meta_to_batch(batch, frame);
+
+    if (!detections[i].found)
+      continue;
+
+    NvDsObjectMeta* object = nvds_acquire_obj_meta_from_pool(batch);
+    object->unique_component_id = BC_DETECTOR_ID;
+    // whatever on_batch is looking for, which can change on SIGHUP
+    object->class_id = g_atomic_int_get(&det->config->class_id);
+    object->object_id = UNTRACKED_OBJECT_ID;
+    object->confidence = detections[i].confidence;
+    object->rect_params = detections[i].rect;
+    nvds_add_obj_meta_to_frame(frame, object, NULL);
+  }
+  det->frame_num++;
+}
+
+static GstPadProbeReturn on_detector_buffer(GstPad* pad,
+                                            GstPadProbeInfo* info,
+                                            CpuDetector* det) {
+  // we're adding meta, so the buffer has to be ours to change
+  GstBuffer* buffer =
+      gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+  GST_PAD_PROBE_INFO_DATA(info) = buffer;
+
+  // a frame we can't look at still gets (empty) meta, on_batch expects it
+  Detection detections[BC_TILES_MAX_VIEWS] = {0};
+  if (det->previous == NULL && !configure_detector(pad, det)) {
+    GST_ERROR(ERR_DETECTOR_CAPS);
+    attach_batch_meta(buffer, det, detections);
+    return GST_PAD_PROBE_OK;
+  }
+
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+    attach_batch_meta(buffer, det, detections);
+    return GST_PAD_PROBE_OK;
+  }
+
+  gsize luma_size = det->stride * det->height;
+  if (map.size >= luma_size) {
+    // nothing to difference against on the very first frame
+    for (guint i = 0; det->frame_num > 0 && i < det->n_views; i++) {
+      detections[i].found =
+          detect_motion(det, map.data, &det->views[i], &detections[i].rect,
+                        &detections[i].confidence);
+    }
+    memcpy(det->previous, map.data, luma_size);
+  }
+  gst_buffer_unmap(buffer, &map);
+
+  attach_batch_meta(buffer, det, detections);
+  return GST_PAD_PROBE_OK;
+}
@@ -0,0 +1,303 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "feed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+typedef struct {
+  GSocketConnection* connection;
+  GSocket* socket;
+  guint32 cursor;   // next record to send
+  GString* out;     // formatted, not all sent yet
+  gsize sent;       // of out
+} BcFeedClient;
+
+struct _BcFeed {
+  // the ring, in shared memory or not
+  BrfHeader* header;
+  BrfSlot* slots;
+  gsize size;
+  gchar* shm_name;  // NULL if it's only ours
+  guint32 head;     // the producer's copy of header->head
+
+  // socket subscribers, only touched on the main loop
+  GSocketService* service;
+  gchar* socket_path;
+  GList* clients;  // BcFeedClient*
+  guint poll_source;
+
+  guint64 published;  // only written by the producer
+  guint64 lost;       // by socket subscribers
+};
+
+// a ring left behind by a producer that's gone (a crash), as opposed to one
+// another birbcam is still publishing to, or something else altogether
+static gboolean shared_stale(const gchar* shm_name) {
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0)
+    return errno == ENOENT;  // gone meanwhile
+  BrfHeader header;
+  gboolean stale = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                   !memcmp(header.magic, BRF_MAGIC, sizeof(BRF_MAGIC)) &&
+                   (header.pid <= 0 ||
+                    (kill(header.pid, 0) != 0 && errno == ESRCH));
+  close(fd);
+  return stale;
+}
+
+static gboolean map_shared(BcFeed* feed, const gchar* shm_name) {
+  // shm_open wants exactly one leading slash
+  feed->shm_name = shm_name[0] == '/' ? g_strdup(shm_name)
+                                      : g_strconcat("/", shm_name, NULL);
+  int fd = shm_open(feed->shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    if (shared_stale(feed->shm_name)) {
+      shm_unlink(feed->shm_name);
+      fd = shm_open(feed->shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    } else {
+      errno = EEXIST;  // in use, say so rather than why it looked alive
+    }
+  }
+  if (fd < 0) {
+    GST_ERROR(ERR_FEED_SHM, feed->shm_name, g_strerror(errno));
+    return FALSE;
+  }
+  if (ftruncate(fd, feed->size) != 0) {
+    GST_ERROR(ERR_FEED_SHM, feed->shm_name, g_strerror(errno));
+    close(fd);
+    shm_unlink(feed->shm_name);
+    return FALSE;
+  }
+  gpointer mem =
+      mmap(NULL, feed->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    GST_ERROR(ERR_FEED_SHM, feed->shm_name, g_strerror(errno));
+    shm_unlink(feed->shm_name);
+    return FALSE;
+  }
+  feed->header = mem;
+  return TRUE;
+}
+
+static void free_client(BcFeedClient* client) {
+  g_io_stream_close(G_IO_STREAM(client->connection), NULL, NULL);
+  g_object_unref(client->connection);
+  g_string_free(client->out, TRUE);
+  g_free(client);
+}
+
+// format the next batch of records, and say so if some were missed
+static void fill_client(BcFeed* feed, BcFeedClient* client) {
+  BrfSlot slot;
+  guint32 lost = 0;
+  g_string_truncate(client->out, 0);
+  client->sent = 0;
+  for (guint i = 0; i < BC_FEED_BATCH; i++) {
+    if (!brf_read(feed->header, feed->slots, &client->cursor, &slot, &lost))
+      break;
+    if (lost) {
+      g_string_append_printf(client->out, JSON_FEED_LOST, lost);
+      feed->lost += lost;
+      lost = 0;
+    }
+    const BrbRecord* r = &slot.record;
+    g_string_append_printf(client->out, JSON_FEED_RECORD, r->source_id,
+                           r->frame_num, r->pts, slot.ts, r->object_id,
+                           r->flags, r->top, r->height, r->left, r->width,
+                           r->species);
+  }
+  if (lost) {
+    g_string_append_printf(client->out, JSON_FEED_LOST, lost);
+    feed->lost += lost;
+  }
+}
+
+// send what we can without blocking. FALSE if the subscriber is gone.
+static gboolean send_client(BcFeed* feed, BcFeedClient* client) {
+  GError* err = NULL;
+  for (;;) {
+    if (client->sent == client->out->len) {
+      fill_client(feed, client);
+      if (client->out->len == 0)
+        return TRUE;  // all caught up
+    }
+    gssize n = g_socket_send(client->socket, client->out->str + client->sent,
+                             client->out->len - client->sent, NULL, &err);
+    if (n < 0) {
+      gboolean full = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+      g_error_free(err);
+      // a full socket is tried again next time, the ring keeps the records
+      return full;
+    }
+    client->sent += n;
+  }
+}
+
+static gboolean on_feed_poll(BcFeed* feed) {
+  GList* next = NULL;
+  for (GList* l = feed->clients; l != NULL; l = next) {
+    next = l->next;
+    if (!send_client(feed, l->data)) {
+      free_client(l->data);
+      feed->clients = g_list_delete_link(feed->clients, l);
+    }
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+// a new subscriber gets the records published from now on
+static gboolean on_feed_subscribe(GSocketService* service,
+                                  GSocketConnection* connection,
+                                  GObject* source,
+                                  BcFeed* feed) {
+  BcFeedClient* client = g_new0(BcFeedClient, 1);
+  client->connection = g_object_ref(connection);
+  client->socket = g_socket_connection_get_socket(connection);
+  g_socket_set_blocking(client->socket, FALSE);
+  client->cursor = (guint32)g_atomic_int_get(&feed->header->head);
+  client->out = g_string_new(NULL);
+  feed->clients = g_list_prepend(feed->clients, client);
+  return TRUE;
+}
+
+static gboolean serve_socket(BcFeed* feed, const gchar* socket_path) {
+  GError* err = NULL;
+  GSocketAddress* address = g_unix_socket_address_new(socket_path);
+  // a stale socket from a crash would make the bind fail, so it's removed
+  // first, but not one that's still served nor anything that isn't a socket
+  GStatBuf st;
+  if (g_stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    GSocket* probe = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                                  G_SOCKET_PROTOCOL_DEFAULT, NULL);
+    gboolean live =
+        probe != NULL && g_socket_connect(probe, address, NULL, NULL);
+    if (probe != NULL)
+      g_object_unref(probe);
+    if (live) {
+      GST_ERROR(ERR_FEED_LISTEN, socket_path, g_strerror(EADDRINUSE));
+      g_object_unref(address);
+      return FALSE;
+    }
+    g_unlink(socket_path);
+  }
+  feed->service = g_socket_service_new();
+  if (!g_socket_listener_add_address(
+          G_SOCKET_LISTENER(feed->service), address, G_SOCKET_TYPE_STREAM,
+          G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &err)) {
+    GST_ERROR(ERR_FEED_LISTEN, socket_path, err->message);
+    g_clear_error(&err);
+    g_object_unref(address);
+    return FALSE;
+  }
+  g_object_unref(address);
+  feed->socket_path = g_strdup(socket_path);
+
+  g_signal_connect(feed->service, "incoming", G_CALLBACK(on_feed_subscribe),
+                   feed);
+  g_socket_service_start(feed->service);
+  feed->poll_source =
+      g_timeout_add(BC_FEED_POLL_MS, (GSourceFunc)on_feed_poll, feed);
+  g_print(MSG_FEED_LISTEN, socket_path);
+  return TRUE;
+}
+
+BcFeed* feed_new(const gchar* shm_name, const gchar* socket_path) {
+  BcFeed* feed = g_new0(BcFeed, 1);
+  feed->size = sizeof(BrfHeader) + BRF_CAPACITY * sizeof(BrfSlot);
+  if (shm_name != NULL) {
+    if (!map_shared(feed, shm_name)) {
+      g_free(feed->shm_name);
+      g_free(feed);
+      return NULL;
+    }
+  } else {
+    feed->header = g_malloc0(feed->size);
+  }
+  feed->slots = (BrfSlot*)(feed->header + 1);
+
+  memcpy(feed->header->magic, BRF_MAGIC, sizeof(BRF_MAGIC));
+  feed->header->version = BRF_VERSION;
+  feed->header->header_size = sizeof(BrfHeader);
+  feed->header->slot_size = sizeof(BrfSlot);
+  feed->header->capacity = BRF_CAPACITY;
+  feed->header->pid = getpid();
+
+  if (socket_path != NULL && !serve_socket(feed, socket_path)) {
+    feed_free(feed);
+    return NULL;
+  }
+  return feed;
+}
+
+void feed_publish(BcFeed* feed, const BrbRecord* record) {
+  guint32 n = feed->head;
+  BrfSlot* slot = &feed->slots[n & (BRF_CAPACITY - 1)];
+  // mark the slot as being written before touching it, so a reader copying
+  // the record that was there can tell
+  g_atomic_int_set(&slot->seq, (gint)(2 * n + 1));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->ts = g_get_real_time();
+  slot->record = *record;
+  g_atomic_int_set(&slot->seq, (gint)(2 * n + 2));
+  feed->head = n + 1;
+  g_atomic_int_set(&feed->header->head, (gint)feed->head);
+  feed->published++;
+}
+
+const BrfHeader* feed_ring(BcFeed* feed) {
+  return feed->header;
+}
+
+void feed_free(BcFeed* feed) {
+  if (feed->poll_source != 0)
+    g_source_remove(feed->poll_source);
+  g_list_free_full(feed->clients, (GDestroyNotify)free_client);
+  if (feed->service != NULL) {
+    g_socket_service_stop(feed->service);
+    g_socket_listener_close(G_SOCKET_LISTENER(feed->service));
+    g_object_unref(feed->service);
+  }
+  if (feed->socket_path != NULL) {
+    g_unlink(feed->socket_path);
+    g_free(feed->socket_path);
+  }
+  g_print(MSG_FEED_STATS, feed->published, feed->lost);
+  if (feed->shm_name != NULL) {
+    munmap(feed->header, feed->size);
+    shm_unlink(feed->shm_name);
+    g_free(feed->shm_name);
+  } else {
+    g_free(feed->header);
+  }
+  g_free(feed);
+}
@@ -0,0 +1,163 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "gate.h"
+
+struct _BcGate {
+  GstClockTime preroll;
+  GstClockTime postroll;
+
+  // last detection, written by the inference branch, read by the encoder's
+  GMutex lock;
+  GstClockTime detected;
+
+  // only touched by the encoder branch streaming thread
+  GQueue held;  // GstBuffer refs, oldest first, first is always a keyframe
+  gsize held_bytes;
+  gboolean recording;
+  gboolean flushing;  // our own pushes re-enter the probe
+};
+
+#define IS_KEYFRAME(buf) (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT))
+
+static GstPadProbeReturn on_encoded(GstPad* pad,
+                                    GstPadProbeInfo* info,
+                                    BcGate* gate);
+
+BcGate* gate_new(GstElement* parser, guint preroll, guint postroll) {
+  GstPad* src_pad = gst_element_get_static_pad(parser, "src");
+  if (src_pad == NULL) {
+    GST_ERROR(ERR_GATE_PAD);
+    return NULL;
+  }
+
+  BcGate* gate = g_new0(BcGate, 1);
+  gate->preroll = preroll * GST_SECOND;
+  gate->postroll = postroll * GST_SECOND;
+  gate->detected = GST_CLOCK_TIME_NONE;
+  g_mutex_init(&gate->lock);
+  g_queue_init(&gate->held);
+
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_encoded, gate, NULL);
+  gst_object_unref(src_pad);
+  return gate;
+}
+
+void gate_trigger(BcGate* gate, GstClockTime pts) {
+  g_mutex_lock(&gate->lock);
+  if (!GST_CLOCK_TIME_IS_VALID(gate->detected) || pts > gate->detected)
+    gate->detected = pts;
+  g_mutex_unlock(&gate->lock);
+}
+
+// drop the oldest GOP (a keyframe and the delta units after it)
+static void drop_oldest_gop(BcGate* gate) {
+  do {
+    GstBuffer* buf = g_queue_pop_head(&gate->held);
+    gate->held_bytes -= gst_buffer_get_size(buf);
+    gst_buffer_unref(buf);
+  } while (!g_queue_is_empty(&gate->held) &&
+           !IS_KEYFRAME((GstBuffer*)g_queue_peek_head(&gate->held)));
+}
+
+// pts of the keyframe starting the second oldest GOP, if there is one
+static GstClockTime second_keyframe_pts(BcGate* gate) {
+  for (GList* l = gate->held.head ? gate->held.head->next : NULL; l != NULL;
+       l = l->next) {
+    if (IS_KEYFRAME((GstBuffer*)l->data))
+      return GST_BUFFER_PTS((GstBuffer*)l->data);
+  }
+  return GST_CLOCK_TIME_NONE;
+}
+
+static void hold(BcGate* gate, GstBuffer* buf) {
+  // the held units have to start with a keyframe to be decodable
+  if (g_queue_is_empty(&gate->held) && !IS_KEYFRAME(buf))
+    return;
+  g_queue_push_tail(&gate->held, gst_buffer_ref(buf));
+  gate->held_bytes += gst_buffer_get_size(buf);
+
+  // keep only as many whole GOPs as it takes to cover preroll
+  GstClockTime newest = GST_BUFFER_PTS(buf);
+  for (;;) {
+    GstClockTime next = second_keyframe_pts(gate);
+    if (!GST_CLOCK_TIME_IS_VALID(next) || next + gate->preroll > newest)
+      break;
+    drop_oldest_gop(gate);
+  }
+  // and never more than BC_GATE_MAX_BYTES, whatever the keyframe interval
+  while (gate->held_bytes > BC_GATE_MAX_BYTES &&
+         GST_CLOCK_TIME_IS_VALID(second_keyframe_pts(gate)))
+    drop_oldest_gop(gate);
+}
+
+static void flush_held(BcGate* gate, GstPad* pad) {
+  gate->flushing = TRUE;
+  GstBuffer* buf;
+  while ((buf = g_queue_pop_head(&gate->held)) != NULL)
+    gst_pad_push(pad, buf);  // takes our ref
+  gate->held_bytes = 0;
+  gate->flushing = FALSE;
+}
+
+static GstPadProbeReturn on_encoded(GstPad* pad,
+                                    GstPadProbeInfo* info,
+                                    BcGate* gate) {
+  if (gate->flushing)
+    return GST_PAD_PROBE_OK;
+
+  GstBuffer* buf = GST_PAD_PROBE_INFO_BUFFER(info);
+  GstClockTime pts = GST_BUFFER_PTS(buf);
+  if (!GST_CLOCK_TIME_IS_VALID(pts))
+    return gate->recording ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+
+  g_mutex_lock(&gate->lock);
+  GstClockTime detected = gate->detected;
+  g_mutex_unlock(&gate->lock);
+  // inference lags the encoder, so "within postroll" is measured from the
+  // detection's own frame, not from when we heard about it
+  gboolean wanted =
+      GST_CLOCK_TIME_IS_VALID(detected) && pts <= detected + gate->postroll;
+
+  if (gate->recording) {
+    if (wanted)
+      return GST_PAD_PROBE_OK;
+    gate->recording = FALSE;
+    g_print(MSG_GATE_STOP, GST_TIME_ARGS(pts));
+  } else if (wanted &&
+             (!g_queue_is_empty(&gate->held) || IS_KEYFRAME(buf))) {
+    // the held units (the pre-roll) go out ahead of this one
+    g_print(MSG_GATE_START, GST_TIME_ARGS(detected));
+    gate->recording = TRUE;
+    flush_held(gate, pad);
+    return GST_PAD_PROBE_OK;
+  }
+
+  hold(gate, buf);
+  return GST_PAD_PROBE_DROP;
+}
+
+void gate_free(BcGate* gate) {
+  g_queue_foreach(&gate->held, (GFunc)gst_buffer_unref, NULL);
+  g_queue_clear(&gate->held);
+  g_mutex_clear(&gate->lock);
+  g_free(gate);
+}
@@ -0,0 +1,562 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "metrics.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+
+#define HTTP_RESPONSE                                           \
+  "HTTP/1.0 200 OK\r\n"                                         \
+  "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n" \
+  "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n"
+
+// upper bounds of the latency histogram buckets, in seconds (the last bucket,
+// +Inf, is implicit)
+static const gdouble BC_METRICS_BUCKET_BOUNDS[BC_METRICS_BUCKETS - 1] = {
+    0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0,
+};
+
+typedef struct {
+  GstClockTime pts;
+  gint64 time;
+} BcInflight;
+
+// one instrumented element. The counters and histogram are written only by
+// the streaming thread of the src pad probe (or the sink pad probe when the
+// point has no latency) and read without locks by the scraper; a torn read
+// of a 64 bit counter on a 32 bit machine just gives one odd sample.
+typedef struct {
+  const gchar* name;
+  gchar labels[64];  // point="name" and source="id", if it's a source's
+  GstElement* element;
+  gboolean is_queue;
+  gboolean timed;  // has a latency histogram
+  gboolean count_bytes;
+
+  guint64 frames;
+  guint64 bytes;
+  gint64 last_frame;
+  gdouble fps;  // exponential moving average
+
+  // buffers that went in the sink pad and haven't come out the src pad yet,
+  // a single producer, single consumer ring like the metadata writer's
+  BcInflight inflight[BC_METRICS_INFLIGHT];
+  gint head;
+  gint tail;
+
+  guint64 buckets[BC_METRICS_BUCKETS];  // not cumulative, summed on output
+  guint64 latency_count;
+  gdouble latency_sum;  // seconds
+} BcMetricPoint;
+
+struct _BcMetrics {
+  BcMetricPoint points[BC_METRICS_POINTS];
+  guint n_points;
+  BcWriter* writers[BC_MAX_SOURCES];  // by source_id, may be NULL
+  BcReconnect* reconnects[BC_MAX_SOURCES];  // the same
+  const guint64* detections[BC_MAX_SOURCES];  // the same
+  guint n_writers;
+  GSocketService* service;
+  gchar* socket_path;  // unlinked on free, if we made one
+};
+
+static void count_frame(BcMetricPoint* point, GstBuffer* buffer, gint64 now) {
+  point->frames++;
+  if (point->count_bytes)
+    point->bytes += gst_buffer_get_size(buffer);
+  if (point->last_frame) {
+    gdouble instant = (gdouble)G_USEC_PER_SEC / MAX(now - point->last_frame, 1);
+    point->fps = point->fps ? 0.9 * point->fps + 0.1 * instant : instant;
+  }
+  point->last_frame = now;
+}
+
+static GstPadProbeReturn on_point_sink(GstPad* pad,
+                                       GstPadProbeInfo* info,
+                                       BcMetricPoint* point) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  guint head = (guint)point->head;
+  // if the element is holding more than we can track, just don't time it
+  if (head - (guint)g_atomic_int_get(&point->tail) < BC_METRICS_INFLIGHT &&
+      GST_BUFFER_PTS_IS_VALID(buffer)) {
+    BcInflight* slot = &point->inflight[head % BC_METRICS_INFLIGHT];
+    slot->pts = GST_BUFFER_PTS(buffer);
+    slot->time = g_get_monotonic_time();
+    g_atomic_int_set(&point->head, (gint)(head + 1));
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+static void observe_latency(BcMetricPoint* point, gint64 usec) {
+  gdouble seconds = (gdouble)usec / G_USEC_PER_SEC;
+  guint i = 0;
+  while (i < G_N_ELEMENTS(BC_METRICS_BUCKET_BOUNDS) &&
+         seconds > BC_METRICS_BUCKET_BOUNDS[i])
+    i++;
+  point->buckets[i]++;
+  point->latency_count++;
+  point->latency_sum += seconds;
+}
+
+static GstPadProbeReturn on_point_src(GstPad* pad,
+                                      GstPadProbeInfo* info,
+                                      BcMetricPoint* point) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gint64 now = g_get_monotonic_time();
+  count_frame(point, buffer, now);
+
+  // match the buffer to when it went in. Anything older that never came out
+  // was dropped inside the element (a leaky queue), so it's skipped over.
+  GstClockTime pts = GST_BUFFER_PTS(buffer);
+  guint tail = (guint)point->tail;
+  guint head = (guint)g_atomic_int_get(&point->head);
+  while (GST_CLOCK_TIME_IS_VALID(pts) && tail != head) {
+    BcInflight* slot = &point->inflight[tail % BC_METRICS_INFLIGHT];
+    if (slot->pts > pts)
+      break;  // not one we saw go in
+    tail++;
+    if (slot->pts == pts) {
+      observe_latency(point, now - slot->time);
+      break;
+    }
+  }
+  g_atomic_int_set(&point->tail, (gint)tail);
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_point_count(GstPad* pad,
+                                        GstPadProbeInfo* info,
+                                        BcMetricPoint* point) {
+  count_frame(point, GST_PAD_PROBE_INFO_BUFFER(info), g_get_monotonic_time());
+  return GST_PAD_PROBE_OK;
+}
+
+static void add_probe(GstElement* element,
+                      const gchar* pad_name,
+                      GstPadProbeCallback callback,
+                      BcMetricPoint* point) {
+  GstPad* pad = gst_element_get_static_pad(element, pad_name);
+  if (pad == NULL)
+    return;
+  gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, callback, point, NULL);
+  gst_object_unref(pad);
+}
+
+// instrument element, which belongs to source (or to all of them, if that's
+// NULL). With latency, buffers are timed from its sink pad to its src pad,
+// otherwise they're only counted at the sink pad.
+static BcMetricPoint* add_point(BcMetrics* metrics,
+                                const gchar* name,
+                                const BcSource* source,
+                                GstElement* element,
+                                gboolean latency) {
+  if (element == NULL || metrics->n_points == BC_METRICS_POINTS)
+    return NULL;
+  BcMetricPoint* point = &metrics->points[metrics->n_points++];
+  point->name = name;
+  if (source != NULL) {
+    g_snprintf(point->labels, sizeof(point->labels),
+               "point=\"%s\",source=\"%u\"", name, source->id);
+  } else {
+    g_snprintf(point->labels, sizeof(point->labels), "point=\"%s\"", name);
+  }
+  point->element = element;
+  point->is_queue = g_str_has_suffix(name, "queue");
+
+  point->timed = latency;
+  if (latency) {
+    add_probe(element, "sink", (GstPadProbeCallback)on_point_sink, point);
+    add_probe(element, "src", (GstPadProbeCallback)on_point_src, point);
+  } else {
+    add_probe(element, "sink", (GstPadProbeCallback)on_point_count, point);
+  }
+  return point;
+}
+
+BcMetrics* metrics_new(PipelineData* p_data,
+                       BcWriter** writers,
+                       BcReconnect** reconnects,
+                       const guint64** detections) {
+  BcMetrics* metrics = g_new0(BcMetrics, 1);
+
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    BcSource* source = &p_data->sources[i];
+    metrics->writers[i] = writers ? writers[i] : NULL;
+    metrics->reconnects[i] = reconnects ? reconnects[i] : NULL;
+    metrics->detections[i] = detections ? detections[i] : NULL;
+    add_point(metrics, "tee", source, source->tee, FALSE);
+    add_point(metrics, "enc_queue", source, source->enc_queue, TRUE);
+    add_point(metrics, "infer_queue", source, source->infer_queue, TRUE);
+    // software only, every source has its own detector
+    add_point(metrics, "infer", source, source->detector, TRUE);
+    BcMetricPoint* filesink =
+        add_point(metrics, "filesink", source, source->filesink, FALSE);
+    if (filesink != NULL)
+      filesink->count_bytes = TRUE;
+  }
+  metrics->n_writers = p_data->n_sources;
+  // tegra only, one batched nvinfer for all of them
+  add_point(metrics, "infer", NULL, p_data->infer, TRUE);
+
+  return metrics;
+}
+
+static void format_header(GString* out,
+                          const gchar* name,
+                          const gchar* type,
+                          const gchar* help) {
+  g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+                         type);
+}
+
+GString* metrics_format(BcMetrics* metrics) {
+  GString* out = g_string_sized_new(4096);
+  BcMetricPoint* points = metrics->points;
+
+  format_header(out, "birbcam_frames_total", "counter",
+                "Buffers seen at each instrumented point.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    g_string_append_printf(out,
+                           "birbcam_frames_total{%s} %" G_GUINT64_FORMAT
+                           "\n",
+                           points[i].labels, points[i].frames);
+  }
+
+  format_header(out, "birbcam_fps", "gauge",
+                "Moving average of the frame rate at each point.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    g_string_append_printf(out, "birbcam_fps{%s} %.2f\n",
+                           points[i].labels, points[i].fps);
+  }
+
+  format_header(out, "birbcam_latency_seconds", "histogram",
+                "Time a buffer spends inside the element.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    if (!points[i].timed)
+      continue;
+    guint64 cumulative = 0;
+    for (guint b = 0; b < BC_METRICS_BUCKETS; b++) {
+      cumulative += points[i].buckets[b];
+      if (b < G_N_ELEMENTS(BC_METRICS_BUCKET_BOUNDS)) {
+        g_string_append_printf(
+            out,
+            "birbcam_latency_seconds_bucket{%s,le=\"%g\"} "
+            "%" G_GUINT64_FORMAT "\n",
+            points[i].labels, BC_METRICS_BUCKET_BOUNDS[b], cumulative);
+      } else {
+        g_string_append_printf(
+            out,
+            "birbcam_latency_seconds_bucket{%s,le=\"+Inf\"} "
+            "%" G_GUINT64_FORMAT "\n",
+            points[i].labels, cumulative);
+      }
+    }
+    g_string_append_printf(out,
+                           "birbcam_latency_seconds_sum{%s} %f\n"
+                           "birbcam_latency_seconds_count{%s} "
+                           "%" G_GUINT64_FORMAT "\n",
+                           points[i].labels, points[i].latency_sum,
+                           points[i].labels, points[i].latency_count);
+  }
+
+  // queue levels are properties, so they're read now rather than tracked
+  format_header(out, "birbcam_queue_buffers", "gauge",
+                "Buffers currently held by the queue.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    if (!points[i].is_queue)
+      continue;
+    guint buffers = 0;
+    g_object_get(G_OBJECT(points[i].element), "current-level-buffers",
+                 &buffers, NULL);
+    g_string_append_printf(out, "birbcam_queue_buffers{%s} %u\n",
+                           points[i].labels, buffers);
+  }
+  format_header(out, "birbcam_queue_seconds", "gauge",
+                "Duration of the data currently held by the queue.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    if (!points[i].is_queue)
+      continue;
+    guint64 time = 0;
+    g_object_get(G_OBJECT(points[i].element), "current-level-time", &time,
+                 NULL);
+    g_string_append_printf(out, "birbcam_queue_seconds{%s} %f\n",
+                           points[i].labels, (gdouble)time / GST_SECOND);
+  }
+  // the queues are limited by time (max-size-buffers is 0), so this over
+  // birbcam_queue_seconds is how full they are
+  format_header(out, "birbcam_queue_max_seconds", "gauge",
+                "Duration of data the queue holds at most, 0 for no limit.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    if (!points[i].is_queue)
+      continue;
+    guint64 max_time = 0;
+    g_object_get(G_OBJECT(points[i].element), "max-size-time", &max_time,
+                 NULL);
+    g_string_append_printf(out, "birbcam_queue_max_seconds{%s} %f\n",
+                           points[i].labels, (gdouble)max_time / GST_SECOND);
+  }
+
+  format_header(out, "birbcam_written_bytes_total", "counter",
+                "Encoded bytes handed to the filesink.");
+  for (guint i = 0; i < metrics->n_points; i++) {
+    if (points[i].count_bytes) {
+      g_string_append_printf(out,
+                             "birbcam_written_bytes_total{%s} "
+                             "%" G_GUINT64_FORMAT "\n",
+                             points[i].labels, points[i].bytes);
+    }
+  }
+
+  // rate() of this is detections per second, whether each becomes a record
+  // or (with tracks) only updates one
+  format_header(out, "birbcam_detections_total", "counter",
+                "Birds detected (boxes of the bird class kept by on_batch).");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->detections[i] == NULL)
+      continue;
+    g_string_append_printf(out,
+                           "birbcam_detections_total{source=\"%u\"} "
+                           "%" G_GUINT64_FORMAT "\n",
+                           i, *metrics->detections[i]);
+  }
+  format_header(out, "birbcam_metadata_records_total", "counter",
+                "Metadata records by what happened to them.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->writers[i] == NULL)
+      continue;
+    BcWriterStats stats;
+    writer_get_stats(metrics->writers[i], &stats);
+    g_string_append_printf(
+        out,
+        "birbcam_metadata_records_total{source=\"%u\",state=\"written\"} "
+        "%" G_GUINT64_FORMAT "\n"
+        "birbcam_metadata_records_total{source=\"%u\",state=\"dropped\"} "
+        "%" G_GUINT64_FORMAT "\n"
+        "birbcam_metadata_records_total{source=\"%u\",state=\"late\"} "
+        "%" G_GUINT64_FORMAT "\n",
+        i, stats.written, i, stats.dropped, i, stats.late);
+  }
+  format_header(out, "birbcam_metadata_writes_total", "counter",
+                "Group commits (write calls) by the metadata writer.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->writers[i] == NULL)
+      continue;
+    BcWriterStats stats;
+    writer_get_stats(metrics->writers[i], &stats);
+    g_string_append_printf(out,
+                           "birbcam_metadata_writes_total{source=\"%u\"} "
+                           "%" G_GUINT64_FORMAT "\n",
+                           i, stats.writes);
+  }
+
+  // only the cameras that can come and go, see reconnect.h
+  format_header(out, "birbcam_source_up", "gauge",
+                "Whether frames are coming from the camera.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->reconnects[i] == NULL)
+      continue;
+    BcReconnectStats stats;
+    reconnect_get_stats(metrics->reconnects[i], &stats);
+    g_string_append_printf(out, "birbcam_source_up{source=\"%u\"} %d\n", i,
+                           stats.up ? 1 : 0);
+  }
+  format_header(out, "birbcam_source_losses_total", "counter",
+                "Times the camera went away.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->reconnects[i] == NULL)
+      continue;
+    BcReconnectStats stats;
+    reconnect_get_stats(metrics->reconnects[i], &stats);
+    g_string_append_printf(out,
+                           "birbcam_source_losses_total{source=\"%u\"} "
+                           "%" G_GUINT64_FORMAT "\n",
+                           i, stats.losses);
+  }
+  format_header(out, "birbcam_source_reconnect_attempts_total", "counter",
+                "New cameras tried after losing one.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->reconnects[i] == NULL)
+      continue;
+    BcReconnectStats stats;
+    reconnect_get_stats(metrics->reconnects[i], &stats);
+    g_string_append_printf(
+        out,
+        "birbcam_source_reconnect_attempts_total{source=\"%u\"} "
+        "%" G_GUINT64_FORMAT "\n",
+        i, stats.attempts);
+  }
+  format_header(out, "birbcam_source_reconnect_seconds", "gauge",
+                "Time from the last loss to the first frame back.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->reconnects[i] == NULL)
+      continue;
+    BcReconnectStats stats;
+    reconnect_get_stats(metrics->reconnects[i], &stats);
+    g_string_append_printf(out,
+                           "birbcam_source_reconnect_seconds{source=\"%u\"} "
+                           "%f\n",
+                           i, stats.last_seconds);
+  }
+  format_header(out, "birbcam_source_down_seconds_total", "counter",
+                "Time without the camera, losses still going on excluded.");
+  for (guint i = 0; i < metrics->n_writers; i++) {
+    if (metrics->reconnects[i] == NULL)
+      continue;
+    BcReconnectStats stats;
+    reconnect_get_stats(metrics->reconnects[i], &stats);
+    g_string_append_printf(
+        out, "birbcam_source_down_seconds_total{source=\"%u\"} %f\n", i,
+        stats.down_seconds);
+  }
+
+  return out;
+}
+
+// one scrape, from accepting the connection to closing it
+typedef struct {
+  BcMetrics* metrics;
+  GSocketConnection* connection;
+  gchar request[1024];
+  GString* response;
+} BcMetricsRequest;
+
+static void request_free(BcMetricsRequest* request) {
+  g_io_stream_close(G_IO_STREAM(request->connection), NULL, NULL);
+  g_object_unref(request->connection);
+  if (request->response != NULL)
+    g_string_free(request->response, TRUE);
+  g_free(request);
+}
+
+static void on_response_written(GOutputStream* stream,
+                                GAsyncResult* result,
+                                BcMetricsRequest* request) {
+  // a client that went away is its own problem
+  g_output_stream_write_all_finish(stream, result, NULL, NULL);
+  request_free(request);
+}
+
+// we answer every request with the metrics, whatever the path, once it has
+// been read (and ignored) so the client isn't reset mid-send
+static void on_request_read(GInputStream* stream,
+                            GAsyncResult* result,
+                            BcMetricsRequest* request) {
+  if (g_input_stream_read_finish(stream, result, NULL) < 0) {
+    request_free(request);
+    return;
+  }
+
+  GString* body = metrics_format(request->metrics);
+  request->response = g_string_new(NULL);
+  g_string_printf(request->response, HTTP_RESPONSE, body->len);
+  g_string_append_len(request->response, body->str, body->len);
+  g_string_free(body, TRUE);
+  g_output_stream_write_all_async(
+      g_io_stream_get_output_stream(G_IO_STREAM(request->connection)),
+      request->response->str, request->response->len, G_PRIORITY_DEFAULT,
+      NULL, (GAsyncReadyCallback)on_response_written, request);
+}
+
+static gboolean on_metrics_request(GSocketService* service,
+                                   GSocketConnection* connection,
+                                   GObject* source,
+                                   BcMetrics* metrics) {
+  // this runs on the main loop, so nothing here waits on the client. One
+  // that goes silent is dropped when the timeout fails its read or write.
+  g_socket_set_timeout(g_socket_connection_get_socket(connection), 1);
+
+  BcMetricsRequest* request = g_new0(BcMetricsRequest, 1);
+  request->metrics = metrics;
+  request->connection = g_object_ref(connection);
+  g_input_stream_read_async(
+      g_io_stream_get_input_stream(G_IO_STREAM(connection)), request->request,
+      sizeof(request->request), G_PRIORITY_DEFAULT, NULL,
+      (GAsyncReadyCallback)on_request_read, request);
+  return TRUE;
+}
+
+static GSocketAddress* parse_address(const gchar* address) {
+  gchar* end = NULL;
+  guint64 port = g_ascii_strtoull(address, &end, 10);
+  if (end != address && *end == '\0' && port > 0 && port <= G_MAXUINT16) {
+    // local only, this is not something to put on the network unprotected
+    GInetAddress* loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress* socket_address =
+        g_inet_socket_address_new(loopback, (guint16)port);
+    g_object_unref(loopback);
+    return socket_address;
+  }
+  // a host would be ignored, so it's not accepted
+  if (strchr(address, ':') != NULL && strchr(address, '/') == NULL) {
+    GST_ERROR(ERR_METRICS_ADDRESS, address);
+    return NULL;
+  }
+  // anything else is a socket path. A stale one from a crash would make the
+  // bind fail, so it's removed first, but nothing that isn't a socket is.
+  GStatBuf st;
+  if (g_stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+    g_unlink(address);
+  return g_unix_socket_address_new(address);
+}
+
+gboolean metrics_serve(BcMetrics* metrics, const gchar* address) {
+  GError* err = NULL;
+  GSocketAddress* socket_address = parse_address(address);
+  if (socket_address == NULL)
+    return FALSE;
+
+  metrics->service = g_socket_service_new();
+  if (!g_socket_listener_add_address(
+          G_SOCKET_LISTENER(metrics->service), socket_address,
+          G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &err)) {
+    GST_ERROR(ERR_METRICS_LISTEN, address, err->message);
+    g_clear_error(&err);
+    g_object_unref(socket_address);
+    return FALSE;
+  }
+  // ours to unlink on the way out
+  if (G_IS_UNIX_SOCKET_ADDRESS(socket_address))
+    metrics->socket_path = g_strdup(address);
+  g_object_unref(socket_address);
+
+  g_signal_connect(metrics->service, "incoming",
+                   G_CALLBACK(on_metrics_request), metrics);
+  g_socket_service_start(metrics->service);
+  g_print(MSG_METRICS_LISTEN, address);
+  return TRUE;
+}
+
+void metrics_free(BcMetrics* metrics) {
+  // a scrape still in flight is abandoned, the main loop isn't run again
+  if (metrics->service != NULL) {
+    g_socket_service_stop(metrics->service);
+    g_socket_listener_close(G_SOCKET_LISTENER(metrics->service));
+    g_object_unref(metrics->service);
+  }
+  if (metrics->socket_path != NULL) {
+    g_unlink(metrics->socket_path);
+    g_free(metrics->socket_path);
+  }
+  g_free(metrics);
+}
@@ -0,0 +1,236 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "motion.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+struct _BcMotion {
+  GstClockTime keepalive;  // 0 for none
+  GstClockTime hold;
+  gint threshold;  // per pixel, atomic
+  BcThrottle* throttle;  // records the frames gated
+
+  // last motion, written by the motion branch, read by the inference branch
+  GMutex lock;
+  GstClockTime moved;
+
+  // only touched by the motion branch streaming thread
+  gint width;
+  gint height;
+  gint stride;
+  guint8* previous;  // last luma plane, NULL until the first frame
+
+  // only touched by the inference branch streaming thread
+  GstClockTime forwarded;  // last frame let through
+  guint64 passed;
+  guint64 total;
+};
+
+static GstPadProbeReturn on_motion_buffer(GstPad* pad,
+                                          GstPadProbeInfo* info,
+                                          BcMotion* motion);
+static GstPadProbeReturn on_infer_buffer(GstPad* pad,
+                                         GstPadProbeInfo* info,
+                                         BcMotion* motion);
+
+BcMotion* motion_new(GstElement* sink,
+                     GstElement* infer_queue,
+                     BcThrottle* throttle,
+                     gdouble keepalive) {
+  GstPad* sink_pad = gst_element_get_static_pad(sink, "sink");
+  GstPad* src_pad = gst_element_get_static_pad(infer_queue, "src");
+  if (sink_pad == NULL || src_pad == NULL) {
+    GST_ERROR(ERR_MOTION_PAD);
+    if (sink_pad != NULL)
+      gst_object_unref(sink_pad);
+    if (src_pad != NULL)
+      gst_object_unref(src_pad);
+    return NULL;
+  }
+
+  BcMotion* motion = g_new0(BcMotion, 1);
+  motion->keepalive = keepalive > 0 ? (GstClockTime)(GST_SECOND / keepalive)
+                                    : 0;
+  motion->hold = BC_MOTION_HOLD * GST_SECOND;
+  motion->threshold = BC_MOTION_THRESHOLD;
+  motion->throttle = throttle;
+  motion->moved = GST_CLOCK_TIME_NONE;
+  motion->forwarded = GST_CLOCK_TIME_NONE;
+  g_mutex_init(&motion->lock);
+
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_motion_buffer, motion, NULL);
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_infer_buffer, motion, NULL);
+  gst_object_unref(sink_pad);
+  gst_object_unref(src_pad);
+  return motion;
+}
+
+void motion_set_threshold(BcMotion* motion, guint threshold) {
+  g_atomic_int_set(&motion->threshold, (gint)threshold);
+}
+
+void motion_free(BcMotion* motion) {
+  g_print(MSG_MOTION_STATS, motion->passed, motion->total);
+  g_mutex_clear(&motion->lock);
+  g_free(motion->previous);
+  g_free(motion);
+}
+
+guint block_sad(const guint8* a, const guint8* b, gint stride) {
+#if defined(__SSE2__)
+  // two rows per register, psadbw sums each 8 byte half
+  __m128i sum = _mm_setzero_si128();
+  for (gint y = 0; y < 8; y += 2) {
+    __m128i ra = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i*)a),
+        _mm_loadl_epi64((const __m128i*)(a + stride)));
+    __m128i rb = _mm_unpacklo_epi64(
+        _mm_loadl_epi64((const __m128i*)b),
+        _mm_loadl_epi64((const __m128i*)(b + stride)));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(ra, rb));
+    a += 2 * stride;
+    b += 2 * stride;
+  }
+  return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#elif defined(__ARM_NEON)
+  // widening absolute difference accumulate, 8 rows can't overflow 16 bits
+  uint16x8_t sum = vdupq_n_u16(0);
+  for (gint y = 0; y < 8; y++) {
+    sum = vabal_u8(sum, vld1_u8(a), vld1_u8(b));
+    a += stride;
+    b += stride;
+  }
+  uint64x2_t total = vpaddlq_u32(vpaddlq_u16(sum));
+  return (guint)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+#else
+  guint sad = 0;
+  for (gint y = 0; y < 8; y++) {
+    for (gint x = 0; x < 8; x++)
+      sad += ABS((gint)a[x] - (gint)b[x]);
+    a += stride;
+    b += stride;
+  }
+  return sad;
+#endif
+}
+
+// read the frame size from the negotiated caps the first time we see a buffer
+static gboolean configure_motion(GstPad* pad, BcMotion* motion) {
+  GstCaps* caps = gst_pad_get_current_caps(pad);
+  if (caps == NULL)
+    return FALSE;
+  GstStructure* s = gst_caps_get_structure(caps, 0);
+  gboolean ok = gst_structure_get_int(s, "width", &motion->width) &&
+                gst_structure_get_int(s, "height", &motion->height);
+  gst_caps_unref(caps);
+  if (!ok)
+    return FALSE;
+  motion->stride = GST_ROUND_UP_4(motion->width);
+  return TRUE;
+}
+
+// count the blocks that changed since the last frame
+static guint count_moving(BcMotion* motion, const guint8* luma) {
+  const guint threshold = (guint)g_atomic_int_get(&motion->threshold) *
+                          BC_MOTION_BLOCK * BC_MOTION_BLOCK;
+  guint moving = 0;
+  for (gint by = 0; by + BC_MOTION_BLOCK <= motion->height;
+       by += BC_MOTION_BLOCK) {
+    const guint8* cur = luma + by * motion->stride;
+    const guint8* old = motion->previous + by * motion->stride;
+    for (gint bx = 0; bx + BC_MOTION_BLOCK <= motion->width;
+         bx += BC_MOTION_BLOCK) {
+      if (block_sad(cur + bx, old + bx, motion->stride) > threshold)
+        moving++;
+    }
+  }
+  return moving;
+}
+
+static GstPadProbeReturn on_motion_buffer(GstPad* pad,
+                                          GstPadProbeInfo* info,
+                                          BcMotion* motion) {
+  if (motion->stride == 0 && !configure_motion(pad, motion)) {
+    GST_ERROR(ERR_MOTION_CAPS);
+    return GST_PAD_PROBE_OK;
+  }
+
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  GstMapInfo map;
+  if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+
+  gsize luma_size = motion->stride * motion->height;
+  if (map.size >= luma_size) {
+    // nothing to difference against on the very first frame
+    if (motion->previous == NULL) {
+      motion->previous = g_malloc(luma_size);
+    } else if (count_moving(motion, map.data) >= BC_MOTION_MIN_BLOCKS) {
+      GstClockTime pts = GST_BUFFER_PTS(buffer);
+      g_mutex_lock(&motion->lock);
+      if (!GST_CLOCK_TIME_IS_VALID(motion->moved) || pts > motion->moved)
+        motion->moved = pts;
+      g_mutex_unlock(&motion->lock);
+    }
+    memcpy(motion->previous, map.data, luma_size);
+  }
+  gst_buffer_unmap(buffer, &map);
+
+  // the frame itself goes nowhere, the sink is a fakesink
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_infer_buffer(GstPad* pad,
+                                         GstPadProbeInfo* info,
+                                         BcMotion* motion) {
+  GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+  motion->total++;
+
+  g_mutex_lock(&motion->lock);
+  GstClockTime moved = motion->moved;
+  g_mutex_unlock(&motion->lock);
+
+  // frames a little before the motion pass too, when the motion branch is
+  // ahead of this one
+  gboolean pass = !GST_CLOCK_TIME_IS_VALID(pts) ||
+                  (GST_CLOCK_TIME_IS_VALID(moved) && pts <= moved + motion->hold);
+  if (!pass && motion->keepalive > 0) {
+    // (time going backwards is a new segment, start over)
+    pass = !GST_CLOCK_TIME_IS_VALID(motion->forwarded) ||
+           pts < motion->forwarded ||
+           pts >= motion->forwarded + motion->keepalive;
+  }
+  if (!pass) {
+    throttle_skip(motion->throttle, pts, BRB_SKIP_MOTION);
+    return GST_PAD_PROBE_DROP;
+  }
+
+  throttle_pass(motion->throttle, BRB_SKIP_MOTION);
+  motion->forwarded = pts;
+  motion->passed++;
+  return GST_PAD_PROBE_OK;
+}
@@ -18,30 +18,100 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
 #include "pipeline.h"
+#include "classifier.h"
+#include "detector.h"
+#include "gate.h"    // BC_KEYFRAME_INTERVAL
+#include "motion.h"  // BC_MOTION_CAPS_STRING
+#include "tracker.h"
 
 // these create the branches of the pipeline
-gboolean create_pipeline_begin(PipelineData* p_data);
-gboolean create_encoder_branch(PipelineData* p_data, const gchar* filename);
-gboolean create_nvinfer_branch(PipelineData* p_data);
+gboolean create_pipeline_begin(PipelineData* p_data,
+                               BcSource* source,
+                               const gchar* input);
+gboolean create_encoder_branch(PipelineData* p_data,
+                               BcSource* source,
+                               const gchar* filename,
+                               const BcSegmentOptions* segments);
+gboolean create_motion_branch(PipelineData* p_data, BcSource* source);
+gboolean create_snapshot_branch(PipelineData* p_data, BcSource* source);
+gboolean create_nvinfer_branch(PipelineData* p_data, guint branches);
 
 // this links the entire pipeline together
 gboolean link_pipeline(PipelineData* p_data);
 
 // main pipeline creation function
-gboolean create_pipeline_data(PipelineData* p_data, const gchar* filename) {
-  // create the branches of the pipeline ...
-  if (!create_pipeline_begin(p_data))
-    return cleanup_pipeline_data(p_data);
-  if (!create_encoder_branch(p_data, filename))
+gboolean create_pipeline_data(PipelineData* p_data,
+                              const BcBackend* backend,
+                              const BcConfig* config,
+                              guint n_sources,
+                              const gchar* const* inputs,
+                              const gchar* const* filenames,
+                              const BcSegmentOptions* segments,
+                              guint branches) {
+  if (backend == NULL) {
+    GST_ERROR(ERR_BACKEND_MISSING);
+    return FALSE;
+  }
+  if (n_sources == 0 || n_sources > BC_MAX_SOURCES) {
+    GST_ERROR(ERR_SOURCES, BC_MAX_SOURCES);
+    return FALSE;
+  }
+  p_data->backend = backend;
+  p_data->config = config;
+  p_data->n_sources = n_sources;
+  p_data->offline = (branches & BC_BRANCH_OFFLINE) != 0;
+  p_data->n_views = tiles_layout(config, p_data->views);
+  GST_INFO("using %s backend with %u sources", backend->name, n_sources);
+  if (p_data->n_views > 1)
+    GST_INFO("inferring %u views of each source", p_data->n_views);
+
+  // create a new Pipeline (Bin subclass) and check that it exists
+  p_data->pipeline = GST_PIPELINE(gst_pipeline_new("pipeline"));
+  if (!GST_IS_PIPELINE(p_data->pipeline)) {
+    GST_ERROR(ERR_PIPELINE_CREATION);
+    return FALSE;
+  }
+
+  // a handy pointer to the bus to avoid having to call
+  // gst_pipeline_get_bus repeatedly.
+  // this must be unreferenced in the cleanup function.
+  p_data->bus = gst_pipeline_get_bus(p_data->pipeline);
+  if (!GST_IS_BUS(p_data->bus)) {
+    GST_ERROR(ERR_BUS_GET);
     return cleanup_pipeline_data(p_data);
-  if (!create_nvinfer_branch(p_data))
+  }
+
+  // create the branches of the pipeline, a beginning and encoder branch per
+  // source and one inference branch they all feed ...
+  for (guint i = 0; i < n_sources; i++) {
+    BcSource* source = &p_data->sources[i];
+    source->id = i;
+    if (!create_pipeline_begin(p_data, source, inputs ? inputs[i] : NULL))
+      return cleanup_pipeline_data(p_data);
+    if (!p_data->offline &&
+        !create_encoder_branch(p_data, source, filenames[i], segments)) {
+      return cleanup_pipeline_data(p_data);
+    }
+    if ((branches & BC_BRANCH_MOTION) && !create_motion_branch(p_data, source))
+      return cleanup_pipeline_data(p_data);
+    if ((branches & BC_BRANCH_SNAPSHOTS) &&
+        !create_snapshot_branch(p_data, source))
+      return cleanup_pipeline_data(p_data);
+  }
+  if (!create_nvinfer_branch(p_data, branches))
     return cleanup_pipeline_data(p_data);
 
   // ... and link them together
   if (!link_pipeline(p_data))
     return cleanup_pipeline_data(p_data);
 
+  // nothing to keep in time with when reprocessing, so run as fast as
+  // everything decodes and infers
+  if (p_data->offline)
+    gst_pipeline_use_clock(p_data->pipeline, NULL);
+
   // dump a pipeline graph to file
   GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(p_data->pipeline), GST_DEBUG_GRAPH_SHOW_ALL,
                             "pipeline");
@@ -49,13 +119,17 @@ gboolean create_pipeline_data(PipelineData* p_data, const gchar* filename) {
   return TRUE;
 }
 
-GstElement* create_and_add_element(GstPipeline* pipeline, const gchar* name) {
+// like create_and_add_element, but for when the same factory is used more
+// than once in the pipeline (element names must be unique within a bin)
+GstElement* create_and_add_named_element(GstPipeline* pipeline,
+                                         const gchar* factory,
+                                         const gchar* name) {
   // make an element
-  GstElement* elem = gst_element_factory_make(name, name);
+  GstElement* elem = gst_element_factory_make(factory, name);
 
   // verify if was created and fail if not
   if (!GST_IS_ELEMENT(elem)) {
-    GST_ERROR(ERR_ELEM, name);
+    GST_ERROR(ERR_ELEM, factory);
     return NULL;
   }
 
@@ -65,189 +139,751 @@ GstElement* create_and_add_element(GstPipeline* pipeline, const gchar* name) {
   return elem;
 }
 
-gboolean create_pipeline_begin(PipelineData* p_data) {
-  // create a new Pipeline (Bin subclass) and check that it exists
-  p_data->pipeline = GST_PIPELINE(gst_pipeline_new("pipeline"));
-  if (!GST_IS_PIPELINE(p_data->pipeline)) {
-    GST_ERROR(ERR_PIPELINE_CREATION);
-    return FALSE;
+GstElement* create_and_add_element(GstPipeline* pipeline, const gchar* name) {
+  return create_and_add_named_element(pipeline, name, name);
+}
+
+// every source has one of each of these, so they're named role_id
+static GstElement* create_source_element(PipelineData* p_data,
+                                         BcSource* source,
+                                         const gchar* factory,
+                                         const gchar* role) {
+  gchar name[32];
+  g_snprintf(name, sizeof(name), "%s_%u", role, source->id);
+  return create_and_add_named_element(p_data->pipeline, factory, name);
+}
+
+// uridecodebin only has pads once it knows what's in the file, so the first
+// video pad gets linked to the rest of the pipeline beginning here
+static void on_source_pad_added(GstElement* source,
+                                GstPad* pad,
+                                GstElement* next) {
+  GstCaps* caps = gst_pad_get_current_caps(pad);
+  if (caps == NULL)
+    caps = gst_pad_query_caps(pad, NULL);
+  gboolean is_video = g_str_has_prefix(
+      gst_structure_get_name(gst_caps_get_structure(caps, 0)), "video/");
+  gst_caps_unref(caps);
+  if (!is_video)
+    return;
+
+  GstPad* sink_pad = gst_element_get_static_pad(next, "sink");
+  if (!gst_pad_is_linked(sink_pad) &&
+      gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK) {
+    GST_ERROR(ERR_LINK, "uri source");
   }
+  gst_object_unref(sink_pad);
+}
 
-  // a handy pointer to the bus to avoid having to call
-  // gst_pipeline_get_bus repeatedly.
-  // this must be unreferenced in the cleanup function.
-  p_data->bus = gst_pipeline_get_bus(p_data->pipeline);
-  if (!GST_IS_BUS(p_data->bus)) {
-    GST_ERROR(ERR_BUS_GET);
-    return FALSE;
+// the camera (or a uri source standing in for one), added to the pipeline.
+// *converter is what converts its output for the rest of the beginning.
+static gboolean create_camera(PipelineData* p_data,
+                              BcSource* source,
+                              const gchar* input,
+                              const gchar** converter) {
+  const BcBackend* backend = p_data->backend;
+  *converter = backend->converter;
+  if (input == NULL || g_str_has_prefix(input, BC_INPUT_CSI)) {
+    source->camera =
+        create_source_element(p_data, source, backend->camera, "camera");
+    if (!GST_IS_ELEMENT(source->camera)) {
+      GST_ERROR(ERR_CAMERA_CREATION);
+      return FALSE;
+    }
+    source->live = TRUE;
+    if (backend->type == BC_BACKEND_TEGRA) {
+      guint sensor =
+          input ? (guint)g_ascii_strtoull(input + strlen(BC_INPUT_CSI), NULL, 10)
+                : 0;
+      g_object_set(G_OBJECT(source->camera), "sensor-id", sensor,
+                   "aeantibanding", 0,  // disables flicker reduction
+                   "maxperf", TRUE,     // enable argus maximum performance
+                   "ee-mode", 2,        // edge enhancement off
+                   "tnr-mode", 2,  // high quality temporal noise reduction
+                   NULL);
+    } else {
+      // a moving ball gives the cpu detector something to find
+      g_object_set(G_OBJECT(source->camera), "is-live", TRUE, NULL);
+      gst_util_set_object_arg(G_OBJECT(source->camera), "pattern", "ball");
+    }
+  } else if (g_str_has_prefix(input, BC_INPUT_V4L2)) {
+    // usb cameras give raw video in system memory, like a decoded uri
+    source->camera =
+        create_source_element(p_data, source, BC_ELEM_CAMERA_V4L2, "camera");
+    if (!GST_IS_ELEMENT(source->camera)) {
+      GST_ERROR(ERR_CAMERA_CREATION);
+      return FALSE;
+    }
+    source->live = TRUE;
+    g_object_set(G_OBJECT(source->camera), "device",
+                 input + strlen(BC_INPUT_V4L2), NULL);
+    *converter = backend->uri_converter;
+  } else {
+    source->camera =
+        create_source_element(p_data, source, backend->uri_source, "camera");
+    if (!GST_IS_ELEMENT(source->camera)) {
+      GST_ERROR(ERR_CAMERA_CREATION);
+      return FALSE;
+    }
+    gchar* uri = gst_uri_is_valid(input) ? g_strdup(input)
+                                         : gst_filename_to_uri(input, NULL);
+    source->live = !g_str_has_prefix(uri, "file:");
+    g_object_set(G_OBJECT(source->camera), "uri", uri, NULL);
+    g_free(uri);
+    *converter = backend->uri_converter;
   }
+  return TRUE;
+}
+
+gboolean create_pipeline_begin(PipelineData* p_data,
+                               BcSource* source,
+                               const gchar* input) {
+  const BcBackend* backend = p_data->backend;
 
-  // create the camera, and add it to the Pipeline
-#ifdef IS_TEGRA  // use the CSI camera, TODO: add usb camera support
-  p_data->camera = create_and_add_element(p_data->pipeline, BC_CAMERA_CSI);
-  if (!GST_IS_ELEMENT(p_data->camera)) {
-    GST_ERROR(ERR_CAMERA_CREATION);
+  // create the camera (or a uri source standing in for one), and add it to
+  // the Pipeline
+  const gchar* converter;
+  if (!create_camera(p_data, source, input, &converter))
     return FALSE;
+
+  // convert and scale to whatever the capsfilter asks for, if needed
+  if (converter != NULL) {
+    source->converter =
+        create_source_element(p_data, source, converter, "converter");
+    if (source->converter == NULL)
+      return FALSE;
   }
-  g_object_set(G_OBJECT(p_data->camera), "aeantibanding",
-               0,                // disables flicker reduction
-               "maxperf", TRUE,  // enable argus maximum performance
-               "ee-mode", 2,     // edge enhancement off
-               "tnr-mode", 2,    // high quality temporal noise reduction
-               NULL);
-#else
-  // TODO(x86) make separate source and converter element
-  GST_ERROR("X86 support unimplimentted");
-  return FALSE;
-#endif
+  if (backend->scaler != NULL) {
+    source->scaler =
+        create_source_element(p_data, source, backend->scaler, "scaler");
+    if (source->scaler == NULL)
+      return FALSE;
+  }
+
   // create a capsfilter element to tell the camera what we want sent downstream
-  p_data->capsfilter =
-      create_and_add_element(p_data->pipeline, BC_ELEM_CAPS_FILTER);
-  if (p_data->capsfilter == NULL)
+  source->capsfilter =
+      create_source_element(p_data, source, BC_ELEM_CAPS_FILTER, "capsfilter");
+  if (source->capsfilter == NULL)
     return FALSE;
-  g_object_set(G_OBJECT(p_data->capsfilter), "caps",
-               gst_caps_from_string(BC_CAPS_STRING), NULL);
+  GstCaps* caps = gst_caps_from_string(backend->caps);
+  gst_caps_set_simple(caps, "width", G_TYPE_INT, p_data->config->width,
+                      "height", G_TYPE_INT, p_data->config->height, NULL);
+  // file inputs on the software backend keep whatever rate they were shot at
+  if (gst_structure_has_field(gst_caps_get_structure(caps, 0), "framerate")) {
+    gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION,
+                        p_data->config->framerate, 1, NULL);
+  }
+  g_object_set(G_OBJECT(source->capsfilter), "caps", caps, NULL);
+  gst_caps_unref(caps);
 
   // create a tee (T) junction element to split the pipeline into two branches
   // (encoder branch and inference branch)
-  p_data->tee = create_and_add_element(p_data->pipeline, BC_ELEM_TEE);
-  if (p_data->tee == NULL)
+  source->tee = create_source_element(p_data, source, BC_ELEM_TEE, "tee");
+  if (source->tee == NULL)
     return FALSE;
 
   return TRUE;
 }
 
-gboolean create_encoder_branch(PipelineData* p_data, const gchar* filename) {
+gboolean create_encoder_branch(PipelineData* p_data,
+                               BcSource* source,
+                               const gchar* filename,
+                               const BcSegmentOptions* segments) {
   // create the encoder queue to buffer data and run everything downstream
   // in it's own thread
-  p_data->enc_queue = gst_element_factory_make(BC_ELEM_QUEUE, "enc_queue");
-  if (!p_data->enc_queue) {
-    GST_ERROR(ERR_ELEM, "(encoder) queue");
+  source->enc_queue =
+      create_source_element(p_data, source, BC_ELEM_QUEUE, "enc_queue");
+  if (source->enc_queue == NULL)
     return FALSE;
-  }
-  gst_bin_add(GST_BIN(p_data->pipeline), p_data->enc_queue);
+  // sized by time, not the default 200 buffers, so a stall downstream (a slow
+  // disk) is absorbed the same at any frame rate. Never leaky: a frame lost
+  // here is lost from the recording.
+  g_object_set(G_OBJECT(source->enc_queue), "max-size-buffers", 0,
+               "max-size-bytes", 0, "max-size-time",
+               (guint64)BC_ENC_QUEUE_TIME * GST_MSECOND, NULL);
 
   // create and configure the h265 encoder
-  p_data->encoder = create_and_add_element(p_data->pipeline, BC_ELEM_ENCODER);
-  if (p_data->encoder == NULL)
+  const BcBackend* backend = p_data->backend;
+  source->encoder =
+      create_source_element(p_data, source, backend->encoder, "encoder");
+  if (source->encoder == NULL)
     return FALSE;
-  g_object_set(G_OBJECT(p_data->encoder), "bitrate", 4000000, NULL);
+  g_object_set(G_OBJECT(source->encoder), "bitrate",
+               p_data->config->bitrate / backend->bitrate_divisor, NULL);
+  // a keyframe every second keeps the recording gate's pre-roll (and any
+  // seek) to within a second of where it should start
+  g_object_set(G_OBJECT(source->encoder), backend->keyframe_property,
+               BC_KEYFRAME_INTERVAL, NULL);
+  if (backend->type == BC_BACKEND_SOFTWARE) {
+    // 1080p30 h265 in real time on a cpu needs all the help it can get
+    gst_util_set_object_arg(G_OBJECT(source->encoder), "speed-preset",
+                            "ultrafast");
+    gst_util_set_object_arg(G_OBJECT(source->encoder), "tune", "zerolatency");
+  }
 
   // create the parser
-  p_data->parser = create_and_add_element(p_data->pipeline, BC_ELEM_PARSER);
-  if (p_data->parser == NULL)
+  source->parser =
+      create_source_element(p_data, source, backend->parser, "parser");
+  if (source->parser == NULL)
     return FALSE;
 
-  // create and configure the muxer
-  p_data->muxer = create_and_add_element(p_data->pipeline, BC_ELEM_MUXER);
-  if (p_data->muxer == NULL)
-    return FALSE;
-  g_object_set(G_OBJECT(p_data->muxer), "writing-app", "birbcam", NULL);
-  // write index every minute so if something happens, the file will still be
-  // seekable (probably, haven't tested this)  TODO: test this
-  g_object_set(G_OBJECT(p_data->muxer), "min-index-interval", (guint64)6e+10,
-               NULL);
+  // create the muxer and filesink. When segmenting, splitmuxsink owns them
+  // (so they aren't added to the pipeline) and swaps files at keyframes.
+  if (segments != NULL) {
+    source->splitmux =
+        create_source_element(p_data, source, BC_ELEM_SPLITMUX, "splitmux");
+    if (source->splitmux == NULL)
+      return FALSE;
+    source->muxer = gst_element_factory_make(backend->muxer, NULL);
+    if (source->muxer == NULL) {
+      GST_ERROR(ERR_ELEM, backend->muxer);
+      return FALSE;
+    }
+    source->filesink = gst_element_factory_make(BC_ELEM_FILESINK, NULL);
+    if (source->filesink == NULL) {
+      GST_ERROR(ERR_ELEM, BC_ELEM_FILESINK);
+      gst_object_unref(source->muxer);
+      return FALSE;
+    }
+  } else {
+    source->muxer =
+        create_source_element(p_data, source, backend->muxer, "muxer");
+    if (source->muxer == NULL)
+      return FALSE;
+    source->filesink =
+        create_source_element(p_data, source, BC_ELEM_FILESINK, "filesink");
+    if (source->filesink == NULL)
+      return FALSE;
+  }
+
+  // configure the muxer
+  g_object_set(G_OBJECT(source->muxer), "writing-app", "birbcam", NULL);
+  // a cue (index entry) every second, at the keyframes. This is only how fine
+  // the index is, matroskamux writes it when the file is closed, so a crash
+  // leaves a file without one (see videosync.h and tools/recover.c).
+  g_object_set(G_OBJECT(source->muxer), "min-index-interval",
+               (guint64)GST_SECOND, NULL);
+
+  // when segmenting this is only the first segment, the rest are named by
+  // whoever is connected to "format-location-full" (see segment.h)
+  g_object_set(G_OBJECT(source->filesink), "location", filename, NULL);
+  if (segments == NULL)
+    return TRUE;
+
+  g_object_set(G_OBJECT(source->splitmux), "muxer", source->muxer, "sink",
+               source->filesink, "max-size-time", segments->max_time,
+               "max-size-bytes", segments->max_bytes, NULL);
+  // ask the encoder for a keyframe right where a time limit runs out, so
+  // segments are as long as asked for rather than up to a keyframe interval
+  // longer. splitmuxsink ignores this if there's a size limit.
+  if (segments->max_time > 0) {
+    g_object_set(G_OBJECT(source->splitmux), "send-keyframe-requests", TRUE,
+                 NULL);
+  }
 
-  // filesink
-  p_data->filesink = create_and_add_element(p_data->pipeline, BC_ELEM_FILESINK);
-  if (p_data->filesink == NULL)
+  return TRUE;
+}
+
+// a tee after infer_queue, and a queue per view into the streammux. All but
+// the whole frame have the view cropped out and scaled to the inference size
+// on the way (nvstreammux would only scale the whole frame).
+static gboolean create_source_tiles(PipelineData* p_data, BcSource* source) {
+  const BcBackend* backend = p_data->backend;
+  const BcConfig* config = p_data->config;
+  source->tile_tee =
+      create_source_element(p_data, source, BC_ELEM_TEE, "tile_tee");
+  if (source->tile_tee == NULL)
     return FALSE;
-  g_object_set(G_OBJECT(p_data->filesink), "location", filename, NULL);
 
+  gchar role[32];
+  for (guint i = 0; i < p_data->n_views; i++) {
+    g_snprintf(role, sizeof(role), "tile%u_queue", i);
+    source->tile_queues[i] =
+        create_source_element(p_data, source, BC_ELEM_QUEUE, role);
+    if (source->tile_queues[i] == NULL)
+      return FALSE;
+    g_object_set(G_OBJECT(source->tile_queues[i]), "max-size-buffers",
+                 BC_TILE_QUEUE_SIZE, "max-size-bytes", 0, "max-size-time",
+                 (guint64)0, NULL);
+    if (i == 0)
+      continue;
+
+    const BcRegion* view = &p_data->views[i];
+    g_snprintf(role, sizeof(role), "tile%u_cropper", i);
+    source->tile_croppers[i] =
+        create_source_element(p_data, source, backend->tile_cropper, role);
+    if (source->tile_croppers[i] == NULL)
+      return FALSE;
+    g_autofree gchar* crop = g_strdup_printf(
+        "%d:%d:%d:%d", view->left, view->top, view->width, view->height);
+    g_object_set(G_OBJECT(source->tile_croppers[i]), "src-crop", crop, NULL);
+
+    g_snprintf(role, sizeof(role), "tile%u_capsfilter", i);
+    source->tile_capsfilters[i] =
+        create_source_element(p_data, source, BC_ELEM_CAPS_FILTER, role);
+    if (source->tile_capsfilters[i] == NULL)
+      return FALSE;
+    GstCaps* caps = gst_caps_from_string(backend->tile_caps);
+    gst_caps_set_simple(caps, "width", G_TYPE_INT, config->infer_width,
+                        "height", G_TYPE_INT, config->infer_height, NULL);
+    g_object_set(G_OBJECT(source->tile_capsfilters[i]), "caps", caps, NULL);
+    gst_caps_unref(caps);
+  }
   return TRUE;
 }
 
-gboolean create_nvinfer_branch(PipelineData* p_data) {
+// a source's way into the inference branch. On software that's also where
+// the scaling and (cpu) detection happen, since funnel can't batch.
+static gboolean create_source_infer(PipelineData* p_data, BcSource* source) {
+  const BcBackend* backend = p_data->backend;
+
   // create the inference queue to run everything downstream in it's own thread
   // and to buffer input
-  p_data->infer_queue = gst_element_factory_make(BC_ELEM_QUEUE, "infer_queue");
-  if (!p_data->infer_queue) {
-    GST_ERROR("Could not create inference queue.");
+  source->infer_queue =
+      create_source_element(p_data, source, BC_ELEM_QUEUE, "infer_queue");
+  if (source->infer_queue == NULL)
     return FALSE;
+  // inference may fall behind, the recording must not, so old frames are
+  // dropped rather than blocking the tee. With a throttle (throttle.h) this
+  // is only the backstop for a stalled branch: the throttle keeps the queue
+  // well short of full and records what it skips. Reprocessing, every frame
+  // is wanted and the decoder can wait.
+  g_object_set(G_OBJECT(source->infer_queue), "leaky", p_data->offline ? 0 : 2,
+               "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time",
+               (guint64)BC_INFER_QUEUE_TIME * GST_MSECOND, NULL);
+  if (backend->type == BC_BACKEND_TEGRA)
+    return p_data->n_views == 1 || create_source_tiles(p_data, source);
+
+  if (backend->infer_scaler != NULL) {
+    source->infer_scaler = create_source_element(
+        p_data, source, backend->infer_scaler, "infer_scaler");
+    if (source->infer_scaler == NULL)
+      return FALSE;
   }
-  gst_bin_add(GST_BIN(p_data->pipeline), p_data->infer_queue);
+  if (backend->infer_caps != NULL) {
+    source->infer_capsfilter = create_source_element(
+        p_data, source, BC_ELEM_CAPS_FILTER, "infer_capsfilter");
+    if (source->infer_capsfilter == NULL)
+      return FALSE;
+    GstCaps* caps = gst_caps_from_string(backend->infer_caps);
+    gst_caps_set_simple(caps, "width", G_TYPE_INT, p_data->config->infer_width,
+                        "height", G_TYPE_INT, p_data->config->infer_height,
+                        NULL);
+    g_object_set(G_OBJECT(source->infer_capsfilter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+  }
+  source->detector =
+      create_source_element(p_data, source, backend->infer, "detector");
+  if (source->detector == NULL)
+    return FALSE;
+  return attach_cpu_detector(source->detector, source->id, p_data->config);
+}
 
-  // create nvstreammux element to add the metadata
-  p_data->streammux =
-      create_and_add_element(p_data->pipeline, BC_ELEM_STREAM_MUX);
-  if (p_data->streammux == NULL)
+// queue -> scaler -> capsfilter -> fakesink, off the tee. The queue leaks so
+// a slow motion branch skips frames instead of holding up the others.
+gboolean create_motion_branch(PipelineData* p_data, BcSource* source) {
+  source->motion_queue =
+      create_source_element(p_data, source, BC_ELEM_QUEUE, "motion_queue");
+  if (source->motion_queue == NULL)
     return FALSE;
-  g_object_set(G_OBJECT(p_data->streammux), "batch-size", 1, "width", 384,
-               "height", 216, NULL);
+  g_object_set(G_OBJECT(source->motion_queue), "leaky", 2, "max-size-buffers",
+               1, NULL);
 
-  // create primary inference element (no secondary as of yet, maybe use the
-  // Coral, but will need to write a plugin for that since Google's is written
-  // in python, no really)
-  p_data->infer = create_and_add_element(p_data->pipeline, BC_ELEM_INFERENCE);
-  if (p_data->infer == NULL)
+  source->motion_scaler = create_source_element(
+      p_data, source, p_data->backend->motion_scaler, "motion_scaler");
+  if (source->motion_scaler == NULL)
     return FALSE;
-  g_object_set(G_OBJECT(p_data->infer), "config-file-path", "../birbcam.cfg",
+
+  source->motion_capsfilter = create_source_element(
+      p_data, source, BC_ELEM_CAPS_FILTER, "motion_capsfilter");
+  if (source->motion_capsfilter == NULL)
+    return FALSE;
+  GstCaps* caps = gst_caps_from_string(BC_MOTION_CAPS_STRING);
+  g_object_set(G_OBJECT(source->motion_capsfilter), "caps", caps, NULL);
+  gst_caps_unref(caps);
+
+  source->motion_sink =
+      create_source_element(p_data, source, BC_ELEM_FAKESINK, "motion_sink");
+  if (source->motion_sink == NULL)
+    return FALSE;
+  g_object_set(G_OBJECT(source->motion_sink), "sync", FALSE, "async", FALSE,
+               "enable-last-sample", FALSE, NULL);
+  return TRUE;
+}
+
+// queue -> converter -> capsfilter -> fakesink, off the tee, for full size
+// frames in system memory. The queue leaks, a snapshot can do without a frame
+// or two but the camera can't wait.
+gboolean create_snapshot_branch(PipelineData* p_data, BcSource* source) {
+  source->snap_queue =
+      create_source_element(p_data, source, BC_ELEM_QUEUE, "snap_queue");
+  if (source->snap_queue == NULL)
+    return FALSE;
+  g_object_set(G_OBJECT(source->snap_queue), "leaky", 2, "max-size-buffers", 1,
                NULL);
 
+  source->snap_converter = create_source_element(
+      p_data, source, p_data->backend->snapshot_converter, "snap_converter");
+  if (source->snap_converter == NULL)
+    return FALSE;
+
+  source->snap_capsfilter = create_source_element(
+      p_data, source, BC_ELEM_CAPS_FILTER, "snap_capsfilter");
+  if (source->snap_capsfilter == NULL)
+    return FALSE;
+  GstCaps* caps = gst_caps_from_string(BC_SNAPSHOT_CAPS_STRING);
+  g_object_set(G_OBJECT(source->snap_capsfilter), "caps", caps, NULL);
+  gst_caps_unref(caps);
+
+  source->snap_sink =
+      create_source_element(p_data, source, BC_ELEM_FAKESINK, "snap_sink");
+  if (source->snap_sink == NULL)
+    return FALSE;
+  g_object_set(G_OBJECT(source->snap_sink), "sync", FALSE, "async", FALSE,
+               "enable-last-sample", FALSE, NULL);
+  return TRUE;
+}
+
+// a secondary nvinfer on tegra, the cpu classifier on software
+static gboolean create_classifier(PipelineData* p_data, gboolean tracking) {
+  const BcBackend* backend = p_data->backend;
+  const BcConfig* config = p_data->config;
+  p_data->classifier = create_and_add_named_element(
+      p_data->pipeline, backend->classifier, "classifier");
+  if (p_data->classifier == NULL)
+    return FALSE;
+  if (backend->type != BC_BACKEND_TEGRA)
+    return attach_cpu_classifier(p_data->classifier, config);
+
+  // only birds, from the detector
+  g_autofree gchar* class_ids = g_strdup_printf("%d", config->class_id);
+  g_object_set(G_OBJECT(p_data->classifier), "config-file-path",
+               config->classifier_file, "process-mode", 2, "unique-id",
+               BC_CLASSIFIER_ID, "infer-on-gie-id", BC_DETECTOR_ID,
+               "infer-on-class-ids", class_ids, "batch-size",
+               BC_CLASSIFIER_BATCH, NULL);
+  // nvinfer keeps a result per tracked object itself, and (since DeepStream
+  // 5) can be told how often to refresh it
+  GObjectClass* klass = G_OBJECT_GET_CLASS(p_data->classifier);
+  if (tracking &&
+      g_object_class_find_property(klass, "secondary-reinfer-interval")) {
+    g_object_set(G_OBJECT(p_data->classifier), "secondary-reinfer-interval",
+                 config->classify_interval, NULL);
+  }
+  return TRUE;
+}
+
+gboolean create_nvinfer_branch(PipelineData* p_data, guint branches) {
+  const BcBackend* backend = p_data->backend;
+  // a frame per source and view (see tiles.h)
+  guint batch_size = p_data->n_sources * p_data->n_views;
+  gboolean live = FALSE;
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    if (!create_source_infer(p_data, &p_data->sources[i]))
+      return FALSE;
+    live |= p_data->sources[i].live;
+  }
+
+  // create nvstreammux element to batch the sources and add the metadata (on
+  // the software backend this just interleaves them, the cpu detectors have
+  // added the metadata already)
+  p_data->streammux = create_and_add_named_element(
+      p_data->pipeline, backend->streammux, "streammux");
+  if (p_data->streammux == NULL)
+    return FALSE;
+  if (backend->type == BC_BACKEND_TEGRA) {
+    g_object_set(G_OBJECT(p_data->streammux), "batch-size", batch_size,
+                 "width", p_data->config->infer_width, "height",
+                 p_data->config->infer_height,
+                 "live-source", live, "batched-push-timeout",
+                 BC_STREAMMUX_TIMEOUT, NULL);
+  }
+
+  // create primary inference element (the secondary, if any, goes after the
+  // tracker so it can cache per track, see classifier.h)
+  if (backend->type == BC_BACKEND_TEGRA) {
+    p_data->infer =
+        create_and_add_named_element(p_data->pipeline, backend->infer, "infer");
+    if (p_data->infer == NULL)
+      return FALSE;
+    // the config file says batch-size 1, a batch is one frame per source
+    // (and view, when tiling)
+    g_object_set(G_OBJECT(p_data->infer), "config-file-path",
+                 p_data->config->infer_file, "batch-size", batch_size,
+                 "interval", p_data->config->interval, NULL);
+  }
+
+  // merge the views back into one frame per source, before anything tracks
+  if (p_data->n_views > 1 &&
+      !attach_tile_merger(p_data->infer ? p_data->infer : p_data->streammux,
+                          p_data->config, p_data->n_sources)) {
+    return FALSE;
+  }
+
+  // give every detection a track id, if asked to
+  if (branches & BC_BRANCH_TRACKER) {
+    p_data->tracker = create_and_add_named_element(
+        p_data->pipeline, backend->tracker, "tracker");
+    if (p_data->tracker == NULL)
+      return FALSE;
+    if (backend->type == BC_BACKEND_TEGRA) {
+      g_object_set(G_OBJECT(p_data->tracker), "ll-lib-file", BC_TRACKER_LIB,
+                   "enable-batch-process", TRUE, NULL);
+    } else if (!attach_iou_tracker(p_data->tracker)) {
+      return FALSE;
+    }
+  }
+
+  // name the species of every bird, if asked to
+  if ((branches & BC_BRANCH_CLASSIFIER) &&
+      !create_classifier(p_data, (branches & BC_BRANCH_TRACKER) != 0)) {
+    return FALSE;
+  }
+
   // create a fakesink, onto which a probe will be attached to call on_batch
   // for each batch of frames to parse the metadata
   p_data->fakesink = create_and_add_element(p_data->pipeline, BC_ELEM_FAKESINK);
   if (p_data->fakesink == NULL) {
     return FALSE;
   }
+  if (p_data->offline)
+    g_object_set(G_OBJECT(p_data->fakesink), "sync", FALSE, NULL);
   return TRUE;
 }
 
-gboolean link_pipeline(PipelineData* p_data) {
-#ifdef IS_TEGRA
+// link a chain of elements in order, skipping any optional (NULL) ones
+static gboolean link_chain(GstElement** chain, gsize length) {
+  GstElement* previous = NULL;
+  for (gsize i = 0; i < length; i++) {
+    if (chain[i] == NULL)
+      continue;
+    if (previous != NULL && !gst_element_link(previous, chain[i]))
+      return FALSE;
+    previous = chain[i];
+  }
+  return TRUE;
+}
+
+GstElement* source_camera_peer(BcSource* source) {
+  if (source->converter != NULL)
+    return source->converter;
+  return source->scaler ? source->scaler : source->capsfilter;
+}
+
+// A uri source has no pads yet, so it is linked from on_source_pad_added to
+// whatever comes right after it.
+static gboolean link_camera(BcSource* source) {
+  GstElement* next = source_camera_peer(source);
+  GstPad* camera_src = gst_element_get_static_pad(source->camera, "src");
+  if (camera_src == NULL) {
+    g_signal_connect(source->camera, "pad-added",
+                     G_CALLBACK(on_source_pad_added), next);
+    return TRUE;
+  }
+  gst_object_unref(camera_src);
+  return gst_element_link(source->camera, next);
+}
+
+// nvstreammux only has request pads, and the pad number is the source_id
+// on_batch sees (or source_id * n_views + view, until the tile merger)
+static gboolean link_source_views(PipelineData* p_data, BcSource* source) {
+  gchar pad_name[16];
+  if (p_data->n_views == 1) {
+    g_snprintf(pad_name, sizeof(pad_name), "sink_%u", source->id);
+    if (!gst_element_link_pads(source->infer_queue, "src", p_data->streammux,
+                               pad_name)) {
+      GST_ERROR(ERR_LINK, "inference queue and stream muxer");
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  if (!gst_element_link(source->infer_queue, source->tile_tee)) {
+    GST_ERROR(ERR_LINK, "inference queue and tile tee");
+    return FALSE;
+  }
+  for (guint i = 0; i < p_data->n_views; i++) {
+    GstElement* view[] = {
+        source->tile_queues[i],
+        source->tile_croppers[i],
+        source->tile_capsfilters[i],
+    };
+    GstElement* last = view[i == 0 ? 0 : G_N_ELEMENTS(view) - 1];
+    g_snprintf(pad_name, sizeof(pad_name), "sink_%u",
+               source->id * p_data->n_views + i);
+    if (!gst_element_link(source->tile_tee, source->tile_queues[i]) ||
+        !link_chain(view, G_N_ELEMENTS(view)) ||
+        !gst_element_link_pads(last, "src", p_data->streammux, pad_name)) {
+      GST_ERROR(ERR_LINK, "tile branch");
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean link_source(PipelineData* p_data, BcSource* source) {
   // link pipeline beginning
-  if (!gst_element_link_many(p_data->camera, p_data->capsfilter, p_data->tee,
-                             NULL)) {
+  GstElement* beginning[] = {
+      source->converter,
+      source->scaler,
+      source->capsfilter,
+      source->tee,
+  };
+  if (!link_chain(beginning, G_N_ELEMENTS(beginning)) ||
+      !link_camera(source)) {
     // "Could not link pipeline %s."
     GST_ERROR(ERR_LINK, "beginning");
     return FALSE;
   }
-#else  // X86
-  // link: camera, converter, capsfilter, tee
-#endif
-  // link and connect encoder branch
-  if (!gst_element_link_many(p_data->enc_queue, p_data->encoder, p_data->parser,
-                             p_data->muxer, p_data->filesink, NULL)) {
+
+  // link and connect encoder branch. splitmuxsink links its own muxer and
+  // filesink, and gst_element_link takes care of its request pad.
+  GstElement* encoder[] = {
+      source->enc_queue,
+      source->encoder,
+      source->parser,
+      source->splitmux ? source->splitmux : source->muxer,
+      source->splitmux ? NULL : source->filesink,
+  };
+  if (!link_chain(encoder, G_N_ELEMENTS(encoder))) {
     GST_ERROR(ERR_LINK, "encoder branch");
     return FALSE;
   }
 
-  // link and connect inference branch
-  if (!gst_element_link_pads(p_data->infer_queue, "src", p_data->streammux,
-                             "sink_0")) {
-    GST_ERROR(ERR_LINK, "inference queue and stream muxer");
-    return FALSE;
+  // link this source into the inference branch
+  if (p_data->backend->type == BC_BACKEND_TEGRA) {
+    if (!link_source_views(p_data, source))
+      return FALSE;
+  } else {
+    GstElement* inference[] = {
+        source->infer_queue, source->infer_scaler, source->infer_capsfilter,
+        source->detector,    p_data->streammux,
+    };
+    if (!link_chain(inference, G_N_ELEMENTS(inference))) {
+      GST_ERROR(ERR_LINK, "inference queue and detector");
+      return FALSE;
+    }
   }
-  if (!gst_element_link_many(p_data->streammux, p_data->infer, p_data->fakesink,
-                             NULL)) {
-    GST_ERROR(ERR_LINK, "inference branch");
-    return FALSE;
+
+  // link the motion branch, if there is one
+  if (source->motion_queue != NULL) {
+    GstElement* motion[] = {
+        source->motion_queue,
+        source->motion_scaler,
+        source->motion_capsfilter,
+        source->motion_sink,
+    };
+    if (!link_chain(motion, G_N_ELEMENTS(motion))) {
+      GST_ERROR(ERR_LINK, "motion branch");
+      return FALSE;
+    }
+  }
+
+  // and the snapshot branch
+  if (source->snap_queue != NULL) {
+    GstElement* snapshot[] = {
+        source->snap_queue,
+        source->snap_converter,
+        source->snap_capsfilter,
+        source->snap_sink,
+    };
+    if (!link_chain(snapshot, G_N_ELEMENTS(snapshot))) {
+      GST_ERROR(ERR_LINK, "snapshot branch");
+      return FALSE;
+    }
   }
 
   // link the branches to the tee
-  if (!gst_element_link(p_data->tee, p_data->enc_queue)) {
+  if (source->enc_queue != NULL &&
+      !gst_element_link(source->tee, source->enc_queue)) {
     GST_ERROR(ERR_LINK, "tee and encoder queue");
   }
-  if (!gst_element_link(p_data->tee, p_data->infer_queue)) {
+  if (!gst_element_link(source->tee, source->infer_queue)) {
     GST_ERROR(ERR_LINK, "tee and inference queue");
   }
+  if (source->motion_queue != NULL &&
+      !gst_element_link(source->tee, source->motion_queue)) {
+    GST_ERROR(ERR_LINK, "tee and motion queue");
+  }
+  if (source->snap_queue != NULL &&
+      !gst_element_link(source->tee, source->snap_queue)) {
+    GST_ERROR(ERR_LINK, "tee and snapshot queue");
+  }
 
   return TRUE;
 }
 
+gboolean link_pipeline(PipelineData* p_data) {
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    if (!link_source(p_data, &p_data->sources[i]))
+      return FALSE;
+  }
+
+  // and the shared end of the inference branch
+  GstElement* inference[] = {
+      p_data->streammux,
+      p_data->infer,
+      p_data->tracker,
+      p_data->classifier,
+      p_data->fakesink,
+  };
+  if (!link_chain(inference, G_N_ELEMENTS(inference))) {
+    GST_ERROR(ERR_LINK, "inference branch");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+void remove_camera(PipelineData* p_data, BcSource* source) {
+  if (source->camera == NULL)
+    return;
+  // so a state change of the pipeline can't bring it back up meanwhile
+  gst_element_set_locked_state(source->camera, TRUE);
+  gst_element_set_state(source->camera, GST_STATE_NULL);
+  // this unlinks it too
+  gst_bin_remove(GST_BIN(p_data->pipeline), source->camera);
+  source->camera = NULL;
+}
+
+gboolean replace_camera(PipelineData* p_data,
+                        BcSource* source,
+                        const gchar* input) {
+  remove_camera(p_data, source);
+  const gchar* converter;
+  if (!create_camera(p_data, source, input, &converter))
+    return FALSE;
+  if (!link_camera(source)) {
+    GST_ERROR(ERR_LINK, "camera");
+    remove_camera(p_data, source);
+    return FALSE;
+  }
+  if (!gst_element_sync_state_with_parent(source->camera)) {
+    remove_camera(p_data, source);
+    return FALSE;
+  }
+  return TRUE;
+}
+
 gboolean shutdown_pipeline(PipelineData* p_data) {
-  // set the pipeline to the playing state
+  // set the pipeline to the null state
+  if (p_data->pipeline == NULL)
+    return FALSE;
   gst_element_set_state(GST_ELEMENT(p_data->pipeline), GST_STATE_NULL);
+  return TRUE;
 }
 
 gboolean cleanup_pipeline_data(PipelineData* p_data) {
   // unreference the bus because gst_pipeline_get_bus requires it
   if (p_data->bus) {
     gst_object_unref(p_data->bus);
+    p_data->bus = NULL;
   }
   shutdown_pipeline(p_data);
   // unreference the pipeline (and all elements added to it implicitly)
-  if (p_data->pipeline)
+  if (p_data->pipeline) {
     gst_object_unref(p_data->pipeline);
+    p_data->pipeline = NULL;
+  }
   return FALSE;
-}
\ No newline at end of file
+}
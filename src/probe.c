@@ -20,66 +20,128 @@
 
 #include "probe.h"
 
-static void print_bbox(gint frame_num, NvOSD_RectParams* rect);
-static void write_json(gint frame_num, NvOSD_RectParams* rect, BcData* data);
-static void write_protobuf(gint frame_num,
-                           NvOSD_RectParams* rect,
-                           BcData* data);
+#include "classifier.h"  // BC_CLASSIFIER_ID
+
+static void fill_record(NvDsFrameMeta* frame,
+                        NvDsObjectMeta* object,
+                        BrbRecord* record);
 
 // many thanks to NVIDIA's test1_app for showing me how to do this
+// this runs on the streaming thread, so all it does is copy records into the
+// writer's ring. Formatting and disk I/O happen on the writer thread. A batch
+// has a frame from each source, and each source has its own outputs.
 GstPadProbeReturn on_batch(GstPad* pad, GstPadProbeInfo* info, BcData* data) {
   // get batched metadata:
   NvDsBatchMeta* batch = gst_buffer_get_nvds_batch_meta((GstBuffer*)info->data);
+  if (batch == NULL)
+    return GST_PAD_PROBE_OK;  // nothing upstream could attach any
 
   NvDsMetaList* frames = NULL;
   NvDsFrameMeta* frame = NULL;
   NvDsMetaList* objects = NULL;
   NvDsObjectMeta* object = NULL;
+  BcOutput* output = NULL;
+  BrbRecord record;
+  gboolean birds = FALSE;
+  guint index = 0;
+  // both can change on SIGHUP
+  gint class_id = g_atomic_int_get(&data->args->config.class_id);
+  gint min_confidence = g_atomic_int_get(&data->args->config.min_confidence);
 
   // for frame in batch.frame_meta_list:
   for (frames = batch->frame_meta_list; frames != NULL; frames = frames->next) {
     frame = (NvDsFrameMeta*)(frames->data);
+    if (frame->source_id >= data->n_outputs)
+      continue;  // can't happen unless nvstreammux is misconfigured
+    output = &data->outputs[frame->source_id];
+    birds = FALSE;
+    index = 0;
+
+    // time this frame's trip through inference (the writer collects the
+    // frames skipped to keep that short itself, and they're published here)
+    if (output->throttle != NULL)
+      throttle_done(output->throttle, frame->buf_pts);
+    writer_publish(output->writer);
 
     // for object in frame.obj_meta_list:
     for (objects = frame->obj_meta_list; objects != NULL;
          objects = objects->next) {
       object = (NvDsObjectMeta*)(objects->data);
 
-      if (object->class_id == BIRB_ID) {
-        print_bbox(frame->frame_num, &object->rect_params);
-        switch (data->args->meta_type) {
-          case JSON_LINES:
-            write_json(frame->frame_num, &object->rect_params, data);
-            break;
-          case PROTOBUF:
-            write_protobuf(frame->frame_num, &object->rect_params, data);
-            break;
+      if (object->class_id == class_id) {
+        fill_record(frame, object, &record);
+        if (record.confidence < min_confidence)
+          continue;
+        // a bird, whether it's written or only updates its track
+        output->detections++;
+        if (output->tracks != NULL && record.object_id != BRB_UNTRACKED) {
+          tracks_update(output->tracks, &record);
+        } else {
+          // a full ring is counted as dropped by the writer (or waited on,
+          // reprocessing)
+          writer_push(output->writer, &record);
         }
+        // never waits, the workers crop and encode it
+        if (output->snapshots != NULL)
+          snapshot_request(output->snapshots, &record, index);
+        index++;
+        birds = TRUE;
       }
     }
+
+    // end the tracks of birds that have left
+    if (output->tracks != NULL)
+      tracks_expire(output->tracks, frame->buf_pts);
+
+    // keep (or start) recording around this frame
+    if (birds && output->gate != NULL)
+      gate_trigger(output->gate, frame->buf_pts);
   }
+  return GST_PAD_PROBE_OK;
 }
 
-static void print_bbox(gint frame_num, NvOSD_RectParams* rect) {
-  g_print(JSON_RECORD, frame_num, rect->top, rect->height, rect->left,
-          rect->width);
+// round and clamp a box coordinate into a record field. NvOSD_RectParams are
+// floats since DeepStream 4.0
+static guint16 to_u16(gfloat value) {
+  return (guint16)CLAMP(value + 0.5f, 0.0f, (gfloat)G_MAXUINT16);
 }
 
-static void write_json(gint frame_num, NvOSD_RectParams* rect, BcData* data) {
-  // write the filled out json record to data->meta_file
-  if (fprintf(data->meta_file, JSON_RECORD, frame_num, rect->top, rect->height,
-              rect->left, rect->width) < 0) {
-    // fprintf had an error, so write a short error with the frame number
-    if (fprintf(data->meta_file, JSON_RECORD_ERR, frame_num, "fprintf") < 0) {
-      // and if even that fails, this is critical so break out of the main loop
-      g_printerr(ERR_METADATA_WRITE);
-      g_main_loop_quit(data->main_loop);  // break out of the main loop
+// the classifier's answer, if it's given one (see classifier.h)
+static void fill_species(NvDsObjectMeta* object, BrbRecord* record) {
+  record->species = BRB_UNCLASSIFIED;
+  record->species_confidence = 0;
+  for (NvDsMetaList* l = object->classifier_meta_list; l != NULL;
+       l = l->next) {
+    NvDsClassifierMeta* meta = (NvDsClassifierMeta*)l->data;
+    if (meta->unique_component_id != BC_CLASSIFIER_ID ||
+        meta->label_info_list == NULL) {
+      continue;
     }
+    NvDsLabelInfo* label = (NvDsLabelInfo*)meta->label_info_list->data;
+    record->species = (guint8)MIN(label->result_class_id + 1, G_MAXUINT8);
+    record->species_confidence = (guint8)(
+        CLAMP(label->result_prob, 0.0f, 1.0f) * BRB_SPECIES_SCALE + 0.5f);
+    return;
   }
 }
 
-static void write_protobuf(gint frame_num,
-                           NvOSD_RectParams* rect,
-                           BcData* data) {
-  // TODO
+static void fill_record(NvDsFrameMeta* frame,
+                        NvDsObjectMeta* object,
+                        BrbRecord* record) {
+  NvOSD_RectParams* rect = &object->rect_params;
+  record->pts = frame->buf_pts;
+  record->frame_num = frame->frame_num;
+  record->object_id = object->object_id == UNTRACKED_OBJECT_ID
+                          ? BRB_UNTRACKED
+                          : (guint32)object->object_id;
+  record->source_id = frame->source_id;
+  record->class_id = object->class_id;
+  record->flags = 0;
+  record->confidence =
+      (guint16)(CLAMP(object->confidence, 0.0f, 1.0f) * BRB_CONFIDENCE_SCALE);
+  record->left = to_u16(rect->left);
+  record->top = to_u16(rect->top);
+  record->width = to_u16(rect->width);
+  record->height = to_u16(rect->height);
+  fill_species(object, record);
 }
@@ -0,0 +1,184 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "reconnect.h"
+
+struct _BcReconnect {
+  PipelineData* p_data;
+  BcSource* source;
+  gchar* input;
+
+  // the streaming thread, read by the watchdog. A torn read on a 32 bit
+  // machine just makes one check look a little early or late.
+  gint64 last_frame;  // monotonic, us
+  gint eos;           // atomic, the camera sent EOS
+
+  // the main thread only
+  gint64 started;  // monotonic, when the current camera went in
+  gint64 lost_at;  // monotonic, 0 unless the camera is lost
+  guint backoff_ms;
+  guint attempts;  // since lost
+  guint retry_id;  // a new camera goes in then, if not 0
+  guint watchdog_id;
+  BcReconnectStats stats;
+};
+
+gboolean reconnect_wanted(const gchar* input) {
+  if (input == NULL || g_str_has_prefix(input, BC_INPUT_CSI))
+    return FALSE;
+  if (g_str_has_prefix(input, BC_INPUT_V4L2))
+    return TRUE;
+  // anything not a uri is a filename
+  return gst_uri_is_valid(input) && !g_str_has_prefix(input, "file:");
+}
+
+// frames (and the end of the stream) on their way in from the camera. This
+// pad stays put while cameras come and go.
+static GstPadProbeReturn on_camera_data(GstPad* pad,
+                                        GstPadProbeInfo* info,
+                                        BcReconnect* reconnect) {
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    reconnect->last_frame = g_get_monotonic_time();
+    return GST_PAD_PROBE_OK;
+  }
+  // the camera is gone, not the recording. Passed on, EOS would finish it.
+  GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+  if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+    g_atomic_int_set(&reconnect->eos, TRUE);
+    return GST_PAD_PROBE_DROP;
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean on_retry(BcReconnect* reconnect);
+
+// take the camera out and try a new one after the backoff. Another loss
+// while waiting for that (more errors from the same failure) changes nothing.
+static void lose(BcReconnect* reconnect, const gchar* reason) {
+  if (reconnect->lost_at == 0) {
+    reconnect->lost_at = g_get_monotonic_time();
+    reconnect->attempts = 0;
+    reconnect->stats.losses++;
+    g_print(MSG_RECONNECT_LOST, reconnect->source->id, reconnect->input,
+            reason);
+  }
+  reconnect->stats.up = FALSE;
+  if (reconnect->retry_id != 0)
+    return;
+  remove_camera(reconnect->p_data, reconnect->source);
+  reconnect->retry_id = g_timeout_add(reconnect->backoff_ms,
+                                      (GSourceFunc)on_retry, reconnect);
+  reconnect->backoff_ms = MIN(reconnect->backoff_ms * 2, BC_RECONNECT_MAX_MS);
+}
+
+static gboolean on_retry(BcReconnect* reconnect) {
+  reconnect->retry_id = 0;
+  reconnect->attempts++;
+  reconnect->stats.attempts++;
+  reconnect->started = g_get_monotonic_time();
+  g_atomic_int_set(&reconnect->eos, FALSE);
+  if (!replace_camera(reconnect->p_data, reconnect->source, reconnect->input))
+    lose(reconnect, "can't start it");
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean on_watchdog(BcReconnect* reconnect) {
+  gint64 now = g_get_monotonic_time();
+  gint64 last_frame = reconnect->last_frame;
+  if (reconnect->retry_id != 0)
+    return G_SOURCE_CONTINUE;  // no camera to watch
+
+  if (g_atomic_int_get(&reconnect->eos)) {
+    lose(reconnect, "end of stream");
+  } else if (last_frame > reconnect->started) {
+    if (reconnect->lost_at != 0) {
+      // back. Timed to the frame, not to when we noticed.
+      gdouble seconds =
+          (gdouble)(last_frame - reconnect->lost_at) / G_USEC_PER_SEC;
+      reconnect->stats.last_seconds = seconds;
+      reconnect->stats.down_seconds += seconds;
+      g_print(MSG_RECONNECT_DONE, reconnect->source->id, seconds,
+              reconnect->attempts);
+      reconnect->lost_at = 0;
+      reconnect->backoff_ms = BC_RECONNECT_MIN_MS;
+    }
+    reconnect->stats.up = TRUE;
+    if (now - last_frame > BC_RECONNECT_STALL_MS * G_TIME_SPAN_MILLISECOND)
+      lose(reconnect, "no frames");
+  } else if (now - reconnect->started >
+             BC_RECONNECT_STALL_MS * G_TIME_SPAN_MILLISECOND) {
+    // not a single frame from this camera
+    lose(reconnect, "no frames");
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+BcReconnect* reconnect_new(PipelineData* p_data,
+                           BcSource* source,
+                           const gchar* input) {
+  // the camera's way in, which the new cameras are linked to as well
+  GstPad* sink_pad =
+      gst_element_get_static_pad(source_camera_peer(source), "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_LINK, "camera watch");
+    return NULL;
+  }
+
+  BcReconnect* reconnect = g_new0(BcReconnect, 1);
+  reconnect->p_data = p_data;
+  reconnect->source = source;
+  reconnect->input = g_strdup(input);
+  reconnect->started = g_get_monotonic_time();
+  reconnect->backoff_ms = BC_RECONNECT_MIN_MS;
+  gst_pad_add_probe(
+      sink_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      (GstPadProbeCallback)on_camera_data, reconnect, NULL);
+  gst_object_unref(sink_pad);
+  reconnect->watchdog_id = g_timeout_add(
+      BC_RECONNECT_CHECK_MS, (GSourceFunc)on_watchdog, reconnect);
+  return reconnect;
+}
+
+gboolean reconnect_on_error(BcReconnect* reconnect,
+                            GstMessage* message,
+                            const GError* err) {
+  GstElement* camera = reconnect->source->camera;
+  if (camera == NULL ||
+      !gst_object_has_as_ancestor(GST_MESSAGE_SRC(message),
+                                  GST_OBJECT(camera))) {
+    return FALSE;
+  }
+  lose(reconnect, err->message);
+  return TRUE;
+}
+
+void reconnect_get_stats(BcReconnect* reconnect, BcReconnectStats* stats) {
+  *stats = reconnect->stats;
+}
+
+void reconnect_free(BcReconnect* reconnect) {
+  if (reconnect->retry_id != 0)
+    g_source_remove(reconnect->retry_id);
+  g_source_remove(reconnect->watchdog_id);
+  g_print(MSG_RECONNECT_STATS, reconnect->source->id, reconnect->stats.losses,
+          reconnect->stats.down_seconds, reconnect->stats.attempts);
+  g_free(reconnect->input);
+  g_free(reconnect);
+}
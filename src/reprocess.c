@@ -0,0 +1,148 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "reprocess.h"
+
+#include <string.h>
+
+#include "brb.h"
+#include "gate.h"    // BC_KEYFRAME_INTERVAL
+#include "writer.h"  // BC_EXT_INDEX
+
+struct _BcReprocess {
+  guint source_id;
+  guint every;          // frames, or keyframes once keyframes_only is set
+  gint keyframes_only;  // atomic, set once a decoder has been told to
+
+  // the streaming thread, then reprocess_free
+  guint64 decoded;
+  guint64 inferred;
+  GstClockTime first_pts;
+  GstClockTime last_pts;
+  gint64 started;   // monotonic, at the first frame
+  gint64 finished;  // monotonic, at the last frame
+};
+
+// birbs.mkv -> birbs
+static gchar* strip_extension(const gchar* filename) {
+  gchar* base = g_strdup(filename);
+  gchar* dot = strrchr(base, '.');
+  if (dot != NULL && strchr(dot, G_DIR_SEPARATOR) == NULL)
+    *dot = '\0';
+  return base;
+}
+
+gchar* reprocess_base_filename(const gchar* input) {
+  g_autofree gchar* base = strip_extension(input);
+  return g_strconcat(base, BC_REPROCESS_SUFFIX, NULL);
+}
+
+gint64 reprocess_start_time(const gchar* input) {
+  g_autofree gchar* base = strip_extension(input);
+  g_autofree gchar* index = g_strconcat(base, BC_EXT_INDEX, NULL);
+
+  gchar* data = NULL;
+  gsize length = 0;
+  if (!g_file_get_contents(index, &data, &length, NULL))
+    return 0;
+  BriHeader header;
+  gint64 start_time = 0;
+  if (length >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    if (!memcmp(header.magic, BRI_MAGIC, sizeof(BRI_MAGIC)))
+      start_time =
+          header.start_time - (gint64)(header.start_pts / GST_USECOND);
+  }
+  g_free(data);
+  return start_time;
+}
+
+static GstPadProbeReturn on_decoded(GstPad* pad,
+                                    GstPadProbeInfo* info,
+                                    BcReprocess* reprocess) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gint64 now = g_get_monotonic_time();
+  if (reprocess->decoded++ == 0) {
+    reprocess->started = now;
+    reprocess->first_pts = GST_BUFFER_PTS(buffer);
+  }
+  reprocess->finished = now;
+  reprocess->last_pts = GST_BUFFER_PTS(buffer);
+
+  guint every = reprocess->every;
+  if (g_atomic_int_get(&reprocess->keyframes_only))
+    every = MAX(every / BC_KEYFRAME_INTERVAL, 1);
+  if ((reprocess->decoded - 1) % every != 0)
+    return GST_PAD_PROBE_DROP;
+  reprocess->inferred++;
+  return GST_PAD_PROBE_OK;
+}
+
+// uridecodebin picks the decoder once it knows what's in the file
+static void on_element_added(GstBin* bin,
+                             GstBin* sub_bin,
+                             GstElement* element,
+                             BcReprocess* reprocess) {
+  GObjectClass* klass = G_OBJECT_GET_CLASS(element);
+  if (reprocess->every < BC_KEYFRAME_INTERVAL ||
+      g_object_class_find_property(klass, "skip-frames") == NULL) {
+    return;
+  }
+  // nvv4l2decoder: 0 decodes everything, 2 keyframes only
+  g_object_set(G_OBJECT(element), "skip-frames", 2, NULL);
+  g_atomic_int_set(&reprocess->keyframes_only, TRUE);
+}
+
+BcReprocess* reprocess_new(BcSource* source, guint every) {
+  // the first element after the decoder
+  GstPad* sink_pad =
+      gst_element_get_static_pad(source_camera_peer(source), "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_REPROCESS_PAD);
+    return NULL;
+  }
+
+  BcReprocess* reprocess = g_new0(BcReprocess, 1);
+  reprocess->source_id = source->id;
+  reprocess->every = MAX(every, 1);
+  if (GST_IS_BIN(source->camera)) {
+    g_signal_connect(source->camera, "deep-element-added",
+                     G_CALLBACK(on_element_added), reprocess);
+  }
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_decoded, reprocess, NULL);
+  gst_object_unref(sink_pad);
+  return reprocess;
+}
+
+void reprocess_free(BcReprocess* reprocess) {
+  gdouble video = 0.0;
+  if (reprocess->decoded > 0 && reprocess->last_pts > reprocess->first_pts)
+    video = (gdouble)(reprocess->last_pts - reprocess->first_pts) / GST_SECOND;
+  gdouble elapsed =
+      (gdouble)(reprocess->finished - reprocess->started) / G_USEC_PER_SEC;
+  g_print(MSG_REPROCESS_STATS, reprocess->source_id, reprocess->decoded,
+          reprocess->inferred, video, elapsed,
+          elapsed > 0.0 ? video / elapsed : 0.0,
+          g_atomic_int_get(&reprocess->keyframes_only)
+              ? MSG_REPROCESS_KEYFRAMES
+              : "");
+  g_free(reprocess);
+}
@@ -0,0 +1,244 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "restart.h"
+
+// every element of the inference branch, sinks first
+#define BC_RESTART_ELEMENTS \
+  (5 + (5 + 3 * BC_TILES_MAX_VIEWS) * BC_MAX_SOURCES)
+
+struct _BcRestart {
+  PipelineData* p_data;
+  GstPad* tee_pads[BC_MAX_SOURCES];    // to each source's infer_queue
+  GstPad* queue_pads[BC_MAX_SOURCES];  // and that infer_queue's sink pad
+  BcThrottle* throttles[BC_MAX_SOURCES];  // record the drops, if not NULL
+
+  gint down;     // atomic, frames go no further than the tee
+  gint dropped;  // atomic, frames dropped there since the branch failed
+
+  // the main thread only
+  gint64 failed_at;                // monotonic, 0 while running
+  gint64 history[BC_RESTART_MAX];  // monotonic, of the latest restarts
+  guint restarts;
+  guint restart_id;  // the restart to come, if not 0
+};
+
+static guint branch_elements(PipelineData* p_data, GstElement** elements) {
+  GstElement* shared[] = {
+      p_data->fakesink, p_data->classifier, p_data->tracker,
+      p_data->infer,    p_data->streammux,
+  };
+  guint n = 0;
+  for (guint i = 0; i < G_N_ELEMENTS(shared); i++) {
+    if (shared[i] != NULL)
+      elements[n++] = shared[i];
+  }
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    BcSource* source = &p_data->sources[i];
+    for (guint j = 0; j < p_data->n_views; j++) {
+      GstElement* view[] = {
+          source->tile_capsfilters[j],
+          source->tile_croppers[j],
+          source->tile_queues[j],
+      };
+      for (guint k = 0; k < G_N_ELEMENTS(view); k++) {
+        if (view[k] != NULL)
+          elements[n++] = view[k];
+      }
+    }
+    GstElement* own[] = {
+        source->tile_tee,
+        source->detector,
+        source->infer_capsfilter,
+        source->infer_scaler,
+        source->infer_queue,
+    };
+    for (guint j = 0; j < G_N_ELEMENTS(own); j++) {
+      if (own[j] != NULL)
+        elements[n++] = own[j];
+    }
+  }
+  return n;
+}
+
+static gboolean in_branch(BcRestart* restart, GstObject* object) {
+  GstElement* elements[BC_RESTART_ELEMENTS];
+  guint n = branch_elements(restart->p_data, elements);
+  for (guint i = 0; i < n; i++) {
+    if (gst_object_has_as_ancestor(object, GST_OBJECT(elements[i])))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// on the thread that posted the message, which is about to return an error
+// that would otherwise reach the tee next
+static GstBusSyncReply on_sync_message(GstBus* bus,
+                                       GstMessage* message,
+                                       BcRestart* restart) {
+  if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR &&
+      in_branch(restart, GST_MESSAGE_SRC(message))) {
+    g_atomic_int_set(&restart->down, TRUE);
+  }
+  return GST_BUS_PASS;
+}
+
+// frames from the tee to inference, dropped while it's down. Events carry
+// on, and are kept by the tee pad if the queue can't take them.
+static GstPadProbeReturn on_tee_buffer(GstPad* pad,
+                                       GstPadProbeInfo* info,
+                                       BcRestart* restart) {
+  if (!g_atomic_int_get(&restart->down))
+    return GST_PAD_PROBE_OK;
+  g_atomic_int_inc(&restart->dropped);
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  for (guint i = 0; i < restart->p_data->n_sources; i++) {
+    if (restart->tee_pads[i] == pad && restart->throttles[i] != NULL &&
+        GST_BUFFER_PTS_IS_VALID(buffer)) {
+      throttle_skip(restart->throttles[i], GST_BUFFER_PTS(buffer),
+                    BRB_SKIP_RESTART);
+    }
+  }
+  return GST_PAD_PROBE_DROP;
+}
+
+// the queue forgot the caps, segment and so on going to NULL
+static gboolean resend_event(GstPad* pad, GstEvent** event, GstPad* sink_pad) {
+  gst_pad_send_event(sink_pad, gst_event_ref(*event));
+  return TRUE;
+}
+
+static gboolean on_restart(BcRestart* restart) {
+  PipelineData* p_data = restart->p_data;
+  restart->restart_id = 0;
+  restart->history[restart->restarts++ % BC_RESTART_MAX] =
+      g_get_monotonic_time();
+
+  // down, then back up, sinks first both ways
+  GstElement* elements[BC_RESTART_ELEMENTS];
+  guint n = branch_elements(p_data, elements);
+  for (guint i = 0; i < n; i++)
+    gst_element_set_state(elements[i], GST_STATE_NULL);
+  for (guint i = 0; i < n; i++) {
+    if (!gst_element_sync_state_with_parent(elements[i])) {
+      // back through the bus, and the retry limit, like any other failure
+      GError* err = g_error_new_literal(GST_CORE_ERROR,
+                                        GST_CORE_ERROR_STATE_CHANGE,
+                                        "could not be restarted");
+      gst_element_post_message(
+          elements[i],
+          gst_message_new_error(GST_OBJECT(elements[i]), err, NULL));
+      g_error_free(err);
+      return G_SOURCE_REMOVE;
+    }
+  }
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    gst_pad_sticky_events_foreach(
+        restart->tee_pads[i], (GstPadStickyEventsForeachFunction)resend_event,
+        restart->queue_pads[i]);
+  }
+
+  g_atomic_int_set(&restart->down, FALSE);
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    if (restart->throttles[i] != NULL)
+      throttle_pass(restart->throttles[i], BRB_SKIP_RESTART);
+  }
+  g_print(MSG_RESTART_DONE,
+          (gdouble)(g_get_monotonic_time() - restart->failed_at) /
+              G_USEC_PER_SEC,
+          (guint)g_atomic_int_and(&restart->dropped, 0));
+  restart->failed_at = 0;
+  return G_SOURCE_REMOVE;
+}
+
+gboolean restart_on_error(BcRestart* restart,
+                          GstMessage* message,
+                          const GError* err) {
+  if (!in_branch(restart, GST_MESSAGE_SRC(message)))
+    return FALSE;
+  g_atomic_int_set(&restart->down, TRUE);
+  // more errors from the same failure
+  if (restart->restart_id != 0)
+    return TRUE;
+
+  gint64 now = g_get_monotonic_time();
+  guint recent = 0;
+  for (guint i = 0; i < MIN(restart->restarts, BC_RESTART_MAX); i++) {
+    if (now - restart->history[i] < BC_RESTART_WINDOW * G_USEC_PER_SEC)
+      recent++;
+  }
+  if (recent >= BC_RESTART_MAX) {
+    g_printerr(ERR_RESTART_LIMIT, recent, BC_RESTART_WINDOW);
+    return FALSE;
+  }
+
+  guint delay_ms = BC_RESTART_DELAY_MS << recent;
+  g_print(MSG_RESTART_FAILED, GST_MESSAGE_SRC_NAME(message), err->message,
+          delay_ms / 1000.0);
+  if (restart->failed_at == 0)
+    restart->failed_at = now;
+  restart->restart_id =
+      g_timeout_add(delay_ms, (GSourceFunc)on_restart, restart);
+  return TRUE;
+}
+
+BcRestart* restart_new(PipelineData* p_data) {
+  BcRestart* restart = g_new0(BcRestart, 1);
+  restart->p_data = p_data;
+  for (guint i = 0; i < p_data->n_sources; i++) {
+    restart->queue_pads[i] =
+        gst_element_get_static_pad(p_data->sources[i].infer_queue, "sink");
+    restart->tee_pads[i] = restart->queue_pads[i]
+                               ? gst_pad_get_peer(restart->queue_pads[i])
+                               : NULL;
+    if (restart->tee_pads[i] == NULL) {
+      GST_ERROR(ERR_RESTART_PAD);
+      restart_free(restart);
+      return NULL;
+    }
+    gst_pad_add_probe(restart->tee_pads[i], GST_PAD_PROBE_TYPE_BUFFER,
+                      (GstPadProbeCallback)on_tee_buffer, restart, NULL);
+  }
+  // a sink coming back up in a playing pipeline mustn't wait to preroll
+  g_object_set(G_OBJECT(p_data->fakesink), "async", FALSE, NULL);
+  gst_bus_set_sync_handler(p_data->bus, (GstBusSyncHandler)on_sync_message,
+                           restart, NULL);
+  return restart;
+}
+
+void restart_set_throttle(BcRestart* restart,
+                          guint source_id,
+                          BcThrottle* throttle) {
+  restart->throttles[source_id] = throttle;
+}
+
+void restart_free(BcRestart* restart) {
+  if (restart->restart_id != 0)
+    g_source_remove(restart->restart_id);
+  if (restart->restarts > 0)
+    g_print(MSG_RESTART_STATS, restart->restarts);
+  for (guint i = 0; i < BC_MAX_SOURCES; i++) {
+    if (restart->tee_pads[i] != NULL)
+      gst_object_unref(restart->tee_pads[i]);
+    if (restart->queue_pads[i] != NULL)
+      gst_object_unref(restart->queue_pads[i]);
+  }
+  g_free(restart);
+}
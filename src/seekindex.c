@@ -0,0 +1,80 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "seekindex.h"
+
+struct _BcSeekIndex {
+  BcWriter* writer;
+  // only touched by the muxer's streaming thread
+  guint64 position;       // where the next buffer goes in the current file
+  GstClockTime last_pts;  // a keyframe can span several buffers
+};
+
+static GstPadProbeReturn on_mkv_data(GstPad* pad,
+                                     GstPadProbeInfo* info,
+                                     BcSeekIndex* index) {
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    // matroskamux seeks back with a new byte segment to rewrite its header
+    // on EOS, and splitmuxsink starts every file with one at 0
+    GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+      const GstSegment* segment;
+      gst_event_parse_segment(event, &segment);
+      if (segment->format == GST_FORMAT_BYTES)
+        index->position = segment->start;
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  GstBuffer* buf = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (GST_BUFFER_OFFSET_IS_VALID(buf))
+    index->position = GST_BUFFER_OFFSET(buf);
+  GstClockTime pts = GST_BUFFER_PTS(buf);
+  if (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT) &&
+      GST_CLOCK_TIME_IS_VALID(pts) && pts != index->last_pts) {
+    writer_mark_keyframe(index->writer, pts, index->position);
+    index->last_pts = pts;
+  }
+  index->position += gst_buffer_get_size(buf);
+  return GST_PAD_PROBE_OK;
+}
+
+BcSeekIndex* seek_index_new(GstElement* filesink, BcWriter* writer) {
+  GstPad* sink_pad = gst_element_get_static_pad(filesink, "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_SEEK_INDEX_PAD);
+    return NULL;
+  }
+
+  BcSeekIndex* index = g_new0(BcSeekIndex, 1);
+  index->writer = writer;
+  index->last_pts = GST_CLOCK_TIME_NONE;
+  gst_pad_add_probe(
+      sink_pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      (GstPadProbeCallback)on_mkv_data, index, NULL);
+  gst_object_unref(sink_pad);
+  return index;
+}
+
+void seek_index_free(BcSeekIndex* index) {
+  g_free(index);
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "segment.h"
+
+gchar* segment_filename(const gchar* base,
+                        guint index,
+                        const gchar* extension) {
+  return g_strdup_printf(BC_SEGMENT_FORMAT, base, index, extension);
+}
+
+gchar* on_format_location(GstElement* splitmux,
+                          guint fragment_id,
+                          GstSample* first_sample,
+                          BcOutput* output) {
+  const gchar* base = output->base_filename;
+  gchar* filename = segment_filename(base, fragment_id, ".mkv");
+  g_print(MSG_SEGMENT, filename);
+
+  // the writer opened the first metadata file itself, the rest start at the
+  // same frame the video segment does
+  GstBuffer* first = gst_sample_get_buffer(first_sample);
+  if (fragment_id > 0 && first != NULL) {
+    gchar* meta_filename =
+        segment_filename(base, fragment_id, output->meta_extension);
+    writer_rotate(output->writer, meta_filename, GST_BUFFER_PTS(first));
+    g_free(meta_filename);
+  }
+
+  return filename;  // splitmuxsink frees it
+}
@@ -0,0 +1,350 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "snapshot.h"
+
+#include <string.h>
+
+#include <gst/video/video.h>
+
+#define BC_NS_PER_MS G_GUINT64_CONSTANT(1000000)
+#define BC_NS_PER_SECOND G_GUINT64_CONSTANT(1000000000)
+#define BC_SNAPSHOT_MIN_SIZE 16  // pixels, a crop is never smaller
+#define BC_SNAPSHOT_STALE 256    // tracks remembered before forgetting old ones
+
+struct _BcSnapshots {
+  gchar* directory;
+  guint infer_width;
+  guint infer_height;
+  guint64 interval;  // ns
+  GThreadPool* pool;
+
+  // written by the snapshot branch, read by the inference branch
+  GMutex lock;
+  GstVideoInfo info;  // of the held frames, valid once one is held
+  GstBuffer** frames;  // ring, NULL until filled
+  guint n_frames;
+  guint next;
+
+  // only touched by the inference branch streaming thread
+  GHashTable* taken;  // object_id -> pts of the last snapshot
+  guint64 untracked;  // pts of the last snapshot of an untracked bird
+  gboolean have_untracked;
+  guint64 dropped;
+
+  // workers
+  gint written;  // atomic
+};
+
+typedef struct {
+  BcSnapshots* snaps;
+  GstBuffer* frame;
+  GstVideoInfo info;
+  gint left;  // crop, in frame pixels, even
+  gint top;
+  gint width;
+  gint height;
+  gchar* filename;
+} BcSnapshotJob;
+
+static GstPadProbeReturn on_snapshot_frame(GstPad* pad,
+                                           GstPadProbeInfo* info,
+                                           BcSnapshots* snaps);
+static void encode_snapshot(BcSnapshotJob* job, gpointer unused);
+
+BcSnapshots* snapshots_new(GstElement* sink,
+                           const gchar* directory,
+                           guint infer_width,
+                           guint infer_height,
+                           guint interval,
+                           guint latency_ms,
+                           guint framerate) {
+  if (g_mkdir_with_parents(directory, 0755) != 0) {
+    GST_ERROR(ERR_SNAPSHOT_DIR, directory);
+    return NULL;
+  }
+  GstPad* sink_pad = gst_element_get_static_pad(sink, "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_SNAPSHOT_PAD);
+    return NULL;
+  }
+
+  BcSnapshots* snaps = g_new0(BcSnapshots, 1);
+  GError* err = NULL;
+  snaps->pool = g_thread_pool_new((GFunc)encode_snapshot, NULL,
+                                  BC_SNAPSHOT_WORKERS, FALSE, &err);
+  if (snaps->pool == NULL) {
+    GST_ERROR(ERR_SNAPSHOT_POOL, err->message);
+    g_error_free(err);
+    gst_object_unref(sink_pad);
+    g_free(snaps);
+    return NULL;
+  }
+  snaps->directory = g_strdup(directory);
+  snaps->infer_width = infer_width;
+  snaps->infer_height = infer_height;
+  snaps->interval = interval * BC_NS_PER_SECOND;
+  // as many frames as arrive while one is inferred, and some to spare
+  snaps->n_frames = MIN(latency_ms * framerate / 1000 + BC_SNAPSHOT_FRAMES,
+                        BC_SNAPSHOT_MAX_FRAMES);
+  snaps->frames = g_new0(GstBuffer*, snaps->n_frames);
+  snaps->taken = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                       g_free);
+  g_mutex_init(&snaps->lock);
+  gst_video_info_init(&snaps->info);
+
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_snapshot_frame, snaps, NULL);
+  gst_object_unref(sink_pad);
+  return snaps;
+}
+
+void snapshots_free(BcSnapshots* snaps) {
+  // let the queued snapshots finish
+  g_thread_pool_free(snaps->pool, FALSE, TRUE);
+  g_print(MSG_SNAPSHOT_STATS, (guint64)g_atomic_int_get(&snaps->written),
+          snaps->dropped);
+  for (guint i = 0; i < snaps->n_frames; i++) {
+    if (snaps->frames[i] != NULL)
+      gst_buffer_unref(snaps->frames[i]);
+  }
+  g_free(snaps->frames);
+  g_hash_table_unref(snaps->taken);
+  g_mutex_clear(&snaps->lock);
+  g_free(snaps->directory);
+  g_free(snaps);
+}
+
+static GstPadProbeReturn on_snapshot_frame(GstPad* pad,
+                                           GstPadProbeInfo* info,
+                                           BcSnapshots* snaps) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (!GST_BUFFER_PTS_IS_VALID(buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock(&snaps->lock);
+  if (GST_VIDEO_INFO_FORMAT(&snaps->info) == GST_VIDEO_FORMAT_UNKNOWN) {
+    GstCaps* caps = gst_pad_get_current_caps(pad);
+    if (caps != NULL) {
+      gst_video_info_from_caps(&snaps->info, caps);
+      gst_caps_unref(caps);
+    }
+  }
+  // replace the oldest frame with this one
+  GstBuffer* old = snaps->frames[snaps->next];
+  snaps->frames[snaps->next] = gst_buffer_ref(buffer);
+  snaps->next = (snaps->next + 1) % snaps->n_frames;
+  g_mutex_unlock(&snaps->lock);
+
+  if (old != NULL)
+    gst_buffer_unref(old);
+  return GST_PAD_PROBE_OK;
+}
+
+// the held frame closest in pts to pts, within BC_SNAPSHOT_SLACK, with a ref
+static GstBuffer* find_frame(BcSnapshots* snaps,
+                             guint64 pts,
+                             GstVideoInfo* info) {
+  GstBuffer* best = NULL;
+  guint64 best_distance = BC_SNAPSHOT_SLACK * BC_NS_PER_MS + 1;
+  g_mutex_lock(&snaps->lock);
+  for (guint i = 0; i < snaps->n_frames; i++) {
+    GstBuffer* frame = snaps->frames[i];
+    if (frame == NULL)
+      continue;
+    guint64 frame_pts = GST_BUFFER_PTS(frame);
+    guint64 distance = frame_pts > pts ? frame_pts - pts : pts - frame_pts;
+    if (distance < best_distance) {
+      best = frame;
+      best_distance = distance;
+    }
+  }
+  if (best != NULL) {
+    gst_buffer_ref(best);
+    *info = snaps->info;
+  }
+  g_mutex_unlock(&snaps->lock);
+  return best;
+}
+
+// rate limit, per track or for all the untracked birds together
+static gboolean due(BcSnapshots* snaps, const BrbRecord* record) {
+  if (record->object_id == BRB_UNTRACKED) {
+    if (snaps->have_untracked &&
+        record->pts < snaps->untracked + snaps->interval &&
+        record->pts >= snaps->untracked) {
+      return FALSE;
+    }
+    snaps->untracked = record->pts;
+    snaps->have_untracked = TRUE;
+    return TRUE;
+  }
+
+  gpointer key = GUINT_TO_POINTER(record->object_id);
+  guint64* taken = g_hash_table_lookup(snaps->taken, key);
+  if (taken != NULL && record->pts < *taken + snaps->interval &&
+      record->pts >= *taken) {
+    return FALSE;
+  }
+  if (taken == NULL) {
+    // forget every track, now and then, rather than track when they end
+    if (g_hash_table_size(snaps->taken) >= BC_SNAPSHOT_STALE)
+      g_hash_table_remove_all(snaps->taken);
+    taken = g_new(guint64, 1);
+    g_hash_table_insert(snaps->taken, key, taken);
+  }
+  *taken = record->pts;
+  return TRUE;
+}
+
+// the box plus a margin, scaled to the frame, clamped and made even for I420
+static void crop_rect(BcSnapshots* snaps,
+                      const BrbRecord* record,
+                      BcSnapshotJob* job) {
+  gint frame_width = GST_VIDEO_INFO_WIDTH(&job->info);
+  gint frame_height = GST_VIDEO_INFO_HEIGHT(&job->info);
+  gfloat sx = (gfloat)frame_width / snaps->infer_width;
+  gfloat sy = (gfloat)frame_height / snaps->infer_height;
+  gfloat mx = record->width * BC_SNAPSHOT_MARGIN;
+  gfloat my = record->height * BC_SNAPSHOT_MARGIN;
+
+  gint left = (gint)((record->left - mx) * sx);
+  gint top = (gint)((record->top - my) * sy);
+  gint right = (gint)((record->left + record->width + mx) * sx);
+  gint bottom = (gint)((record->top + record->height + my) * sy);
+  left = CLAMP(left, 0, frame_width - BC_SNAPSHOT_MIN_SIZE) & ~1;
+  top = CLAMP(top, 0, frame_height - BC_SNAPSHOT_MIN_SIZE) & ~1;
+  right = CLAMP(right, left + BC_SNAPSHOT_MIN_SIZE, frame_width) & ~1;
+  bottom = CLAMP(bottom, top + BC_SNAPSHOT_MIN_SIZE, frame_height) & ~1;
+
+  job->left = left;
+  job->top = top;
+  job->width = right - left;
+  job->height = bottom - top;
+}
+
+void snapshot_request(BcSnapshots* snaps,
+                      const BrbRecord* record,
+                      guint index) {
+  if (!due(snaps, record))
+    return;
+  // bounded, a backlog of old birds helps nobody
+  if (g_thread_pool_unprocessed(snaps->pool) >= BC_SNAPSHOT_QUEUE) {
+    snaps->dropped++;
+    return;
+  }
+
+  BcSnapshotJob* job = g_new0(BcSnapshotJob, 1);
+  job->frame = find_frame(snaps, record->pts, &job->info);
+  if (job->frame == NULL ||
+      GST_VIDEO_INFO_FORMAT(&job->info) != GST_VIDEO_FORMAT_I420) {
+    // the frame was skipped by the leaky queue or is long gone
+    if (job->frame != NULL)
+      gst_buffer_unref(job->frame);
+    g_free(job);
+    snaps->dropped++;
+    return;
+  }
+  job->snaps = snaps;
+  crop_rect(snaps, record, job);
+  if (record->object_id == BRB_UNTRACKED) {
+    job->filename = g_strdup_printf("%s/%" G_GUINT64_FORMAT "_%u.jpg",
+                                    snaps->directory, record->pts, index);
+  } else {
+    job->filename = g_strdup_printf("%s/%" G_GUINT64_FORMAT "_t%u.jpg",
+                                    snaps->directory, record->pts,
+                                    record->object_id);
+  }
+  g_thread_pool_push(snaps->pool, job, NULL);
+}
+
+// copy the crop out of the frame into a new I420 buffer
+static GstBuffer* crop_frame(BcSnapshotJob* job, GstVideoInfo* crop_info) {
+  GstVideoFrame frame, crop;
+  if (!gst_video_frame_map(&frame, &job->info, job->frame, GST_MAP_READ))
+    return NULL;
+  gst_video_info_set_format(crop_info, GST_VIDEO_FORMAT_I420, job->width,
+                            job->height);
+  GstBuffer* buffer =
+      gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(crop_info), NULL);
+  if (!gst_video_frame_map(&crop, crop_info, buffer, GST_MAP_WRITE)) {
+    gst_video_frame_unmap(&frame);
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+
+  for (guint plane = 0; plane < 3; plane++) {
+    // the chroma planes are half size both ways
+    gint shift = plane == 0 ? 0 : 1;
+    gint src_stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, plane);
+    gint dst_stride = GST_VIDEO_FRAME_PLANE_STRIDE(&crop, plane);
+    const guint8* src = (const guint8*)GST_VIDEO_FRAME_PLANE_DATA(&frame,
+                                                                   plane) +
+                        (job->top >> shift) * src_stride + (job->left >> shift);
+    guint8* dst = GST_VIDEO_FRAME_PLANE_DATA(&crop, plane);
+    for (gint y = 0; y < job->height >> shift; y++)
+      memcpy(dst + y * dst_stride, src + y * src_stride, job->width >> shift);
+  }
+
+  gst_video_frame_unmap(&crop);
+  gst_video_frame_unmap(&frame);
+  return buffer;
+}
+
+// a worker: crop, encode and write one snapshot
+static void encode_snapshot(BcSnapshotJob* job, gpointer unused) {
+  GstVideoInfo crop_info;
+  GError* err = NULL;
+  GstBuffer* cropped = crop_frame(job, &crop_info);
+  gst_buffer_unref(job->frame);
+  if (cropped == NULL)
+    goto done;
+
+  GstCaps* caps = gst_video_info_to_caps(&crop_info);
+  GstSample* sample = gst_sample_new(cropped, caps, NULL, NULL);
+  gst_caps_unref(caps);
+  gst_buffer_unref(cropped);
+  GstCaps* jpeg_caps = gst_caps_new_empty_simple("image/jpeg");
+  GstSample* jpeg =
+      gst_video_convert_sample(sample, jpeg_caps, GST_SECOND, &err);
+  gst_caps_unref(jpeg_caps);
+  gst_sample_unref(sample);
+  if (jpeg == NULL)
+    goto done;
+
+  GstMapInfo map;
+  GstBuffer* buffer = gst_sample_get_buffer(jpeg);
+  if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+    if (g_file_set_contents(job->filename, (const gchar*)map.data, map.size,
+                            &err)) {
+      g_atomic_int_inc(&job->snaps->written);
+    }
+    gst_buffer_unmap(buffer, &map);
+  }
+  gst_sample_unref(jpeg);
+
+done:
+  if (err != NULL) {
+    g_printerr(ERR_SNAPSHOT_WRITE, job->filename, err->message);
+    g_error_free(err);
+  }
+  g_free(job->filename);
+  g_free(job);
+}
@@ -0,0 +1,271 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "throttle.h"
+
+#include <string.h>
+
+typedef struct {
+  guint64 pts;
+  gint64 entered;  // monotonic time it entered infer_queue
+} BcInflight;
+
+// consecutive skipped frames
+typedef struct {
+  guint64 first;  // pts
+  guint64 last;   // pts
+  guint32 count;
+  gint64 started;  // monotonic
+} BcSkipRun;
+
+// one reason's runs, oldest first
+typedef struct {
+  BcSkipRun runs[BC_THROTTLE_RUNS];
+  guint n_runs;
+  gboolean open;  // the newest run is still growing
+} BcSkipLog;
+
+struct _BcThrottle {
+  GstElement* infer_queue;
+  BcWriter* writer;
+  guint source_id;
+  gint64 budget;  // us
+
+  // the streaming threads on both sides of infer_queue and the writer
+  // thread, under lock
+  GMutex lock;
+  BcInflight inflight[BC_THROTTLE_INFLIGHT];  // ring
+  guint next_inflight;
+  BcSkipLog skips[BC_THROTTLE_REASONS];
+
+  // the infer_queue sink side only
+  guint64 frames;
+  guint64 decimated;
+  guint64 over_budget;
+
+  // under lock
+  guint64 unrecorded;  // skips that found every run taken
+
+  // the inference side only
+  gint decimation;  // atomic, infer 1 in this many
+  gdouble latency;  // us, moving average, 0 until there is one
+  gint64 adjusted;  // monotonic time the decimation last changed
+};
+
+static guint pull_runs(BcThrottle* throttle, BrbRecord* records, guint max);
+
+void throttle_skip(BcThrottle* throttle, guint64 pts, guint8 reason) {
+  g_mutex_lock(&throttle->lock);
+  BcSkipLog* log = &throttle->skips[reason];
+  if (log->open) {
+    BcSkipRun* run = &log->runs[log->n_runs - 1];
+    run->first = MIN(run->first, pts);
+    run->last = MAX(run->last, pts);
+    run->count++;
+  } else if (log->n_runs < BC_THROTTLE_RUNS) {
+    log->runs[log->n_runs++] =
+        (BcSkipRun){pts, pts, 1, g_get_monotonic_time()};
+    log->open = TRUE;
+  } else {
+    // growing the newest run would claim the frames inferred since
+    throttle->unrecorded++;
+  }
+  g_mutex_unlock(&throttle->lock);
+}
+
+void throttle_pass(BcThrottle* throttle, guint8 reason) {
+  g_mutex_lock(&throttle->lock);
+  throttle->skips[reason].open = FALSE;
+  g_mutex_unlock(&throttle->lock);
+}
+
+static GstPadProbeReturn on_infer_enter(GstPad* pad,
+                                        GstPadProbeInfo* info,
+                                        BcThrottle* throttle) {
+  // a frame without a pts is throttled like any other, but can't be timed
+  // or be part of a run
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gboolean timed = GST_BUFFER_PTS_IS_VALID(buffer);
+  guint64 pts = GST_BUFFER_PTS(buffer);
+
+  // already a budget's worth waiting, this one would only be later still
+  guint64 queued = 0;
+  g_object_get(G_OBJECT(throttle->infer_queue), "current-level-time", &queued,
+               NULL);
+  if (queued / GST_USECOND > (guint64)throttle->budget) {
+    throttle->over_budget++;
+    if (timed)
+      throttle_skip(throttle, pts, BRB_SKIP_THROTTLE);
+    return GST_PAD_PROBE_DROP;
+  }
+  guint decimation = (guint)g_atomic_int_get(&throttle->decimation);
+  if (throttle->frames++ % decimation != 0) {
+    throttle->decimated++;
+    if (timed)
+      throttle_skip(throttle, pts, BRB_SKIP_THROTTLE);
+    return GST_PAD_PROBE_DROP;
+  }
+  if (!timed)
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock(&throttle->lock);
+  throttle->skips[BRB_SKIP_THROTTLE].open = FALSE;
+  BcInflight* frame = &throttle->inflight[throttle->next_inflight];
+  frame->pts = pts;
+  frame->entered = g_get_monotonic_time();
+  throttle->next_inflight =
+      (throttle->next_inflight + 1) % BC_THROTTLE_INFLIGHT;
+  g_mutex_unlock(&throttle->lock);
+  return GST_PAD_PROBE_OK;
+}
+
+BcThrottle* throttle_new(GstElement* infer_queue,
+                         BcWriter* writer,
+                         guint source_id,
+                         guint budget_ms) {
+  GstPad* sink_pad = gst_element_get_static_pad(infer_queue, "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_THROTTLE_PAD);
+    return NULL;
+  }
+
+  BcThrottle* throttle = g_new0(BcThrottle, 1);
+  throttle->infer_queue = infer_queue;
+  throttle->writer = writer;
+  throttle->source_id = source_id;
+  throttle->budget = (gint64)budget_ms * 1000;
+  throttle->decimation = 1;
+  g_mutex_init(&throttle->lock);
+  if (budget_ms > 0) {
+    // frames over budget are skipped before they get in, so the queue only
+    // fills (and leaks) if inference stops altogether
+    guint64 max_time = 0;
+    g_object_get(G_OBJECT(infer_queue), "max-size-time", &max_time, NULL);
+    g_object_set(G_OBJECT(infer_queue), "max-size-time",
+                 MAX(max_time, (guint64)budget_ms * 2 * GST_MSECOND), NULL);
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      (GstPadProbeCallback)on_infer_enter, throttle, NULL);
+  }
+  gst_object_unref(sink_pad);
+  writer_set_pull(writer, (BcWriterPull)pull_runs, throttle);
+  return throttle;
+}
+void throttle_done(BcThrottle* throttle, guint64 pts) {
+  gint64 now = g_get_monotonic_time();
+  gint64 entered = 0;
+  g_mutex_lock(&throttle->lock);
+  for (guint i = 0; i < BC_THROTTLE_INFLIGHT; i++) {
+    if (throttle->inflight[i].pts == pts && throttle->inflight[i].entered) {
+      entered = throttle->inflight[i].entered;
+      throttle->inflight[i].entered = 0;
+      break;
+    }
+  }
+  g_mutex_unlock(&throttle->lock);
+  if (entered == 0)
+    return;  // from before a restart, or timed out of the ring
+
+  gdouble latency = (gdouble)(now - entered);
+  throttle->latency =
+      throttle->latency == 0
+          ? latency
+          : throttle->latency +
+                BC_THROTTLE_SMOOTHING * (latency - throttle->latency);
+
+  // one step at a time, and not more often than the average can follow
+  if (now - throttle->adjusted < BC_THROTTLE_ADJUST_MS * 1000)
+    return;
+  gint decimation = g_atomic_int_get(&throttle->decimation);
+  if (throttle->latency > throttle->budget &&
+      decimation < BC_THROTTLE_MAX_DECIMATION) {
+    g_atomic_int_set(&throttle->decimation, decimation + 1);
+    throttle->adjusted = now;
+  } else if (throttle->latency < throttle->budget / 2 && decimation > 1) {
+    g_atomic_int_set(&throttle->decimation, decimation - 1);
+    throttle->adjusted = now;
+  }
+}
+
+// a run as a record (see BRB_FRAME_SKIPPED)
+static void run_record(BcThrottle* throttle,
+                       const BcSkipRun* run,
+                       guint8 reason,
+                       BrbRecord* record) {
+  memset(record, 0, sizeof(*record));
+  record->pts = run->first;
+  record->frame_num = -1;  // never numbered, it didn't reach the muxer
+  record->object_id = run->count;
+  record->source_id = throttle->source_id;
+  record->class_id = reason;
+  record->flags = BRB_FRAME_SKIPPED;
+  brb_set_skip_last(record, run->last);
+}
+
+// take at most max runs as records, oldest first, leaving one that's still
+// growing unless it's been going a while (or everything is wanted, max_age
+// 0). Under lock.
+static guint take_runs(BcThrottle* throttle,
+                       BrbRecord* records,
+                       guint max,
+                       gint64 max_age) {
+  gint64 now = g_get_monotonic_time();
+  guint n = 0;
+  for (guint reason = 0; reason < BC_THROTTLE_REASONS; reason++) {
+    BcSkipLog* log = &throttle->skips[reason];
+    guint taken = 0;
+    for (; taken < log->n_runs && n < max; taken++) {
+      const BcSkipRun* run = &log->runs[taken];
+      if (log->open && taken == log->n_runs - 1 && max_age > 0 &&
+          now - run->started < max_age) {
+        break;
+      }
+      run_record(throttle, run, reason, &records[n++]);
+    }
+    if (taken == log->n_runs)
+      log->open = FALSE;  // the next skip starts a new one
+    log->n_runs -= taken;
+    memmove(log->runs, log->runs + taken, log->n_runs * sizeof(BcSkipRun));
+  }
+  return n;
+}
+
+// on the writer thread (see writer_set_pull)
+static guint pull_runs(BcThrottle* throttle, BrbRecord* records, guint max) {
+  g_mutex_lock(&throttle->lock);
+  guint n = take_runs(throttle, records, max, BC_THROTTLE_RUN_MS * 1000);
+  g_mutex_unlock(&throttle->lock);
+  return n;
+}
+
+void throttle_free(BcThrottle* throttle) {
+  // the pipeline is gone, so this is the only producer the writer has left
+  writer_set_pull(throttle->writer, NULL, NULL);
+  BrbRecord records[BC_THROTTLE_REASONS * BC_THROTTLE_RUNS];
+  guint n = take_runs(throttle, records, G_N_ELEMENTS(records), 0);
+  for (guint i = 0; i < n; i++)
+    writer_push(throttle->writer, &records[i]);
+  g_print(MSG_THROTTLE_STATS, throttle->decimated + throttle->over_budget,
+          throttle->decimated, throttle->over_budget,
+          throttle->latency / 1000, (guint)throttle->decimation);
+  if (throttle->unrecorded > 0)
+    g_print(MSG_THROTTLE_UNRECORDED, throttle->unrecorded);
+  g_mutex_clear(&throttle->lock);
+  g_free(throttle);
+}
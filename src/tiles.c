@@ -0,0 +1,245 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "tiles.h"
+
+#include "brb.h"       // BRB_CONFIDENCE_SCALE
+#include "pipeline.h"  // BC_MAX_SOURCES
+
+typedef struct {
+  const BcConfig* config;
+  BcRegion views[BC_TILES_MAX_VIEWS];
+  guint n_views;
+  guint n_sources;
+  GPtrArray* objects;  // a frame's boxes, reused so a batch allocates nothing
+} TileMerger;
+
+static GstPadProbeReturn on_merge_batch(GstPad* pad,
+                                        GstPadProbeInfo* info,
+                                        TileMerger* merger);
+static void free_merger(TileMerger* merger);
+
+// n tiles across size, each overlapping its neighbours by overlap percent of
+// the step between them, the ones at the edges pushed back inside
+static void split(gint size, gint n, gint overlap, gint* starts, gint* length) {
+  gint step = size / n;
+  *length = MIN(size, step + step * overlap / 100) & ~1;
+  for (gint i = 0; i < n; i++)
+    starts[i] = CLAMP(i * step - (*length - step) / 2, 0, size - *length) & ~1;
+}
+
+guint tiles_layout(const BcConfig* config, BcRegion* views) {
+  views[0] = (BcRegion){0, 0, config->width, config->height};
+  guint n = 1;
+
+  if (config->n_regions > 0) {
+    for (gint i = 0; i < config->n_regions; i++) {
+      const BcRegion* region = &config->regions[i];
+      views[n++] = (BcRegion){region->left & ~1, region->top & ~1,
+                              region->width & ~1, region->height & ~1};
+    }
+    return n;
+  }
+  if (config->tile_columns * config->tile_rows == 1)
+    return n;
+
+  gint lefts[BC_CONFIG_MAX_TILES];
+  gint tops[BC_CONFIG_MAX_TILES];
+  gint width, height;
+  split(config->width, config->tile_columns, config->tile_overlap, lefts,
+        &width);
+  split(config->height, config->tile_rows, config->tile_overlap, tops,
+        &height);
+  for (gint row = 0; row < config->tile_rows; row++) {
+    for (gint column = 0; column < config->tile_columns; column++)
+      views[n++] = (BcRegion){lefts[column], tops[row], width, height};
+  }
+  return n;
+}
+
+void tiles_to_frame(const BcConfig* config,
+                    const BcRegion* view,
+                    NvOSD_RectParams* rect) {
+  gfloat x_scale = (gfloat)view->width / config->width;
+  gfloat y_scale = (gfloat)view->height / config->height;
+  rect->left = (gfloat)view->left * config->infer_width / config->width +
+               rect->left * x_scale;
+  rect->top = (gfloat)view->top * config->infer_height / config->height +
+              rect->top * y_scale;
+  rect->width *= x_scale;
+  rect->height *= y_scale;
+}
+
+gboolean attach_tile_merger(GstElement* elem,
+                            const BcConfig* config,
+                            guint n_sources) {
+  GstPad* src_pad = gst_element_get_static_pad(elem, "src");
+  if (src_pad == NULL) {
+    GST_ERROR(ERR_TILES_PAD);
+    return FALSE;
+  }
+  // the probe owns the merger and frees it when removed
+  TileMerger* merger = g_new0(TileMerger, 1);
+  merger->config = config;
+  merger->n_views = tiles_layout(config, merger->views);
+  merger->n_sources = n_sources;
+  merger->objects = g_ptr_array_new();
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_merge_batch, merger,
+                    (GDestroyNotify)free_merger);
+  gst_object_unref(src_pad);
+  return TRUE;
+}
+
+static void free_merger(TileMerger* merger) {
+  g_ptr_array_free(merger->objects, TRUE);
+  g_free(merger);
+}
+
+// most confident first
+static gint by_confidence(gconstpointer a, gconstpointer b) {
+  const NvDsObjectMeta* x = *(NvDsObjectMeta* const*)a;
+  const NvDsObjectMeta* y = *(NvDsObjectMeta* const*)b;
+  return (x->confidence < y->confidence) - (x->confidence > y->confidence);
+}
+
+// how much of the smaller box is inside the other, in BRB_CONFIDENCE_SCALE
+// units. A bird cut off at the edge of a tile is all inside the box of the
+// whole bird, but if it's only a sliver their intersection over union is low.
+static gint overlap(const NvOSD_RectParams* a, const NvOSD_RectParams* b) {
+  gfloat width =
+      MIN(a->left + a->width, b->left + b->width) - MAX(a->left, b->left);
+  gfloat height =
+      MIN(a->top + a->height, b->top + b->height) - MAX(a->top, b->top);
+  gfloat smaller = MIN(a->width * a->height, b->width * b->height);
+  if (width <= 0.0f || height <= 0.0f || smaller <= 0.0f)
+    return 0;
+  return (gint)(width * height / smaller * BRB_CONFIDENCE_SCALE);
+}
+
+// grow a to cover b as well
+static void grow(NvOSD_RectParams* a, const NvOSD_RectParams* b) {
+  gfloat right = MAX(a->left + a->width, b->left + b->width);
+  gfloat bottom = MAX(a->top + a->height, b->top + b->height);
+  a->left = MIN(a->left, b->left);
+  a->top = MIN(a->top, b->top);
+  a->width = right - a->left;
+  a->height = bottom - a->top;
+}
+
+// greedy, most confident first: a box of the same class that overlaps one
+// that's kept is the same bird seen from another view, so it's dropped and
+// the kept box grows to cover it (the other may have seen more of the bird)
+static void merge_boxes(TileMerger* merger, NvDsFrameMeta* frame) {
+  GPtrArray* objects = merger->objects;
+  g_ptr_array_set_size(objects, 0);
+  for (NvDsMetaList* l = frame->obj_meta_list; l != NULL; l = l->next)
+    g_ptr_array_add(objects, l->data);
+  g_ptr_array_sort(objects, by_confidence);
+
+  for (guint i = 0; i < objects->len; i++) {
+    NvDsObjectMeta* kept = g_ptr_array_index(objects, i);
+    if (kept == NULL)
+      continue;
+    for (guint j = i + 1; j < objects->len; j++) {
+      NvDsObjectMeta* other = g_ptr_array_index(objects, j);
+      if (other == NULL || other->class_id != kept->class_id ||
+          overlap(&kept->rect_params, &other->rect_params) <
+              merger->config->tile_nms) {
+        continue;
+      }
+      grow(&kept->rect_params, &other->rect_params);
+      nvds_remove_obj_meta_from_frame(frame, other);
+      objects->pdata[j] = NULL;
+    }
+  }
+}
+
+// a copy of object in frame, its box moved out of view. The original goes
+// back to the pool with the frame it was in.
+static void move_object(NvDsBatchMeta* batch,
+                        NvDsFrameMeta* frame,
+                        NvDsObjectMeta* object,
+                        const TileMerger* merger,
+                        const BcRegion* view) {
+  NvDsObjectMeta* copy = nvds_acquire_obj_meta_from_pool(batch);
+  copy->unique_component_id = object->unique_component_id;
+  copy->class_id = object->class_id;
+  copy->object_id = object->object_id;
+  copy->confidence = object->confidence;
+  copy->rect_params = object->rect_params;
+  g_strlcpy(copy->obj_label, object->obj_label, sizeof(copy->obj_label));
+  tiles_to_frame(merger->config, view, &copy->rect_params);
+  nvds_add_obj_meta_to_frame(frame, copy, NULL);
+}
+
+static GstPadProbeReturn on_merge_batch(GstPad* pad,
+                                        GstPadProbeInfo* info,
+                                        TileMerger* merger) {
+  NvDsBatchMeta* batch =
+      gst_buffer_get_nvds_batch_meta(GST_PAD_PROBE_INFO_BUFFER(info));
+  if (batch == NULL)
+    return GST_PAD_PROBE_OK;
+  const guint n_views = merger->n_views;
+
+  // every source's boxes go to its whole frame. nvstreammux may push part of
+  // a batch, and a tile's frame can't stand in for a missing whole frame (its
+  // surface is the tile's, which the tracker, classifier and snapshots would
+  // crop from), so the tiles of a source without one are dropped with it.
+  NvDsFrameMeta* homes[BC_MAX_SOURCES] = {NULL};
+  for (NvDsMetaList* l = batch->frame_meta_list; l != NULL; l = l->next) {
+    NvDsFrameMeta* frame = (NvDsFrameMeta*)l->data;
+    guint source = frame->source_id / n_views;
+    if (source < merger->n_sources && frame->source_id % n_views == 0)
+      homes[source] = frame;
+  }
+
+  // the rest of the views are emptied into it, and leave the batch
+  NvDsFrameMeta* merged[BC_MAX_SOURCES * BC_TILES_MAX_VIEWS];
+  guint n_merged = 0;
+  for (NvDsMetaList* l = batch->frame_meta_list; l != NULL; l = l->next) {
+    NvDsFrameMeta* frame = (NvDsFrameMeta*)l->data;
+    guint source = frame->source_id / n_views;
+    if (source >= merger->n_sources || frame == homes[source] ||
+        n_merged == G_N_ELEMENTS(merged)) {
+      continue;
+    }
+    const BcRegion* view = &merger->views[frame->source_id % n_views];
+    for (NvDsMetaList* o = frame->obj_meta_list; o != NULL; o = o->next) {
+      if (homes[source] != NULL) {
+        move_object(batch, homes[source], (NvDsObjectMeta*)o->data, merger,
+                    view);
+      }
+    }
+    merged[n_merged++] = frame;
+  }
+  for (guint i = 0; i < n_merged; i++)
+    nvds_remove_frame_meta_from_batch(batch, merged[i]);
+
+  // and on_batch sees one frame per source, as without tiles
+  for (guint i = 0; i < merger->n_sources; i++) {
+    if (homes[i] == NULL)
+      continue;
+    homes[i]->source_id = i;
+    homes[i]->pad_index = i;
+    merge_boxes(merger, homes[i]);
+  }
+  return GST_PAD_PROBE_OK;
+}
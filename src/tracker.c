@@ -0,0 +1,133 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "tracker.h"
+
+typedef struct {
+  guint64 id;
+  NvOSD_RectParams rect;  // last seen
+  GstClockTime seen;
+  gboolean matched;  // in the current frame
+} IouTrack;
+
+typedef struct {
+  GArray* tracks[BC_MAX_SOURCES];  // IouTrack, by source_id
+  guint64 next_id;
+} IouTracker;
+
+static GstPadProbeReturn on_tracker_buffer(GstPad* pad,
+                                           GstPadProbeInfo* info,
+                                           IouTracker* tracker);
+static void free_tracker(IouTracker* tracker);
+
+gboolean attach_iou_tracker(GstElement* elem) {
+  GstPad* src_pad = gst_element_get_static_pad(elem, "src");
+  if (src_pad == NULL) {
+    GST_ERROR(ERR_TRACKER_PAD);
+    return FALSE;
+  }
+  // the probe owns the tracker state and frees it when removed
+  IouTracker* tracker = g_new0(IouTracker, 1);
+  for (guint i = 0; i < BC_MAX_SOURCES; i++)
+    tracker->tracks[i] = g_array_new(FALSE, FALSE, sizeof(IouTrack));
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_tracker_buffer, tracker,
+                    (GDestroyNotify)free_tracker);
+  gst_object_unref(src_pad);
+  return TRUE;
+}
+
+static void free_tracker(IouTracker* tracker) {
+  for (guint i = 0; i < BC_MAX_SOURCES; i++)
+    g_array_free(tracker->tracks[i], TRUE);
+  g_free(tracker);
+}
+
+static gfloat rect_iou(const NvOSD_RectParams* a, const NvOSD_RectParams* b) {
+  gfloat left = MAX(a->left, b->left);
+  gfloat top = MAX(a->top, b->top);
+  gfloat right = MIN(a->left + a->width, b->left + b->width);
+  gfloat bottom = MIN(a->top + a->height, b->top + b->height);
+  if (right <= left || bottom <= top)
+    return 0.0f;
+  gfloat overlap = (right - left) * (bottom - top);
+  return overlap / (a->width * a->height + b->width * b->height - overlap);
+}
+
+static void track_frame(IouTracker* tracker, NvDsFrameMeta* frame) {
+  GArray* tracks = tracker->tracks[frame->source_id];
+  GstClockTime pts = frame->buf_pts;
+
+  // forget what hasn't been seen for a while
+  for (guint i = tracks->len; i-- > 0;) {
+    IouTrack* track = &g_array_index(tracks, IouTrack, i);
+    if (pts > track->seen + BC_TRACKER_MAX_AGE * GST_SECOND) {
+      g_array_remove_index_fast(tracks, i);
+    } else {
+      track->matched = FALSE;
+    }
+  }
+
+  // greedy: each object takes the best unmatched track
+  for (NvDsMetaList* objects = frame->obj_meta_list; objects != NULL;
+       objects = objects->next) {
+    NvDsObjectMeta* object = (NvDsObjectMeta*)objects->data;
+    IouTrack* best = NULL;
+    gfloat best_iou = BC_TRACKER_IOU;
+    for (guint i = 0; i < tracks->len; i++) {
+      IouTrack* track = &g_array_index(tracks, IouTrack, i);
+      if (track->matched)
+        continue;
+      gfloat iou = rect_iou(&track->rect, &object->rect_params);
+      if (iou >= best_iou) {
+        best = track;
+        best_iou = iou;
+      }
+    }
+    if (best == NULL) {
+      IouTrack track = {tracker->next_id++};
+      g_array_append_val(tracks, track);
+      best = &g_array_index(tracks, IouTrack, tracks->len - 1);
+    }
+    best->rect = object->rect_params;
+    best->seen = pts;
+    best->matched = TRUE;
+    object->object_id = best->id;
+  }
+}
+
+static GstPadProbeReturn on_tracker_buffer(GstPad* pad,
+                                           GstPadProbeInfo* info,
+                                           IouTracker* tracker) {
+  NvDsBatchMeta* batch =
+      gst_buffer_get_nvds_batch_meta(GST_PAD_PROBE_INFO_BUFFER(info));
+  if (batch == NULL)
+    return GST_PAD_PROBE_OK;
+
+  for (NvDsMetaList* frames = batch->frame_meta_list; frames != NULL;
+       frames = frames->next) {
+    NvDsFrameMeta* frame = (NvDsFrameMeta*)frames->data;
+    if (frame->source_id < BC_MAX_SOURCES &&
+        GST_CLOCK_TIME_IS_VALID(frame->buf_pts)) {
+      track_frame(tracker, frame);
+    }
+  }
+  return GST_PAD_PROBE_OK;
+}
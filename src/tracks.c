@@ -0,0 +1,138 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "tracks.h"
+
+#define BC_NS_PER_SECOND G_GUINT64_CONSTANT(1000000000)
+
+typedef struct {
+  guint64 started;    // pts of its start record
+  BrbRecord seen;     // the last time it was seen
+  BrbRecord written;  // the last record written for it
+} BcTrack;
+
+struct _BcTracks {
+  BcWriter* writer;
+  GHashTable* open;  // object_id -> BcTrack
+  gint rotations;    // the writer's, as of the last split
+};
+
+BcTracks* tracks_new(BcWriter* writer) {
+  BcTracks* tracks = g_new0(BcTracks, 1);
+  tracks->writer = writer;
+  tracks->open =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  return tracks;
+}
+
+static gfloat box_iou(const BrbRecord* a, const BrbRecord* b) {
+  gint left = MAX(a->left, b->left);
+  gint top = MAX(a->top, b->top);
+  gint right = MIN(a->left + a->width, b->left + b->width);
+  gint bottom = MIN(a->top + a->height, b->top + b->height);
+  if (right <= left || bottom <= top)
+    return 0.0f;
+  gfloat overlap = (gfloat)(right - left) * (bottom - top);
+  gfloat total = (gfloat)a->width * a->height + (gfloat)b->width * b->height;
+  return overlap / (total - overlap);
+}
+
+static void write_track(BcTracks* tracks,
+                        BcTrack* track,
+                        const BrbRecord* record,
+                        guint8 flags) {
+  track->written = *record;
+  track->written.flags = flags;
+  // a full ring is counted as dropped by the writer (or waited on,
+  // reprocessing)
+  writer_push(tracks->writer, &track->written);
+}
+
+// write the end record, and have the hash table remove the track
+static gboolean end_track(gpointer key, BcTrack* track, BcTracks* tracks) {
+  write_track(tracks, track, &track->seen, BRB_TRACK_END);
+  return TRUE;
+}
+
+// end a track started before the boundary, in the file it started in: at the
+// last time it was seen, or just before the boundary if that's after it
+static gboolean end_if_before(gpointer key, BcTrack* track, gpointer* args) {
+  BcTracks* tracks = args[0];
+  guint64 boundary = *(guint64*)args[1];
+  if (track->started >= boundary)
+    return FALSE;
+  if (track->seen.pts >= boundary)
+    track->seen.pts = boundary - 1;
+  return end_track(key, track, tracks);
+}
+
+// a new metadata file has begun, so close the tracks in the last one. A bird
+// still there starts a new track in the new file.
+static void split_tracks(BcTracks* tracks) {
+  guint64 boundary;
+  if (!writer_rotated(tracks->writer, &tracks->rotations, &boundary))
+    return;
+  gpointer args[] = {tracks, &boundary};
+  g_hash_table_foreach_remove(tracks->open, (GHRFunc)end_if_before, args);
+}
+
+void tracks_update(BcTracks* tracks, const BrbRecord* record) {
+  split_tracks(tracks);
+  gpointer key = GUINT_TO_POINTER(record->object_id);
+  BcTrack* track = g_hash_table_lookup(tracks->open, key);
+  if (track == NULL) {
+    track = g_new(BcTrack, 1);
+    track->started = record->pts;
+    track->seen = *record;
+    g_hash_table_insert(tracks->open, key, track);
+    write_track(tracks, track, record, BRB_TRACK_START);
+    return;
+  }
+
+  track->seen = *record;
+  if (box_iou(&track->written, record) < BC_TRACK_KEY_IOU ||
+      record->species != track->written.species ||
+      record->pts >=
+          track->written.pts + BC_TRACK_KEY_INTERVAL * BC_NS_PER_SECOND) {
+    write_track(tracks, track, record, BRB_TRACK_KEY);
+  }
+}
+
+static gboolean end_if_expired(gpointer key,
+                               BcTrack* track,
+                               gpointer* args) {
+  BcTracks* tracks = args[0];
+  guint64 pts = *(guint64*)args[1];
+  if (pts < track->seen.pts + BRB_TRACK_TIMEOUT * BC_NS_PER_SECOND)
+    return FALSE;
+  return end_track(key, track, tracks);
+}
+
+void tracks_expire(BcTracks* tracks, guint64 pts) {
+  split_tracks(tracks);
+  gpointer args[] = {tracks, &pts};
+  g_hash_table_foreach_remove(tracks->open, (GHRFunc)end_if_expired, args);
+}
+
+void tracks_free(BcTracks* tracks) {
+  g_hash_table_foreach_remove(tracks->open, (GHRFunc)end_track, tracks);
+  g_hash_table_unref(tracks->open);
+  g_free(tracks);
+}
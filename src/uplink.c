@@ -0,0 +1,511 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "uplink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+// a gzipped batch of JSON lines, in memory or spooled to a file
+typedef struct {
+  GBytes* data;  // NULL once spooled
+  gchar* path;   // NULL until spooled
+  gsize size;
+  guint records;
+} BcUplinkBatch;
+
+struct _BcUplink {
+  const BcUplinkBackend* backend;
+  gpointer state;  // the backend's
+  gchar* url;
+
+  // the feed, only read by the collector thread
+  const BrfHeader* ring;
+  guint32 cursor;
+  GString* batch;  // JSON lines not yet sealed into a batch
+  guint batch_records;
+  gint64 batch_started;  // monotonic
+
+  // shared by both threads, under lock
+  GMutex lock;
+  GCond wake;
+  gboolean running;
+  GQueue memory;  // BcUplinkBatch*, oldest first
+  gsize memory_bytes;
+  GQueue spool;  // BcUplinkBatch*, oldest first, all older than memory
+  guint64 spool_bytes;
+  guint64 spool_max;
+  gchar* spool_dir;
+  guint spool_seq;
+
+  // counters, each has a single writer (see BcUplinkStats)
+  BcUplinkStats stats;
+
+  GThread* collector;
+  GThread* sender;
+};
+
+// http://HOST[:PORT]/PATH
+typedef struct {
+  gchar* url;
+  gchar* host;  // as in the url, for the Host header
+  gchar* path;
+} BcHttpState;
+
+static gboolean http_open(const gchar* url, gpointer* state, GError** err) {
+  GSocketConnectable* address = g_network_address_parse_uri(url, 80, err);
+  if (address == NULL)
+    return FALSE;
+  g_object_unref(address);
+  const gchar* authority = strstr(url, "://");
+  if (authority == NULL)
+    return FALSE;
+  authority += 3;
+
+  BcHttpState* http = g_new0(BcHttpState, 1);
+  const gchar* path = strchr(authority, '/');
+  http->url = g_strdup(url);
+  http->host = path ? g_strndup(authority, path - authority)
+                    : g_strdup(authority);
+  http->path = g_strdup(path ? path : "/");
+  *state = http;
+  return TRUE;
+}
+
+static gboolean http_deliver(BcHttpState* http, GBytes* batch, GError** err) {
+  GSocketClient* client = g_socket_client_new();
+  g_socket_client_set_timeout(client, BC_UPLINK_TIMEOUT);
+  GSocketConnection* connection =
+      g_socket_client_connect_to_uri(client, http->url, 80, NULL, err);
+  g_object_unref(client);
+  if (connection == NULL)
+    return FALSE;
+
+  gsize size;
+  gconstpointer data = g_bytes_get_data(batch, &size);
+  gchar* head = g_strdup_printf(HTTP_POST, http->path, http->host, size);
+  GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+  gboolean ok =
+      g_output_stream_write_all(out, head, strlen(head), NULL, NULL, err) &&
+      g_output_stream_write_all(out, data, size, NULL, NULL, err);
+  g_free(head);
+
+  // the status line is all we need from the response
+  if (ok) {
+    gchar status[64] = {0};
+    GInputStream* in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    gssize n = g_input_stream_read(in, status, sizeof(status) - 1, NULL, err);
+    guint code = 0;
+    if (n < 0) {
+      ok = FALSE;
+    } else if (sscanf(status, "HTTP/%*s %u", &code) != 1 || code / 100 != 2) {
+      gint line = (gint)strcspn(status, "\r\n");
+      g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED, ERR_UPLINK_STATUS,
+                  http->host, line, status);
+      ok = FALSE;
+    }
+  }
+  g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+  g_object_unref(connection);
+  return ok;
+}
+
+static void http_close(BcHttpState* http) {
+  g_free(http->url);
+  g_free(http->host);
+  g_free(http->path);
+  g_free(http);
+}
+
+// file://PATH, gzip members concatenate into a valid gzip file
+static gboolean file_open(const gchar* url, gpointer* state, GError** err) {
+  *state = g_strdup(url + strlen("file://"));
+  return TRUE;
+}
+
+static gboolean file_deliver(gchar* path, GBytes* batch, GError** err) {
+  gsize size;
+  const gchar* data = g_bytes_get_data(batch, &size);
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  while (fd >= 0 && size > 0) {
+    gssize n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    data += n;
+    size -= n;
+  }
+  if (fd < 0 || size > 0) {
+    g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errno), "%s: %s", path,
+                g_strerror(errno));
+  }
+  if (fd >= 0)
+    close(fd);
+  return size == 0;
+}
+
+static const BcUplinkBackend BC_UPLINK_BACKENDS[] = {
+    {
+        "http",
+        http_open,
+        (gboolean(*)(gpointer, GBytes*, GError**))http_deliver,
+        (void (*)(gpointer))http_close,
+    },
+    {
+        "file",
+        file_open,
+        (gboolean(*)(gpointer, GBytes*, GError**))file_deliver,
+        g_free,
+    },
+};
+
+static void free_batch(BcUplinkBatch* batch) {
+  if (batch->data != NULL)
+    g_bytes_unref(batch->data);
+  g_free(batch->path);
+  g_free(batch);
+}
+
+static GBytes* compress(const gchar* data, gsize size) {
+  GZlibCompressor* gzip =
+      g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  GOutputStream* memory = g_memory_output_stream_new_resizable();
+  GOutputStream* out =
+      g_converter_output_stream_new(memory, G_CONVERTER(gzip));
+  // memory can't fail
+  g_output_stream_write_all(out, data, size, NULL, NULL, NULL);
+  g_output_stream_close(out, NULL, NULL);  // and memory, with it
+  GBytes* bytes =
+      g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(memory));
+  g_object_unref(out);
+  g_object_unref(memory);
+  g_object_unref(gzip);
+  return bytes;
+}
+
+// move a batch from memory to the spool, dropping the oldest spooled batches
+// if there isn't room. With the lock held.
+static void spool_batch(BcUplink* uplink, BcUplinkBatch* batch) {
+  while (uplink->spool_bytes + batch->size > uplink->spool_max &&
+         !g_queue_is_empty(&uplink->spool)) {
+    BcUplinkBatch* oldest = g_queue_pop_head(&uplink->spool);
+    g_unlink(oldest->path);
+    uplink->spool_bytes -= oldest->size;
+    uplink->stats.dropped++;
+    free_batch(oldest);
+  }
+  // named so they sort oldest first, with the record count for the stats
+  batch->path = g_strdup_printf(
+      "%s/%020" G_GINT64_FORMAT "-%010u-%u" BC_UPLINK_SPOOL_EXT,
+      uplink->spool_dir, g_get_real_time(), uplink->spool_seq++,
+      batch->records);
+  gsize size;
+  gconstpointer data = g_bytes_get_data(batch->data, &size);
+  if (batch->size > uplink->spool_max ||
+      !g_file_set_contents(batch->path, data, size, NULL)) {
+    uplink->stats.dropped++;
+    free_batch(batch);
+    return;
+  }
+  g_bytes_unref(batch->data);
+  batch->data = NULL;
+  g_queue_push_tail(&uplink->spool, batch);
+  uplink->spool_bytes += batch->size;
+  uplink->stats.spooled++;
+}
+
+// compress the pending records into a batch and queue it for the sender
+static void seal_batch(BcUplink* uplink) {
+  if (uplink->batch_records == 0)
+    return;
+  BcUplinkBatch* batch = g_new0(BcUplinkBatch, 1);
+  batch->data = compress(uplink->batch->str, uplink->batch->len);
+  batch->size = g_bytes_get_size(batch->data);
+  batch->records = uplink->batch_records;
+  g_string_truncate(uplink->batch, 0);
+  uplink->batch_records = 0;
+
+  g_mutex_lock(&uplink->lock);
+  g_queue_push_tail(&uplink->memory, batch);
+  uplink->memory_bytes += batch->size;
+  // the collector is down (or slow), make room for the next batch
+  while (uplink->memory_bytes > BC_UPLINK_MEMORY) {
+    BcUplinkBatch* oldest = g_queue_pop_head(&uplink->memory);
+    uplink->memory_bytes -= oldest->size;
+    spool_batch(uplink, oldest);
+  }
+  g_cond_broadcast(&uplink->wake);
+  g_mutex_unlock(&uplink->lock);
+}
+
+// read everything new from the feed into the pending batch
+static void collect(BcUplink* uplink) {
+  BrfSlot slot;
+  guint32 lost = 0;
+  while (brf_read(uplink->ring, BRF_SLOTS(uplink->ring), &uplink->cursor,
+                  &slot, &lost)) {
+    const BrbRecord* r = &slot.record;
+    if (uplink->batch_records == 0)
+      uplink->batch_started = g_get_monotonic_time();
+    g_string_append_printf(uplink->batch, JSON_FEED_RECORD, r->source_id,
+                           r->frame_num, r->pts, slot.ts, r->object_id,
+                           r->flags, r->top, r->height, r->left, r->width,
+                           r->species);
+    if (++uplink->batch_records >= BC_UPLINK_BATCH_RECORDS)
+      seal_batch(uplink);
+  }
+  uplink->stats.lost += lost;
+  if (uplink->batch_records > 0 &&
+      g_get_monotonic_time() - uplink->batch_started >=
+          BC_UPLINK_BATCH_MS * G_TIME_SPAN_MILLISECOND) {
+    seal_batch(uplink);
+  }
+}
+
+static gpointer collector_thread(BcUplink* uplink) {
+  g_mutex_lock(&uplink->lock);
+  while (uplink->running) {
+    gint64 until = g_get_monotonic_time() +
+                   BC_UPLINK_POLL_MS * G_TIME_SPAN_MILLISECOND;
+    while (uplink->running && g_get_monotonic_time() < until)
+      g_cond_wait_until(&uplink->wake, &uplink->lock, until);
+    g_mutex_unlock(&uplink->lock);
+    collect(uplink);
+    g_mutex_lock(&uplink->lock);
+  }
+  g_mutex_unlock(&uplink->lock);
+
+  // whatever was published before uplink_free, however few
+  collect(uplink);
+  seal_batch(uplink);
+  return NULL;
+}
+
+// take the oldest batch, spooled ones first. With the lock held.
+static BcUplinkBatch* next_batch(BcUplink* uplink) {
+  BcUplinkBatch* batch = g_queue_pop_head(&uplink->spool);
+  if (batch != NULL)
+    return batch;
+  batch = g_queue_pop_head(&uplink->memory);
+  if (batch != NULL)
+    uplink->memory_bytes -= batch->size;
+  return batch;
+}
+
+// with the lock held, returns with it held
+static gboolean deliver(BcUplink* uplink, BcUplinkBatch* batch, GError** err) {
+  g_mutex_unlock(&uplink->lock);
+  gboolean ok = FALSE;
+  if (batch->data == NULL) {
+    gchar* data = NULL;
+    gsize size = 0;
+    if (g_file_get_contents(batch->path, &data, &size, err)) {
+      GBytes* bytes = g_bytes_new_take(data, size);
+      ok = uplink->backend->deliver(uplink->state, bytes, err);
+      g_bytes_unref(bytes);
+    }
+  } else {
+    ok = uplink->backend->deliver(uplink->state, batch->data, err);
+  }
+  g_mutex_lock(&uplink->lock);
+  return ok;
+}
+
+static gpointer sender_thread(BcUplink* uplink) {
+  guint backoff = BC_UPLINK_BACKOFF;
+  gint64 retry_at = 0;
+  gboolean down = FALSE;
+  GError* err = NULL;
+
+  g_mutex_lock(&uplink->lock);
+  while (uplink->running) {
+    if (g_get_monotonic_time() < retry_at) {
+      g_cond_wait_until(&uplink->wake, &uplink->lock, retry_at);
+      continue;
+    }
+    BcUplinkBatch* batch = next_batch(uplink);
+    if (batch == NULL) {
+      g_cond_wait(&uplink->wake, &uplink->lock);
+      continue;
+    }
+
+    if (deliver(uplink, batch, &err)) {
+      uplink->stats.records += batch->records;
+      uplink->stats.batches++;
+      uplink->stats.bytes += batch->size;
+      if (batch->path != NULL) {
+        g_unlink(batch->path);
+        uplink->spool_bytes -= batch->size;
+      }
+      free_batch(batch);
+      if (down)
+        g_print(MSG_UPLINK_UP);
+      down = FALSE;
+      backoff = BC_UPLINK_BACKOFF;
+      retry_at = 0;
+    } else if (batch->path != NULL && err != NULL &&
+               err->domain == G_FILE_ERROR) {
+      // a spooled batch that can't be read is never going to be delivered
+      uplink->spool_bytes -= batch->size;
+      uplink->stats.dropped++;
+      free_batch(batch);
+    } else {
+      // put it back where it was and wait
+      if (batch->path != NULL) {
+        g_queue_push_head(&uplink->spool, batch);
+      } else {
+        g_queue_push_head(&uplink->memory, batch);
+        uplink->memory_bytes += batch->size;
+      }
+      g_print(MSG_UPLINK_DOWN, err ? err->message : "failed", backoff);
+      down = TRUE;
+      retry_at = g_get_monotonic_time() + backoff * G_TIME_SPAN_SECOND;
+      backoff = MIN(backoff * 2, BC_UPLINK_BACKOFF_MAX);
+    }
+    g_clear_error(&err);
+  }
+  g_mutex_unlock(&uplink->lock);
+  return NULL;
+}
+
+// pick up what a previous run left in the spool, oldest first
+static void load_spool(BcUplink* uplink) {
+  GDir* dir = g_dir_open(uplink->spool_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+  GList* names = NULL;
+  const gchar* name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    if (g_str_has_suffix(name, BC_UPLINK_SPOOL_EXT))
+      names = g_list_prepend(names, g_strdup(name));
+  }
+  g_dir_close(dir);
+  names = g_list_sort(names, (GCompareFunc)g_strcmp0);
+
+  for (GList* l = names; l != NULL; l = l->next) {
+    name = l->data;
+    GStatBuf st;
+    BcUplinkBatch* batch = g_new0(BcUplinkBatch, 1);
+    batch->path = g_build_filename(uplink->spool_dir, name, NULL);
+    if (g_stat(batch->path, &st) != 0) {
+      free_batch(batch);
+      continue;
+    }
+    batch->size = st.st_size;
+    sscanf(name, "%*[0-9]-%*[0-9]-%u", &batch->records);
+    g_queue_push_tail(&uplink->spool, batch);
+    uplink->spool_bytes += batch->size;
+  }
+  g_list_free_full(names, g_free);
+}
+
+BcUplink* uplink_new(BcFeed* feed,
+                     const gchar* url,
+                     const gchar* spool_dir,
+                     guint spool_mb) {
+  GError* err = NULL;
+  const BcUplinkBackend* backend = NULL;
+  gchar* scheme = g_uri_parse_scheme(url);
+  for (gsize i = 0; scheme != NULL && i < G_N_ELEMENTS(BC_UPLINK_BACKENDS);
+       i++) {
+    if (!g_ascii_strcasecmp(scheme, BC_UPLINK_BACKENDS[i].scheme))
+      backend = &BC_UPLINK_BACKENDS[i];
+  }
+  g_free(scheme);
+  if (backend == NULL) {
+    GST_ERROR(ERR_UPLINK_URL, url);
+    return NULL;
+  }
+  if (g_mkdir_with_parents(spool_dir, 0755) != 0) {
+    GST_ERROR(ERR_UPLINK_SPOOL, spool_dir);
+    return NULL;
+  }
+
+  BcUplink* uplink = g_new0(BcUplink, 1);
+  if (!backend->open(url, &uplink->state, &err)) {
+    GST_ERROR(ERR_UPLINK_URL, url);
+    g_clear_error(&err);
+    g_free(uplink);
+    return NULL;
+  }
+  uplink->backend = backend;
+  uplink->url = g_strdup(url);
+  uplink->ring = feed_ring(feed);
+  uplink->cursor = (guint32)g_atomic_int_get(&uplink->ring->head);
+  uplink->batch = g_string_sized_new(BC_UPLINK_BATCH_RECORDS * 128);
+  uplink->spool_dir = g_strdup(spool_dir);
+  uplink->spool_max = (guint64)spool_mb << 20;
+  g_mutex_init(&uplink->lock);
+  g_cond_init(&uplink->wake);
+  load_spool(uplink);
+
+  uplink->running = TRUE;
+  uplink->collector = g_thread_try_new(
+      "uplink-batch", (GThreadFunc)collector_thread, uplink, NULL);
+  uplink->sender = g_thread_try_new("uplink-send", (GThreadFunc)sender_thread,
+                                    uplink, NULL);
+  if (uplink->collector == NULL || uplink->sender == NULL) {
+    GST_ERROR(ERR_UPLINK_THREAD);
+    uplink_free(uplink);
+    return NULL;
+  }
+  return uplink;
+}
+
+void uplink_get_stats(BcUplink* uplink, BcUplinkStats* stats) {
+  *stats = uplink->stats;
+}
+
+void uplink_free(BcUplink* uplink) {
+  g_mutex_lock(&uplink->lock);
+  uplink->running = FALSE;
+  g_cond_broadcast(&uplink->wake);
+  g_mutex_unlock(&uplink->lock);
+  if (uplink->collector != NULL)
+    g_thread_join(uplink->collector);
+  if (uplink->sender != NULL)
+    g_thread_join(uplink->sender);
+
+  // nothing is lost on the way down, the next run delivers it
+  BcUplinkBatch* batch;
+  while ((batch = g_queue_pop_head(&uplink->memory)) != NULL)
+    spool_batch(uplink, batch);
+  while ((batch = g_queue_pop_head(&uplink->spool)) != NULL)
+    free_batch(batch);
+
+  BcUplinkStats* stats = &uplink->stats;
+  g_print(MSG_UPLINK_STATS, stats->records, stats->batches, stats->bytes >> 10,
+          stats->spooled, stats->dropped, stats->lost);
+  uplink->backend->close(uplink->state);
+  g_string_free(uplink->batch, TRUE);
+  g_mutex_clear(&uplink->lock);
+  g_cond_clear(&uplink->wake);
+  g_free(uplink->spool_dir);
+  g_free(uplink->url);
+  g_free(uplink);
+}
@@ -0,0 +1,168 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "videosync.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct _BcVideoSync {
+  GstElement* filesink;
+  guint64 interval;  // ns of video between syncs
+  guint64 last_pts;  // of the last buffer that asked for a sync
+
+  GThread* thread;
+  GMutex lock;  // protects the rest
+  GCond wake;
+  gboolean running;
+  gchar* location;  // the file being written, as of the last request
+  gboolean requested;
+
+  // only touched by the sync thread
+  int fd;
+  gchar* fd_location;
+  guint64 syncs;
+  gint64 slowest;  // us
+};
+
+// fsync works on any descriptor for the file, so the sync thread keeps its own
+// (read only) rather than reaching into filesink
+static void sync_file(BcVideoSync* sync, const gchar* location) {
+  if (g_strcmp0(location, sync->fd_location) != 0) {
+    if (sync->fd >= 0) {
+      fdatasync(sync->fd);  // the last of the previous segment
+      close(sync->fd);
+    }
+    g_free(sync->fd_location);
+    sync->fd_location = g_strdup(location);
+    sync->fd = location ? open(location, O_RDONLY) : -1;
+    if (location != NULL && sync->fd < 0)
+      g_printerr(ERR_VIDEO_SYNC, location, g_strerror(errno));
+  }
+  if (sync->fd < 0)
+    return;
+
+  gint64 start = g_get_monotonic_time();
+  if (fdatasync(sync->fd) != 0) {
+    g_printerr(ERR_VIDEO_SYNC, sync->fd_location, g_strerror(errno));
+    return;
+  }
+  sync->syncs++;
+  sync->slowest = MAX(sync->slowest, g_get_monotonic_time() - start);
+}
+
+static gpointer video_sync_thread(BcVideoSync* sync) {
+  g_mutex_lock(&sync->lock);
+  while (sync->running) {
+    if (!sync->requested) {
+      g_cond_wait(&sync->wake, &sync->lock);
+      continue;
+    }
+    gchar* location = g_strdup(sync->location);
+    sync->requested = FALSE;
+    g_mutex_unlock(&sync->lock);
+    sync_file(sync, location);
+    g_free(location);
+    g_mutex_lock(&sync->lock);
+  }
+  g_mutex_unlock(&sync->lock);
+  return NULL;
+}
+
+static GstPadProbeReturn on_video_data(GstPad* pad,
+                                       GstPadProbeInfo* info,
+                                       BcVideoSync* sync) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (!GST_BUFFER_PTS_IS_VALID(buffer))
+    return GST_PAD_PROBE_OK;  // headers and size fixups, no time of their own
+  guint64 pts = GST_BUFFER_PTS(buffer);
+  if (sync->last_pts != GST_CLOCK_TIME_NONE && pts >= sync->last_pts &&
+      pts - sync->last_pts < sync->interval) {
+    return GST_PAD_PROBE_OK;
+  }
+  sync->last_pts = pts;
+
+  // this is filesink's streaming thread, which is also the only one that
+  // changes its location (splitmuxsink swaps files on it)
+  gchar* location = NULL;
+  g_object_get(G_OBJECT(sync->filesink), "location", &location, NULL);
+  g_mutex_lock(&sync->lock);
+  g_free(sync->location);
+  sync->location = location;
+  sync->requested = TRUE;
+  g_cond_signal(&sync->wake);
+  g_mutex_unlock(&sync->lock);
+  return GST_PAD_PROBE_OK;
+}
+
+BcVideoSync* video_sync_new(GstElement* filesink, guint interval) {
+  GstPad* sink_pad = gst_element_get_static_pad(filesink, "sink");
+  if (sink_pad == NULL) {
+    GST_ERROR(ERR_VIDEO_SYNC_PAD);
+    return NULL;
+  }
+
+  BcVideoSync* sync = g_new0(BcVideoSync, 1);
+  sync->filesink = filesink;
+  sync->interval = interval * GST_SECOND;
+  sync->last_pts = GST_CLOCK_TIME_NONE;
+  sync->fd = -1;
+  g_mutex_init(&sync->lock);
+  g_cond_init(&sync->wake);
+  sync->running = TRUE;
+  sync->thread = g_thread_try_new("video-sync",
+                                  (GThreadFunc)video_sync_thread, sync, NULL);
+  if (sync->thread == NULL) {
+    GST_ERROR(ERR_VIDEO_SYNC_THREAD);
+    gst_object_unref(sink_pad);
+    g_mutex_clear(&sync->lock);
+    g_cond_clear(&sync->wake);
+    g_free(sync);
+    return NULL;
+  }
+
+  // filesink's own buffering would keep up to 64 KiB from the kernel (and
+  // from fdatasync), matroskamux already hands it whole blocks
+  gst_util_set_object_arg(G_OBJECT(filesink), "buffer-mode", "unbuffered");
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_video_data, sync, NULL);
+  gst_object_unref(sink_pad);
+  return sync;
+}
+
+void video_sync_free(BcVideoSync* sync) {
+  g_mutex_lock(&sync->lock);
+  sync->running = FALSE;
+  g_cond_signal(&sync->wake);
+  g_mutex_unlock(&sync->lock);
+  g_thread_join(sync->thread);
+
+  // the file is closed by now, but its last writes may not be on disk yet
+  sync_file(sync, sync->location);
+  if (sync->fd >= 0)
+    close(sync->fd);
+  g_print(MSG_VIDEO_SYNC_STATS, sync->syncs, sync->slowest / 1000);
+  g_free(sync->location);
+  g_free(sync->fd_location);
+  g_mutex_clear(&sync->lock);
+  g_cond_clear(&sync->wake);
+  g_free(sync);
+}
@@ -0,0 +1,629 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+
+typedef struct {
+  BrbRecord record;
+  gint64 queued;  // monotonic time on_batch pushed it, for the late counter
+} BcWriterSlot;
+
+// things that happen at a pts, from the encoder branch (see writer_rotate
+// and writer_mark_keyframe). They arrive in pts order.
+typedef struct {
+  gchar* filename;     // rotate to this file, or NULL for a keyframe
+  guint64 pts;         // first pts that goes in the new file, or keyframe pts
+  guint64 mkv_offset;  // keyframes only
+  gint64 requested;    // monotonic time it was queued
+} BcWriterEvent;
+
+struct _BcWriter {
+  // the ring. head is only written by the producer, tail only by the writer
+  // thread, and each publishes with an atomic store after touching the slots
+  BcWriterSlot* slots;
+  guint capacity;
+  gint head;
+  gint tail;
+
+  // pulled records on their way back to the streaming thread, the feed's
+  // only producer, to be published (see writer_publish). The same kind of
+  // ring, the writer thread producing
+  BrbRecord* pulled;
+  gint pulled_head;
+  gint pulled_tail;
+
+  // output, only touched by the writer thread after writer_new
+  int fd;
+  int index_fd;     // the .bri seek index (see brb.h)
+  guint64 offset;   // bytes committed to fd
+  guint64 start_pts;  // the first pts that goes in fd
+  // the file before the last rotation, for records older than start_pts
+  int last_fd;
+  GString* last_buffer;
+  guint last_buffered;
+  BcWriterOptions options;
+  GString* buffer;  // one group commit worth of formatted records
+  guint buffered;   // records in buffer
+  GString* index;   // and the index entries that go with them
+  gint64 start_time;  // wall time at pts 0
+  GQueue events;      // BcWriterEvent*, oldest first
+  gint64 echo_window;  // start of the current one second echo window
+  guint echoed;
+  guint suppressed;
+
+  // counters, each has a single writer (see BcWriterStats)
+  BcWriterStats stats;
+
+  GThread* thread;
+  GMutex lock;  // only protects running, requested and the wakeup below
+  GCond wake;
+  gboolean running;
+  GQueue requested;  // BcWriterEvent*, not yet seen by the writer thread
+  gint rotations;     // writer_rotate calls, read without the lock
+  guint64 boundary;   // and the pts of the latest
+  BcWriterPull pull;  // and where records from other threads come from
+  gpointer pull_data;
+  GMainLoop* main_loop;
+};
+
+static gpointer writer_thread(BcWriter* writer);
+
+// write() until everything is written or there's a real error
+static gboolean write_all(int fd, const gchar* buf, gsize len) {
+  while (len > 0) {
+    gssize n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    buf += n;
+    len -= n;
+  }
+  return TRUE;
+}
+
+static gint64 wall_time(BcWriter* writer, guint64 pts) {
+  return writer->start_time + (gint64)(pts / GST_USECOND);
+}
+
+static gboolean write_headers(BcWriter* writer, guint64 start_pts) {
+  BrbHeader header = {
+      BRB_MAGIC,
+      BRB_VERSION,
+      sizeof(BrbHeader),
+      sizeof(BrbRecord),
+      (guint16)writer->options.frame_width,
+      (guint16)writer->options.frame_height,
+      0,
+      wall_time(writer, start_pts),
+      start_pts,
+  };
+  if (writer->options.type == BRB) {
+    if (!write_all(writer->fd, (const gchar*)&header, sizeof(header)))
+      return FALSE;
+    writer->offset = sizeof(header);
+  }
+
+  // the index header is the same, apart from what's in it
+  BriHeader* index_header = &header;
+  memcpy(index_header->magic, BRI_MAGIC, sizeof(BRI_MAGIC));
+  index_header->version = BRI_VERSION;
+  index_header->record_size = sizeof(BriEntry);
+  return write_all(writer->index_fd, (const gchar*)index_header,
+                   sizeof(*index_header));
+}
+
+// birbs.jl -> birbs.bri
+static gchar* index_filename(BcWriter* writer, const gchar* filename) {
+  const gchar* extension = writer_extension(writer->options.type);
+  gsize length = strlen(filename);
+  if (g_str_has_suffix(filename, extension))
+    length -= strlen(extension);
+  g_autofree gchar* base = g_strndup(filename, length);
+  return g_strconcat(base, BC_EXT_INDEX, NULL);
+}
+
+// a finished segment should be complete on disk, like at shutdown
+static void close_file(int* fd) {
+  if (*fd >= 0) {
+    fdatasync(*fd);
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+static void close_output(BcWriter* writer) {
+  close_file(&writer->last_fd);
+  close_file(&writer->fd);
+  close_file(&writer->index_fd);
+}
+
+// make filename (and its index) the current file. The one it replaces is
+// kept for stragglers, and the one before that closed.
+static gboolean open_output(BcWriter* writer,
+                            const gchar* filename,
+                            guint64 start_pts) {
+  close_file(&writer->last_fd);
+  close_file(&writer->index_fd);
+  writer->last_fd = writer->fd;
+  g_autofree gchar* index = index_filename(writer, filename);
+  writer->offset = 0;
+  writer->start_pts = start_pts;
+  writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer->fd < 0) {
+    GST_ERROR(ERR_WRITER_OPEN, filename, g_strerror(errno));
+    return FALSE;
+  }
+  writer->index_fd =
+      open(index, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer->index_fd < 0 || !write_headers(writer, start_pts)) {
+    GST_ERROR(ERR_WRITER_OPEN, index, g_strerror(errno));
+    return FALSE;
+  }
+  writer->stats.files++;
+  return TRUE;
+}
+
+static void event_free(BcWriterEvent* event) {
+  g_free(event->filename);
+  g_free(event);
+}
+
+BcWriter* writer_new(const gchar* filename,
+                     const BcWriterOptions* options,
+                     GMainLoop* main_loop) {
+  BcWriter* writer = g_new0(BcWriter, 1);
+  writer->slots = g_new0(BcWriterSlot, BC_WRITER_CAPACITY);
+  writer->pulled = g_new0(BrbRecord, BC_WRITER_UNPUBLISHED);
+  writer->capacity = BC_WRITER_CAPACITY;
+  writer->fd = -1;
+  writer->index_fd = -1;
+  writer->last_fd = -1;
+  writer->options = *options;
+  writer->buffer = g_string_sized_new(BC_WRITER_CAPACITY * 64);
+  writer->last_buffer = g_string_new(NULL);
+  writer->index = g_string_new(NULL);
+  // the pipeline is set to playing right after this, so pts 0 is (close
+  // enough to) now, unless it's a recording being reprocessed
+  writer->start_time =
+      options->start_time ? options->start_time : g_get_real_time();
+  writer->main_loop = main_loop;
+  writer->running = TRUE;
+  g_queue_init(&writer->events);
+  g_queue_init(&writer->requested);
+  g_mutex_init(&writer->lock);
+  g_cond_init(&writer->wake);
+
+  if (!open_output(writer, filename, 0)) {
+    writer->running = FALSE;
+    writer_free(writer);
+    return NULL;
+  }
+
+  writer->thread = g_thread_try_new("bc-writer", (GThreadFunc)writer_thread,
+                                    writer, NULL);
+  if (writer->thread == NULL) {
+    GST_ERROR(ERR_WRITER_THREAD);
+    writer->running = FALSE;
+    writer_free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+void writer_publish(BcWriter* writer) {
+  if (writer->options.feed == NULL)
+    return;
+  guint tail = (guint)writer->pulled_tail;  // we're the only one changing it
+  guint head = (guint)g_atomic_int_get(&writer->pulled_head);
+  for (; tail != head; tail++) {
+    feed_publish(writer->options.feed,
+                 &writer->pulled[tail & (BC_WRITER_UNPUBLISHED - 1)]);
+  }
+  g_atomic_int_set(&writer->pulled_tail, (gint)tail);
+}
+
+gboolean writer_push(BcWriter* writer, const BrbRecord* record) {
+  // subscribers see it now, whatever happens to it here, after anything
+  // pulled before it
+  if (writer->options.feed != NULL) {
+    writer_publish(writer);
+    feed_publish(writer->options.feed, record);
+  }
+
+  guint head = (guint)writer->head;  // we're the only one changing it
+  guint used = head - (guint)g_atomic_int_get(&writer->tail);
+  // nothing live to keep up with when reprocessing, so wait for the writer
+  // rather than lose the record. It drains even after a failed write.
+  while (used >= writer->capacity && writer->options.lossless) {
+    g_mutex_lock(&writer->lock);
+    g_cond_signal(&writer->wake);
+    g_mutex_unlock(&writer->lock);
+    g_usleep(BC_WRITER_WAIT_MS * 1000);
+    used = head - (guint)g_atomic_int_get(&writer->tail);
+  }
+  if (used >= writer->capacity) {
+    writer->stats.dropped++;
+    return FALSE;
+  }
+
+  BcWriterSlot* slot = &writer->slots[head & (writer->capacity - 1)];
+  slot->record = *record;
+  slot->queued = g_get_monotonic_time();
+  g_atomic_int_set(&writer->head, (gint)(head + 1));  // publish the slot
+  writer->stats.queued++;
+
+  // a burst is filling the ring faster than flush_ms, commit early. This is
+  // the only time the streaming thread touches the lock.
+  if (used + 1 == writer->capacity / 2) {
+    g_mutex_lock(&writer->lock);
+    g_cond_signal(&writer->wake);
+    g_mutex_unlock(&writer->lock);
+  }
+  return TRUE;
+}
+
+// these are a few a second at most, so a lock is fine
+static void push_event(BcWriter* writer,
+                       const gchar* filename,
+                       guint64 pts,
+                       guint64 mkv_offset) {
+  BcWriterEvent* event = g_new0(BcWriterEvent, 1);
+  event->filename = g_strdup(filename);
+  event->pts = pts;
+  event->mkv_offset = mkv_offset;
+  event->requested = g_get_monotonic_time();
+
+  g_mutex_lock(&writer->lock);
+  g_queue_push_tail(&writer->requested, event);
+  g_mutex_unlock(&writer->lock);
+}
+
+void writer_set_pull(BcWriter* writer, BcWriterPull pull, gpointer user_data) {
+  g_mutex_lock(&writer->lock);
+  writer->pull = pull;
+  writer->pull_data = user_data;
+  g_mutex_unlock(&writer->lock);
+}
+
+void writer_rotate(BcWriter* writer, const gchar* filename, guint64 pts) {
+  push_event(writer, filename, pts, 0);
+  g_mutex_lock(&writer->lock);
+  writer->boundary = pts;
+  g_atomic_int_inc(&writer->rotations);
+  g_mutex_unlock(&writer->lock);
+}
+
+gboolean writer_rotated(BcWriter* writer, gint* rotations, guint64* pts) {
+  gint now = g_atomic_int_get(&writer->rotations);
+  if (now == *rotations)
+    return FALSE;
+  g_mutex_lock(&writer->lock);
+  *pts = writer->boundary;
+  *rotations = g_atomic_int_get(&writer->rotations);
+  g_mutex_unlock(&writer->lock);
+  return TRUE;
+}
+
+void writer_mark_keyframe(BcWriter* writer, guint64 pts, guint64 mkv_offset) {
+  push_event(writer, NULL, pts, mkv_offset);
+}
+
+const gchar* writer_extension(MetaType type) {
+  return type == BRB ? BC_EXT_BRB : BC_EXT_JSON_LINES;
+}
+
+static void format_record(BcWriter* writer,
+                          GString* buffer,
+                          const BrbRecord* record) {
+  switch (writer->options.type) {
+    case JSON_LINES:
+      if (record->flags & BRB_FRAME_SKIPPED) {
+        g_string_append_printf(buffer, JSON_SKIP_RECORD, record->frame_num,
+                               record->pts, wall_time(writer, record->pts),
+                               record->flags, record->class_id,
+                               brb_skip_count(record), brb_skip_last(record));
+        break;
+      }
+      if (record->flags != 0) {
+        g_string_append_printf(buffer, JSON_TRACK_RECORD, record->frame_num,
+                               record->pts, wall_time(writer, record->pts),
+                               record->object_id, record->flags, record->top,
+                               record->height, record->left, record->width);
+      } else {
+        g_string_append_printf(buffer, JSON_RECORD, record->frame_num,
+                               record->pts, wall_time(writer, record->pts),
+                               record->top, record->height, record->left,
+                               record->width);
+      }
+      if (record->species != BRB_UNCLASSIFIED) {
+        // in place of the closing "}\n"
+        g_string_truncate(buffer, buffer->len - 2);
+        g_string_append_printf(buffer, JSON_SPECIES, record->species,
+                               record->species_confidence / BRB_SPECIES_SCALE);
+      }
+      break;
+    case BRB:
+      g_string_append_len(buffer, (const gchar*)record, sizeof(*record));
+      break;
+  }
+}
+
+// the old hot path g_print, now opt-in and at most echo_rate lines a second
+static void echo_record(BcWriter* writer, const BrbRecord* record, gint64 now) {
+  if (now - writer->echo_window >= G_USEC_PER_SEC) {
+    if (writer->suppressed)
+      g_print(MSG_ECHO_SUPPRESSED, writer->suppressed);
+    writer->echo_window = now;
+    writer->echoed = 0;
+    writer->suppressed = 0;
+  }
+  if (record->flags & BRB_FRAME_SKIPPED)
+    return;  // not a bird
+  if (writer->echoed++ < writer->options.echo_rate) {
+    g_print(JSON_RECORD, record->frame_num, record->pts,
+            wall_time(writer, record->pts), record->top, record->height,
+            record->left, record->width);
+  } else {
+    writer->suppressed++;
+  }
+}
+
+static gboolean sync_policy(BcWriter* writer, int fd) {
+  return writer->options.sync != BC_SYNC_BATCH || fdatasync(fd) == 0;
+}
+
+// hand what's been formatted so far to the kernel, one write() for the
+// records and then one for the index entries pointing into them, and one
+// more for any stragglers from the previous file
+static gboolean commit(BcWriter* writer) {
+  if (writer->last_buffered > 0) {
+    if (!write_all(writer->last_fd, writer->last_buffer->str,
+                   writer->last_buffer->len) ||
+        !sync_policy(writer, writer->last_fd)) {
+      return FALSE;
+    }
+    writer->stats.written += writer->last_buffered;
+    writer->stats.writes++;
+    writer->last_buffered = 0;
+    g_string_truncate(writer->last_buffer, 0);
+  }
+  if (writer->buffered > 0) {
+    if (!write_all(writer->fd, writer->buffer->str, writer->buffer->len) ||
+        !sync_policy(writer, writer->fd)) {
+      return FALSE;
+    }
+    writer->offset += writer->buffer->len;
+    writer->stats.written += writer->buffered;
+    writer->stats.writes++;
+    writer->buffered = 0;
+    g_string_truncate(writer->buffer, 0);
+  }
+  if (writer->index->len > 0) {
+    if (!write_all(writer->index_fd, writer->index->str, writer->index->len) ||
+        !sync_policy(writer, writer->index_fd)) {
+      return FALSE;
+    }
+    g_string_truncate(writer->index, 0);
+  }
+  return TRUE;
+}
+
+// rotate, or index a keyframe at where the next record will be written
+static gboolean apply_event(BcWriter* writer) {
+  BcWriterEvent* event = g_queue_pop_head(&writer->events);
+  gboolean ok = TRUE;
+  if (event->filename != NULL) {
+    ok = commit(writer) && open_output(writer, event->filename, event->pts);
+    if (ok)
+      g_print(MSG_WRITER_ROTATE, event->filename);
+  } else {
+    BriEntry entry = {
+        event->pts,
+        wall_time(writer, event->pts),
+        event->mkv_offset,
+        writer->offset + writer->buffer->len,
+    };
+    g_string_append_len(writer->index, (const gchar*)&entry, sizeof(entry));
+  }
+  event_free(event);
+  return ok;
+}
+
+// there's an event to apply before a record with this pts
+static gboolean event_due(BcWriter* writer, guint64 pts) {
+  BcWriterEvent* next = g_queue_peek_head(&writer->events);
+  return next != NULL && pts >= next->pts;
+}
+
+// an event no record has crossed yet (no birds) is applied once anything
+// older than it would be late anyway, so quiet segments still get a file
+// and quiet stretches are still indexed
+static gboolean event_stale(BcWriter* writer, gint64 now) {
+  BcWriterEvent* next = g_queue_peek_head(&writer->events);
+  return next != NULL && now - next->requested > BC_WRITER_LATE_MS * 1000;
+}
+
+// format a record into the current batch, applying whatever comes before it
+static gboolean take_record(BcWriter* writer,
+                            const BrbRecord* record,
+                            gint64 queued,
+                            gint64 now) {
+  while (event_due(writer, record->pts)) {
+    if (!apply_event(writer))
+      return FALSE;
+  }
+  if (now - queued > BC_WRITER_LATE_MS * 1000)
+    writer->stats.late++;
+  // from before the current file, in the one it belongs in if that's open
+  if (record->pts < writer->start_pts && writer->last_fd >= 0) {
+    format_record(writer, writer->last_buffer, record);
+    writer->last_buffered++;
+  } else {
+    format_record(writer, writer->buffer, record);
+    writer->buffered++;
+  }
+  if (writer->options.echo_rate)
+    echo_record(writer, record, now);
+  return TRUE;
+}
+
+// hand pulled records to writer_publish, on the streaming thread. If it's
+// fallen that far behind the oldest are kept and the rest counted.
+static void queue_publish(BcWriter* writer, const BrbRecord* records, guint n) {
+  if (writer->options.feed == NULL)
+    return;
+  guint head = (guint)writer->pulled_head;  // we're the only one changing it
+  guint tail = (guint)g_atomic_int_get(&writer->pulled_tail);
+  guint room = BC_WRITER_UNPUBLISHED - (head - tail);
+  for (guint i = 0; i < MIN(n, room); i++)
+    writer->pulled[head++ & (BC_WRITER_UNPUBLISHED - 1)] = records[i];
+  g_atomic_int_set(&writer->pulled_head, (gint)head);
+  if (n > room)
+    writer->stats.unpublished += n - room;
+}
+
+// format everything queued so far and commit it, one write() per file.
+// Returns FALSE (and quits the main loop) if the disk let us down.
+static gboolean writer_drain(BcWriter* writer) {
+  BrbRecord pulled[BC_WRITER_PULL];
+  guint n_pulled = 0;
+  g_mutex_lock(&writer->lock);
+  BcWriterEvent* event;
+  while ((event = g_queue_pop_head(&writer->requested)) != NULL)
+    g_queue_push_tail(&writer->events, event);
+  // under the lock, so writer_set_pull can't take it away meanwhile
+  if (writer->pull != NULL)
+    n_pulled = writer->pull(writer->pull_data, pulled, BC_WRITER_PULL);
+  g_mutex_unlock(&writer->lock);
+
+  guint tail = (guint)writer->tail;  // we're the only one changing it
+  guint head = (guint)g_atomic_int_get(&writer->head);
+  gint64 now = g_get_monotonic_time();
+  // these are older than the ring's, mostly
+  for (guint i = 0; i < n_pulled; i++) {
+    if (!take_record(writer, &pulled[i], now, now))
+      goto error;
+    writer->stats.pulled++;
+  }
+  queue_publish(writer, pulled, n_pulled);
+  for (; tail != head; tail++) {
+    BcWriterSlot* slot = &writer->slots[tail & (writer->capacity - 1)];
+    if (!take_record(writer, &slot->record, slot->queued, now))
+      goto error;
+  }
+  // everything is copied out, so on_batch can have the slots back before we
+  // block on the disk
+  g_atomic_int_set(&writer->tail, (gint)tail);
+
+  while (event_stale(writer, now)) {
+    if (!apply_event(writer))
+      goto error;
+  }
+  if (!commit(writer))
+    goto error;
+  return TRUE;
+
+error:
+  g_printerr(ERR_METADATA_WRITE);
+  writer->stats.failed = TRUE;
+  g_main_loop_quit(writer->main_loop);  // thread safe
+  // drop the failed batch rather than count it or pile more onto it
+  writer->buffered = 0;
+  writer->last_buffered = 0;
+  g_string_truncate(writer->buffer, 0);
+  g_string_truncate(writer->last_buffer, 0);
+  g_string_truncate(writer->index, 0);
+  g_atomic_int_set(&writer->tail, (gint)head);
+  return FALSE;
+}
+
+static gpointer writer_thread(BcWriter* writer) {
+  g_mutex_lock(&writer->lock);
+  while (writer->running) {
+    gint64 deadline =
+        g_get_monotonic_time() + writer->options.flush_ms * G_TIME_SPAN_MILLISECOND;
+    // woken early by writer_push when half full, or by writer_free
+    g_cond_wait_until(&writer->wake, &writer->lock, deadline);
+    g_mutex_unlock(&writer->lock);
+    writer_drain(writer);
+    g_mutex_lock(&writer->lock);
+  }
+  g_mutex_unlock(&writer->lock);
+  // whatever came in while we were being stopped. The pipeline is gone, so
+  // every segment that was started gets its file and every keyframe its
+  // entry, birds or not.
+  if (writer_drain(writer)) {
+    gboolean ok = TRUE;
+    while (ok && !g_queue_is_empty(&writer->events))
+      ok = apply_event(writer);
+    if (!ok || !commit(writer)) {
+      g_printerr(ERR_METADATA_WRITE);
+      writer->stats.failed = TRUE;
+    }
+  }
+  return NULL;
+}
+
+void writer_get_stats(BcWriter* writer, BcWriterStats* stats) {
+  *stats = writer->stats;
+}
+
+gboolean writer_free(BcWriter* writer) {
+  if (writer->thread != NULL) {
+    g_mutex_lock(&writer->lock);
+    writer->running = FALSE;
+    g_cond_signal(&writer->wake);
+    g_mutex_unlock(&writer->lock);
+    g_thread_join(writer->thread);
+  }
+  // the pipeline is gone, so this is the feed's only producer now
+  writer_publish(writer);
+
+  g_print(MSG_WRITER_STATS, writer->stats.written, writer->stats.writes,
+          writer->stats.dropped, writer->stats.late);
+
+  // the whole point of a clean shutdown is a complete file
+  close_output(writer);
+  g_queue_foreach(&writer->events, (GFunc)event_free, NULL);
+  g_queue_clear(&writer->events);
+  g_queue_foreach(&writer->requested, (GFunc)event_free, NULL);
+  g_queue_clear(&writer->requested);
+  g_string_free(writer->buffer, TRUE);
+  g_string_free(writer->last_buffer, TRUE);
+  g_string_free(writer->index, TRUE);
+  g_mutex_clear(&writer->lock);
+  g_cond_clear(&writer->wake);
+  g_free(writer->slots);
+  g_free(writer->pulled);
+  gboolean ok = !writer->stats.failed;
+  g_free(writer);
+  return ok;
+}
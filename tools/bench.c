@@ -0,0 +1,366 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// birbcam-bench: microbenchmarks for the metadata hot path. Synthetic
+// NvDsBatchMeta (batch sizes and birds per frame varied) is run through the
+// real on_batch() into real writers, so a regression in the probe, the
+// writer ring, the track output or the formatters shows up here before it
+// shows up on a camera. For every case it reports the time spent in
+// on_batch per object and per batch, heap allocations made by on_batch per
+// batch, and the group commits, write() and fdatasync() calls the writers
+// needed.
+//
+//   birbcam-bench [-n BATCHES] [-d DIR]
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gstnvdsmeta.h>
+
+#include "data.h"
+#include "probe.h"
+
+#define MSG_BENCH_HEADER                                                   \
+  "format   output  batch  birds  ns/object   ns/batch  allocs/batch  " \
+  "records  commits   writes    syncs  dropped\n"
+#define MSG_BENCH_ROW                                                   \
+  "%-8s %-7s %5u  %5u  %9s  %9.1f  %12.2f  %7" G_GUINT64_FORMAT "  %7" \
+  G_GUINT64_FORMAT "  %7u  %7u  %7" G_GUINT64_FORMAT "\n"
+#define MSG_BENCH_NO_COUNTS \
+  "allocs, writes and syncs are only counted with glibc, 0 here\n"
+
+#define BC_BENCH_BATCHES 20000  // per case, default
+#define BC_BENCH_RING 64        // prebuilt batches, cycled through
+#define BC_BENCH_FRAME_NS 33333333  // 30 fps
+
+#ifdef __GLIBC__
+// count heap allocations made on the benchmark thread. glibc exports its
+// allocator as __libc_*, so these can stand in for the real thing (for glib
+// and DeepStream too) without a preload library. The writer threads
+// allocate as well, but they have their own counters.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void* __libc_valloc(size_t size);
+static __thread guint64 allocations;
+// and the write() and fdatasync() calls every thread makes, the writers'
+// above all. These go straight to the kernel.
+static gint write_calls;
+static gint sync_calls;
+
+void* malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  allocations++;
+  return __libc_memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+  allocations++;
+  return __libc_valloc(size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) {
+  allocations++;
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  void* memory = __libc_memalign(alignment, size);
+  if (memory == NULL)
+    return ENOMEM;
+  *p = memory;
+  return 0;
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  g_atomic_int_inc(&write_calls);
+  return syscall(SYS_write, fd, buf, count);
+}
+
+int fdatasync(int fd) {
+  g_atomic_int_inc(&sync_calls);
+  return syscall(SYS_fdatasync, fd);
+}
+#else
+static guint64 allocations;  // not counted, always 0
+static gint write_calls;
+static gint sync_calls;
+#endif
+
+static const guint BATCH_SIZES[] = {1, 4, 8};
+static const guint BIRDS[] = {0, 1, 4, 16};
+
+typedef struct {
+  MetaType type;
+  gboolean tracks;
+  guint batch_size;
+  guint birds;  // per frame
+} BenchCase;
+
+static gint64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void discard_print(const gchar* string) {}
+
+// a buffer with the metadata nvstreammux + nvinfer (+ nvtracker) attach: a
+// frame per source, each with the same birds at slightly different places
+static GstBuffer* make_batch(const BenchCase* bench, guint seed) {
+  GstBuffer* buffer = gst_buffer_new();
+  NvDsBatchMeta* batch = nvds_create_batch_meta(bench->batch_size);
+  NvDsMeta* meta =
+      gst_buffer_add_nvds_meta(buffer, batch, NULL, nvds_batch_meta_copy_func,
+                               nvds_batch_meta_release_func);
+  meta->meta_type = NVDS_BATCH_GST_META;
+  batch->base_meta.batch_meta = batch;
+
+  for (guint s = 0; s < bench->batch_size; s++) {
+    NvDsFrameMeta* frame = nvds_acquire_frame_meta_from_pool(batch);
+    frame->source_id = s;
+    frame->pad_index = s;
+    frame->source_frame_width = BC_INFER_WIDTH;
+    frame->source_frame_height = BC_INFER_HEIGHT;
+    nvds_add_frame_meta_to_batch(batch, frame);
+
+    for (guint b = 0; b < bench->birds; b++) {
+      NvDsObjectMeta* object = nvds_acquire_obj_meta_from_pool(batch);
+      object->unique_component_id = 1;
+      object->class_id = BIRB_ID;
+      // a stable id per bird, as a tracker would give
+      object->object_id = bench->tracks ? b : UNTRACKED_OBJECT_ID;
+      object->confidence = 0.9f;
+      object->rect_params.left = (b * 23 + seed) % (BC_INFER_WIDTH - 40);
+      object->rect_params.top = (b * 11) % (BC_INFER_HEIGHT - 40);
+      object->rect_params.width = 32;
+      object->rect_params.height = 32;
+      nvds_add_obj_meta_to_frame(frame, object, NULL);
+    }
+  }
+  return buffer;
+}
+
+// stamp every frame of a prebuilt batch as the next one
+static void set_pts(GstBuffer* buffer, guint64 index) {
+  NvDsBatchMeta* batch = gst_buffer_get_nvds_batch_meta(buffer);
+  for (NvDsMetaList* l = batch->frame_meta_list; l != NULL; l = l->next) {
+    NvDsFrameMeta* frame = (NvDsFrameMeta*)l->data;
+    frame->buf_pts = index * BC_BENCH_FRAME_NS;
+    frame->frame_num = (gint)index;
+  }
+}
+
+// keep the writers' rings from overflowing, so what's measured is the
+// normal path and not the drop path
+static void wait_for_writers(BcData* data, guint64 slack) {
+  for (guint i = 0; i < data->n_outputs; i++) {
+    BcWriterStats stats;
+    for (;;) {
+      writer_get_stats(data->outputs[i].writer, &stats);
+      if (stats.queued - stats.written <= slack)
+        break;
+      g_usleep(100);
+    }
+  }
+}
+
+static gboolean run_case(const BenchCase* bench,
+                         guint batches,
+                         const gchar* dir,
+                         GMainLoop* main_loop) {
+  guint writes_before = (guint)g_atomic_int_get(&write_calls);
+  guint syncs_before = (guint)g_atomic_int_get(&sync_calls);
+  BcData data = {NULL};
+  BcArgs args = {NULL};
+  config_init(&args.config);
+  data.args = &args;
+  BcWriterOptions options = {
+      bench->type,    BC_SYNC_NONE, BC_WRITER_FLUSH_MS, 0,
+      BC_INFER_WIDTH, BC_INFER_HEIGHT,
+  };
+  data.n_outputs = bench->batch_size;
+  for (guint i = 0; i < data.n_outputs; i++) {
+    BcOutput* output = &data.outputs[i];
+    output->meta_extension = writer_extension(bench->type);
+    output->base_filename = g_strdup_printf("%s/bench_%u", dir, i);
+    output->meta_filename =
+        g_strconcat(output->base_filename, output->meta_extension, NULL);
+    output->writer = writer_new(output->meta_filename, &options, main_loop);
+    if (output->writer == NULL)
+      return FALSE;
+    if (bench->tracks)
+      output->tracks = tracks_new(output->writer);
+  }
+
+  GstBuffer* ring[BC_BENCH_RING];
+  for (guint i = 0; i < BC_BENCH_RING; i++)
+    ring[i] = make_batch(bench, i);
+  GstPadProbeInfo info = {0};
+
+  // time on_batch in chunks of BC_BENCH_RING calls, with the bookkeeping
+  // and waiting in between left out
+  gint64 probe_ns = 0;
+  guint64 probe_allocations = 0;
+  for (guint done = 0; done < batches; done += BC_BENCH_RING) {
+    guint chunk = MIN(BC_BENCH_RING, batches - done);
+    for (guint i = 0; i < chunk; i++)
+      set_pts(ring[i], done + i);
+
+    guint64 before = allocations;
+    gint64 start = now_ns();
+    for (guint i = 0; i < chunk; i++) {
+      info.data = ring[i];
+      on_batch(NULL, &info, &data);
+    }
+    probe_ns += now_ns() - start;
+    probe_allocations += allocations - before;
+
+    wait_for_writers(&data, BC_WRITER_CAPACITY / 2);
+  }
+  wait_for_writers(&data, 0);
+
+  // the writers print their own stats on the way out, they'd bury ours
+  BcWriterStats total = {0};
+  GPrintFunc print = g_set_print_handler(discard_print);
+  for (guint i = 0; i < data.n_outputs; i++) {
+    BcOutput* output = &data.outputs[i];
+    if (output->tracks != NULL)
+      tracks_free(output->tracks);
+    BcWriterStats stats;
+    writer_get_stats(output->writer, &stats);
+    total.queued += stats.queued;
+    total.written += stats.written;
+    total.writes += stats.writes;
+    total.dropped += stats.dropped;
+    writer_free(output->writer);
+
+    g_autofree gchar* index =
+        g_strconcat(output->base_filename, BC_EXT_INDEX, NULL);
+    g_unlink(output->meta_filename);
+    g_unlink(index);
+    g_free(output->base_filename);
+    g_free(output->meta_filename);
+  }
+  g_set_print_handler(print);
+  // every file is closed (and synced) now
+  guint writes = (guint)g_atomic_int_get(&write_calls) - writes_before;
+  guint syncs = (guint)g_atomic_int_get(&sync_calls) - syncs_before;
+  for (guint i = 0; i < BC_BENCH_RING; i++)
+    gst_buffer_unref(ring[i]);
+  config_clear(&args.config);
+
+  guint64 objects = (guint64)batches * bench->batch_size * bench->birds;
+  gchar per_object[32] = "-";
+  if (objects > 0)
+    g_snprintf(per_object, sizeof(per_object), "%.1f",
+               (gdouble)probe_ns / objects);
+  g_print(MSG_BENCH_ROW, bench->type == BRB ? "brb" : "json",
+          bench->tracks ? "tracks" : "frames", bench->batch_size,
+          bench->birds, per_object, (gdouble)probe_ns / batches,
+          (gdouble)probe_allocations / batches, total.queued, total.writes,
+          writes, syncs, total.dropped);
+  return TRUE;
+}
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx =
+      g_option_context_new("- benchmark the birbcam metadata hot path");
+  GError* err = NULL;
+  gint batches = BC_BENCH_BATCHES;
+  gchar* dir = NULL;
+
+  GOptionEntry entries[] = {
+      {"batches", 'n', 0, G_OPTION_ARG_INT, &batches,
+       "batches per case (default: 20000)", "N"},
+      {"dir", 'd', 0, G_OPTION_ARG_FILENAME, &dir,
+       "write the metadata files here, eg. to bench an SD card (default: a "
+       "temporary directory)",
+       "DIR"},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  g_option_context_add_group(ctx, gst_init_get_option_group());
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  if (batches <= 0) {
+    g_printerr("batches must be positive\n");
+    return 1;
+  }
+
+  gboolean temporary = dir == NULL;
+  if (temporary && (dir = g_dir_make_tmp("birbcam-bench-XXXXXX", &err)) ==
+                       NULL) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  GMainLoop* main_loop = g_main_loop_new(NULL, FALSE);
+
+  int status = 0;
+  g_print(MSG_BENCH_HEADER);
+#ifndef __GLIBC__
+  g_print(MSG_BENCH_NO_COUNTS);
+#endif
+  for (gint type = JSON_LINES; type <= BRB && status == 0; type++) {
+    for (gint tracks = FALSE; tracks <= TRUE && status == 0; tracks++) {
+      for (gsize b = 0; b < G_N_ELEMENTS(BATCH_SIZES) && status == 0; b++) {
+        for (gsize n = 0; n < G_N_ELEMENTS(BIRDS) && status == 0; n++) {
+          BenchCase bench = {type, tracks, BATCH_SIZES[b], BIRDS[n]};
+          if (!run_case(&bench, batches, dir, main_loop))
+            status = 1;
+        }
+      }
+    }
+  }
+
+  g_main_loop_unref(main_loop);
+  if (temporary)
+    g_rmdir(dir);
+  g_free(dir);
+  return status;
+}
@@ -0,0 +1,323 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// birbcam-compact: rewrites closed metadata files (.jl or .brb) as .brc
+// files (see brc.h) for the long haul: columns of small deltas instead of
+// text or fixed size records, in chunks with zone maps that let
+// birbcam-query skip whatever can't match. Files modified in the last
+// --min-age seconds are taken to be still open and left for next time, as
+// are files already compacted, so it can run from cron over everything.
+// The .brc is written next to the original and synced before the original
+// is (with --delete) removed.
+//
+//   birbcam-compact /media/birbs/*.jl
+//   birbcam-compact --delete --min-age 3600 /media/birbs/*.brb
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "brb.h"
+#include "brc.h"
+#include "jl.h"
+
+#define ERR_COMPACT_OPEN "%s: %s\n"
+#define ERR_COMPACT_FORMAT "%s: not a .jl or .brb file\n"
+#define ERR_COMPACT_WRITE "%s: can't write: %s\n"
+#define MSG_COMPACT_SKIP "%s: %s, skipped\n"
+#define MSG_COMPACT_DONE                                                  \
+  "%s: %" G_GUINT64_FORMAT " records in %u chunks, %.2f MiB to %.2f MiB " \
+  "(%.1fx)\n"
+
+#define BC_COMPACT_MIN_AGE 60  // seconds since a file was last written
+
+typedef struct {
+  const gchar* path;
+  FILE* out;
+  BrbHeader header;
+  gboolean json;     // times come from the records, not a header
+  gboolean started;  // header written, which needs the first record
+  BrbRecord records[BRC_CHUNK_RECORDS];
+  gint64 times[BRC_CHUNK_RECORDS];
+  guint count;
+  guint8* buffer;  // a column being encoded
+  guint64 total;   // records
+  guint chunks;
+  gboolean failed;
+} Compactor;
+
+// encode column c of the records so far into compactor->buffer, returns the
+// bytes
+static guint encode_column(Compactor* compactor, BrcColumn column) {
+  guint8* out = compactor->buffer;
+  guint length = 0;
+  gint64 last = 0;
+  guint64 zeros = 0;
+  for (guint i = 0; i <= compactor->count; i++) {
+    gint64 delta = 0;
+    if (i < compactor->count) {
+      gint64 value = brc_get(&compactor->header, &compactor->records[i],
+                             compactor->times[i], column);
+      delta = value - last;
+      last = value;
+    }
+    // a run of zeros ends at a change or the end of the chunk
+    if (delta == 0 && i < compactor->count) {
+      zeros++;
+      continue;
+    }
+    if (zeros > 0) {
+      out[length++] = 0;
+      length += brc_put_varint(out + length, zeros - 1);
+      zeros = 0;
+    }
+    if (i < compactor->count)
+      length += brc_put_varint(out + length, brc_zigzag(delta));
+  }
+  return length;
+}
+
+static void write_chunk(Compactor* compactor) {
+  if (compactor->count == 0 || compactor->failed)
+    return;
+  BrcChunk chunk = {0};
+  chunk.count = compactor->count;
+  chunk.min_time = G_MAXINT64;
+  chunk.max_time = G_MININT64;
+  chunk.min_area = G_MAXUINT32;
+  chunk.min_species = G_MAXUINT8;
+  for (guint i = 0; i < compactor->count; i++) {
+    const BrbRecord* record = &compactor->records[i];
+    guint32 area = (guint32)record->width * record->height;
+    chunk.min_time = MIN(chunk.min_time, compactor->times[i]);
+    chunk.max_time = MAX(chunk.max_time, compactor->times[i]);
+    chunk.min_area = MIN(chunk.min_area, area);
+    chunk.max_area = MAX(chunk.max_area, area);
+    chunk.min_species = MIN(chunk.min_species, record->species);
+    chunk.max_species = MAX(chunk.max_species, record->species);
+    chunk.flags |= record->flags;
+  }
+
+  // the header is filled in once the sizes are known, so write it last
+  long start = ftell(compactor->out);
+  fseek(compactor->out, sizeof(chunk), SEEK_CUR);
+  for (guint c = 0; c < BRC_COLUMNS; c++) {
+    chunk.column_size[c] = encode_column(compactor, (BrcColumn)c);
+    chunk.size += chunk.column_size[c];
+    fwrite(compactor->buffer, 1, chunk.column_size[c], compactor->out);
+  }
+  // so the next chunk's header is aligned
+  static const guint8 padding[8] = {0};
+  guint pad = (8 - chunk.size % 8) % 8;
+  fwrite(padding, 1, pad, compactor->out);
+  chunk.size += pad;
+  long end = ftell(compactor->out);
+  fseek(compactor->out, start, SEEK_SET);
+  fwrite(&chunk, sizeof(chunk), 1, compactor->out);
+  fseek(compactor->out, end, SEEK_SET);
+  if (ferror(compactor->out))
+    compactor->failed = TRUE;
+  compactor->chunks++;
+  compactor->count = 0;
+}
+
+static void write_header(Compactor* compactor) {
+  if (fwrite(&compactor->header, sizeof(BrbHeader), 1, compactor->out) != 1)
+    compactor->failed = TRUE;
+  compactor->started = TRUE;
+}
+
+static void add_record(Compactor* compactor,
+                       const BrbRecord* record,
+                       gint64 time) {
+  if (!compactor->started) {
+    // a .jl file's times are its first record's
+    if (compactor->json) {
+      compactor->header.start_time = time;
+      compactor->header.start_pts = record->pts;
+    }
+    write_header(compactor);
+  }
+  compactor->records[compactor->count] = *record;
+  compactor->times[compactor->count] = time;
+  compactor->total++;
+  if (++compactor->count == BRC_CHUNK_RECORDS)
+    write_chunk(compactor);
+}
+
+static void read_json(Compactor* compactor, const gchar* data, gsize size) {
+  const gchar* end = data + size;
+  for (const gchar* p = data; p < end;) {
+    const gchar* eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      break;  // a partial last line, cut short by a crash
+    BrbRecord record;
+    gint64 time;
+    if (jl_parse_line(p, eol, &record, &time))
+      add_record(compactor, &record, time);
+    p = eol + 1;
+  }
+}
+
+static void read_brb(Compactor* compactor, const gchar* data, gsize size) {
+  const BrbHeader* header = (const BrbHeader*)data;
+  compactor->header.frame_width = header->frame_width;
+  compactor->header.frame_height = header->frame_height;
+  compactor->header.start_time = header->start_time;
+  compactor->header.start_pts = header->start_pts;
+  for (const gchar* p = data + header->header_size;
+       header->header_size <= size && p + header->record_size <= data + size;
+       p += header->record_size) {
+    // copied, as newer records may be bigger
+    BrbRecord record;
+    memcpy(&record, p, sizeof(record));
+    add_record(compactor, &record, brc_pts_time(header, record.pts));
+  }
+}
+
+// why path shouldn't be compacted (yet), or NULL if it should
+static const gchar* skip_reason(const gchar* path,
+                                const gchar* output,
+                                gint min_age) {
+  GStatBuf st;
+  if (g_stat(output, &st) == 0)
+    return "already compacted";
+  if (g_stat(path, &st) != 0)
+    return g_strerror(errno);
+  if (g_get_real_time() / G_USEC_PER_SEC - st.st_mtime < min_age)
+    return "still being written";
+  return NULL;
+}
+
+static gboolean compact(const gchar* path, gint min_age, gboolean delete) {
+  const gchar* dot = strrchr(path, '.');
+  if (dot != NULL && strchr(dot, G_DIR_SEPARATOR) != NULL)
+    dot = NULL;  // a dot in a directory name
+  g_autofree gchar* base = dot ? g_strndup(path, dot - path) : g_strdup(path);
+  g_autofree gchar* output = g_strconcat(base, BRC_EXTENSION, NULL);
+  g_autofree gchar* partial = g_strconcat(output, ".part", NULL);
+  const gchar* reason = skip_reason(path, output, min_age);
+  if (reason != NULL) {
+    g_print(MSG_COMPACT_SKIP, path, reason);
+    return TRUE;
+  }
+
+  GError* err = NULL;
+  GMappedFile* map = g_mapped_file_new(path, FALSE, &err);
+  if (map == NULL) {
+    g_printerr(ERR_COMPACT_OPEN, path, err->message);
+    g_error_free(err);
+    return FALSE;
+  }
+  const gchar* data = g_mapped_file_get_contents(map);
+  gsize size = g_mapped_file_get_length(map);
+  const BrbHeader* header = (const BrbHeader*)data;
+  gboolean brb = size >= sizeof(BrbHeader) &&
+                 !memcmp(header->magic, BRB_MAGIC, 4) &&
+                 header->record_size >= sizeof(BrbRecord);
+  if (!brb && size > 0 && data[0] != '{') {
+    g_printerr(ERR_COMPACT_FORMAT, path);
+    g_mapped_file_unref(map);
+    return FALSE;
+  }
+
+  Compactor* compactor = g_new0(Compactor, 1);
+  compactor->path = path;
+  compactor->buffer = g_malloc(2 * BRC_CHUNK_RECORDS * BRC_MAX_VARINT);
+  memcpy(compactor->header.magic, BRC_MAGIC, 4);
+  compactor->header.version = BRC_VERSION;
+  compactor->header.header_size = sizeof(BrbHeader);
+  compactor->header.record_size = sizeof(BrcChunk);
+  compactor->out = g_fopen(partial, "wb");
+  compactor->json = !brb;
+  gboolean ok = compactor->out != NULL;
+  if (ok) {
+    if (brb)
+      read_brb(compactor, data, size);
+    else
+      read_json(compactor, data, size);
+    if (!compactor->started)
+      write_header(compactor);  // no records, but still a .brc
+    write_chunk(compactor);
+    // on disk before it's in place, and before the original goes
+    ok = !compactor->failed && fflush(compactor->out) == 0 &&
+         fsync(fileno(compactor->out)) == 0;
+    ok = fclose(compactor->out) == 0 && ok;
+    ok = ok && g_rename(partial, output) == 0;
+  }
+  if (!ok) {
+    g_printerr(ERR_COMPACT_WRITE, output, g_strerror(errno));
+    g_unlink(partial);
+  } else {
+    GStatBuf st;
+    gdouble compacted = g_stat(output, &st) == 0 ? (gdouble)st.st_size : 0.0;
+    g_print(MSG_COMPACT_DONE, path, compactor->total, compactor->chunks,
+            size / 1048576.0, compacted / 1048576.0,
+            compacted > 0.0 ? size / compacted : 0.0);
+    if (delete && g_unlink(path) != 0) {
+      g_printerr(ERR_COMPACT_OPEN, path, g_strerror(errno));
+      ok = FALSE;
+    }
+  }
+  g_mapped_file_unref(map);
+  g_free(compactor->buffer);
+  g_free(compactor);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx =
+      g_option_context_new("FILE... - compact birbcam metadata into .brc");
+  GError* err = NULL;
+  gint min_age = BC_COMPACT_MIN_AGE;
+  gboolean delete = FALSE;
+  gchar** files = NULL;
+
+  GOptionEntry entries[] = {
+      {"min-age", 0, 0, G_OPTION_ARG_INT, &min_age,
+       "leave files written to in the last SECONDS alone (default: 60)",
+       "SECONDS"},
+      {"delete", 0, 0, G_OPTION_ARG_NONE, &delete,
+       "remove each original once its .brc is safely written", NULL},
+      {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, NULL,
+       NULL},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  if (files == NULL) {
+    g_printerr("no files given, use --help for full usage\n");
+    return 1;
+  }
+
+  gboolean ok = TRUE;
+  for (gchar** file = files; *file != NULL; file++)
+    ok = compact(*file, min_age, delete) && ok;
+  g_strfreev(files);
+  return ok ? 0 : 1;
+}
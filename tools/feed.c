@@ -0,0 +1,124 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// birbcam-feed: follows the shared memory record feed of a running birbcam
+// (--feed-shm) and prints each record as a JSON line as soon as it's
+// published. It's also a minimal example of a shared memory subscriber: map
+// the ring read only, keep a cursor, call brf_read() (see feed.h). Any
+// number of these can run at once, and none of them can slow birbcam down.
+//
+//   birbcam-feed -n birbcam
+//   birbcam-feed -n birbcam --backlog | grep '"k": 1'
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "feed.h"
+
+#define ERR_FEED_OPEN "%s: %s\n"
+#define ERR_FEED_FORMAT "%s: not a birbcam feed\n"
+
+#define BC_FEED_DEFAULT_NAME "birbcam"
+#define BC_FEED_READ_POLL_MS 1  // between looks at the ring, when idle
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx =
+      g_option_context_new("- print birbcam's live records");
+  GError* err = NULL;
+  gchar* name = NULL;
+  gboolean backlog = FALSE;
+
+  GOptionEntry entries[] = {
+      {"name", 'n', 0, G_OPTION_ARG_STRING, &name,
+       "shared memory NAME given to birbcam --feed-shm (default: birbcam)",
+       "NAME"},
+      {"backlog", 'b', 0, G_OPTION_ARG_NONE, &backlog,
+       "start with the records still in the ring, not just new ones", NULL},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  // shm_open wants exactly one leading slash, as in feed.c
+  if (name == NULL)
+    name = BC_FEED_DEFAULT_NAME;
+  g_autofree gchar* shm_name =
+      name[0] == '/' ? g_strdup(name) : g_strconcat("/", name, NULL);
+
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0) {
+    g_printerr(ERR_FEED_OPEN, shm_name, g_strerror(errno));
+    return 1;
+  }
+  // the header first, for the size of the rest
+  BrfHeader* header =
+      mmap(NULL, sizeof(BrfHeader), PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED || memcmp(header->magic, BRF_MAGIC, 4) ||
+      header->version != BRF_VERSION ||
+      header->slot_size != sizeof(BrfSlot) || header->capacity == 0 ||
+      (header->capacity & (header->capacity - 1))) {
+    g_printerr(ERR_FEED_FORMAT, shm_name);
+    close(fd);
+    return 1;
+  }
+  gsize size = header->header_size + (gsize)header->capacity * sizeof(BrfSlot);
+  munmap(header, sizeof(BrfHeader));
+  header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    g_printerr(ERR_FEED_OPEN, shm_name, g_strerror(errno));
+    return 1;
+  }
+  const BrfSlot* slots = BRF_SLOTS(header);
+
+  guint32 cursor = (guint32)g_atomic_int_get(&header->head);
+  if (backlog)
+    cursor -= MIN(cursor, header->capacity);  // lapped is fine, it catches up
+  BrfSlot slot;
+  guint32 lost = 0;
+  for (;;) {
+    gboolean any = FALSE;
+    while (brf_read(header, slots, &cursor, &slot, &lost)) {
+      if (lost) {
+        printf(JSON_FEED_LOST, lost);
+        lost = 0;
+      }
+      const BrbRecord* r = &slot.record;
+      printf(JSON_FEED_RECORD, r->source_id, r->frame_num, r->pts, slot.ts,
+             r->object_id, r->flags, r->top, r->height, r->left, r->width,
+             r->species);
+      any = TRUE;
+    }
+    if (any)
+      fflush(stdout);
+    else
+      g_usleep(BC_FEED_READ_POLL_MS * 1000);
+  }
+  return 0;
+}
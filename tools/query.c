@@ -0,0 +1,580 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// birbcam-query: answers questions about metadata files (.jl, .brb or .brc)
+// without a detour through Python. Files are mmapped and scanned in
+// parallel, one file per worker. JSON lines are split with memchr and only
+// the keys birbcam writes are parsed; .brb files are a flat array walk. With
+// --from, a file's .bri seek index (see brb.h) is binary searched to skip
+// straight to the first record that can match. Compacted .brc files (see
+// brc.h) are only decoded a chunk at a time where the chunk's zone map says
+// something in it might match.
+//
+//   birbcam-query -q per-minute --from 2019-09-01T06:00:00Z birbs_*.brb
+//   birbcam-query -q boxes --min-area 2500 birbs.jl
+//   birbcam-query --benchmark birbs_*.jl
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "brb.h"
+#include "brc.h"
+#include "jl.h"
+
+#define ERR_QUERY_OPEN "%s: %s\n"
+#define ERR_QUERY_FORMAT "%s: not a .jl, .brb or .brc file\n"
+#define ERR_QUERY_TIME "can't parse time: %s (ISO 8601 or unix seconds)\n"
+#define MSG_BENCHMARK                                                \
+  "%" G_GUINT64_FORMAT " records, %.1f MiB in %.3f s: %.0f records/s, " \
+  "%.1f MiB/s (best of %d)\n"
+
+#define BC_QUERY_BENCH_RUNS 5
+
+typedef enum {
+  QUERY_COUNT,       // matching boxes
+  QUERY_BOXES,       // every matching box
+  QUERY_FRAMES,      // every frame with a matching box
+  QUERY_PER_MINUTE,  // matching boxes per minute
+  QUERY_TRACKS,      // every track starting in range (files from --tracks)
+  QUERY_SKIPPED,     // every run of frames inference skipped
+} QueryType;
+
+typedef struct {
+  QueryType type;
+  gint64 from;  // wall time, us since the epoch, inclusive
+  gint64 to;    // exclusive
+  guint min_area;
+  gint species;    // only this BrbRecord species, -1 for any
+  gboolean quiet;  // scan, but produce no output (benchmark)
+} Query;
+
+typedef struct {
+  const gchar* path;
+  GString* out;         // boxes and frames, printed in file order
+  GHashTable* minutes;  // gint64 minute -> guint64 count
+  guint64 records;      // scanned
+  guint64 matched;
+  guint64 bytes;
+  gchar* error;
+} FileResult;
+
+// records are in pts order except track ends, which can be late
+static gboolean past_end(const Query* query, gint64 time) {
+  return query->to != G_MAXINT64 &&
+         time >= query->to + BRB_TRACK_TIMEOUT * G_USEC_PER_SEC;
+}
+
+static gint64 minute_key(gint64 time) {
+  return time / (60 * G_USEC_PER_SEC);
+}
+
+static void append_time(GString* out, gint64 time) {
+  GDateTime* dt = g_date_time_new_from_unix_utc(time / G_USEC_PER_SEC);
+  gchar* formatted = g_date_time_format(dt, "%Y-%m-%dT%H:%M:%S");
+  g_string_append_printf(out, "%s.%06dZ", formatted,
+                         (gint)(time % G_USEC_PER_SEC));
+  g_free(formatted);
+  g_date_time_unref(dt);
+}
+
+// a run's BRB_SKIP_* reason, as -q skipped prints it
+static const gchar* skip_reason(guint8 reason) {
+  switch (reason) {
+    case BRB_SKIP_MOTION:
+      return "motion";
+    case BRB_SKIP_RESTART:
+      return "restart";
+    default:
+      return "throttle";
+  }
+}
+
+// everything a query looks at happens here, for both formats
+static void visit(const Query* query,
+                  FileResult* result,
+                  const BrbRecord* record,
+                  gint64 time,
+                  const BrbRecord** last_frame) {
+  result->records++;
+  if (time < query->from || time >= query->to)
+    return;
+  // a skipped frame has no box, and only the skipped query wants them
+  if ((query->type == QUERY_SKIPPED) != !!(record->flags & BRB_FRAME_SKIPPED))
+    return;
+  if ((guint)record->width * record->height < query->min_area &&
+      query->type != QUERY_SKIPPED) {
+    return;
+  }
+  if (query->species >= 0 && record->species != query->species)
+    return;
+  if (query->type == QUERY_TRACKS && !(record->flags & BRB_TRACK_START))
+    return;
+  // a skipped record is a run of frames, and it's frames that are counted
+  result->matched +=
+      query->type == QUERY_SKIPPED ? brb_skip_count(record) : 1;
+  if (query->quiet)
+    return;
+
+  switch (query->type) {
+    case QUERY_COUNT:
+      break;
+    case QUERY_BOXES:
+      append_time(result->out, time);
+      g_string_append_printf(
+          result->out, " %" G_GUINT64_FORMAT " %d %u %u %u %u\n", record->pts,
+          record->frame_num, record->left, record->top, record->width,
+          record->height);
+      break;
+    case QUERY_SKIPPED:
+      append_time(result->out, time);
+      g_string_append_printf(
+          result->out,
+          " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %u %s\n", record->pts,
+          brb_skip_last(record), brb_skip_count(record),
+          skip_reason(record->class_id));
+      break;
+    case QUERY_FRAMES:
+      // a frame's boxes are written together
+      if (*last_frame != NULL && (*last_frame)->pts == record->pts &&
+          (*last_frame)->frame_num == record->frame_num) {
+        break;
+      }
+      append_time(result->out, time);
+      g_string_append_printf(result->out, " %" G_GUINT64_FORMAT " %d\n",
+                             record->pts, record->frame_num);
+      break;
+    case QUERY_PER_MINUTE: {
+      gint64 minute = minute_key(time);
+      guint64* count = g_hash_table_lookup(result->minutes, &minute);
+      if (count == NULL) {
+        gint64* key = g_new(gint64, 1);
+        *key = minute;
+        count = g_new0(guint64, 1);
+        g_hash_table_insert(result->minutes, key, count);
+      }
+      (*count)++;
+      break;
+    }
+    case QUERY_TRACKS:
+      append_time(result->out, time);
+      g_string_append_printf(result->out, " %u %u %u %u %u\n",
+                             record->object_id, record->left, record->top,
+                             record->width, record->height);
+      break;
+  }
+  *last_frame = record;
+}
+
+// the byte offset in a metadata file to start scanning at for query->from,
+// from its .bri index if there is one, else 0
+static gsize seek_start(const Query* query, const gchar* path, gsize size) {
+  if (query->from == G_MININT64)
+    return 0;
+
+  const gchar* dot = strrchr(path, '.');
+  if (dot != NULL && strchr(dot, G_DIR_SEPARATOR) != NULL)
+    dot = NULL;  // a dot in a directory name
+  g_autofree gchar* base = dot ? g_strndup(path, dot - path) : g_strdup(path);
+  g_autofree gchar* index_path = g_strconcat(base, ".bri", NULL);
+  GMappedFile* map = g_mapped_file_new(index_path, FALSE, NULL);
+  if (map == NULL)
+    return 0;
+
+  gsize start = 0;
+  const gchar* data = g_mapped_file_get_contents(map);
+  gsize length = g_mapped_file_get_length(map);
+  const BriHeader* header = (const BriHeader*)data;
+  if (length >= sizeof(BriHeader) && !memcmp(header->magic, BRI_MAGIC, 4) &&
+      header->record_size >= sizeof(BriEntry)) {
+    gsize count = (length - header->header_size) / header->record_size;
+    const gchar* entries = data + header->header_size;
+    // the last keyframe at or before from; everything we want is after it
+    gsize lo = 0, hi = count;
+    while (lo < hi) {
+      gsize mid = lo + (hi - lo) / 2;
+      const BriEntry* entry =
+          (const BriEntry*)(entries + mid * header->record_size);
+      if (entry->time <= query->from)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0) {
+      const BriEntry* entry =
+          (const BriEntry*)(entries + (lo - 1) * header->record_size);
+      if (entry->meta_offset <= size)
+        start = entry->meta_offset;
+    }
+  }
+  g_mapped_file_unref(map);
+  return start;
+}
+
+static void scan_json(const Query* query,
+                      FileResult* result,
+                      const gchar* data,
+                      gsize size) {
+  const gchar* p = data + seek_start(query, result->path, size);
+  const gchar* end = data + size;
+  BrbRecord records[2];  // the current one and the last that matched
+  const BrbRecord* last_frame = NULL;
+  guint current = 0;
+  while (p < end) {
+    const gchar* eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      break;  // a partial last line, cut short by a crash
+    gint64 time;
+    if (jl_parse_line(p, eol, &records[current], &time)) {
+      // records are in pts order, nothing after this can match
+      if (past_end(query, time))
+        break;
+      const BrbRecord* before = last_frame;
+      visit(query, result, &records[current], time, &last_frame);
+      if (last_frame != before)
+        current ^= 1;  // keep it, last_frame points at it
+    }
+    p = eol + 1;
+  }
+}
+
+static void scan_brb(const Query* query,
+                     FileResult* result,
+                     const gchar* data,
+                     gsize size) {
+  const BrbHeader* header = (const BrbHeader*)data;
+  if (header->header_size > size)
+    return;
+  gsize start = MAX(seek_start(query, result->path, size),
+                    (gsize)header->header_size);
+  // the index points at a record boundary, but don't trust it blindly
+  start -= (start - header->header_size) % header->record_size;
+  const BrbRecord* last_frame = NULL;
+  for (const gchar* p = data + start; p + header->record_size <= data + size;
+       p += header->record_size) {
+    const BrbRecord* record = (const BrbRecord*)p;
+    gint64 time = header->start_time +
+                  (gint64)(record->pts - header->start_pts) / 1000;
+    if (past_end(query, time))
+      break;
+    visit(query, result, record, time, &last_frame);
+  }
+}
+
+// whether anything in a chunk could match, from its zone map alone. The same
+// tests as visit(), in the same order.
+static gboolean chunk_may_match(const Query* query, const BrcChunk* chunk) {
+  if (chunk->max_time < query->from || chunk->min_time >= query->to)
+    return FALSE;
+  if (query->type == QUERY_SKIPPED)
+    return (chunk->flags & BRB_FRAME_SKIPPED) != 0;
+  if (chunk->max_area < query->min_area)
+    return FALSE;
+  if (query->species >= 0 && (query->species < chunk->min_species ||
+                              query->species > chunk->max_species)) {
+    return FALSE;
+  }
+  if (query->type == QUERY_TRACKS && !(chunk->flags & BRB_TRACK_START))
+    return FALSE;
+  return TRUE;
+}
+
+static void scan_brc(const Query* query,
+                     FileResult* result,
+                     const gchar* data,
+                     gsize size) {
+  const BrbHeader* header = (const BrbHeader*)data;
+  if (header->header_size > size)
+    return;
+  BrbRecord* records = g_new(BrbRecord, BRC_CHUNK_RECORDS);
+  gint64* times = g_new(gint64, BRC_CHUNK_RECORDS);
+  BrbRecord last;  // last_frame, as records is reused for every chunk
+  const BrbRecord* last_frame = NULL;
+  const guint8* end = (const guint8*)data + size;
+  const guint8* p = (const guint8*)data + header->header_size;
+  while ((gsize)(end - p) >= header->record_size) {
+    const BrcChunk* chunk = (const BrcChunk*)p;
+    // chunks are in time order, give or take the track ends
+    if (past_end(query, chunk->min_time))
+      break;
+    if (chunk_may_match(query, chunk)) {
+      if (!brc_decode(header, p, end - p, records, times))
+        break;  // cut short by a crash
+      for (guint i = 0; i < chunk->count; i++)
+        visit(query, result, &records[i], times[i], &last_frame);
+      if (last_frame != NULL) {
+        last = *last_frame;
+        last_frame = &last;
+      }
+    }
+    gsize length = (gsize)header->record_size + chunk->size;
+    if (length > (gsize)(end - p))
+      break;
+    p += length;
+  }
+  g_free(times);
+  g_free(records);
+}
+
+static void scan_file(FileResult* result, const Query* query) {
+  GError* err = NULL;
+  GMappedFile* map = g_mapped_file_new(result->path, FALSE, &err);
+  if (map == NULL) {
+    result->error = g_strdup_printf(ERR_QUERY_OPEN, result->path, err->message);
+    g_error_free(err);
+    return;
+  }
+  const gchar* data = g_mapped_file_get_contents(map);
+  gsize size = g_mapped_file_get_length(map);
+  result->bytes = size;
+
+  const BrbHeader* header = (const BrbHeader*)data;
+  if (size >= sizeof(BrbHeader) && !memcmp(header->magic, BRB_MAGIC, 4) &&
+      header->record_size >= sizeof(BrbRecord)) {
+    scan_brb(query, result, data, size);
+  } else if (size >= sizeof(BrbHeader) &&
+             !memcmp(header->magic, BRC_MAGIC, 4) &&
+             header->record_size >= sizeof(BrcChunk)) {
+    scan_brc(query, result, data, size);
+  } else if (size == 0 || data[0] == '{') {
+    scan_json(query, result, data, size);
+  } else {
+    result->error = g_strdup_printf(ERR_QUERY_FORMAT, result->path);
+  }
+  g_mapped_file_unref(map);
+}
+
+static void result_clear(FileResult* result) {
+  g_string_truncate(result->out, 0);
+  g_hash_table_remove_all(result->minutes);
+  g_clear_pointer(&result->error, g_free);
+  result->records = result->matched = result->bytes = 0;
+}
+
+// scan every file, a worker per processor. Returns FALSE if any failed.
+static gboolean run(const Query* query,
+                    FileResult* results,
+                    guint count,
+                    gint threads) {
+  GThreadPool* pool =
+      g_thread_pool_new((GFunc)scan_file, (gpointer)query, threads, TRUE, NULL);
+  for (guint i = 0; i < count; i++) {
+    result_clear(&results[i]);
+    g_thread_pool_push(pool, &results[i], NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);  // wait for all of them
+
+  gboolean ok = TRUE;
+  for (guint i = 0; i < count; i++) {
+    if (results[i].error != NULL) {
+      g_printerr("%s", results[i].error);
+      ok = FALSE;
+    }
+  }
+  return ok;
+}
+
+static gint compare_minutes(gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_results(const Query* query,
+                          FileResult* results,
+                          guint count) {
+  guint64 matched = 0;
+  GHashTable* minutes =
+      g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+  for (guint i = 0; i < count; i++) {
+    fputs(results[i].out->str, stdout);
+    matched += results[i].matched;
+
+    // a segment boundary can split a minute between files
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, results[i].minutes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      guint64* total = g_hash_table_lookup(minutes, key);
+      if (total == NULL) {
+        total = g_new0(guint64, 1);
+        g_hash_table_insert(minutes, key, total);
+      }
+      *total += *(guint64*)value;
+    }
+  }
+
+  if (query->type == QUERY_COUNT || query->type == QUERY_TRACKS) {
+    g_print("%" G_GUINT64_FORMAT "\n", matched);
+  } else if (query->type == QUERY_PER_MINUTE) {
+    GList* keys =
+        g_list_sort(g_hash_table_get_keys(minutes), compare_minutes);
+    GString* line = g_string_new(NULL);
+    for (GList* l = keys; l != NULL; l = l->next) {
+      g_string_truncate(line, 0);
+      append_time(line, *(gint64*)l->data * 60 * G_USEC_PER_SEC);
+      g_print("%s %" G_GUINT64_FORMAT "\n", line->str,
+              *(guint64*)g_hash_table_lookup(minutes, l->data));
+    }
+    g_string_free(line, TRUE);
+    g_list_free(keys);
+  }
+  // keys belong to the per file tables, which outlive this one
+  g_hash_table_unref(minutes);
+}
+
+static gboolean parse_time(const gchar* text, gint64* out) {
+  gchar* end;
+  gint64 seconds = g_ascii_strtoll(text, &end, 10);
+  if (*text != '\0' && *end == '\0') {
+    *out = seconds * G_USEC_PER_SEC;
+    return TRUE;
+  }
+  GDateTime* dt = g_date_time_new_from_iso8601(text, NULL);
+  if (dt == NULL) {
+    g_printerr(ERR_QUERY_TIME, text);
+    return FALSE;
+  }
+  *out = g_date_time_to_unix(dt) * G_USEC_PER_SEC +
+         g_date_time_get_microsecond(dt);
+  g_date_time_unref(dt);
+  return TRUE;
+}
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx =
+      g_option_context_new("FILE... - query birbcam metadata");
+  GError* err = NULL;
+  gchar* type = NULL;
+  gchar* from = NULL;
+  gchar* to = NULL;
+  gint min_area = 0;
+  gint species = -1;
+  gint threads = 0;
+  gboolean benchmark = FALSE;
+  gchar** files = NULL;
+
+  GOptionEntry entries[] = {
+      {"query", 'q', 0, G_OPTION_ARG_STRING, &type,
+       "count, boxes, frames, per-minute, tracks or skipped (default: "
+       "count)",
+       "QUERY"},
+      {"from", 0, 0, G_OPTION_ARG_STRING, &from,
+       "only records at or after TIME (ISO 8601 or unix seconds)", "TIME"},
+      {"to", 0, 0, G_OPTION_ARG_STRING, &to, "only records before TIME",
+       "TIME"},
+      {"min-area", 'a', 0, G_OPTION_ARG_INT, &min_area,
+       "only boxes of at least PIXELS (width * height)", "PIXELS"},
+      {"species", 's', 0, G_OPTION_ARG_INT, &species,
+       "only birds classified as ID (see --classify, 0 for unclassified)",
+       "ID"},
+      {"threads", 'j', 0, G_OPTION_ARG_INT, &threads,
+       "files scanned at once (default: one per processor)", "N"},
+      {"benchmark", 0, 0, G_OPTION_ARG_NONE, &benchmark,
+       "time the scan and report records/s instead of results", NULL},
+      {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, NULL,
+       NULL},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  if (files == NULL) {
+    g_printerr("no metadata files given, use --help for full usage\n");
+    return 1;
+  }
+
+  Query query = {QUERY_COUNT, G_MININT64, G_MAXINT64, (guint)MAX(min_area, 0),
+                 species, benchmark};
+  if (type == NULL || !strcmp(type, "count")) {
+    query.type = QUERY_COUNT;
+  } else if (!strcmp(type, "boxes")) {
+    query.type = QUERY_BOXES;
+  } else if (!strcmp(type, "frames")) {
+    query.type = QUERY_FRAMES;
+  } else if (!strcmp(type, "per-minute")) {
+    query.type = QUERY_PER_MINUTE;
+  } else if (!strcmp(type, "tracks")) {
+    query.type = QUERY_TRACKS;
+  } else if (!strcmp(type, "skipped")) {
+    query.type = QUERY_SKIPPED;
+  } else {
+    g_printerr("unknown query: %s (choices: count, boxes, frames, "
+               "per-minute, tracks, skipped)\n",
+               type);
+    return 1;
+  }
+  if ((from != NULL && !parse_time(from, &query.from)) ||
+      (to != NULL && !parse_time(to, &query.to))) {
+    return 1;
+  }
+  if (threads <= 0)
+    threads = (gint)g_get_num_processors();
+
+  guint count = g_strv_length(files);
+  FileResult* results = g_new0(FileResult, count);
+  for (guint i = 0; i < count; i++) {
+    results[i].path = files[i];
+    results[i].out = g_string_new(NULL);
+    results[i].minutes =
+        g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+  }
+
+  int status = 0;
+  if (benchmark) {
+    // the first run also pays for the page cache, so report the best
+    gint64 best = G_MAXINT64;
+    guint64 records = 0, bytes = 0;
+    for (int run_i = 0; run_i < BC_QUERY_BENCH_RUNS && status == 0; run_i++) {
+      gint64 start = g_get_monotonic_time();
+      if (!run(&query, results, count, threads))
+        status = 1;
+      best = MIN(best, g_get_monotonic_time() - start);
+    }
+    for (guint i = 0; i < count; i++) {
+      records += results[i].records;
+      bytes += results[i].bytes;
+    }
+    gdouble seconds = MAX(best, 1) / (gdouble)G_USEC_PER_SEC;
+    g_print(MSG_BENCHMARK, records, bytes / 1048576.0, seconds,
+            records / seconds, bytes / 1048576.0 / seconds,
+            BC_QUERY_BENCH_RUNS);
+  } else if (run(&query, results, count, threads)) {
+    print_results(&query, results, count);
+  } else {
+    status = 1;
+  }
+
+  for (guint i = 0; i < count; i++) {
+    g_string_free(results[i].out, TRUE);
+    g_hash_table_unref(results[i].minutes);
+    g_free(results[i].error);
+  }
+  g_free(results);
+  g_strfreev(files);
+  g_free(type);
+  g_free(from);
+  g_free(to);
+  return status;
+}
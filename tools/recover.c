@@ -0,0 +1,645 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// birbcam-recover: makes a recording that was cut short (power loss, crash,
+// kill -9) seekable again, in place, without remuxing. matroskamux writes the
+// index (Cues) and the final element sizes only when a file is closed, so a
+// file that never was plays from the start but can't be seeked, and players
+// may not even know how long it is. This walks the file once, reading only
+// element headers and the first bytes of each block, and then:
+//
+//   - cuts off a half-written last Cluster (or the part of it that is),
+//   - appends Cues with an entry per Cluster that starts with a video
+//     keyframe (birbcam starts one every keyframe, every second),
+//   - fills in the sizes of the Segment and the last Cluster, the SeekHead
+//     entries and the Duration, which matroskamux left as placeholders.
+//
+// Nothing but the tail of the file and a few header bytes is written, so
+// recovering a day's recording takes about as long as reading its headers.
+// Files that were closed properly are left alone.
+//
+//   birbcam-recover birbs.mkv
+//   birbcam-recover --dry-run birbs_*.mkv
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define ERR_RECOVER_OPEN "%s: %s\n"
+#define ERR_RECOVER_FORMAT "%s: not a Matroska file\n"
+#define ERR_RECOVER_EMPTY "%s: no complete clusters, nothing to recover\n"
+#define ERR_RECOVER_PATCH "%s: can't fill in %s, it has no room\n"
+#define MSG_RECOVER_OK "%s: closed properly, nothing to do\n"
+#define MSG_RECOVER_DONE                                                  \
+  "%s: %u clusters, %u cues, %.1f s%s, %" G_GUINT64_FORMAT                \
+  " bytes of partial cluster cut\n"
+
+// the EBML and Matroska element IDs we care about
+#define EBML_ID_HEADER 0x1A45DFA3
+#define EBML_ID_VOID 0xEC
+#define MKV_ID_SEGMENT 0x18538067
+#define MKV_ID_SEEKHEAD 0x114D9B74
+#define MKV_ID_SEEK 0x4DBB
+#define MKV_ID_SEEKID 0x53AB
+#define MKV_ID_SEEKPOSITION 0x53AC
+#define MKV_ID_INFO 0x1549A966
+#define MKV_ID_TIMECODESCALE 0x2AD7B1
+#define MKV_ID_DURATION 0x4489
+#define MKV_ID_TRACKS 0x1654AE6B
+#define MKV_ID_TRACKENTRY 0xAE
+#define MKV_ID_TRACKNUMBER 0xD7
+#define MKV_ID_TRACKTYPE 0x83
+#define MKV_ID_CLUSTER 0x1F43B675
+#define MKV_ID_TIMECODE 0xE7
+#define MKV_ID_SIMPLEBLOCK 0xA3
+#define MKV_ID_BLOCKGROUP 0xA0
+#define MKV_ID_BLOCK 0xA1
+#define MKV_ID_REFERENCEBLOCK 0xFB
+#define MKV_ID_CUES 0x1C53BB6B
+#define MKV_ID_CUEPOINT 0xBB
+#define MKV_ID_CUETIME 0xB3
+#define MKV_ID_CUETRACKPOSITIONS 0xB7
+#define MKV_ID_CUETRACK 0xF7
+#define MKV_ID_CUECLUSTERPOSITION 0xF1
+
+#define MKV_TRACK_VIDEO 1
+#define MKV_DEFAULT_TIMECODESCALE 1000000  // ns per tick
+#define BC_RECOVER_SEEKS 8  // SeekHead entries we can fill in
+
+typedef struct {
+  guint64 start;  // of the element (its ID)
+  guint64 data;   // of its contents
+  guint64 size;   // of its contents, if known
+  guint size_len;  // bytes in the size field
+  gboolean unknown;  // size
+  guint32 id;
+} Element;
+
+typedef struct {
+  guint32 id;      // of the element it points to
+  guint64 start;   // of the Seek entry
+  guint64 length;  // of the Seek entry
+  guint64 position;    // of the SeekPosition value
+  guint position_len;  // 0 if there is none
+} SeekEntry;
+
+typedef struct {
+  guint64 time;  // ticks
+  guint64 cluster;  // relative to the segment's contents
+} CuePoint;
+
+typedef struct {
+  const guint8* data;
+  guint64 length;
+
+  Element segment;
+  SeekEntry seeks[BC_RECOVER_SEEKS];
+  guint n_seeks;
+  guint64 info;    // element start, 0 if there is none
+  guint64 tracks;  //
+  guint64 duration;  // of the Duration value, 0 if there is none
+  guint duration_len;
+  guint64 timecode_scale;
+  guint64 video_track;  // 0 for the first track with a keyframe
+  gboolean cues;  // there's a complete Cues element
+
+  GArray* cue_points;  // CuePoint
+  guint clusters;
+  guint64 last_time;  // ticks, of the last block
+  guint64 end;        // of the last complete element, where the file is cut
+  Element last_cluster;  // whose size needs filling in, if size_len
+  guint64 cut;           // bytes of it that were incomplete
+} MkvFile;
+
+// an EBML variable size integer. Returns its length, 0 if it runs past end
+// or is invalid. IDs keep their marker bit, sizes don't.
+static guint read_vint(const guint8* p,
+                       const guint8* end,
+                       gboolean marker,
+                       guint64* value,
+                       gboolean* unknown) {
+  if (p >= end || *p == 0)
+    return 0;
+  guint len = 1;
+  while (!(*p & (0x80 >> (len - 1))))
+    len++;
+  if (p + len > end)
+    return 0;
+  guint64 v = marker ? *p : *p & (0xFF >> len);
+  gboolean ones = v == (guint64)(0xFF >> len);
+  for (guint i = 1; i < len; i++) {
+    v = (v << 8) | p[i];
+    ones = ones && p[i] == 0xFF;
+  }
+  *value = v;
+  if (unknown != NULL)
+    *unknown = !marker && ones;
+  return len;
+}
+
+// the element header at pos, FALSE if it doesn't fit before end
+static gboolean read_element(const MkvFile* mkv,
+                             guint64 pos,
+                             guint64 end,
+                             Element* elem) {
+  const guint8* p = mkv->data + pos;
+  const guint8* limit = mkv->data + end;
+  guint64 id = 0;
+  guint id_len = read_vint(p, limit, TRUE, &id, NULL);
+  if (id_len == 0 || id_len > 4)
+    return FALSE;
+  guint size_len =
+      read_vint(p + id_len, limit, FALSE, &elem->size, &elem->unknown);
+  if (size_len == 0)
+    return FALSE;
+  elem->id = (guint32)id;
+  elem->start = pos;
+  elem->data = pos + id_len + size_len;
+  elem->size_len = size_len;
+  return TRUE;
+}
+
+// the element's contents are all there
+static gboolean complete(const Element* elem, guint64 end) {
+  return !elem->unknown && elem->data + elem->size <= end;
+}
+
+static guint64 read_uint(const MkvFile* mkv, const Element* elem) {
+  guint64 v = 0;
+  for (guint64 i = 0; i < elem->size && i < 8; i++)
+    v = (v << 8) | mkv->data[elem->data + i];
+  return v;
+}
+
+static void scan_seekhead(MkvFile* mkv, const Element* seekhead) {
+  Element seek, child;
+  guint64 end = seekhead->data + seekhead->size;
+  for (guint64 pos = seekhead->data;
+       read_element(mkv, pos, end, &seek) && complete(&seek, end);
+       pos = seek.data + seek.size) {
+    if (seek.id != MKV_ID_SEEK || mkv->n_seeks == BC_RECOVER_SEEKS)
+      continue;
+    SeekEntry* entry = &mkv->seeks[mkv->n_seeks++];
+    memset(entry, 0, sizeof(*entry));
+    entry->start = seek.start;
+    entry->length = seek.data + seek.size - seek.start;
+    guint64 seek_end = seek.data + seek.size;
+    for (guint64 cpos = seek.data;
+         read_element(mkv, cpos, seek_end, &child) &&
+         complete(&child, seek_end);
+         cpos = child.data + child.size) {
+      if (child.id == MKV_ID_SEEKID) {
+        entry->id = (guint32)read_uint(mkv, &child);
+      } else if (child.id == MKV_ID_SEEKPOSITION) {
+        entry->position = child.data;
+        entry->position_len = (guint)child.size;
+      }
+    }
+  }
+}
+
+static void scan_info(MkvFile* mkv, const Element* info) {
+  Element child;
+  guint64 end = info->data + info->size;
+  mkv->info = info->start;
+  for (guint64 pos = info->data;
+       read_element(mkv, pos, end, &child) && complete(&child, end);
+       pos = child.data + child.size) {
+    if (child.id == MKV_ID_TIMECODESCALE) {
+      mkv->timecode_scale = read_uint(mkv, &child);
+    } else if (child.id == MKV_ID_DURATION &&
+               (child.size == 4 || child.size == 8)) {
+      mkv->duration = child.data;
+      mkv->duration_len = (guint)child.size;
+    }
+  }
+}
+
+static void scan_tracks(MkvFile* mkv, const Element* tracks) {
+  Element entry, child;
+  guint64 end = tracks->data + tracks->size;
+  mkv->tracks = tracks->start;
+  for (guint64 pos = tracks->data;
+       read_element(mkv, pos, end, &entry) && complete(&entry, end);
+       pos = entry.data + entry.size) {
+    if (entry.id != MKV_ID_TRACKENTRY)
+      continue;
+    guint64 number = 0, type = 0;
+    guint64 entry_end = entry.data + entry.size;
+    for (guint64 cpos = entry.data;
+         read_element(mkv, cpos, entry_end, &child) &&
+         complete(&child, entry_end);
+         cpos = child.data + child.size) {
+      if (child.id == MKV_ID_TRACKNUMBER)
+        number = read_uint(mkv, &child);
+      else if (child.id == MKV_ID_TRACKTYPE)
+        type = read_uint(mkv, &child);
+    }
+    if (type == MKV_TRACK_VIDEO && mkv->video_track == 0)
+      mkv->video_track = number;
+  }
+}
+
+// a (Simple)Block's track, time relative to the cluster and keyframe flag
+static gboolean read_block(const MkvFile* mkv,
+                           const Element* block,
+                           guint64* track,
+                           gint16* time,
+                           guint8* flags) {
+  const guint8* p = mkv->data + block->data;
+  const guint8* end = p + block->size;
+  guint len = read_vint(p, end, FALSE, track, NULL);
+  if (len == 0 || p + len + 3 > end)
+    return FALSE;
+  *time = (gint16)((p[len] << 8) | p[len + 1]);
+  *flags = p[len + 2];
+  return TRUE;
+}
+
+// one of the things that can follow a cluster, which ends one of unknown size
+static gboolean is_top_level(guint32 id) {
+  return id == MKV_ID_CLUSTER || id == MKV_ID_CUES || id == MKV_ID_SEEKHEAD ||
+         id == MKV_ID_INFO || id == MKV_ID_TRACKS || id == 0x1254C367 ||
+         id == 0x1043A770 || id == 0x1941A469 || id == MKV_ID_SEGMENT ||
+         id == EBML_ID_HEADER;
+}
+
+// returns where the cluster's last complete child ends
+static guint64 scan_cluster(MkvFile* mkv, const Element* cluster) {
+  Element child;
+  guint64 end = cluster->unknown
+                    ? mkv->length
+                    : MIN(cluster->data + cluster->size, mkv->length);
+  guint64 timecode = 0;
+  gboolean cued = FALSE;
+  gboolean blocks = FALSE;
+  guint64 pos = cluster->data;
+
+  while (read_element(mkv, pos, end, &child) && complete(&child, end)) {
+    if (cluster->unknown && is_top_level(child.id))
+      break;
+    guint64 track = 0;
+    gint16 time = 0;
+    guint8 flags = 0;
+    gboolean keyframe = FALSE;
+    gboolean block = FALSE;
+
+    if (child.id == MKV_ID_TIMECODE) {
+      timecode = read_uint(mkv, &child);
+    } else if (child.id == MKV_ID_SIMPLEBLOCK) {
+      block = read_block(mkv, &child, &track, &time, &flags);
+      keyframe = (flags & 0x80) != 0;
+    } else if (child.id == MKV_ID_BLOCKGROUP) {
+      // a keyframe is a Block without a ReferenceBlock
+      Element part;
+      guint64 group_end = child.data + child.size;
+      keyframe = TRUE;
+      for (guint64 gpos = child.data;
+           read_element(mkv, gpos, group_end, &part) &&
+           complete(&part, group_end);
+           gpos = part.data + part.size) {
+        if (part.id == MKV_ID_BLOCK)
+          block = read_block(mkv, &part, &track, &time, &flags);
+        else if (part.id == MKV_ID_REFERENCEBLOCK)
+          keyframe = FALSE;
+      }
+    }
+
+    if (block) {
+      guint64 at = (guint64)MAX((gint64)timecode + time, 0);
+      blocks = TRUE;
+      mkv->last_time = MAX(mkv->last_time, at);
+      if (mkv->video_track == 0 && keyframe)
+        mkv->video_track = track;
+      if (keyframe && !cued && track == mkv->video_track) {
+        CuePoint cue = {at, cluster->start - mkv->segment.data};
+        g_array_append_val(mkv->cue_points, cue);
+        cued = TRUE;
+      }
+    }
+    pos = child.data + child.size;
+  }
+  return blocks ? pos : cluster->start;
+}
+
+static gboolean scan(MkvFile* mkv, const gchar* path) {
+  Element elem;
+  if (!read_element(mkv, 0, mkv->length, &elem) || elem.id != EBML_ID_HEADER ||
+      !complete(&elem, mkv->length) ||
+      !read_element(mkv, elem.data + elem.size, mkv->length, &mkv->segment) ||
+      mkv->segment.id != MKV_ID_SEGMENT) {
+    g_printerr(ERR_RECOVER_FORMAT, path);
+    return FALSE;
+  }
+
+  mkv->end = mkv->segment.data;
+  guint64 pos = mkv->segment.data;
+  while (read_element(mkv, pos, mkv->length, &elem)) {
+    if (elem.id == MKV_ID_CLUSTER) {
+      guint64 cluster_end = scan_cluster(mkv, &elem);
+      if (cluster_end == elem.start)
+        break;  // nothing in it made it to disk
+      mkv->clusters++;
+      mkv->end = cluster_end;
+      if (elem.unknown || cluster_end != elem.data + elem.size) {
+        // cut short, or never given a size
+        mkv->last_cluster = elem;
+        mkv->cut = elem.unknown
+                       ? 0
+                       : MIN(elem.data + elem.size, mkv->length) - cluster_end;
+        if (cluster_end != elem.data + elem.size && !elem.unknown)
+          break;
+        pos = cluster_end;
+        continue;
+      }
+      pos = cluster_end;
+      continue;
+    }
+
+    if (!complete(&elem, mkv->length))
+      break;  // truncated, or a size we can't follow
+    if (elem.id == MKV_ID_SEEKHEAD)
+      scan_seekhead(mkv, &elem);
+    else if (elem.id == MKV_ID_INFO)
+      scan_info(mkv, &elem);
+    else if (elem.id == MKV_ID_TRACKS)
+      scan_tracks(mkv, &elem);
+    else if (elem.id == MKV_ID_CUES)
+      mkv->cues = TRUE;
+    pos = mkv->end = elem.data + elem.size;
+  }
+  return TRUE;
+}
+
+static void append_id(GByteArray* out, guint32 id) {
+  guint8 bytes[4];
+  guint len = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+  for (guint i = 0; i < len; i++)
+    bytes[i] = (guint8)(id >> (8 * (len - 1 - i)));
+  g_byte_array_append(out, bytes, len);
+}
+
+// size as an EBML vint of len bytes, into p. FALSE if it doesn't fit.
+static gboolean put_size(guint8* p, guint64 size, guint len) {
+  if (len == 0 || len > 8 || size >= (G_GUINT64_CONSTANT(1) << (7 * len)) - 1)
+    return FALSE;
+  guint64 v = size | (G_GUINT64_CONSTANT(1) << (7 * len));
+  for (guint i = 0; i < len; i++)
+    p[i] = (guint8)(v >> (8 * (len - 1 - i)));
+  return TRUE;
+}
+
+static void append_uint(GByteArray* out, guint32 id, guint64 value) {
+  guint8 bytes[9];
+  guint len = 1;
+  while (len < 8 && value >> (8 * len))
+    len++;
+  append_id(out, id);
+  put_size(bytes, len, 1);
+  for (guint i = 0; i < len; i++)
+    bytes[1 + i] = (guint8)(value >> (8 * (len - 1 - i)));
+  g_byte_array_append(out, bytes, len + 1);
+}
+
+static void append_master(GByteArray* out, guint32 id, GByteArray* body) {
+  guint8 size[8];
+  append_id(out, id);
+  put_size(size, body->len, 8);
+  g_byte_array_append(out, size, sizeof(size));
+  g_byte_array_append(out, body->data, body->len);
+}
+
+static GByteArray* build_cues(const MkvFile* mkv) {
+  GByteArray* points = g_byte_array_new();
+  GByteArray* point = g_byte_array_new();
+  GByteArray* positions = g_byte_array_new();
+  for (guint i = 0; i < mkv->cue_points->len; i++) {
+    const CuePoint* cue = &g_array_index(mkv->cue_points, CuePoint, i);
+    g_byte_array_set_size(positions, 0);
+    append_uint(positions, MKV_ID_CUETRACK, mkv->video_track);
+    append_uint(positions, MKV_ID_CUECLUSTERPOSITION, cue->cluster);
+    g_byte_array_set_size(point, 0);
+    append_uint(point, MKV_ID_CUETIME, cue->time);
+    append_master(point, MKV_ID_CUETRACKPOSITIONS, positions);
+    append_master(points, MKV_ID_CUEPOINT, point);
+  }
+  GByteArray* cues = g_byte_array_new();
+  append_master(cues, MKV_ID_CUES, points);
+  g_byte_array_unref(positions);
+  g_byte_array_unref(point);
+  g_byte_array_unref(points);
+  return cues;
+}
+
+static gboolean pwrite_all(int fd, const guint8* p, gsize len, guint64 at) {
+  while (len > 0) {
+    gssize n = pwrite(fd, p, len, (off_t)at);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return FALSE;
+    p += n;
+    len -= n;
+    at += n;
+  }
+  return TRUE;
+}
+
+// an unsigned integer, big endian, into the len bytes already there
+static gboolean patch_uint(int fd, guint64 at, guint len, guint64 value) {
+  guint8 bytes[8];
+  if (len == 0 || len > 8 || (len < 8 && value >> (8 * len)))
+    return FALSE;
+  for (guint i = 0; i < len; i++)
+    bytes[i] = (guint8)(value >> (8 * (len - 1 - i)));
+  return pwrite_all(fd, bytes, len, at);
+}
+
+static gboolean patch_size(int fd, const Element* elem, guint64 size) {
+  guint8 bytes[8];
+  return put_size(bytes, size, elem->size_len) &&
+         pwrite_all(fd, bytes, elem->size_len, elem->data - elem->size_len);
+}
+
+// the SeekHead entry for id points at position, or is turned into a Void if
+// there's nothing for it to point at
+static gboolean patch_seek(int fd, const SeekEntry* seek, guint64 position) {
+  if (position != G_MAXUINT64)
+    return patch_uint(fd, seek->position, seek->position_len, position);
+  guint8 bytes[9] = {EBML_ID_VOID};
+  guint len = seek->length - 1 < 127 ? 1 : 8;
+  return put_size(bytes + 1, seek->length - 1 - len, len) &&
+         pwrite_all(fd, bytes, 1 + len, seek->start);
+}
+
+static gboolean recover(const gchar* path, gboolean dry_run) {
+  GError* err = NULL;
+  GMappedFile* map = g_mapped_file_new(path, FALSE, &err);
+  if (map == NULL) {
+    g_printerr(ERR_RECOVER_OPEN, path, err->message);
+    g_error_free(err);
+    return FALSE;
+  }
+  MkvFile mkv = {(const guint8*)g_mapped_file_get_contents(map),
+                 g_mapped_file_get_length(map)};
+  mkv.timecode_scale = MKV_DEFAULT_TIMECODESCALE;
+  mkv.cue_points = g_array_new(FALSE, FALSE, sizeof(CuePoint));
+  gboolean ok = scan(&mkv, path);
+  guint64 length = mkv.length;
+  g_mapped_file_unref(map);
+  mkv.data = NULL;  // everything needed is in mkv now
+  if (!ok)
+    goto done;
+
+  if (mkv.cues && !mkv.segment.unknown && mkv.end == length &&
+      mkv.last_cluster.size_len == 0) {
+    g_print(MSG_RECOVER_OK, path);
+    goto done;
+  }
+  if (mkv.clusters == 0) {
+    g_printerr(ERR_RECOVER_EMPTY, path);
+    ok = FALSE;
+    goto done;
+  }
+
+  gdouble seconds = (gdouble)mkv.last_time * mkv.timecode_scale / 1e9;
+  g_print(MSG_RECOVER_DONE, path, mkv.clusters, mkv.cue_points->len, seconds,
+          dry_run ? " (dry run)" : "", length - mkv.end);
+  if (dry_run)
+    goto done;
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    g_printerr(ERR_RECOVER_OPEN, path, g_strerror(errno));
+    ok = FALSE;
+    goto done;
+  }
+  // the new tail first, then the headers that point into it
+  GByteArray* cues = build_cues(&mkv);
+  guint64 cues_at = mkv.end;
+  guint64 segment_size = cues_at + cues->len - mkv.segment.data;
+  ok = ftruncate(fd, (off_t)cues_at) == 0 &&
+       pwrite_all(fd, cues->data, cues->len, cues_at) && fdatasync(fd) == 0;
+  g_byte_array_unref(cues);
+  if (!ok)
+    g_printerr(ERR_RECOVER_OPEN, path, g_strerror(errno));
+
+
+  // a header that can't be patched leaves the file half done, so it fails
+  if (ok && mkv.last_cluster.size_len != 0 &&
+      !patch_size(fd, &mkv.last_cluster,
+                  MIN(cues_at, mkv.last_cluster.unknown
+                                   ? cues_at
+                                   : mkv.last_cluster.data +
+                                         mkv.last_cluster.size) -
+                      mkv.last_cluster.data)) {
+    g_printerr(ERR_RECOVER_PATCH, path, "the last cluster's size");
+    ok = FALSE;
+  }
+  if (ok && !patch_size(fd, &mkv.segment, segment_size)) {
+    g_printerr(ERR_RECOVER_PATCH, path, "the segment size");
+    ok = FALSE;
+  }
+
+  for (guint i = 0; ok && i < mkv.n_seeks; i++) {
+    const SeekEntry* seek = &mkv.seeks[i];
+    guint64 position = G_MAXUINT64;
+    if (seek->id == MKV_ID_CUES)
+      position = cues_at - mkv.segment.data;
+    else if (seek->id == MKV_ID_INFO && mkv.info != 0)
+      position = mkv.info - mkv.segment.data;
+    else if (seek->id == MKV_ID_TRACKS && mkv.tracks != 0)
+      position = mkv.tracks - mkv.segment.data;
+    if (!patch_seek(fd, seek, position)) {
+      g_printerr(ERR_RECOVER_PATCH, path, "the seek head");
+      ok = FALSE;
+    }
+  }
+
+  if (ok && mkv.duration != 0) {
+    guint8 bytes[8];
+    if (mkv.duration_len == 8) {
+      union {
+        gdouble d;
+        guint64 u;
+      } v = {(gdouble)mkv.last_time};
+      guint64 be = GUINT64_TO_BE(v.u);
+      memcpy(bytes, &be, 8);
+    } else {
+      union {
+        gfloat f;
+        guint32 u;
+      } v = {(gfloat)mkv.last_time};
+      guint32 be = GUINT32_TO_BE(v.u);
+      memcpy(bytes, &be, 4);
+    }
+    if (!pwrite_all(fd, bytes, mkv.duration_len, mkv.duration)) {
+      g_printerr(ERR_RECOVER_OPEN, path, g_strerror(errno));
+      ok = FALSE;
+    }
+  }
+  // whatever was patched, keep it
+  if (fdatasync(fd) != 0 && ok) {
+    g_printerr(ERR_RECOVER_OPEN, path, g_strerror(errno));
+    ok = FALSE;
+  }
+  close(fd);
+
+done:
+  g_array_unref(mkv.cue_points);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx =
+      g_option_context_new("FILE... - make interrupted recordings seekable");
+  GError* err = NULL;
+  gboolean dry_run = FALSE;
+  gchar** files = NULL;
+
+  GOptionEntry entries[] = {
+      {"dry-run", 'n', 0, G_OPTION_ARG_NONE, &dry_run,
+       "only say what would be done", NULL},
+      {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, NULL,
+       NULL},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  if (files == NULL) {
+    g_printerr("no files given, use --help for full usage\n");
+    return 1;
+  }
+
+  int status = 0;
+  for (guint i = 0; files[i] != NULL; i++) {
+    if (!recover(files[i], dry_run))
+      status = 1;
+  }
+  g_strfreev(files);
+  return status;
+}
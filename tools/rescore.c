@@ -0,0 +1,487 @@
+// Copyright (c) 2019 Michael de Gans
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// birbcam-rescore: runs birbcam --reprocess (see reprocess.h) over a whole
+// archive. Recordings come from directories (searched for .mkv files) and
+// manifests (a path per line), and are handed out in batches of up to
+// --batch, one birbcam per batch, so each pipeline infers a batch of frames
+// at once, with --jobs of them running at a time (no more than --gpu-jobs,
+// see BC_RESCORE_TEGRA_JOBS). Every finished recording
+// is appended to the --journal (and synced) as soon as its birbcam exits
+// cleanly, and recordings already in the journal are skipped, so an
+// interrupted run picks up where it stopped, redoing at most the batches
+// that were running. A batch that fails is split and its recordings retried
+// on their own, so one bad file doesn't hold up its neighbours.
+//
+//   birbcam-rescore -j 2 -b 4 -a "-f brb --tracks" /media/birbs
+//   birbcam-rescore --manifest todo.txt --journal todo.journal
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+
+#define ERR_RESCORE_JOURNAL "%s: %s\n"
+#define ERR_RESCORE_INPUT "%s: %s\n"
+#define ERR_RESCORE_SPAWN "can't run %s: %s\n"
+#define ERR_RESCORE_FAILED "rescore: failed: %s\n"
+#define MSG_RESCORE_START \
+  "rescore: %u recordings, %u already done, %u jobs of up to %u\n"
+#define MSG_RESCORE_DONE "rescore: [%u/%u] %s (%.1f frames/s so far)\n"
+#define MSG_RESCORE_STATS                                                \
+  "rescore: %u done, %u failed, %" G_GUINT64_FORMAT " frames decoded (%" \
+  G_GUINT64_FORMAT " inferred) in %.1f s, %.1f frames/s\n"
+#define MSG_RESCORE_STOP \
+  "rescore: stopping, the running batches are redone next time\n"
+
+// the start of birbcam's MSG_REPROCESS_STATS, one line per source
+#define BC_RESCORE_STATS_LINE \
+  "reprocess: source %u, %" G_GUINT64_FORMAT " frames decoded, %" \
+  G_GUINT64_FORMAT " inferred"
+
+#define BC_RESCORE_JOURNAL "birbcam-rescore.journal"
+#define BC_RESCORE_EXTENSION ".mkv"
+#define BC_RESCORE_MAX_BATCH 8  // BC_MAX_SOURCES, the most inputs birbcam takes
+#define BC_RESCORE_BATCH 4
+#define BC_RESCORE_CORES_PER_JOB 2  // decoding and the writer, roughly
+// on a Jetson every birbcam infers on the one GPU, which a single batch
+// already keeps busy, and loads its own copy of the engine into the memory
+// the GPU shares with everything else, so more only makes it worse.
+// Elsewhere birbcam infers on the cpu (see backend.h) and cores are the limit.
+#define BC_RESCORE_TEGRA_JOBS 1
+#define BC_RESCORE_TEGRA_RELEASE "/etc/nv_tegra_release"  // L4T has one
+
+typedef struct _Scheduler Scheduler;
+
+typedef struct {
+  Scheduler* scheduler;
+  GPtrArray* recordings;  // gchar*, owned
+  GSubprocess* process;   // while running
+} Batch;
+
+struct _Scheduler {
+  GMainLoop* loop;
+  gchar* birbcam;
+  gchar** birbcam_args;  // extra, from --args
+  GQueue pending;        // Batch*
+  GList* running;        // Batch*
+  guint jobs;
+  gint journal_fd;
+  gboolean stopping;
+
+  guint total;  // recordings this run
+  guint done;
+  guint failed;
+  guint64 decoded;  // frames, over every birbcam
+  guint64 inferred;
+  gint64 started;  // monotonic, us
+};
+
+static gdouble frame_rate(Scheduler* scheduler) {
+  gdouble seconds = (g_get_monotonic_time() - scheduler->started) /
+                    (gdouble)G_USEC_PER_SEC;
+  return seconds > 0.0 ? scheduler->decoded / seconds : 0.0;
+}
+
+static Batch* batch_new(Scheduler* scheduler) {
+  Batch* batch = g_new0(Batch, 1);
+  batch->scheduler = scheduler;
+  batch->recordings = g_ptr_array_new_with_free_func(g_free);
+  return batch;
+}
+
+static void batch_free(Batch* batch) {
+  g_ptr_array_unref(batch->recordings);
+  g_clear_object(&batch->process);
+  g_free(batch);
+}
+
+// recordings are known by their absolute path, however they were given
+static gchar* absolute_path(const gchar* path) {
+  char* resolved = realpath(path, NULL);
+  if (resolved == NULL)
+    return NULL;
+  gchar* copy = g_strdup(resolved);
+  free(resolved);
+  return copy;
+}
+
+static void add_recording(GPtrArray* recordings, const gchar* path) {
+  gchar* absolute = absolute_path(path);
+  if (absolute == NULL) {
+    g_printerr(ERR_RESCORE_INPUT, path, g_strerror(errno));
+    return;
+  }
+  g_ptr_array_add(recordings, absolute);
+}
+
+static void add_directory(GPtrArray* recordings, const gchar* path) {
+  GError* err = NULL;
+  GDir* dir = g_dir_open(path, 0, &err);
+  if (dir == NULL) {
+    g_printerr(ERR_RESCORE_INPUT, path, err->message);
+    g_error_free(err);
+    return;
+  }
+  const gchar* name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    g_autofree gchar* child = g_build_filename(path, name, NULL);
+    if (g_file_test(child, G_FILE_TEST_IS_DIR))
+      add_directory(recordings, child);
+    else if (g_str_has_suffix(name, BC_RESCORE_EXTENSION))
+      add_recording(recordings, child);
+  }
+  g_dir_close(dir);
+}
+
+static void add_manifest(GPtrArray* recordings, const gchar* path) {
+  gchar* contents = NULL;
+  GError* err = NULL;
+  if (!g_file_get_contents(path, &contents, NULL, &err)) {
+    g_printerr(ERR_RESCORE_INPUT, path, err->message);
+    g_error_free(err);
+    return;
+  }
+  gchar** lines = g_strsplit(contents, "\n", -1);
+  for (gchar** line = lines; *line != NULL; line++) {
+    g_strstrip(*line);
+    if (**line != '\0' && **line != '#')
+      add_recording(recordings, *line);
+  }
+  g_strfreev(lines);
+  g_free(contents);
+}
+
+// the recordings already done, and the journal opened to add to it
+static GHashTable* open_journal(Scheduler* scheduler, const gchar* path) {
+  GHashTable* done = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL);
+  gchar* contents = NULL;
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    // a line cut short by a crash has no newline, and isn't done
+    gchar* end = strrchr(contents, '\n');
+    if (end != NULL) {
+      *end = '\0';
+      gchar** lines = g_strsplit(contents, "\n", -1);
+      for (gchar** line = lines; *line != NULL; line++) {
+        if (**line != '\0')
+          g_hash_table_add(done, g_strdup(*line));
+      }
+      g_strfreev(lines);
+    }
+    g_free(contents);
+  }
+  scheduler->journal_fd =
+      open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (scheduler->journal_fd < 0) {
+    g_printerr(ERR_RESCORE_JOURNAL, path, g_strerror(errno));
+    g_hash_table_unref(done);
+    return NULL;
+  }
+  return done;
+}
+
+// one write and a sync per finished recording, so it's either all there or
+// (cut short, without its newline) not at all
+static void journal_done(Scheduler* scheduler, const gchar* recording) {
+  g_autofree gchar* line = g_strconcat(recording, "\n", NULL);
+  gsize length = strlen(line);
+  if (write(scheduler->journal_fd, line, length) != (gssize)length ||
+      fdatasync(scheduler->journal_fd) != 0) {
+    g_printerr(ERR_RESCORE_JOURNAL, recording, g_strerror(errno));
+  }
+}
+
+// add up the frames from each source's stats line
+static void read_stats(Scheduler* scheduler, const gchar* output) {
+  if (output == NULL)
+    return;
+  for (const gchar* line = output; line != NULL && *line != '\0';) {
+    guint source;
+    guint64 decoded, inferred;
+    if (sscanf(line, BC_RESCORE_STATS_LINE, &source, &decoded, &inferred) ==
+        3) {
+      scheduler->decoded += decoded;
+      scheduler->inferred += inferred;
+    }
+    line = strchr(line, '\n');
+    if (line != NULL)
+      line++;
+  }
+}
+
+static void start_batches(Scheduler* scheduler);
+
+static void on_batch_done(GSubprocess* process,
+                          GAsyncResult* result,
+                          Batch* batch) {
+  Scheduler* scheduler = batch->scheduler;
+  gchar* output = NULL;
+  GError* err = NULL;
+  gboolean ok = g_subprocess_communicate_utf8_finish(process, result, &output,
+                                                     NULL, &err) &&
+                g_subprocess_get_successful(process);
+  g_clear_error(&err);
+  read_stats(scheduler, output);
+  g_free(output);
+  scheduler->running = g_list_remove(scheduler->running, batch);
+
+  if (ok) {
+    for (guint i = 0; i < batch->recordings->len; i++) {
+      const gchar* recording = g_ptr_array_index(batch->recordings, i);
+      journal_done(scheduler, recording);
+      g_print(MSG_RESCORE_DONE, ++scheduler->done, scheduler->total,
+              recording, frame_rate(scheduler));
+    }
+  } else if (!scheduler->stopping && batch->recordings->len > 1) {
+    // find the bad one by trying each on its own
+    for (guint i = batch->recordings->len; i-- > 0;) {
+      Batch* single = batch_new(scheduler);
+      g_ptr_array_add(single->recordings,
+                      g_strdup(g_ptr_array_index(batch->recordings, i)));
+      g_queue_push_head(&scheduler->pending, single);
+    }
+  } else if (!scheduler->stopping) {
+    g_printerr(ERR_RESCORE_FAILED,
+               (const gchar*)g_ptr_array_index(batch->recordings, 0));
+    scheduler->failed++;
+  }
+  batch_free(batch);
+  start_batches(scheduler);
+}
+
+static gboolean start_batch(Scheduler* scheduler, Batch* batch) {
+  GPtrArray* argv = g_ptr_array_new();
+  g_ptr_array_add(argv, scheduler->birbcam);
+  g_ptr_array_add(argv, "--reprocess");
+  for (gchar** arg = scheduler->birbcam_args; arg && *arg; arg++)
+    g_ptr_array_add(argv, *arg);
+  for (guint i = 0; i < batch->recordings->len; i++) {
+    g_ptr_array_add(argv, "-i");
+    g_ptr_array_add(argv, g_ptr_array_index(batch->recordings, i));
+  }
+  g_ptr_array_add(argv, NULL);
+
+  GError* err = NULL;
+  batch->process =
+      g_subprocess_newv((const gchar* const*)argv->pdata,
+                        G_SUBPROCESS_FLAGS_STDOUT_PIPE, &err);
+  g_ptr_array_unref(argv);
+  if (batch->process == NULL) {
+    g_printerr(ERR_RESCORE_SPAWN, scheduler->birbcam, err->message);
+    g_error_free(err);
+    return FALSE;
+  }
+  scheduler->running = g_list_prepend(scheduler->running, batch);
+  g_subprocess_communicate_utf8_async(batch->process, NULL, NULL,
+                                      (GAsyncReadyCallback)on_batch_done,
+                                      batch);
+  return TRUE;
+}
+
+static void start_batches(Scheduler* scheduler) {
+  while (!scheduler->stopping &&
+         g_list_length(scheduler->running) < scheduler->jobs &&
+         !g_queue_is_empty(&scheduler->pending)) {
+    Batch* batch = g_queue_pop_head(&scheduler->pending);
+    if (!start_batch(scheduler, batch)) {
+      // birbcam itself is missing or broken, no point going on
+      batch_free(batch);
+      scheduler->stopping = TRUE;
+    }
+  }
+  if (scheduler->running == NULL &&
+      (scheduler->stopping || g_queue_is_empty(&scheduler->pending))) {
+    g_main_loop_quit(scheduler->loop);
+  }
+}
+
+// stop starting batches and have the running ones stop. birbcam exits with
+// an error when interrupted before the end, so they aren't journaled.
+static gboolean on_SIGINT(Scheduler* scheduler) {
+  g_print(MSG_RESCORE_STOP);
+  scheduler->stopping = TRUE;
+  for (GList* l = scheduler->running; l != NULL; l = l->next)
+    g_subprocess_send_signal(((Batch*)l->data)->process, SIGINT);
+  if (scheduler->running == NULL)
+    g_main_loop_quit(scheduler->loop);
+  return G_SOURCE_CONTINUE;
+}
+
+// birbcam from the same directory as us, if it's there, else from the PATH
+static gchar* find_birbcam(const gchar* argv0) {
+  g_autofree gchar* dir = g_path_get_dirname(argv0);
+  gchar* sibling = g_build_filename(dir, "birbcam", NULL);
+  if (strchr(argv0, G_DIR_SEPARATOR) != NULL &&
+      g_file_test(sibling, G_FILE_TEST_IS_EXECUTABLE)) {
+    return sibling;
+  }
+  g_free(sibling);
+  return g_strdup("birbcam");
+}
+
+int main(int argc, char** argv) {
+  g_autoptr(GOptionContext) ctx = g_option_context_new(
+      "DIR|RECORDING... - rescore recordings with birbcam --reprocess");
+  GError* err = NULL;
+  gchar* manifest = NULL;
+  gchar* journal = NULL;
+  gchar* birbcam = NULL;
+  gchar* extra_args = NULL;
+  gint jobs = 0;
+  gint gpu_jobs = -1;
+  gint batch_size = BC_RESCORE_BATCH;
+  gchar** inputs = NULL;
+
+  GOptionEntry entries[] = {
+      {"manifest", 'm', 0, G_OPTION_ARG_FILENAME, &manifest,
+       "also rescore the recordings listed in FILE, one per line", "FILE"},
+      {"journal", 'J', 0, G_OPTION_ARG_FILENAME, &journal,
+       "record finished recordings in FILE, and skip those already there "
+       "(default: " BC_RESCORE_JOURNAL ")",
+       "FILE"},
+      {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+       "birbcams running at once (default: one per two processors)", "N"},
+      {"gpu-jobs", 'g', 0, G_OPTION_ARG_INT, &gpu_jobs,
+       "at most N birbcams at once, whatever --jobs says, 0 for no limit "
+       "(default: 1 on a Jetson, where they share the GPU, otherwise 0)",
+       "N"},
+      {"batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+       "recordings per birbcam, inferred as one batch (default: 4, at most "
+       "8)",
+       "N"},
+      {"args", 'a', 0, G_OPTION_ARG_STRING, &extra_args,
+       "more birbcam options, e.g. \"-f brb --tracks --every 5\"", "ARGS"},
+      {"birbcam", 0, 0, G_OPTION_ARG_FILENAME, &birbcam,
+       "the birbcam to run (default: the one next to this, or on the PATH)",
+       "PATH"},
+      {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL,
+       NULL},
+      {NULL},
+  };
+  g_option_context_add_main_entries(ctx, entries, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  if (inputs == NULL && manifest == NULL) {
+    g_printerr("no recordings given, use --help for full usage\n");
+    return 1;
+  }
+  if (batch_size < 1 || batch_size > BC_RESCORE_MAX_BATCH) {
+    g_printerr("--batch must be between 1 and %d\n", BC_RESCORE_MAX_BATCH);
+    return 1;
+  }
+  if (jobs <= 0)
+    jobs = MAX((gint)g_get_num_processors() / BC_RESCORE_CORES_PER_JOB, 1);
+  if (gpu_jobs < 0) {
+    gpu_jobs = g_file_test(BC_RESCORE_TEGRA_RELEASE, G_FILE_TEST_EXISTS)
+                   ? BC_RESCORE_TEGRA_JOBS
+                   : 0;
+  }
+  if (gpu_jobs > 0)
+    jobs = MIN(jobs, gpu_jobs);
+
+  Scheduler scheduler = {NULL};
+  g_queue_init(&scheduler.pending);
+  scheduler.jobs = (guint)jobs;
+  scheduler.birbcam = birbcam ? g_strdup(birbcam) : find_birbcam(argv[0]);
+  if (extra_args != NULL &&
+      !g_shell_parse_argv(extra_args, NULL, &scheduler.birbcam_args, &err)) {
+    g_printerr("--args: %s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+
+  // everything asked for, in order, then what's left of it
+  GPtrArray* recordings = g_ptr_array_new_with_free_func(g_free);
+  for (gchar** input = inputs; input && *input; input++) {
+    if (g_file_test(*input, G_FILE_TEST_IS_DIR))
+      add_directory(recordings, *input);
+    else
+      add_recording(recordings, *input);
+  }
+  if (manifest != NULL)
+    add_manifest(recordings, manifest);
+  g_ptr_array_sort(recordings, (GCompareFunc)g_strcmp0);
+
+  GHashTable* done =
+      open_journal(&scheduler, journal ? journal : BC_RESCORE_JOURNAL);
+  if (done == NULL)
+    return 1;
+  GHashTable* seen = g_hash_table_new(g_str_hash, g_str_equal);
+  Batch* batch = NULL;
+  guint skipped = 0;
+  for (guint i = 0; i < recordings->len; i++) {
+    const gchar* recording = g_ptr_array_index(recordings, i);
+    if (!g_hash_table_add(seen, (gpointer)recording))
+      continue;  // given twice
+    if (g_hash_table_contains(done, recording)) {
+      skipped++;
+      continue;
+    }
+    if (batch == NULL || batch->recordings->len == (guint)batch_size) {
+      batch = batch_new(&scheduler);
+      g_queue_push_tail(&scheduler.pending, batch);
+    }
+    g_ptr_array_add(batch->recordings, g_strdup(recording));
+    scheduler.total++;
+  }
+  g_hash_table_unref(seen);
+  g_hash_table_unref(done);
+  g_print(MSG_RESCORE_START, scheduler.total, skipped, scheduler.jobs,
+          (guint)batch_size);
+
+  scheduler.started = g_get_monotonic_time();
+  scheduler.loop = g_main_loop_new(NULL, FALSE);
+  g_unix_signal_add(SIGINT, (GSourceFunc)on_SIGINT, &scheduler);
+  start_batches(&scheduler);
+  if (scheduler.running != NULL)
+    g_main_loop_run(scheduler.loop);
+
+  gdouble seconds = (g_get_monotonic_time() - scheduler.started) /
+                    (gdouble)G_USEC_PER_SEC;
+  g_print(MSG_RESCORE_STATS, scheduler.done, scheduler.failed,
+          scheduler.decoded, scheduler.inferred, seconds,
+          frame_rate(&scheduler));
+
+  gboolean complete = scheduler.done == scheduler.total;
+  g_queue_foreach(&scheduler.pending, (GFunc)batch_free, NULL);
+  g_queue_clear(&scheduler.pending);
+  g_main_loop_unref(scheduler.loop);
+  close(scheduler.journal_fd);
+  g_ptr_array_unref(recordings);
+  g_strfreev(scheduler.birbcam_args);
+  g_free(scheduler.birbcam);
+  g_strfreev(inputs);
+  g_free(manifest);
+  g_free(journal);
+  g_free(birbcam);
+  g_free(extra_args);
+  return complete ? 0 : 1;
+}